@@ -2,7 +2,14 @@
 * LC4.c: Defines simulator functions for executing instructions
 */
 #include "LC4.h"
+#include "device.h"
 #include <stdio.h>
+
+int DebugOutput = 1;
+
+// debug output is only formatted when DebugOutput is set
+#define DebugPrintf(...) do { if (DebugOutput) printf(__VA_ARGS__); } while (0)
+
 /*
 * Reset the machine state as Pennsim would do
 */
@@ -21,12 +28,105 @@ void Reset(MachineState* CPU) {
   }
 
   ClearSignals(CPU);
+  SetDefaultPageAttributes(CPU);
+  CPU->devices = NULL;
+  CPU->fault = 0;
  
   // clear output file variables
   CPU->regInputVal = 0;
   CPU->NZPVal = 0;
   CPU->dmemAddr = 0;
   CPU->dmemValue = 0;
+
+  CPU->hashing = 0;
+  CPU->hash = 0;
+}
+/*
+* XOR of HashWord over count words of memory starting at address
+*/
+unsigned long long HashMemory(const unsigned short int* words, unsigned int address, unsigned int count) {
+  unsigned long long hash = 0;
+  for (unsigned int i = 0; i < count; i++) {
+    hash ^= HashWord(address + i, words[i]);
+  }
+  return hash;
+}
+/*
+* Hash the machine from scratch and keep the hash up to date from now on
+*/
+void StartStateHash(MachineState* CPU) {
+  CPU->hash = HashMemory(CPU->memory, 0, 65536) ^ HashWord(HASH_KEY_PSR, CPU->PSR);
+  for (int i = 0; i < 8; i++) {
+    CPU->hash ^= HashWord(HASH_KEY_R + i, CPU->R[i]);
+  }
+  CPU->hashing = 1;
+}
+/*
+* The hash of the whole machine, PC included
+*/
+unsigned long long StateHash(MachineState* CPU) {
+  return CPU->hash ^ HashWord(HASH_KEY_PC, CPU->PC);
+}
+/*
+* Apply the registers and PSR that changed since R and PSR to the hash
+*/
+void HashRegisterChanges(MachineState* CPU, const unsigned short int* R, unsigned short int PSR) {
+  for (int i = 0; i < 8; i++) {
+    if (CPU->R[i] != R[i]) {
+      CPU->hash ^= HashWord(HASH_KEY_R + i, R[i]) ^ HashWord(HASH_KEY_R + i, CPU->R[i]);
+    }
+  }
+  if (CPU->PSR != PSR) {
+    CPU->hash ^= HashWord(HASH_KEY_PSR, PSR) ^ HashWord(HASH_KEY_PSR, CPU->PSR);
+  }
+}
+/*
+* Build the page table from the LC4 memory map
+*/
+void SetDefaultPageAttributes(MachineState* CPU) {
+  unsigned char user_data = PAGE_READ_USER | PAGE_READ_OS | PAGE_WRITE_USER | PAGE_WRITE_OS;
+
+  SetPageAttributes(CPU, 0x0000, 0x1FFF, PAGE_EXEC_USER | PAGE_EXEC_OS);
+  SetPageAttributes(CPU, 0x2000, 0x7FFF, user_data);
+  SetPageAttributes(CPU, 0x8000, 0x9FFF, PAGE_EXEC_OS);
+  SetPageAttributes(CPU, 0xA000, 0xFFFF, PAGE_READ_OS | PAGE_WRITE_OS);
+}
+/*
+* Set the attributes of every page holding an address in [start, end]
+*/
+void SetPageAttributes(MachineState* CPU, unsigned short int start, unsigned short int end, unsigned char attr) {
+  for (int page = start >> 8; page <= end >> 8; page++) {
+    CPU->pageAttr[page] = attr;
+  }
+}
+/*
+* Report a denied access, only called once PAGE_ALLOWS has failed
+*/
+int AccessFault(MachineState* CPU, unsigned short int address, unsigned char access) {
+  unsigned char attr = CPU->pageAttr[address >> 8];
+  if (attr & PAGE_HOOKED) {
+    // device registers and video memory are OS data
+    attr |= PAGE_READ_OS | PAGE_WRITE_OS;
+  }
+  unsigned char any_mode = access | (access << 1);
+  CPU->fault = access;
+
+  if (access == PAGE_EXEC_USER) {
+    // executable for the OS only, or not executable at all
+    if (attr & any_mode) {
+      printf("UMS: Cannot access OS memory when in user mode.\n");
+    } else {
+      printf("Cannot execute a data section address as code.\n");
+    }
+  } else {
+    // not data at all, or data for the OS only
+    if ((attr & any_mode) == 0) {
+      printf("Cannot read a code section address as data.\n");
+    } else {
+      printf("%s: Cannot access OS memory when in user mode.\n", access == PAGE_READ_USER ? "LDR" : "STR");
+    }
+  }
+  return 1;
 }
 /*
 * Clear all of the control signals (set to 0)
@@ -43,6 +143,11 @@ void ClearSignals(MachineState* CPU) {
 * This function should write out the current state of the CPU to the file output.
 */
 void WriteOut(MachineState* CPU, FILE* output) {
+  // tracing is off
+  if (output == NULL) {
+    return;
+  }
+
   // Print PC
   fprintf(output, "%04X ", CPU->PC);
 
@@ -113,46 +218,45 @@ unsigned short int NZP_calc(int value) {
 }
 
 /*
-* This function should execute one LC4 datapath cycle.
+* Execute one LC4 datapath cycle; UpdateMachineState adds the state hash
 */
-int UpdateMachineState(MachineState* CPU, FILE* output) {
+static int ExecuteInstruction(MachineState* CPU, FILE* output) {
 
- if (CPU->PC >= 0x8000 && (CPU->PSR >> 15) == 0) {
-		 printf("UMS: Cannot access OS memory when in user mode.\n");
-    return 1;
+ // one page table lookup decides whether this fetch is allowed
+ if (!PAGE_ALLOWS(CPU, CPU->PC, PAGE_EXEC_USER)) {
+    return AccessFault(CPU, CPU->PC, PAGE_EXEC_USER);
 	}
 
-	if ((CPU->PC >= 0x4000 && CPU->PC < 8000) || 
-		(CPU->PC >= 0xA000 && CPU->PC <= 0xFFFF)) {
-    printf("Cannot execute a data section address as code.\n");
-		return 1;
-	}
+ // the devices' clock counts every instruction that starts
+ if (CPU->devices != NULL) {
+    CPU->devices->clock++;
+ }
 
  // Print the initial PSR
- printf("Initial PSR: \n");
+ DebugPrintf("Initial PSR: \n");
  for (int i = 15; i >= 0; i--) {
-      printf("%d", (CPU->PSR >> i) & 1);
+      DebugPrintf("%d", (CPU->PSR >> i) & 1);
   }
-  printf("\n");
+  DebugPrintf("\n");
 
  // Fetch the instruction
   unsigned short int instruction = CPU->memory[CPU->PC];
 
   // Print the fetched instruction and current PC
-  printf("Fetched instruction: %04x from PC: %04x\n", instruction, CPU->PC);
+  DebugPrintf("Fetched instruction: %04x from PC: %04x\n", instruction, CPU->PC);
 
   //Print the binary representation
-  printf("Binary representation: ");
+  DebugPrintf("Binary representation: ");
   for (int i = 15; i >= 0; i--) {
-      printf("%d", (instruction >> i) & 1);
+      DebugPrintf("%d", (instruction >> i) & 1);
       if (i % 4 == 0) {
-          printf(" ");
+          DebugPrintf(" ");
       }
   }
-  printf("\n");
+  DebugPrintf("\n");
 
   if (instruction == 0) {
-     printf("UMS:NOP instruction. No operation performed.\n");
+     DebugPrintf("UMS:NOP instruction. No operation performed.\n");
     //  CPU->PC++; //no difference
     //  return 1; // otherwise infinite loop
   }
@@ -196,42 +300,38 @@ int UpdateMachineState(MachineState* CPU, FILE* output) {
 
        unsigned short int des_reg = (instruction >> 9) & 0x07; //extracting bits 11-9
        unsigned short int src_reg = (instruction >> 6) & 0x07; //extracting bits 8-6
-       printf("Value at Source Register %01X: %01X(%d)\n", src_reg, CPU->R[src_reg], (short)(CPU->R[src_reg]));
+       DebugPrintf("Value at Source Register %01X: %01X(%d)\n", src_reg, CPU->R[src_reg], (short)(CPU->R[src_reg]));
        short int imm6 = instruction & 0x003F; // Extract bits 0-5 
        if (imm6 & 0x0020) { // If the sign bit (bit 5) is set
        imm6 |= 0xFFC0; // Extend the sign to 16 bits
        }
-       printf("Immediate 6-bit: 0x%04X (%d)\n", imm6, (short)imm6); 
+       DebugPrintf("Immediate 6-bit: 0x%04X (%d)\n", imm6, (short)imm6); 
 
        unsigned short int dmem_address =  CPU->R[src_reg] + imm6;
-       if ((dmem_address < 0x2000) || (dmem_address >= 0x8000 && dmem_address < 0xA000)) {
-        printf("Cannot read a code section address as data.\n");
+       unsigned short int value;
+       if (PAGE_ALLOWS(CPU, dmem_address, PAGE_READ_USER)) {
+        value = CPU->memory[dmem_address];
+       } else if (IN_DEVICE_PAGE(CPU, dmem_address)) {
+        value = DeviceRead(CPU, dmem_address);
+       } else {
         CPU->PC++;
-        return 1;
-        break;
-       }
-
-       if (dmem_address >= 0xA000 && (CPU->PSR >> 15)==0 ) {
-		    printf("LDR: Cannot access OS memory when in user mode.\n");
-        CPU->PC++;
-        return 1;
-        break;
+        return AccessFault(CPU, dmem_address, PAGE_READ_USER);
        }
       
       // store contents of data memory at calculated address in des_reg
       CPU->dmemAddr = dmem_address; 
-      CPU->R[des_reg] = CPU->memory[dmem_address];
+      CPU->R[des_reg] = value;
       CPU->dmemValue = CPU->R[des_reg];
 
       CPU->NZPVal = NZP_calc((short)CPU->dmemValue);
       SetNZP(CPU, CPU->NZPVal);
                 
       WriteOut(CPU, output);
-      printf("WRITING LOAD INSTRUCTION TO FILE. \n");
+      DebugPrintf("WRITING LOAD INSTRUCTION TO FILE. \n");
 
       // Increment the PC
       CPU->PC++;
-      printf("Updated PC: %04x\n", CPU->PC);
+      DebugPrintf("Updated PC: %04x\n", CPU->PC);
       break;
     }
     case 7: { // STR
@@ -244,38 +344,36 @@ int UpdateMachineState(MachineState* CPU, FILE* output) {
 
        unsigned short int trg_reg = (instruction >> 9) & 0x07; //extracting bits 11-9
        unsigned short int src_reg = (instruction >> 6) & 0x07; //extracting bits 8-6
-       printf("Value at Source Register %01X: %01X(%d)\n", src_reg, CPU->R[src_reg], (short)(CPU->R[src_reg]));
+       DebugPrintf("Value at Source Register %01X: %01X(%d)\n", src_reg, CPU->R[src_reg], (short)(CPU->R[src_reg]));
        short int imm6 = instruction & 0x003F; // Extract bits 0-5 
        if (imm6 & 0x0020) { // If the sign bit (bit 5) is set
        imm6 |= 0xFFC0; // Extend the sign to 16 bits
        }
-       printf("Immediate 6-bit: 0x%04X (%d)\n", imm6, (short)imm6); 
+       DebugPrintf("Immediate 6-bit: 0x%04X (%d)\n", imm6, (short)imm6); 
 
        CPU->dmemValue = CPU->R[trg_reg];
     
        unsigned short int dmem_address =  CPU->R[src_reg] + imm6;
-       if ((dmem_address < 0x2000) || (dmem_address >= 0x8000 && dmem_address < 0xA000)) {
-        printf("Cannot read a code section address as data.\n");
+       unsigned short int old_value = CPU->memory[dmem_address];
+       if (PAGE_ALLOWS(CPU, dmem_address, PAGE_WRITE_USER)) {
+        CPU->memory[dmem_address] = CPU->dmemValue;
+       } else if (IN_DEVICE_PAGE(CPU, dmem_address)) {
+        DeviceWrite(CPU, dmem_address, CPU->dmemValue);
+       } else {
         CPU->PC++;
-        return 1;
-       }
-
-       if (dmem_address >= 0xA000 && (CPU->PSR >> 15)==0 ) {
-		    printf("STR: Cannot access OS memory when in user mode.\n");
-        CPU->PC++;
-        return 1;
+        return AccessFault(CPU, dmem_address, PAGE_WRITE_USER);
        }
+       HASH_STORE(CPU, dmem_address, old_value);
 
       // store contents of trg_reg in the data memory at the calculated address
       CPU->dmemAddr = dmem_address; 
-      CPU->memory[dmem_address] = CPU->dmemValue;
 
       WriteOut(CPU, output);
-      printf("WRITING STORE INSTRUCTION TO FILE. \n");
+      DebugPrintf("WRITING STORE INSTRUCTION TO FILE. \n");
 
       // Increment the PC
       CPU->PC++;
-      printf("Updated PC: %04x\n", CPU->PC);
+      DebugPrintf("Updated PC: %04x\n", CPU->PC);
       break;
     }
     case 8: { // RTI
@@ -289,11 +387,11 @@ int UpdateMachineState(MachineState* CPU, FILE* output) {
       CPU->PSR = CPU->PSR & 0x7FFF; 
       
       WriteOut(CPU, output);
-      printf("WRITING RTI INSTRUCTION TO FILE. \n");
+      DebugPrintf("WRITING RTI INSTRUCTION TO FILE. \n");
 
       // Increment the PC
       CPU->PC = CPU->R[7];
-      printf("Updated PC: %04x\n", CPU->PC);
+      DebugPrintf("Updated PC: %04x\n", CPU->PC);
       break;
     }
     case 9: { // CONST
@@ -309,18 +407,18 @@ int UpdateMachineState(MachineState* CPU, FILE* output) {
       CPU->NZP_WE = 1;     
       CPU->DATA_WE = 0;
       CPU->rdMux_CTL = 0;
-      printf("Value being stored in reg %u: %04x(%d)\n", reg, imm9, imm9); 
+      DebugPrintf("Value being stored in reg %u: %04x(%d)\n", reg, imm9, imm9); 
 
       // Calculate NZP value
       CPU->NZPVal = NZP_calc((short)CPU->R[reg]);
       SetNZP(CPU, CPU->NZPVal);
             
       WriteOut(CPU, output);
-      printf("WRITING CONST INSTRUCTION TO FILE. \n");
+      DebugPrintf("WRITING CONST INSTRUCTION TO FILE. \n");
 
       // Increment the PC
       CPU->PC++;
-      printf("Updated PC: %04x\n", CPU->PC);
+      DebugPrintf("Updated PC: %04x\n", CPU->PC);
       break;
       }
 
@@ -345,25 +443,25 @@ int UpdateMachineState(MachineState* CPU, FILE* output) {
       CPU->rsMux_CTL = 2;
 
       CPU->R[reg] = (CPU->R[reg] & 0xFF) | (u_imm8 << 8);    
-      printf("Value being stored in reg %u: %04x(%d)\n", reg, u_imm8, u_imm8); 
+      DebugPrintf("Value being stored in reg %u: %04x(%d)\n", reg, u_imm8, u_imm8); 
 
       // Calculate NZP value
       CPU->NZPVal = NZP_calc((short)CPU->R[reg]);
       SetNZP(CPU, CPU->NZPVal);
             
       WriteOut(CPU, output);
-      printf("WRITING CONST INSTRUCTION TO FILE. \n");
+      DebugPrintf("WRITING CONST INSTRUCTION TO FILE. \n");
 
       // Increment the PC
       CPU->PC++;
-      printf("Updated PC: %04x\n", CPU->PC);
+      DebugPrintf("Updated PC: %04x\n", CPU->PC);
       break;
       }
       case 15: { // TRAP
       unsigned short int u_imm8 = instruction & 0xFF;  // Extracting bits 0-7 (value)
       unsigned short int PC_val = CPU->PC;
-      printf("\n");
-      printf("Starting PC value: %d\n", PC_val);
+      DebugPrintf("\n");
+      DebugPrintf("Starting PC value: %d\n", PC_val);
 
       // Set control signals
       CPU->regFile_WE = 1;  
@@ -377,27 +475,43 @@ int UpdateMachineState(MachineState* CPU, FILE* output) {
       // store PC + 1 in R7
       PC_val++;
       CPU->R[7] = PC_val;  
-      printf("PC+1 (%d) saved in R7: %d\n",CPU->PC, CPU->R[7]); 
+      DebugPrintf("PC+1 (%d) saved in R7: %d\n",CPU->PC, CPU->R[7]); 
 
         // Calculate NZP value
       CPU->NZPVal = NZP_calc(CPU->R[7] + 1);
       SetNZP(CPU, CPU->NZPVal);
 
       WriteOut(CPU, output);
-      printf("WRITING TRAP INSTRUCTION TO FILE. \n");
+      DebugPrintf("WRITING TRAP INSTRUCTION TO FILE. \n");
 
       // Increment the PC
       CPU->PC = (0x8000 | u_imm8);
-      printf("Updated PC: %04x\n", CPU->PC);
+      DebugPrintf("Updated PC: %04x\n", CPU->PC);
       break;  
       }
     default: {
-      printf("Unknown opcode\n");
+      DebugPrintf("Unknown opcode\n");
       break;
     }
   }
   return 0;
 }
+/*
+* This function should execute one LC4 datapath cycle.
+*/
+int UpdateMachineState(MachineState* CPU, FILE* output) {
+  if (!CPU->hashing) {
+    return ExecuteInstruction(CPU, output);
+  }
+
+  // stores move the hash as they happen, registers by what changed
+  unsigned short int R[8];
+  unsigned short int PSR = CPU->PSR;
+  memcpy(R, CPU->R, sizeof(R));
+  int result = ExecuteInstruction(CPU, output);
+  HashRegisterChanges(CPU, R, PSR);
+  return result;
+}
 
 //////////////// PARSING HELPER FUNCTIONS ///////////////////////////
 /*
@@ -418,18 +532,18 @@ void BranchOp(MachineState* CPU, FILE* output)
  CPU->NZP_WE = 0;      
 
   // Print the 9-bit immediate value in binary
-  printf("9-bit immediate value: ");
+  DebugPrintf("9-bit immediate value: ");
   for (int i = 8; i >= 0; i--) {
-      printf("%d", (imm9 >> i) & 1);
+      DebugPrintf("%d", (imm9 >> i) & 1);
   }
-  printf("\n");
+  DebugPrintf("\n");
 
   // Print condition bits in binary
-  printf("Condition bits: ");
+  DebugPrintf("Condition bits: ");
   for (int i = 2; i >= 0; i--) {
-      printf("%d", (condition >> i) & 1);
+      DebugPrintf("%d", (condition >> i) & 1);
   }
-  printf("\n");
+  DebugPrintf("\n");
 
   // Sign-extend IMM9
   if (imm9 & 0x0100) { // If the sign bit (bit 8) is set
@@ -437,7 +551,7 @@ void BranchOp(MachineState* CPU, FILE* output)
   }
 
   short signed_imm9 = (short)imm9;
-  printf("Sign-extended IMM9 in decimal: %d\n", signed_imm9);
+  DebugPrintf("Sign-extended IMM9 in decimal: %d\n", signed_imm9);
 
   // Determine if the branch should be taken
   int branch_taken = 0;
@@ -448,16 +562,16 @@ void BranchOp(MachineState* CPU, FILE* output)
   }
 
   WriteOut(CPU, output);
-  printf("WRITING BRANCH INSTRUCTION TO FILE. \n");
+  DebugPrintf("WRITING BRANCH INSTRUCTION TO FILE. \n");
 
   unsigned short int old_PC = CPU->PC;
 
   if (branch_taken) {
       CPU->PC += 1 + signed_imm9; // Update the PC if branch is taken
-      printf("Branch taken. PC updated from %04x to %04x\n", old_PC, CPU->PC);
+      DebugPrintf("Branch taken. PC updated from %04x to %04x\n", old_PC, CPU->PC);
   } else {
       CPU->PC++; // PC + 1 if the branch is not taken
-      printf("Branch not taken. PC incremented from %04x to %04x\n", old_PC, CPU->PC);
+      DebugPrintf("Branch not taken. PC incremented from %04x to %04x\n", old_PC, CPU->PC);
   }
 }
 /*
@@ -469,8 +583,8 @@ void ArithmeticOp(MachineState* CPU, FILE* output) {
   unsigned short int instruction = CPU->memory[CPU->PC];
   unsigned short int src_reg = (instruction >> 6) & 0x07; //extracting bits 8-6
   unsigned short int des_reg = (instruction >> 9) & 0x07; //extracting bits 11-9
-  printf("Source Reg: %01X\n", src_reg);
-  printf("Destination Reg: %01X\n", des_reg);
+  DebugPrintf("Source Reg: %01X\n", src_reg);
+  DebugPrintf("Destination Reg: %01X\n", des_reg);
 
   // Set control signals
   CPU->DATA_WE = 0;
@@ -486,18 +600,18 @@ void ArithmeticOp(MachineState* CPU, FILE* output) {
     if (imm5 & 0x0010) { // If the sign bit (bit 4) is set
         imm5 |= 0xFFE0;  // Extend the sign to 16 bits
     }
-    printf("Immediate 5-bit: 0x%04X (%d)\n", imm5, (short)imm5); // Print in both hex and decimal
+    DebugPrintf("Immediate 5-bit: 0x%04X (%d)\n", imm5, (short)imm5); // Print in both hex and decimal
     CPU->R[des_reg] = CPU->R[src_reg] + imm5;
   
     } else {
     // Extract sub-opcode (bits 3 to 5)
     unsigned short int subop = (instruction >> 3) & 0x07;
-    printf("\n");
-    printf("Arithmetic Subopcode: %01X\n", subop);
+    DebugPrintf("\n");
+    DebugPrintf("Arithmetic Subopcode: %01X\n", subop);
 
     // Extract target register (bits 0 to 2)
     unsigned short int target_reg = instruction & 0x07;
-    printf("Target Reg: %01X\n", target_reg);
+    DebugPrintf("Target Reg: %01X\n", target_reg);
 
       switch (subop) {
         case 0:
@@ -513,15 +627,15 @@ void ArithmeticOp(MachineState* CPU, FILE* output) {
             CPU->R[des_reg] = CPU->R[src_reg] - CPU->R[target_reg];
             break;
         case 3:
-            /// Division
-            CPU->R[des_reg] = CPU->R[src_reg] / CPU->R[target_reg];
+            /// Division, a zero divisor gives 0 like the fast engines
+            CPU->R[des_reg] = CPU->R[target_reg] ? CPU->R[src_reg] / CPU->R[target_reg] : 0;
             break;
         default:
-            printf("Unknown subopcode\n");
+            DebugPrintf("Unknown subopcode\n");
             break;
       }
     }  
-  printf("Value at Destination Register %01X: %01X(%d)\n", des_reg, CPU->R[des_reg], (short)(CPU->R[des_reg]));
+  DebugPrintf("Value at Destination Register %01X: %01X(%d)\n", des_reg, CPU->R[des_reg], (short)(CPU->R[des_reg]));
 
   // calculate NZP
   CPU->NZPVal = NZP_calc((short)CPU->R[des_reg]);
@@ -529,11 +643,11 @@ void ArithmeticOp(MachineState* CPU, FILE* output) {
 
   // Print output for current cycle
   WriteOut(CPU, output);
-  printf("WRITING arithmetic INSTRUCTION TO FILE. \n");
+  DebugPrintf("WRITING arithmetic INSTRUCTION TO FILE. \n");
 
   // Increment the PC
   CPU->PC++;
-  printf("Updated PC: %04x\n", CPU->PC);
+  DebugPrintf("Updated PC: %04x\n", CPU->PC);
 }
 
 /*
@@ -553,30 +667,31 @@ void ComparativeOp(MachineState* CPU, FILE* output)
 
    // Extract bits 7-8 for subop
   unsigned short int subop = (instruction >> 7) & 0x3;
-  printf("\n");
-  printf("COMPARISON Subopcode: %01X\n", subop);
+  DebugPrintf("\n");
+  DebugPrintf("COMPARISON Subopcode: %01X\n", subop);
 
   // Extract bits 9-11 for src_reg
   unsigned short int src_reg = (instruction >> 9) & 0x7;
-  printf("Value at Source Register %01X: %01X(%d)\n", src_reg, CPU->R[src_reg], (short)(CPU->R[src_reg]));
+  DebugPrintf("Value at Source Register %01X: %01X(%d)\n", src_reg, CPU->R[src_reg], (short)(CPU->R[src_reg]));
 
   int result;
 
   if (subop == 0 || subop == 1) { // CMP
        // Extract bits 0-2 for target_reg
        unsigned short int target_reg = instruction & 0x7;
-       printf("Value at Target Register %01X: %01X(%d)\n", target_reg, CPU->R[target_reg], (short)(CPU->R[target_reg]));
+       DebugPrintf("Value at Target Register %01X: %01X(%d)\n", target_reg, CPU->R[target_reg], (short)(CPU->R[target_reg]));
        if (subop == 0) {  // CMP
-          result = CPU->R[src_reg] - CPU->R[target_reg];
-          printf("CMP Result: %d\n", (short)result);
+          // signed, so the difference of the operands can leave 16 bits
+          result = (short)CPU->R[src_reg] - (short)CPU->R[target_reg];
+          DebugPrintf("CMP Result: %d\n", result);
 
           //calculate NZP and set in PSR
-          CPU->NZPVal = NZP_calc((short)result);
+          CPU->NZPVal = NZP_calc(result);
           SetNZP(CPU, CPU->NZPVal);
        } else {  // CMPU
            result = (unsigned)CPU->R[src_reg] - (unsigned)CPU->R[target_reg];
-           printf("%d - %d\n", (unsigned)CPU->R[src_reg], (unsigned)CPU->R[target_reg]);
-           printf("CMPU Result: %01X(%d)\n", result, result);
+           DebugPrintf("%d - %d\n", (unsigned)CPU->R[src_reg], (unsigned)CPU->R[target_reg]);
+           DebugPrintf("CMPU Result: %01X(%d)\n", result, result);
           
           //calculate NZP and set in PSR
           CPU->NZPVal = NZP_calc(result);
@@ -588,33 +703,33 @@ void ComparativeOp(MachineState* CPU, FILE* output)
            if (imm7 & 0x0040) { // If the sign bit (bit 6) is set
                imm7 |= 0xFF80;  // Extend the sign to 16 bits
            }
-           printf("Immediate: %04X (%d)\n", imm7, (short)imm7);
-           result = CPU->R[src_reg] - imm7;
-           printf("Result CMPI: %d\n", (short)result);
+           DebugPrintf("Immediate: %04X (%d)\n", imm7, (short)imm7);
+           result = (short)CPU->R[src_reg] - (short)imm7;
+           DebugPrintf("Result CMPI: %d\n", result);
           
            //calculate NZP and set in PSR
-           CPU->NZPVal = NZP_calc((short)result);
+           CPU->NZPVal = NZP_calc(result);
            SetNZP(CPU, CPU->NZPVal);
            } else {  // CMPIU
             result = (unsigned short)CPU->R[src_reg] - (unsigned short)imm7;
-            printf("Result CMPIU: %d\n", result);
+            DebugPrintf("Result CMPIU: %d\n", result);
           
             //calculate NZP and set in PSR
             CPU->NZPVal = NZP_calc(result);
             SetNZP(CPU, CPU->NZPVal);
            }
    } else {
-       printf("Unknown subopcode\n");
+       DebugPrintf("Unknown subopcode\n");
        return;
    }
 
    // Print output for current cycle
     WriteOut(CPU, output);
-    printf("WRITING comparative INSTRUCTION TO FILE. \n");
+    DebugPrintf("WRITING comparative INSTRUCTION TO FILE. \n");
 
    // Increment the PC
     CPU->PC++;
-    printf("Updated PC: %04X\n", CPU->PC);
+    DebugPrintf("Updated PC: %04X\n", CPU->PC);
 }
 /*
 * Parses rest of JSR operation and prints out.
@@ -628,20 +743,21 @@ void JSROp(MachineState* CPU, FILE* output)
   CPU->NZP_WE = 1;   
   CPU->regFile_WE = 1;  
   CPU->DATA_WE = 0;  
+  CPU->rsMux_CTL = 0;
   CPU->rdMux_CTL = 1;
   
   unsigned short int subop = (instruction >> 11) & 1;  // Extract bit 11 for subop
-  printf("Subopcode: %01X\n", subop);
+  DebugPrintf("Subopcode: %01X\n", subop);
 		
   if (subop == 0) { // JSRR
     unsigned short int src_reg = (instruction >> 6) & 0x07;
-    printf("Source Register: %01X\n", src_reg);
+    DebugPrintf("Source Register: %01X\n", src_reg);
 
     unsigned short int src_reg_val = CPU->R[src_reg];
     unsigned short int temp_PC = CPU->PC;
 
     CPU->R[7] = temp_PC + 1;
-    printf("Register R7 set to: %04X\n", CPU->R[7]);
+    DebugPrintf("Register R7 set to: %04X\n", CPU->R[7]);
 
    //calculate NZP
    CPU->NZPVal = NZP_calc((short)(CPU->R[7]));
@@ -649,25 +765,25 @@ void JSROp(MachineState* CPU, FILE* output)
 
    // Print output for current cycle
    WriteOut(CPU, output);
-   printf("WRITING JSRR INSTRUCTION TO FILE. \n");
+   DebugPrintf("WRITING JSRR INSTRUCTION TO FILE. \n");
 
     CPU->PC = src_reg_val;
-    printf("Program Counter set to: %04X\n", CPU->PC);
+    DebugPrintf("Program Counter set to: %04X\n", CPU->PC);
 
   } else if (subop == 1) { // JSR
 
     short int imm11 = instruction & 0x07FF;    // extract immediate value
-    printf("Bits 0-10: %04X\n", imm11);
+    DebugPrintf("Bits 0-10: %04X\n", imm11);
 
   // Print the 9-bit immediate value in binary
-    printf("0-bit immediate value: ");
+    DebugPrintf("0-bit immediate value: ");
     for (int i = 10; i >= 0; i--) {
-        printf("%d", (imm11 >> i) & 1);
+        DebugPrintf("%d", (imm11 >> i) & 1);
     }
-    printf("\n");
+    DebugPrintf("\n");
 
     CPU->R[7] = CPU->PC + 1;
-    printf("Register R7 set to: %04X\n", CPU->R[7]);
+    DebugPrintf("Register R7 set to: %04X\n", CPU->R[7]);
 
    //calculate NZP
       CPU->NZPVal = NZP_calc((short)CPU->R[7]);
@@ -675,13 +791,13 @@ void JSROp(MachineState* CPU, FILE* output)
 
    // Print output for current cycle
     WriteOut(CPU, output);
-    printf("WRITING JSR INSTRUCTION TO FILE. \n");
+    DebugPrintf("WRITING JSR INSTRUCTION TO FILE. \n");
 
     CPU->PC = ((CPU->PC) & 0x8000) | (imm11 << 4);
-    printf("Program Counter set to: %04X\n", CPU->PC);
+    DebugPrintf("Program Counter set to: %04X\n", CPU->PC);
 
 	} else { 
-    printf("Unknown subopcode\n");
+    DebugPrintf("Unknown subopcode\n");
     return;
 	}
  }
@@ -701,18 +817,18 @@ void JumpOp(MachineState* CPU, FILE* output)
   CPU->rsMux_CTL = 0;
  
   unsigned short int subop = (instruction >> 11) & 1;  // Extract bit 11 for subop
-  printf("Subopcode: %01X\n", subop);
+  DebugPrintf("Subopcode: %01X\n", subop);
 		
   if (subop == 0) { // JMPR
    unsigned short int src_reg = (instruction >> 6) & 0x07; // Extracting bits 8-6
-   printf("Source Reg: %01X\n", src_reg);
+   DebugPrintf("Source Reg: %01X\n", src_reg);
 
    // Print output for current cycle
    WriteOut(CPU, output);
-   printf("WRITING JMPR INSTRUCTION TO FILE. \n");
+   DebugPrintf("WRITING JMPR INSTRUCTION TO FILE. \n");
 
    CPU->PC = CPU->R[src_reg];
-   printf("Program Counter set to: %04X\n", CPU->PC);
+   DebugPrintf("Program Counter set to: %04X\n", CPU->PC);
   }
 
   else if (subop == 1) { //JMP
@@ -722,17 +838,17 @@ void JumpOp(MachineState* CPU, FILE* output)
     }
 
     short signed_imm11 = (short)imm11;
-    printf("Sign-extended IMM11 in decimal: %d\n", signed_imm11);
+    DebugPrintf("Sign-extended IMM11 in decimal: %d\n", signed_imm11);
 
     // Print output for current cycle
     WriteOut(CPU, output);
-    printf("WRITING JMP INSTRUCTION TO FILE. \n");
+    DebugPrintf("WRITING JMP INSTRUCTION TO FILE. \n");
 
     CPU->PC = CPU->PC + 1 + imm11 ;
-    printf("Program Counter set to: %04X\n", CPU->PC);
+    DebugPrintf("Program Counter set to: %04X\n", CPU->PC);
    }
   else { 
-    printf("Unknown subopcode\n");
+    DebugPrintf("Unknown subopcode\n");
     return;
 	}
 }
@@ -746,8 +862,8 @@ void LogicalOp(MachineState* CPU, FILE* output)
   unsigned short int instruction = CPU->memory[CPU->PC];
   unsigned short int src_reg = (instruction >> 6) & 0x07; //extracting bits 8-6
   unsigned short int des_reg = (instruction >> 9) & 0x07; //extracting bits 11-9
-  printf("Source Reg: %01X\n", src_reg);
-  printf("Destination Reg: %01X\n", des_reg);
+  DebugPrintf("Source Reg: %01X\n", src_reg);
+  DebugPrintf("Destination Reg: %01X\n", des_reg);
 
   // Set control signals
   CPU->DATA_WE = 0;
@@ -763,19 +879,19 @@ void LogicalOp(MachineState* CPU, FILE* output)
     if (imm5 & 0x0010) { // If the sign bit (bit 4) is set
         imm5 |= 0xFFE0;  // Extend the sign to 16 bits
     }
-    printf("Immediate 5-bit: 0x%04X (%d)\n", imm5, (short)imm5); // Print in both hex and decimal
+    DebugPrintf("Immediate 5-bit: 0x%04X (%d)\n", imm5, (short)imm5); // Print in both hex and decimal
     CPU->R[des_reg] = CPU->R[src_reg] & imm5;
   
     } else {
 
     // Extract sub-opcode (bits 3 to 5)
     unsigned short int subop = (instruction >> 3) & 0x07;
-    printf("\n");
-    printf("LogicalOP Subopcode: %01X\n", subop);
+    DebugPrintf("\n");
+    DebugPrintf("LogicalOP Subopcode: %01X\n", subop);
 
     // Extract target register (bits 0 to 2)
     unsigned short int target_reg = instruction & 0x07;
-    printf("Target Reg: %01X\n", target_reg);
+    DebugPrintf("Target Reg: %01X\n", target_reg);
 
   switch (subop) {
     case 0:
@@ -795,11 +911,11 @@ void LogicalOp(MachineState* CPU, FILE* output)
         CPU->R[des_reg] = CPU->R[src_reg] ^ CPU->R[target_reg];
         break;
     default:
-        printf("Unknown subopcode\n");
+        DebugPrintf("Unknown subopcode\n");
         break;
     }
   }  
-  printf("Value at Destination Register %01X: %01X(%d)\n", des_reg, CPU->R[des_reg], (short)(CPU->R[des_reg]));
+  DebugPrintf("Value at Destination Register %01X: %01X(%d)\n", des_reg, CPU->R[des_reg], (short)(CPU->R[des_reg]));
 
   // calculate NZP
   CPU->NZPVal = NZP_calc((short)CPU->R[des_reg]);
@@ -807,11 +923,11 @@ void LogicalOp(MachineState* CPU, FILE* output)
 
   // Print output for current cycle
   WriteOut(CPU, output);
-  printf("WRITING logical INSTRUCTION TO FILE. \n");
+  DebugPrintf("WRITING logical INSTRUCTION TO FILE. \n");
 
   // Increment the PC
   CPU->PC++;
-  printf("Updated PC: %04x\n", CPU->PC);
+  DebugPrintf("Updated PC: %04x\n", CPU->PC);
 }
 
 
@@ -825,8 +941,8 @@ void ShiftModOp(MachineState* CPU, FILE* output)
   unsigned short int instruction = CPU->memory[CPU->PC];
   unsigned short int src_reg = (instruction >> 6) & 0x07; //extracting bits 8-6
   unsigned short int des_reg = (instruction >> 9) & 0x07; //extracting bits 11-9
-  printf("Source Reg: %01X\n", src_reg);
-  printf("Destination Reg: %01X\n", des_reg);
+  DebugPrintf("Source Reg: %01X\n", src_reg);
+  DebugPrintf("Destination Reg: %01X\n", des_reg);
 
   // Set control signals
   CPU->DATA_WE = 0;
@@ -837,14 +953,15 @@ void ShiftModOp(MachineState* CPU, FILE* output)
   CPU->rdMux_CTL = 0;
 
   unsigned short int subop = (instruction >> 4) & 0x3;  // Extract sub-opcode (bits 4 to 5)
-  printf("\n");
-  printf("ShiftMod Subopcode: %01X\n", subop);
+  DebugPrintf("\n");
+  DebugPrintf("ShiftMod Subopcode: %01X\n", subop);
 
   if (subop == 3) { // MOD
   unsigned short int target_reg = instruction & 0x07;  // Extract target register (bits 0 to 2)
-  printf("Target Reg: %01X\n", target_reg);
+  DebugPrintf("Target Reg: %01X\n", target_reg);
 
-  CPU->R[des_reg] = CPU->R[src_reg] % CPU->R[target_reg];
+  // a zero divisor gives 0 like the fast engines
+  CPU->R[des_reg] = CPU->R[target_reg] ? CPU->R[src_reg] % CPU->R[target_reg] : 0;
   }
   else {
     short int u_imm4 = instruction & 0x000F; // Extract bits 0 to 3
@@ -865,12 +982,12 @@ void ShiftModOp(MachineState* CPU, FILE* output)
         CPU->R[des_reg] = CPU->R[src_reg] >> u_imm4;
         break;
       default:
-        printf("Unknown subopcode\n");
+        DebugPrintf("Unknown subopcode\n");
         break;
     }
   }
 
-  printf("Value at Destination Register %01X: %01X(%d)\n", des_reg, CPU->R[des_reg], (short)(CPU->R[des_reg]));
+  DebugPrintf("Value at Destination Register %01X: %01X(%d)\n", des_reg, CPU->R[des_reg], (short)(CPU->R[des_reg]));
 
   // calculate NZP
   CPU->NZPVal = NZP_calc((short)CPU->R[des_reg]);
@@ -878,11 +995,11 @@ void ShiftModOp(MachineState* CPU, FILE* output)
 
   // Print output for current cycle
   WriteOut(CPU, output);
-  printf("WRITING ShiftMod INSTRUCTION TO FILE. \n");
+  DebugPrintf("WRITING ShiftMod INSTRUCTION TO FILE. \n");
 
   // Increment the PC
   CPU->PC++;
-  printf("Updated PC: %04x\n", CPU->PC);
+  DebugPrintf("Updated PC: %04x\n", CPU->PC);
  }
 
 
@@ -892,7 +1009,7 @@ void ShiftModOp(MachineState* CPU, FILE* output)
 void SetNZP(MachineState* CPU, short result)
 {
      // Print NZP value
-  printf("NZP Value: %u\n", CPU->NZPVal);
+  DebugPrintf("NZP Value: %u\n", CPU->NZPVal);
 
   CPU->PSR &= ~(1 << 0);  // Clear P bit
   CPU->PSR &= ~(1 << 1);  // Clear Z bit
@@ -901,28 +1018,28 @@ void SetNZP(MachineState* CPU, short result)
   switch (result) {
     case 1: {
        CPU->PSR |= (1 << 0);  // Set P bit if positive
-       printf("P flag set\n");
+       DebugPrintf("P flag set\n");
        break;
     }
     case 2: {
       CPU->PSR |= (1 << 1);  // Set Z bit if zero
-      printf("Z flag set\n");
+      DebugPrintf("Z flag set\n");
       break;
     }
     case 4: {
        CPU->PSR |= (1 << 2);  // Set N bit if negative
-       printf("N flag set\n");
+       DebugPrintf("N flag set\n");
        break;
     }
     default: {
-      printf("Unknown NZP Value\n");
+      DebugPrintf("Unknown NZP Value\n");
       break;
     }
   }
   // Print the updated PSR
-  printf("Updated PSR: \n");
+  DebugPrintf("Updated PSR: \n");
   for (int i = 15; i >= 0; i--) {
-    printf("%d", (CPU->PSR >> i) & 1);
+    DebugPrintf("%d", (CPU->PSR >> i) & 1);
   }
-  printf("\n");
+  DebugPrintf("\n");
  }
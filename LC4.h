@@ -2,6 +2,9 @@
  * LC4.h: Declares simulator functions for executing instructions
  */
 
+#ifndef LC4_H
+#define LC4_H
+
 #include "string.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -33,11 +36,76 @@ typedef struct {
     unsigned short int dmemAddr;
     unsigned short int dmemValue;
 
+    // Access permissions of each 256 word page, see the PAGE_* bits below
+    unsigned char pageAttr[256];
+
+    // Memory-mapped devices behind PAGE_DEVICE pages, NULL when none are attached
+    struct DeviceState* devices;
+
+    // PAGE_*_USER bit of the last access AccessFault reported, 0 for none
+    unsigned char fault;
+
+    // While hashing is set, hash is the XOR of HashWord over R, PSR and
+    // memory, kept up to date by every engine; see StartStateHash
+    int hashing;
+    unsigned long long hash;
+
     // Machine memory - all of it
     unsigned short int memory[65536];
 } MachineState;
 
 
+// Page permission bits; each OS bit is the user bit shifted left by one so the
+// bit needed at the current privilege is (user bit << (PSR >> 15))
+#define PAGE_EXEC_USER  0x01
+#define PAGE_EXEC_OS    0x02
+#define PAGE_READ_USER  0x04
+#define PAGE_READ_OS    0x08
+#define PAGE_WRITE_USER 0x10
+#define PAGE_WRITE_OS   0x20
+
+// Device page: no plain access is allowed, so loads and stores fall into the
+// slow path, which hands OS accesses to DeviceRead and DeviceWrite
+#define PAGE_DEVICE     0x40
+
+// Video page: plain reads, but stores take the same slow path, to VideoStore
+#define PAGE_VIDEO      0x80
+
+// Pages whose OS accesses go to the devices instead of faulting
+#define PAGE_HOOKED     (PAGE_DEVICE | PAGE_VIDEO)
+
+// Non-zero if the current privilege level may access address (PAGE_*_USER bit)
+#define PAGE_ALLOWS(CPU, address, access) \
+    ((CPU)->pageAttr[(unsigned short int)(address) >> 8] & ((access) << ((CPU)->PSR >> 15)))
+
+// Non-zero if the OS is running and address is on a device or video page
+#define IN_DEVICE_PAGE(CPU, address) \
+    (((CPU)->pageAttr[(unsigned short int)(address) >> 8] & PAGE_HOOKED) && ((CPU)->PSR & 0x8000))
+
+// Keys of the registers for HashWord, past the last memory address
+#define HASH_KEY_PC  0x10000
+#define HASH_KEY_PSR 0x10001
+#define HASH_KEY_R   0x10002
+
+// Hash of one word of state: a memory address or HASH_KEY_* in key and its
+// value; a state hashes to the XOR over its words, so writing a word moves
+// the hash by HashWord(key, old) ^ HashWord(key, new)
+static inline unsigned long long HashWord(unsigned int key, unsigned short int value) {
+    unsigned long long x = ((unsigned long long)key << 16 | value) + 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+// Move CPU->hash past a write to memory[address] that replaced old
+#define HASH_STORE(CPU, address, old) \
+    do { \
+        if ((CPU)->hashing) { \
+            (CPU)->hash ^= HashWord((address), (old)) ^ HashWord((address), (CPU)->memory[(address)]); \
+        } \
+    } while (0)
+
+
 /*
  * This function should execute one LC4 datapath cycle.
  */
@@ -104,7 +172,64 @@ void SetNZP(MachineState* CPU, short result);
 void Reset(MachineState* CPU);
 
 
+/*
+ * Build the page table from the LC4 memory map: user code x0000-x1FFF,
+ * user data x2000-x7FFF, OS code x8000-x9FFF, OS data xA000-xFFFF.
+ */
+void SetDefaultPageAttributes(MachineState* CPU);
+
+
+/*
+ * Set the attributes of every page holding an address in [start, end].
+ */
+void SetPageAttributes(MachineState* CPU, unsigned short int start, unsigned short int end, unsigned char attr);
+
+
+/*
+ * Report a denied access (access is a PAGE_*_USER bit), record it in
+ * CPU->fault and return 1.
+ */
+int AccessFault(MachineState* CPU, unsigned short int address, unsigned char access);
+
+
+/*
+ * XOR of HashWord over count words of memory starting at address, the first
+ * held in words[0].
+ */
+unsigned long long HashMemory(const unsigned short int* words, unsigned int address, unsigned int count);
+
+
+/*
+ * Hash R, PSR and memory into CPU->hash from scratch and keep it up to date
+ * from now on: UpdateMachineState and RunFast apply each write to it, at
+ * O(1) per instruction.
+ */
+void StartStateHash(MachineState* CPU);
+
+
+/*
+ * The 64-bit hash of the whole machine: PC, PSR, R and memory. Two machines
+ * with different states almost surely differ in it. Needs StartStateHash.
+ */
+unsigned long long StateHash(MachineState* CPU);
+
+
+/*
+ * Apply to CPU->hash the registers and PSR that differ from R and PSR.
+ */
+void HashRegisterChanges(MachineState* CPU, const unsigned short int* R, unsigned short int PSR);
+
+
 /*
  * Clear all of the internal values (set to 0)
  */
 void ClearSignals(MachineState* CPU);
+
+
+/*
+ * Per-instruction debug output of UpdateMachineState goes to stdout while this
+ * is non-zero (the default). Batch runs clear it before starting any threads.
+ */
+extern int DebugOutput;
+
+#endif
@@ -0,0 +1,414 @@
+/*
+ * analysis.c: Defines the static control-flow and code/data analysis of a loaded image
+ */
+
+#include "analysis.h"
+#include "engine.h"
+
+// Register values known along a straight run of code
+typedef struct {
+    unsigned char known;                // bit r set when R[r] is known
+    unsigned short int value[8];
+} Constants;
+
+// helper to tell whether insn ends a basic block: branches, jumps, calls,
+// returns and the opcodes that never move the PC
+static int EndsBlock(unsigned short int insn) {
+    switch (insn >> 12) {
+        case 0:
+            return ((insn >> 9) & 7) != 0;
+        case 3: case 4: case 8: case 11: case 12: case 14: case 15:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// helper to follow the registers an instruction that does not end a block writes
+static void Track(Constants* k, unsigned short int insn) {
+    int d = (insn >> 9) & 7, s = (insn >> 6) & 7;
+    switch (insn >> 12) {
+        case 9:
+            k->value[d] = SEXT(insn, 9);
+            k->known |= 1 << d;
+            break;
+        case 13:
+            k->value[d] = (k->value[d] & 0xFF) | ((insn & 0xFF) << 8);
+            break;
+        case 1:
+            if ((insn & 0x20) && (k->known & (1 << s))) {
+                k->value[d] = k->value[s] + SEXT(insn, 5);
+                k->known |= 1 << d;
+            } else {
+                k->known &= ~(1 << d);
+            }
+            break;
+        case 5: case 6: case 10:
+            k->known &= ~(1 << d);
+            break;
+        default:
+            break;
+    }
+}
+
+// helper to queue an address to walk from, which starts a basic block
+static void Push(CodeAnalysis* A, int* stack, int* depth, int address, int* grew) {
+    if (!(A->map[address] & MAP_LEADER)) {
+        A->map[address] |= MAP_LEADER;
+        *grew = 1;
+    }
+    if (!(A->map[address] & MAP_REACHED)) {
+        stack[(*depth)++] = address;
+    }
+}
+
+// helper for the call, jump or return target of the instruction at address
+static int ControlTarget(Constants* k, unsigned short int address, unsigned short int insn) {
+    int s = (insn >> 6) & 7;
+    switch (insn >> 12) {
+        case 0:
+            return (unsigned short int)(address + 1 + SEXT(insn, 9));
+        case 4:
+            if (insn & 0x0800) {
+                return (address & 0x8000) | ((insn & 0x7FF) << 4);
+            }
+            return (k->known & (1 << s)) ? k->value[s] : TARGET_INDIRECT;
+        case 8:
+            return (k->known & 0x80) ? k->value[7] : TARGET_NONE;
+        case 12:
+            if (insn & 0x0800) {
+                return (unsigned short int)(address + 1 + SEXT(insn, 11));
+            }
+            if (k->known & (1 << s)) {
+                return k->value[s];
+            }
+            // JMPR R7 is a return
+            return s == 7 ? TARGET_NONE : TARGET_INDIRECT;
+        case 15:
+            return 0x8000 | (insn & 0xFF);
+        default:
+            return TARGET_NONE;
+    }
+}
+
+// helper to walk everything reachable from the entries once; returns 1 if
+// new leaders were found, so constants have to be worked out again
+static int Walk(CodeAnalysis* A, MachineState* CPU, ObjectInfo* info, int* stack) {
+    int grew = 0, depth = 0;
+    for (int a = 0; a < 65536; a++) {
+        A->map[a] &= MAP_CODE | MAP_DATA | MAP_LEADER;
+        A->target[a] = TARGET_NONE;
+        A->store[a] = STORE_NONE;
+    }
+
+    // where PennSim starts, and where the OS hands over to user code
+    int entries[2] = {0x8200, 0x0000};
+    for (int i = 0; i < 2; i++) {
+        if (A->map[entries[i]] & MAP_CODE) {
+            A->map[entries[i]] |= MAP_FUNCTION;
+            Push(A, stack, &depth, entries[i], &grew);
+        }
+    }
+    if (A->indirect) {
+        for (int i = 0; i < info->numSymbols; i++) {
+            unsigned short int address = info->symbols[i].address;
+            if (A->map[address] & MAP_CODE) {
+                A->map[address] |= MAP_FUNCTION;
+                Push(A, stack, &depth, address, &grew);
+            }
+        }
+    }
+
+    while (depth > 0) {
+        int start = stack[--depth];
+        Constants k = {0};
+        for (int a = start;; a = (a + 1) & 0xFFFF) {
+            if (A->map[a] & MAP_REACHED) {
+                // two paths meet here
+                if (a != start && !(A->map[a] & MAP_LEADER)) {
+                    A->map[a] |= MAP_LEADER;
+                    grew = 1;
+                }
+                break;
+            }
+            // the halt, or a page that faults when executed
+            if (a == 0x80FF || !(CPU->pageAttr[a >> 8] & (PAGE_EXEC_USER | PAGE_EXEC_OS))) {
+                break;
+            }
+            if (A->map[a] & MAP_LEADER) {
+                k.known = 0;
+            }
+            A->map[a] |= MAP_REACHED;
+
+            unsigned short int insn = CPU->memory[a];
+            if (!EndsBlock(insn)) {
+                if ((insn >> 12) == 7) {
+                    int base = (insn >> 6) & 7;
+                    A->store[a] = (k.known & (1 << base)) ?
+                                  (unsigned short int)(k.value[base] + SEXT(insn, 6)) : STORE_ANYWHERE;
+                }
+                Track(&k, insn);
+                continue;
+            }
+
+            int opcode = insn >> 12;
+            int target = ControlTarget(&k, a, insn);
+            A->target[a] = target;
+            if (target == TARGET_INDIRECT && !A->indirect) {
+                A->indirect = 1;
+                grew = 1;
+            }
+            if (target >= 0) {
+                // RTI starts the code it returns to, usually user code after the OS
+                if (opcode == 4 || opcode == 8 || opcode == 15) {
+                    A->map[target] |= MAP_FUNCTION;
+                }
+                Push(A, stack, &depth, target, &grew);
+            }
+            // calls return, except to the halt, and only BRnzp is sure to be taken
+            if (((opcode == 4 || opcode == 15) && target != 0x80FF) || (opcode == 0 && ((insn >> 9) & 7) != 7)) {
+                Push(A, stack, &depth, (a + 1) & 0xFFFF, &grew);
+            }
+            break;
+        }
+    }
+    return grew;
+}
+
+// helper to add a call edge
+static int AddCall(CodeAnalysis* A, int* capCalls, unsigned short int caller, unsigned short int site,
+                   unsigned short int callee) {
+    if (A->numCalls == *capCalls) {
+        int cap = *capCalls ? 2 * *capCalls : 64;
+        CallEdge* calls = realloc(A->calls, cap * sizeof(CallEdge));
+        if (calls == NULL) {
+            return -1;
+        }
+        A->calls = calls;
+        *capCalls = cap;
+    }
+    CallEdge* edge = &A->calls[A->numCalls++];
+    edge->caller = caller;
+    edge->site = site;
+    edge->callee = callee;
+    return 0;
+}
+
+// helper to record the calls made by the code reachable from function
+// without going through a call; seen[] holds the function last visiting each address
+static int FindCalls(CodeAnalysis* A, MachineState* CPU, int function, int* seen, int* stack, int* capCalls) {
+    int depth = 0;
+    stack[depth++] = function;
+    while (depth > 0) {
+        for (int a = stack[--depth]; seen[a] != function && a != 0x80FF; a = (a + 1) & 0xFFFF) {
+            seen[a] = function;
+            unsigned short int insn = CPU->memory[a];
+            if (!EndsBlock(insn)) {
+                continue;
+            }
+
+            int opcode = insn >> 12, target = A->target[a];
+            if (opcode == 4 || opcode == 15) {
+                if (target >= 0 && AddCall(A, capCalls, function, a, target) != 0) {
+                    return -1;
+                }
+                if (target != 0x80FF) {
+                    stack[depth++] = (a + 1) & 0xFFFF;
+                }
+            } else if (opcode != 8) {
+                if (target >= 0) {
+                    stack[depth++] = target;
+                }
+                if (opcode == 0 && ((insn >> 9) & 7) != 7) {
+                    stack[depth++] = (a + 1) & 0xFFFF;
+                }
+            }
+            break;
+        }
+    }
+    return 0;
+}
+
+int AnalyzeImage(MachineState* CPU, ObjectInfo* info, CodeAnalysis* A) {
+    memset(A->map, 0, sizeof(A->map));
+    A->blocks = NULL;
+    A->numBlocks = 0;
+    A->calls = NULL;
+    A->numCalls = 0;
+    A->indirect = 0;
+    for (int i = 0; i < info->numSections; i++) {
+        ObjectSection* section = &info->sections[i];
+        for (int w = 0; w < section->words; w++) {
+            A->map[(unsigned short int)(section->address + w)] |= section->code ? MAP_CODE : MAP_DATA;
+        }
+    }
+
+    // every control instruction pushes at most two addresses, plus the labels
+    int* stack = malloc((2 * 65536 + info->numSymbols + 2) * sizeof(int));
+    int* seen = malloc(65536 * sizeof(int));
+    if (stack == NULL || seen == NULL) {
+        fprintf(stderr, "Error: Out of memory for the analysis\n");
+        free(stack);
+        free(seen);
+        return -1;
+    }
+    // a pass that changes anything adds a leader or sets indirect, and
+    // neither is ever undone, so the walks reach a fixpoint
+    while (Walk(A, CPU, info, stack)) {
+    }
+
+    // blocks run from each reached leader to the next leader or control instruction
+    int capBlocks = 0;
+    for (int a = 0; a < 65536; a++) {
+        if ((A->map[a] & (MAP_REACHED | MAP_LEADER)) != (MAP_REACHED | MAP_LEADER)) {
+            continue;
+        }
+        int end = a;
+        while (!EndsBlock(CPU->memory[end]) && end < 0xFFFF && end + 1 != 0x80FF &&
+               (A->map[end + 1] & (MAP_REACHED | MAP_LEADER)) == MAP_REACHED) {
+            end++;
+        }
+        if (A->numBlocks == capBlocks) {
+            capBlocks = capBlocks ? 2 * capBlocks : 256;
+            BasicBlock* blocks = realloc(A->blocks, capBlocks * sizeof(BasicBlock));
+            if (blocks == NULL) {
+                fprintf(stderr, "Error: Out of memory for the analysis\n");
+                free(stack);
+                free(seen);
+                return -1;
+            }
+            A->blocks = blocks;
+        }
+        A->blocks[A->numBlocks].start = a;
+        A->blocks[A->numBlocks].end = end;
+        A->numBlocks++;
+    }
+
+    int capCalls = 0;
+    for (int a = 0; a < 65536; a++) {
+        seen[a] = -1;
+    }
+    for (int a = 0; a < 65536; a++) {
+        if ((A->map[a] & (MAP_REACHED | MAP_FUNCTION)) == (MAP_REACHED | MAP_FUNCTION) &&
+            FindCalls(A, CPU, a, seen, stack, &capCalls) != 0) {
+            fprintf(stderr, "Error: Out of memory for the analysis\n");
+            free(stack);
+            free(seen);
+            return -1;
+        }
+    }
+    free(stack);
+    free(seen);
+
+    // an STR through an unknown address may write any writable page
+    int anywhere = 0;
+    for (int a = 0; a < 65536; a++) {
+        if (A->store[a] == STORE_ANYWHERE) {
+            anywhere = 1;
+        } else if (A->store[a] >= 0 && (CPU->pageAttr[A->store[a] >> 8] & (PAGE_WRITE_USER | PAGE_WRITE_OS))) {
+            A->map[A->store[a]] |= MAP_WRITTEN;
+        }
+    }
+    for (int a = 0; a < 65536; a++) {
+        if (anywhere && (CPU->pageAttr[a >> 8] & (PAGE_WRITE_USER | PAGE_WRITE_OS))) {
+            A->map[a] |= MAP_WRITTEN;
+        }
+        if ((A->map[a] & (MAP_CODE | MAP_WRITTEN)) == MAP_CODE) {
+            A->map[a] |= MAP_READONLY;
+        }
+    }
+    return 0;
+}
+
+// helper to print an address with its label, if any
+static void PrintAddress(FILE* output, ObjectInfo* info, int address) {
+    const char* name = SymbolAt(info, address);
+    fprintf(output, "x%04X%s%s", address, name ? " " : "", name ? name : "");
+}
+
+void PrintAnalysis(CodeAnalysis* A, MachineState* CPU, ObjectInfo* info, FILE* output) {
+    fprintf(output, "Sections:\n");
+    for (int i = 0; i < info->numSections; i++) {
+        ObjectSection* section = &info->sections[i];
+        fprintf(output, "  %s x%04X-x%04X (%u words)\n", section->code ? "code" : "data", section->address,
+                (unsigned short int)(section->address + section->words - 1), section->words);
+    }
+
+    int reached = 0, functions = 0, codeWords = 0, readOnly = 0, outside = 0;
+    for (int a = 0; a < 65536; a++) {
+        reached += (A->map[a] & MAP_REACHED) != 0;
+        functions += (A->map[a] & (MAP_REACHED | MAP_FUNCTION)) == (MAP_REACHED | MAP_FUNCTION);
+        codeWords += (A->map[a] & MAP_CODE) != 0;
+        readOnly += (A->map[a] & MAP_READONLY) != 0;
+        outside += (A->map[a] & (MAP_REACHED | MAP_CODE)) == MAP_REACHED;
+    }
+    fprintf(output, "Reachable: %d instructions in %d blocks, %d functions, %d calls\n", reached, A->numBlocks,
+            functions, A->numCalls);
+    fprintf(output, "Read-only code: %d of %d code words\n", readOnly, codeWords);
+    if (outside > 0) {
+        fprintf(output, "Reachable words outside code sections: %d\n", outside);
+    }
+    if (A->indirect) {
+        fprintf(output, "Some register jumps or calls have unknown targets; every code label is an entry\n");
+    }
+
+    fprintf(output, "Blocks:\n");
+    for (int i = 0; i < A->numBlocks; i++) {
+        BasicBlock* block = &A->blocks[i];
+        unsigned short int insn = CPU->memory[block->end];
+        int opcode = insn >> 12, target = A->target[block->end];
+        fprintf(output, "  x%04X-x%04X", block->start, block->end);
+        const char* name = SymbolAt(info, block->start);
+        if (name != NULL) {
+            fprintf(output, " %s", name);
+        }
+        fprintf(output, " ->");
+        if (!EndsBlock(insn) || ((opcode == 4 || opcode == 15) && target != 0x80FF) ||
+            (opcode == 0 && ((insn >> 9) & 7) != 7)) {
+            unsigned short int next = block->end + 1;
+            if (CPU->pageAttr[next >> 8] & (PAGE_EXEC_USER | PAGE_EXEC_OS)) {
+                fprintf(output, " x%04X", next);
+            } else {
+                fprintf(output, " fault");
+            }
+        }
+        if (target == 0x80FF) {
+            fprintf(output, " halt");
+        } else if (target >= 0 && opcode != 4 && opcode != 15) {
+            fprintf(output, " x%04X", target);
+        } else if (target == TARGET_INDIRECT) {
+            fprintf(output, " ?");
+        } else if (EndsBlock(insn) && (opcode == 8 || opcode == 12)) {
+            fprintf(output, " return");
+        }
+        fprintf(output, "\n");
+    }
+
+    fprintf(output, "Call graph:\n");
+    for (int i = 0; i < A->numCalls; i++) {
+        CallEdge* edge = &A->calls[i];
+        fprintf(output, "  ");
+        PrintAddress(output, info, edge->caller);
+        fprintf(output, " -> ");
+        PrintAddress(output, info, edge->callee);
+        fprintf(output, " at x%04X\n", edge->site);
+    }
+
+    fprintf(output, "Stores that may write code:\n");
+    for (int a = 0; a < 65536; a++) {
+        if (A->store[a] == STORE_ANYWHERE && codeWords > readOnly) {
+            fprintf(output, "  x%04X to an unknown address\n", a);
+        } else if (A->store[a] >= 0 && (A->map[A->store[a]] & (MAP_CODE | MAP_WRITTEN)) == (MAP_CODE | MAP_WRITTEN)) {
+            fprintf(output, "  x%04X to x%04X\n", a, A->store[a]);
+        }
+    }
+}
+
+void FreeAnalysis(CodeAnalysis* A) {
+    free(A->blocks);
+    free(A->calls);
+    A->blocks = NULL;
+    A->calls = NULL;
+    A->numBlocks = 0;
+    A->numCalls = 0;
+}
@@ -0,0 +1,76 @@
+/*
+ * analysis.h: Declares the static control-flow and code/data analysis of a loaded image
+ */
+
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+#include <stdio.h>
+#include "loader.h"
+
+// Per-address bits of the map
+#define MAP_CODE     0x01 // loaded by a code section
+#define MAP_DATA     0x02 // loaded by a data section
+#define MAP_REACHED  0x04 // some path from an entry executes it
+#define MAP_LEADER   0x08 // a basic block starts here
+#define MAP_FUNCTION 0x10 // an entry, or the target of a JSR, JSRR or TRAP
+#define MAP_WRITTEN  0x20 // some reachable STR may store here
+#define MAP_READONLY 0x40 // code no reachable STR can change
+
+// Values of target[] besides an address
+#define TARGET_NONE     -1 // falls through, returns, or is not control flow
+#define TARGET_INDIRECT -2 // a register jump or call whose target is not known
+
+// Values of store[] besides an address
+#define STORE_ANYWHERE -1 // an STR whose address is not known
+#define STORE_NONE     -2 // not a reachable STR
+
+// A straight run of reachable instructions entered only at start
+typedef struct {
+    unsigned short int start;
+    unsigned short int end;             // last instruction, inclusive
+} BasicBlock;
+
+// A call site: the function it lies in and the function it calls
+typedef struct {
+    unsigned short int caller;
+    unsigned short int site;
+    unsigned short int callee;
+} CallEdge;
+
+typedef struct {
+    unsigned char map[65536];
+    int target[65536];                  // where the control instruction at an address goes
+    int store[65536];                   // where the STR at an address writes
+
+    BasicBlock* blocks;
+    int numBlocks;
+    CallEdge* calls;
+    int numCalls;
+
+    int indirect;                       // some target was not known, so every code label is an entry
+} CodeAnalysis;
+
+/*
+ * Recover the reachable code of the image in CPU from the code and data
+ * sections in info. Entries are x8200 and x0000 when a code section holds
+ * them, then every JSR/TRAP target, branch and jump target and return point.
+ * Constants built by CONST/HICONST/ADD within a block resolve JMPR, JSRR,
+ * RTI and STR addresses; a return through R7 has no static target. STR
+ * addresses that stay unknown may write any code on a writable page.
+ * Returns 0, or -1 after printing an error.
+ */
+int AnalyzeImage(MachineState* CPU, ObjectInfo* info, CodeAnalysis* A);
+
+/*
+ * Print the sections, basic blocks with their successors, the call graph
+ * and the STRs that may write code.
+ */
+void PrintAnalysis(CodeAnalysis* A, MachineState* CPU, ObjectInfo* info, FILE* output);
+
+/*
+ * Release the blocks and calls.
+ */
+void FreeAnalysis(CodeAnalysis* A);
+
+#endif
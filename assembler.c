@@ -0,0 +1,720 @@
+/*
+ * assembler.c: Defines the built-in LC4 assembler
+ */
+
+#include "assembler.h"
+#include <ctype.h>
+#include <strings.h>
+
+// longest source line we accept
+#define MAX_LINE 1024
+
+// most words (label, mnemonic, operands) on one source line
+#define MAX_TOKENS 8
+
+// instruction formats understood by the assembler
+enum {
+    K_NOP, K_BR, K_ARITH, K_RRR, K_NOT, K_CMP, K_CMPI, K_JSRR, K_JSR, K_MEM,
+    K_RTI, K_CONST, K_SHIFT, K_MOD, K_JMPR, K_RET, K_JMP, K_HICONST, K_TRAP,
+    K_LEA, K_LC
+};
+
+// one mnemonic and the bits it always sets
+typedef struct {
+    const char* name;
+    int kind;
+    unsigned short int base;
+} Mnemonic;
+
+static const Mnemonic mnemonics[] = {
+    {"NOP", K_NOP, 0x0000},
+    {"BR", K_BR, 0x0E00}, {"BRN", K_BR, 0x0800}, {"BRZ", K_BR, 0x0400},
+    {"BRP", K_BR, 0x0200}, {"BRNZ", K_BR, 0x0C00}, {"BRNP", K_BR, 0x0A00},
+    {"BRZP", K_BR, 0x0600}, {"BRNZP", K_BR, 0x0E00},
+    {"ADD", K_ARITH, 0x1000}, {"MUL", K_RRR, 0x1008}, {"SUB", K_RRR, 0x1010},
+    {"DIV", K_RRR, 0x1018},
+    {"CMP", K_CMP, 0x2000}, {"CMPU", K_CMP, 0x2080}, {"CMPI", K_CMPI, 0x2100},
+    {"CMPIU", K_CMPI, 0x2180},
+    {"JSRR", K_JSRR, 0x4000}, {"JSR", K_JSR, 0x4800},
+    {"AND", K_ARITH, 0x5000}, {"NOT", K_NOT, 0x5008}, {"OR", K_RRR, 0x5010},
+    {"XOR", K_RRR, 0x5018},
+    {"LDR", K_MEM, 0x6000}, {"STR", K_MEM, 0x7000},
+    {"RTI", K_RTI, 0x8000},
+    {"CONST", K_CONST, 0x9000},
+    {"SLL", K_SHIFT, 0xA000}, {"SRA", K_SHIFT, 0xA010}, {"SRL", K_SHIFT, 0xA020},
+    {"MOD", K_MOD, 0xA030},
+    {"JMPR", K_JMPR, 0xC000}, {"RET", K_RET, 0xC1C0}, {"JMP", K_JMP, 0xC800},
+    {"HICONST", K_HICONST, 0xD100},
+    {"TRAP", K_TRAP, 0xF000},
+    {"LEA", K_LEA, 0x0000}, {"LC", K_LC, 0x0000},
+};
+
+// state of one assembly run
+typedef struct {
+    AsmImage* image;
+    char* filename;
+    int line;
+    int pass;                    // 0 collects constants, 1 labels, 2 emits words
+    int os;                      // inside .OS
+    int data;                    // inside .DATA
+    unsigned int location[2][2]; // location counters indexed by [os][data]
+    ObjectInfo constants;
+    int errors;
+} Assembler;
+
+
+// helper to report a source error (a pass with errors is the last one run)
+static void AsmError(Assembler* A, const char* message, const char* arg) {
+    fprintf(stderr, "Error: %s:%d: %s%s%s\n", A->filename, A->line, message,
+            arg ? " " : "", arg ? arg : "");
+    A->errors++;
+}
+
+// helper to find a mnemonic
+static const Mnemonic* FindMnemonic(const char* name) {
+    for (unsigned int i = 0; i < sizeof(mnemonics) / sizeof(mnemonics[0]); i++) {
+        if (strcasecmp(mnemonics[i].name, name) == 0) {
+            return &mnemonics[i];
+        }
+    }
+    return NULL;
+}
+
+// helper to parse #decimal, xHEX, 0xHEX or a bare decimal number
+static int ParseNumber(const char* text, int* value) {
+    char* end;
+    long result;
+
+    if (text[0] == '#') {
+        result = strtol(text + 1, &end, 10);
+    } else if (text[0] == 'x' || text[0] == 'X') {
+        result = strtol(text + 1, &end, 16);
+    } else if (text[0] == '0' && (text[1] == 'x' || text[1] == 'X')) {
+        result = strtol(text + 2, &end, 16);
+    } else if (isdigit((unsigned char)text[0]) || text[0] == '-') {
+        result = strtol(text, &end, 10);
+    } else {
+        return -1;
+    }
+
+    if (*end != '\0' || end == text || result < -65536 || result > 65535) {
+        return -1;
+    }
+    *value = (int)result;
+    return 0;
+}
+
+// helper to parse R0-R7
+static int ParseRegister(Assembler* A, const char* text) {
+    if ((text[0] == 'R' || text[0] == 'r') && text[1] >= '0' && text[1] <= '7' && text[2] == '\0') {
+        return text[1] - '0';
+    }
+    AsmError(A, "expected a register, got", text);
+    return 0;
+}
+
+// helper to resolve a number or a label; labels may be unknown before pass 2
+static int ParseValue(Assembler* A, const char* text, int* value, int* isLabel) {
+    unsigned short int address;
+
+    *isLabel = 0;
+    if (ParseNumber(text, value) == 0) {
+        return 0;
+    }
+
+    *isLabel = 1;
+    if (LookupSymbol(&A->image->info, text, &address) == 0) {
+        *value = address;
+        return 0;
+    }
+    if (LookupSymbol(&A->constants, text, &address) == 0) {
+        *value = (short int)address;
+        return 0;
+    }
+
+    *value = 0;
+    if (A->pass == 2) {
+        AsmError(A, "undefined label", text);
+        return -1;
+    }
+    return 0;
+}
+
+// helper to range check a value and fit it into a bit field
+static unsigned short int Field(Assembler* A, int value, int bits, int isSigned) {
+    int low = isSigned ? -(1 << (bits - 1)) : 0;
+    int high = (1 << bits) - 1;
+
+    if (value < low || value > high) {
+        char text[32];
+        snprintf(text, sizeof(text), "%d", value);
+        AsmError(A, "immediate out of range:", text);
+    }
+    return (unsigned short int)(value & high);
+}
+
+// helper to place one word at the current location
+static void Emit(Assembler* A, unsigned short int word) {
+    unsigned int address = A->location[A->os][A->data];
+
+    if (address > 0xFFFF) {
+        AsmError(A, "program runs past the end of memory", NULL);
+        return;
+    }
+    A->location[A->os][A->data]++;
+    if (A->pass != 2) {
+        return;
+    }
+
+    AsmImage* image = A->image;
+    unsigned short int type = A->data ? SECTION_DATA : SECTION_CODE;
+    AsmSection* last = image->numSections ? &image->sections[image->numSections - 1] : NULL;
+
+    // extend the current section or start a new one
+    if (last != NULL && last->type == type && last->address + last->count == address) {
+        last->count++;
+    } else if (image->numSections < MAX_SECTIONS) {
+        last = &image->sections[image->numSections++];
+        last->type = type;
+        last->address = (unsigned short int)address;
+        last->count = 1;
+    } else {
+        AsmError(A, "too many sections", NULL);
+        return;
+    }
+
+    image->words[address] = word;
+    image->lines[address] = (unsigned short int)A->line;
+}
+
+// helper to check an instruction's operand count
+static int ExpectOperands(Assembler* A, int have, int want, const char* name) {
+    if (have != want) {
+        AsmError(A, "wrong number of operands for", name);
+        return -1;
+    }
+    return 0;
+}
+
+// helper to encode one instruction or pseudo-op
+static void AssembleInstruction(Assembler* A, const Mnemonic* m, char** ops, int n) {
+    unsigned int pc = A->location[A->os][A->data];
+    int value, isLabel;
+    unsigned short int word = m->base;
+
+    switch (m->kind) {
+        case K_NOP:
+        case K_RTI:
+        case K_RET: {
+            if (ExpectOperands(A, n, 0, m->name) == 0) {
+                Emit(A, word);
+            }
+            return;
+        }
+        case K_BR: {
+            if (ExpectOperands(A, n, 1, m->name) != 0 || ParseValue(A, ops[0], &value, &isLabel) != 0) {
+                return;
+            }
+            // labels become PC relative offsets, numbers are offsets already
+            if (isLabel) {
+                value -= (int)pc + 1;
+            }
+            Emit(A, word | Field(A, A->pass == 2 ? value : 0, 9, 1));
+            return;
+        }
+        case K_ARITH:
+        case K_RRR: {
+            if (ExpectOperands(A, n, 3, m->name) != 0) {
+                return;
+            }
+            word |= ParseRegister(A, ops[0]) << 9;
+            word |= ParseRegister(A, ops[1]) << 6;
+            // ADD and AND take an immediate in place of the last register
+            if (m->kind == K_ARITH && toupper((unsigned char)ops[2][0]) != 'R') {
+                ParseValue(A, ops[2], &value, &isLabel);
+                word |= 0x0020 | Field(A, value, 5, 1);
+            } else {
+                word |= ParseRegister(A, ops[2]);
+            }
+            Emit(A, word);
+            return;
+        }
+        case K_NOT: {
+            if (ExpectOperands(A, n, 2, m->name) == 0) {
+                Emit(A, word | ParseRegister(A, ops[0]) << 9 | ParseRegister(A, ops[1]) << 6);
+            }
+            return;
+        }
+        case K_CMP: {
+            if (ExpectOperands(A, n, 2, m->name) == 0) {
+                Emit(A, word | ParseRegister(A, ops[0]) << 9 | ParseRegister(A, ops[1]));
+            }
+            return;
+        }
+        case K_CMPI: {
+            if (ExpectOperands(A, n, 2, m->name) != 0) {
+                return;
+            }
+            word |= ParseRegister(A, ops[0]) << 9;
+            ParseValue(A, ops[1], &value, &isLabel);
+            Emit(A, word | Field(A, value, 7, m->base == 0x2100));
+            return;
+        }
+        case K_JSRR:
+        case K_JMPR: {
+            if (ExpectOperands(A, n, 1, m->name) == 0) {
+                Emit(A, word | ParseRegister(A, ops[0]) << 6);
+            }
+            return;
+        }
+        case K_JSR: {
+            if (ExpectOperands(A, n, 1, m->name) != 0 || ParseValue(A, ops[0], &value, &isLabel) != 0) {
+                return;
+            }
+            // a label must be 16 word aligned and in the same half of memory
+            if (isLabel && A->pass == 2) {
+                if ((value & 0xF) != 0 || (value & 0x8000) != (pc & 0x8000)) {
+                    AsmError(A, "JSR target is not reachable (missing .FALIGN?):", ops[0]);
+                }
+                value = (value & 0x7FFF) >> 4;
+            }
+            Emit(A, word | Field(A, value, 11, 0));
+            return;
+        }
+        case K_MEM: {
+            if (ExpectOperands(A, n, 3, m->name) != 0) {
+                return;
+            }
+            word |= ParseRegister(A, ops[0]) << 9;
+            word |= ParseRegister(A, ops[1]) << 6;
+            ParseValue(A, ops[2], &value, &isLabel);
+            Emit(A, word | Field(A, value, 6, 1));
+            return;
+        }
+        case K_CONST: {
+            if (ExpectOperands(A, n, 2, m->name) != 0) {
+                return;
+            }
+            word |= ParseRegister(A, ops[0]) << 9;
+            ParseValue(A, ops[1], &value, &isLabel);
+            Emit(A, word | Field(A, value, 9, 1));
+            return;
+        }
+        case K_SHIFT: {
+            if (ExpectOperands(A, n, 3, m->name) != 0) {
+                return;
+            }
+            word |= ParseRegister(A, ops[0]) << 9;
+            word |= ParseRegister(A, ops[1]) << 6;
+            ParseValue(A, ops[2], &value, &isLabel);
+            Emit(A, word | Field(A, value, 4, 0));
+            return;
+        }
+        case K_MOD: {
+            if (ExpectOperands(A, n, 3, m->name) == 0) {
+                Emit(A, word | ParseRegister(A, ops[0]) << 9 | ParseRegister(A, ops[1]) << 6 |
+                        ParseRegister(A, ops[2]));
+            }
+            return;
+        }
+        case K_JMP: {
+            if (ExpectOperands(A, n, 1, m->name) != 0 || ParseValue(A, ops[0], &value, &isLabel) != 0) {
+                return;
+            }
+            if (isLabel) {
+                value -= (int)pc + 1;
+            }
+            Emit(A, word | Field(A, A->pass == 2 ? value : 0, 11, 1));
+            return;
+        }
+        case K_HICONST: {
+            if (ExpectOperands(A, n, 2, m->name) != 0) {
+                return;
+            }
+            word |= ParseRegister(A, ops[0]) << 9;
+            ParseValue(A, ops[1], &value, &isLabel);
+            Emit(A, word | Field(A, value, 8, 0));
+            return;
+        }
+        case K_TRAP: {
+            if (ExpectOperands(A, n, 1, m->name) == 0) {
+                ParseValue(A, ops[0], &value, &isLabel);
+                Emit(A, word | Field(A, value, 8, 0));
+            }
+            return;
+        }
+        case K_LEA:
+        case K_LC: {
+            if (ExpectOperands(A, n, 2, m->name) != 0) {
+                return;
+            }
+            unsigned short int reg = ParseRegister(A, ops[0]);
+            unsigned short int address;
+            int known = 0;
+
+            // LC of a number or .CONST has a known size, anything else is a label
+            if (m->kind == K_LC && ParseNumber(ops[1], &value) == 0) {
+                known = 1;
+            } else if (m->kind == K_LC && LookupSymbol(&A->constants, ops[1], &address) == 0) {
+                value = address;
+                known = 1;
+            } else {
+                ParseValue(A, ops[1], &value, &isLabel);
+            }
+
+            // a constant that fits IMM9 needs no HICONST (labels always take two words)
+            short int signed_value = (short int)value;
+            if (m->kind == K_LC && known && signed_value >= -256 && signed_value <= 255) {
+                Emit(A, 0x9000 | reg << 9 | (signed_value & 0x1FF));
+            } else {
+                Emit(A, 0x9000 | reg << 9 | (value & 0xFF));
+                Emit(A, 0xD100 | reg << 9 | ((value >> 8) & 0xFF));
+            }
+            return;
+        }
+    }
+}
+
+// helper to emit the characters of a .STRINGZ literal
+static void AssembleString(Assembler* A, const char* text) {
+    const char* c = strchr(text, '"');
+    if (c == NULL) {
+        AsmError(A, ".STRINGZ needs a quoted string", NULL);
+        return;
+    }
+
+    for (c++; *c != '"'; c++) {
+        if (*c == '\0') {
+            AsmError(A, "unterminated string", NULL);
+            return;
+        }
+        char character = *c;
+        if (character == '\\') {
+            c++;
+            switch (*c) {
+                case 'n': character = '\n'; break;
+                case 't': character = '\t'; break;
+                case 'r': character = '\r'; break;
+                case '0': character = '\0'; break;
+                case '\0': AsmError(A, "unterminated string", NULL); return;
+                default: character = *c; break;
+            }
+        }
+        Emit(A, (unsigned char)character);
+    }
+    Emit(A, 0);
+}
+
+// helper to process a directive, label may be NULL
+static void AssembleDirective(Assembler* A, const char* label, char** ops, int n, const char* raw) {
+    const char* name = ops[0];
+    int value, isLabel;
+
+    // constants are collected in pass 0 so LC knows their size early
+    if (strcasecmp(name, ".CONST") == 0 || strcasecmp(name, ".UCONST") == 0) {
+        int isSigned = (strcasecmp(name, ".CONST") == 0);
+        if (label == NULL || n != 2 || ParseNumber(ops[1], &value) != 0) {
+            AsmError(A, "usage: LABEL .CONST|.UCONST <number>", NULL);
+        } else if (A->pass == 0) {
+            if ((isSigned && (value < -32768 || value > 32767)) || (!isSigned && value < 0)) {
+                AsmError(A, "constant out of range:", ops[1]);
+            }
+            AddSymbol(&A->constants, label, (unsigned short int)value);
+        }
+        return;
+    }
+    if (A->pass == 0) {
+        return;
+    }
+
+    // everything else may carry a label naming the current location
+    if (label != NULL && A->pass == 1) {
+        unsigned short int address;
+        if (LookupSymbol(&A->image->info, label, &address) == 0 ||
+            LookupSymbol(&A->constants, label, &address) == 0) {
+            AsmError(A, "duplicate label", label);
+        } else {
+            AddSymbol(&A->image->info, label, (unsigned short int)A->location[A->os][A->data]);
+        }
+    }
+
+    if (strcasecmp(name, ".CODE") == 0) {
+        A->data = 0;
+    } else if (strcasecmp(name, ".DATA") == 0) {
+        A->data = 1;
+    } else if (strcasecmp(name, ".OS") == 0) {
+        A->os = 1;
+    } else if (strcasecmp(name, ".ADDR") == 0) {
+        if (n != 2 || ParseNumber(ops[1], &value) != 0 || value < 0) {
+            AsmError(A, "usage: .ADDR <address>", NULL);
+        } else {
+            A->location[A->os][A->data] = (unsigned int)value;
+        }
+    } else if (strcasecmp(name, ".FALIGN") == 0) {
+        A->location[A->os][A->data] = (A->location[A->os][A->data] + 15) & ~15u;
+    } else if (strcasecmp(name, ".FILL") == 0) {
+        if (n != 2 || ParseValue(A, ops[1], &value, &isLabel) != 0) {
+            AsmError(A, "usage: .FILL <value>", NULL);
+        } else {
+            Emit(A, (unsigned short int)Field(A, value < 0 ? value & 0xFFFF : value, 16, 0));
+        }
+    } else if (strcasecmp(name, ".BLKW") == 0) {
+        if (n != 2 || ParseNumber(ops[1], &value) != 0 || value < 0) {
+            AsmError(A, "usage: .BLKW <count>", NULL);
+        } else {
+            for (int i = 0; i < value; i++) {
+                Emit(A, 0);
+            }
+        }
+    } else if (strcasecmp(name, ".STRINGZ") == 0) {
+        AssembleString(A, raw);
+    } else if (strcasecmp(name, ".END") != 0) {
+        AsmError(A, "unknown directive", name);
+    }
+}
+
+// helper to split a line into label, mnemonic/directive and operands
+static void AssembleLine(Assembler* A, char* line) {
+    char raw[MAX_LINE];
+    strncpy(raw, line, sizeof(raw) - 1);
+    raw[sizeof(raw) - 1] = '\0';
+
+    // strip the comment, leaving semicolons inside strings alone
+    int quoted = 0;
+    for (char* c = line; *c != '\0'; c++) {
+        if (*c == '"') {
+            quoted = !quoted;
+        } else if (*c == ';' && !quoted) {
+            *c = '\0';
+            break;
+        }
+    }
+
+    // a quoted string is read from raw, so splitting stops at its first word
+    char* tokens[MAX_TOKENS];
+    int n = 0;
+    char* rest;
+    for (char* word = strtok_r(line, " \t\r\n,", &rest); word != NULL; word = strtok_r(NULL, " \t\r\n,", &rest)) {
+        if (n == MAX_TOKENS) {
+            AsmError(A, "too many operands at", word);
+            return;
+        }
+        tokens[n++] = word;
+        if (word[0] == '"') {
+            break;
+        }
+    }
+    if (n == 0) {
+        return;
+    }
+
+    // anything that is not a mnemonic or directive starts with a label
+    char* label = NULL;
+    if (tokens[0][0] != '.' && FindMnemonic(tokens[0]) == NULL) {
+        label = tokens[0];
+        size_t length = strlen(label);
+        if (length > 0 && label[length - 1] == ':') {
+            label[length - 1] = '\0';
+        }
+        n--;
+        memmove(tokens, tokens + 1, n * sizeof(char*));
+    }
+
+    if (n > 0 && tokens[0][0] == '.') {
+        AssembleDirective(A, label, tokens, n, raw);
+        return;
+    }
+    if (A->pass == 0) {
+        return;
+    }
+
+    if (label != NULL && A->pass == 1) {
+        unsigned short int address;
+        if (LookupSymbol(&A->image->info, label, &address) == 0 ||
+            LookupSymbol(&A->constants, label, &address) == 0) {
+            AsmError(A, "duplicate label", label);
+        } else {
+            AddSymbol(&A->image->info, label, (unsigned short int)A->location[A->os][A->data]);
+        }
+    }
+
+    if (n > 0) {
+        const Mnemonic* m = FindMnemonic(tokens[0]);
+        if (m == NULL) {
+            AsmError(A, "unknown instruction", tokens[0]);
+        } else if (A->data) {
+            AsmError(A, "instruction in a .DATA section:", tokens[0]);
+        } else {
+            AssembleInstruction(A, m, tokens + 1, n - 1);
+        }
+    }
+}
+
+AsmImage* AssembleFile(char* filename) {
+    FILE* file = fopen(filename, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Error: Could not open file %s\n", filename);
+        return NULL;
+    }
+
+    AsmImage* image = calloc(1, sizeof(AsmImage));
+    if (image == NULL) {
+        fprintf(stderr, "Error: Out of memory assembling %s\n", filename);
+        fclose(file);
+        return NULL;
+    }
+    strncpy(image->source, filename, PATH_MAX - 1);
+
+    Assembler A;
+    memset(&A, 0, sizeof(A));
+    A.image = image;
+    A.filename = filename;
+
+    char line[MAX_LINE];
+    for (A.pass = 0; A.pass <= 2 && A.errors == 0; A.pass++) {
+        // every pass starts from the default section addresses
+        A.line = 0;
+        A.os = 0;
+        A.data = 0;
+        A.location[0][0] = 0x0000;
+        A.location[0][1] = 0x2000;
+        A.location[1][0] = 0x8000;
+        A.location[1][1] = 0xA000;
+
+        rewind(file);
+        while (fgets(line, sizeof(line), file) != NULL) {
+            A.line++;
+            AssembleLine(&A, line);
+        }
+    }
+
+    FreeObjectInfo(&A.constants);
+    fclose(file);
+
+    if (A.errors != 0) {
+        FreeAsmImage(image);
+        return NULL;
+    }
+    return image;
+}
+
+int LoadAsmImage(AsmImage* image, MachineState* CPU, ObjectInfo* info) {
+    for (int i = 0; i < image->numSections; i++) {
+        AsmSection* section = &image->sections[i];
+        memcpy(&CPU->memory[section->address], &image->words[section->address],
+               section->count * sizeof(unsigned short int));
+    }
+
+    if (info != NULL) {
+        for (int i = 0; i < image->info.numSymbols; i++) {
+            if (AddSymbol(info, image->info.symbols[i].name, image->info.symbols[i].address) != 0) {
+                return -1;
+            }
+        }
+        for (int i = 0; i < image->numSections; i++) {
+            AsmSection* section = &image->sections[i];
+            if (AddSection(info, section->address, section->count, section->type == SECTION_CODE) != 0) {
+                return -1;
+            }
+        }
+
+        // a line for every code word, as WriteAsmImage records them
+        int file = AddFile(info, image->source);
+        if (file < 0) {
+            return -1;
+        }
+        for (int i = 0; i < image->numSections; i++) {
+            AsmSection* section = &image->sections[i];
+            for (unsigned int j = 0; section->type == SECTION_CODE && j < section->count; j++) {
+                if (AddLine(info, section->address + j, image->lines[section->address + j], file) != 0) {
+                    return -1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+// helper to write a big-endian word, as the object format requires
+static void WriteWord(FILE* file, unsigned short int word) {
+    fputc(word >> 8, file);
+    fputc(word & 0xFF, file);
+}
+
+int WriteAsmImage(AsmImage* image, char* filename) {
+    FILE* file = fopen(filename, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Error: Could not open file %s\n", filename);
+        return -1;
+    }
+
+    // code sections first, then data, like PennSim
+    for (int pass = 0; pass < 2; pass++) {
+        unsigned short int type = pass == 0 ? SECTION_CODE : SECTION_DATA;
+        for (int i = 0; i < image->numSections; i++) {
+            AsmSection* section = &image->sections[i];
+            if (section->type != type) {
+                continue;
+            }
+            WriteWord(file, section->type);
+            WriteWord(file, section->address);
+            WriteWord(file, section->count);
+            for (unsigned int j = 0; j < section->count; j++) {
+                WriteWord(file, image->words[section->address + j]);
+            }
+        }
+    }
+
+    for (int i = 0; i < image->info.numSymbols; i++) {
+        Symbol* symbol = &image->info.symbols[i];
+        WriteWord(file, 0xC3B7);
+        WriteWord(file, symbol->address);
+        WriteWord(file, strlen(symbol->name));
+        fputs(symbol->name, file);
+    }
+
+    // one file name section, then a line number for every code word
+    WriteWord(file, 0xF17E);
+    WriteWord(file, strlen(image->source));
+    fputs(image->source, file);
+    for (int i = 0; i < image->numSections; i++) {
+        AsmSection* section = &image->sections[i];
+        if (section->type != SECTION_CODE) {
+            continue;
+        }
+        for (unsigned int j = 0; j < section->count; j++) {
+            WriteWord(file, 0x715E);
+            WriteWord(file, section->address + j);
+            WriteWord(file, image->lines[section->address + j]);
+            WriteWord(file, 0);
+        }
+    }
+
+    if (fclose(file) != 0) {
+        fprintf(stderr, "Error: Could not write file %s\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+int LoadProgramFile(char* filename, MachineState* CPU, ObjectInfo* info) {
+    size_t length = strlen(filename);
+    if (length < 4 || strcasecmp(filename + length - 4, ".asm") != 0) {
+        return LoadObjectFile(filename, CPU, info);
+    }
+
+    AsmImage* image = AssembleFile(filename);
+    if (image == NULL) {
+        return -1;
+    }
+    int result = LoadAsmImage(image, CPU, info);
+    FreeAsmImage(image);
+    return result;
+}
+
+void FreeAsmImage(AsmImage* image) {
+    if (image != NULL) {
+        FreeObjectInfo(&image->info);
+        free(image);
+    }
+}
@@ -0,0 +1,64 @@
+/*
+ * assembler.h: Declares the built-in LC4 assembler
+ */
+
+#ifndef ASSEMBLER_H
+#define ASSEMBLER_H
+
+#include <limits.h>
+#include "loader.h"
+
+// Section types, same tags as in an object file
+#define SECTION_CODE 0xCADE
+#define SECTION_DATA 0xDADA
+
+// Most contiguous runs of words one source file may produce
+#define MAX_SECTIONS 256
+
+// A contiguous run of assembled words
+typedef struct {
+    unsigned short int type;
+    unsigned short int address;
+    unsigned int count;
+} AsmSection;
+
+// The assembled program, kept in memory until loaded or written out
+typedef struct {
+    char source[PATH_MAX];
+    AsmSection sections[MAX_SECTIONS];
+    int numSections;
+    unsigned short int words[65536];
+    unsigned short int lines[65536];
+    ObjectInfo info;
+} AsmImage;
+
+/*
+ * Assemble an .asm file. Supports all LC4 instructions, labels, the LEA/LC
+ * pseudo-ops and .CODE, .DATA, .OS, .ADDR, .FALIGN, .FILL, .BLKW, .STRINGZ,
+ * .CONST and .UCONST. Returns NULL after printing errors to stderr.
+ */
+AsmImage* AssembleFile(char* filename);
+
+/*
+ * Copy the assembled words into memory and its labels, sections, source file
+ * name and code lines into info (may be NULL).
+ */
+int LoadAsmImage(AsmImage* image, MachineState* CPU, ObjectInfo* info);
+
+/*
+ * Write the image as an object file with symbol, file name and line sections.
+ */
+int WriteAsmImage(AsmImage* image, char* filename);
+
+/*
+ * Load a program: .asm files are assembled in memory, anything else is read
+ * as an object file. Labels and sections go into info (may be NULL).
+ */
+int LoadProgramFile(char* filename, MachineState* CPU, ObjectInfo* info);
+
+/*
+ * Release an image returned by AssembleFile.
+ */
+void FreeAsmImage(AsmImage* image);
+
+#endif
@@ -0,0 +1,687 @@
+/*
+ * batch.c: Defines the lockstep engine running one program over many inputs
+ */
+
+#include "batch.h"
+#include "engine.h"
+#include <strings.h>
+
+// longest input line we accept
+#define BATCH_MAX_LINE 4096
+
+// Operations on BATCH_VECTOR 16 bit lanes at once: AVX2 when the compiler
+// targets it, otherwise plain loops the compiler may vectorize itself
+#ifdef __AVX2__
+#include <immintrin.h>
+
+typedef __m256i Vec;
+#define VLoad(p)       _mm256_load_si256((const __m256i*)(p))
+#define VStore(p, v)   _mm256_store_si256((__m256i*)(p), (v))
+#define VSet(x)        _mm256_set1_epi16((short)(x))
+#define VAdd(a, b)     _mm256_add_epi16((a), (b))
+#define VSub(a, b)     _mm256_sub_epi16((a), (b))
+#define VMul(a, b)     _mm256_mullo_epi16((a), (b))
+#define VAnd(a, b)     _mm256_and_si256((a), (b))
+#define VOr(a, b)      _mm256_or_si256((a), (b))
+#define VXor(a, b)     _mm256_xor_si256((a), (b))
+#define VAndNot(a, b)  _mm256_andnot_si256((a), (b))
+#define VEq(a, b)      _mm256_cmpeq_epi16((a), (b))
+#define VGt(a, b)      _mm256_cmpgt_epi16((a), (b))
+#define VMin(a, b)     _mm256_min_epu16((a), (b))
+#define VShl(a, n)     _mm256_sll_epi16((a), _mm_cvtsi32_si128(n))
+#define VShr(a, n)     _mm256_srl_epi16((a), _mm_cvtsi32_si128(n))
+#define VSar(a, n)     _mm256_sra_epi16((a), _mm_cvtsi32_si128(n))
+#define VAny(a)        (!_mm256_testz_si256((a), (a)))
+#define VCount(a)      (__builtin_popcount(_mm256_movemask_epi8(a)) / 2)
+
+#else
+
+typedef struct {
+    unsigned short int lane[BATCH_VECTOR];
+} Vec;
+
+// body of a lane by lane operation, l is the lane
+#define LANEWISE(expr) \
+    Vec r; \
+    for (int l = 0; l < BATCH_VECTOR; l++) { \
+        r.lane[l] = (unsigned short int)(expr); \
+    } \
+    return r
+
+static inline Vec VLoad(const unsigned short int* p) { Vec r; memcpy(&r, p, sizeof(r)); return r; }
+static inline void VStore(unsigned short int* p, Vec a) { memcpy(p, &a, sizeof(a)); }
+static inline Vec VSet(int x) { LANEWISE(x); }
+static inline Vec VAdd(Vec a, Vec b) { LANEWISE(a.lane[l] + b.lane[l]); }
+static inline Vec VSub(Vec a, Vec b) { LANEWISE(a.lane[l] - b.lane[l]); }
+static inline Vec VMul(Vec a, Vec b) { LANEWISE((unsigned int)a.lane[l] * b.lane[l]); }
+static inline Vec VAnd(Vec a, Vec b) { LANEWISE(a.lane[l] & b.lane[l]); }
+static inline Vec VOr(Vec a, Vec b) { LANEWISE(a.lane[l] | b.lane[l]); }
+static inline Vec VXor(Vec a, Vec b) { LANEWISE(a.lane[l] ^ b.lane[l]); }
+static inline Vec VAndNot(Vec a, Vec b) { LANEWISE(~a.lane[l] & b.lane[l]); }
+static inline Vec VEq(Vec a, Vec b) { LANEWISE(a.lane[l] == b.lane[l] ? 0xFFFF : 0); }
+static inline Vec VGt(Vec a, Vec b) { LANEWISE((short)a.lane[l] > (short)b.lane[l] ? 0xFFFF : 0); }
+static inline Vec VMin(Vec a, Vec b) { LANEWISE(a.lane[l] < b.lane[l] ? a.lane[l] : b.lane[l]); }
+static inline Vec VShl(Vec a, int n) { LANEWISE(a.lane[l] << n); }
+static inline Vec VShr(Vec a, int n) { LANEWISE(a.lane[l] >> n); }
+static inline Vec VSar(Vec a, int n) { LANEWISE((short)a.lane[l] >> n); }
+static inline int VAny(Vec a) {
+    unsigned short int any = 0;
+    for (int l = 0; l < BATCH_VECTOR; l++) {
+        any |= a.lane[l];
+    }
+    return any != 0;
+}
+static inline int VCount(Vec a) {
+    int count = 0;
+    for (int l = 0; l < BATCH_VECTOR; l++) {
+        count += a.lane[l] != 0;
+    }
+    return count;
+}
+
+#endif
+
+// a where mask is set, b elsewhere
+#define VBlend(mask, a, b) VOr(VAnd((mask), (a)), VAndNot((mask), (b)))
+
+// every chunk of BATCH_VECTOR lanes
+#define FOR_CHUNKS(B, i) for (int i = 0; i < (B)->padded; i += BATCH_VECTOR)
+
+
+// helper to allocate a zeroed lane array, aligned for vector loads
+static void* LaneArray(BatchState* B, size_t size) {
+    size_t bytes = ((B->padded * size + 31) / 32) * 32;
+    void* array = aligned_alloc(32, bytes);
+    if (array != NULL) {
+        memset(array, 0, bytes);
+    }
+    return array;
+}
+
+// helper to write a word of one lane's memory, copying the page on its
+// first write; returns -1 when out of memory
+static int BatchStore(BatchState* B, int lane, unsigned short int address, unsigned short int value) {
+    unsigned short int** page = &B->pages[(size_t)lane * 256 + (address >> 8)];
+    if (*page == &B->base->memory[address & 0xFF00]) {
+        unsigned short int* copy = malloc(256 * sizeof(unsigned short int));
+        if (copy == NULL) {
+            return -1;
+        }
+        memcpy(copy, *page, 256 * sizeof(unsigned short int));
+        *page = copy;
+        B->privatePages[address >> 8]++;
+    }
+    (*page)[address & 0xFF] = value;
+    return 0;
+}
+
+unsigned short int BatchLoad(BatchState* B, int lane, unsigned short int address) {
+    return B->pages[(size_t)lane * 256 + (address >> 8)][address & 0xFF];
+}
+
+// helper to parse a PennSim number: xHEX, #DECIMAL or DECIMAL
+static int ParseWord(const char* text, unsigned short int* word) {
+    char* end;
+    long value;
+    if (text[0] == 'x' || text[0] == 'X') {
+        value = strtol(text + 1, &end, 16);
+    } else {
+        value = strtol(text + (text[0] == '#'), &end, 10);
+    }
+    if (end == text || *end != '\0' || value < -32768 || value > 0xFFFF) {
+        return -1;
+    }
+    *word = (unsigned short int)value;
+    return 0;
+}
+
+// helper to apply one "name=value" setting to a lane
+static int ApplySetting(BatchState* B, int lane, char* setting) {
+    char* equals = strchr(setting, '=');
+    unsigned short int value, address;
+    if (equals == NULL || ParseWord(equals + 1, &value) != 0) {
+        return -1;
+    }
+
+    // compare the name on its own, then put the setting back for messages
+    *equals = '\0';
+    int result = 0;
+    if ((setting[0] == 'R' || setting[0] == 'r') && setting[1] >= '0' && setting[1] <= '7' && setting[2] == '\0') {
+        B->R[setting[1] - '0'][lane] = value;
+    } else if (strcasecmp(setting, "PC") == 0) {
+        B->PC[lane] = value;
+    } else if (strcasecmp(setting, "PSR") == 0) {
+        B->PSR[lane] = value;
+    } else if (ParseWord(setting, &address) == 0) {
+        result = BatchStore(B, lane, address, value);
+    } else {
+        result = -1;
+    }
+    *equals = '=';
+    return result;
+}
+
+BatchState* OpenBatch(MachineState* base, int lanes) {
+    BatchState* B = calloc(1, sizeof(BatchState));
+    if (B == NULL) {
+        fprintf(stderr, "Error: Out of memory for the batch\n");
+        return NULL;
+    }
+    B->lanes = lanes;
+    B->padded = (lanes + BATCH_VECTOR - 1) / BATCH_VECTOR * BATCH_VECTOR;
+    B->base = base;
+    B->PC = LaneArray(B, sizeof(unsigned short int));
+    B->PSR = LaneArray(B, sizeof(unsigned short int));
+    B->live = LaneArray(B, sizeof(unsigned short int));
+    int allocated = B->PC != NULL && B->PSR != NULL && B->live != NULL;
+    for (int r = 0; r < 8; r++) {
+        B->R[r] = LaneArray(B, sizeof(unsigned short int));
+        allocated = allocated && B->R[r] != NULL;
+    }
+    B->pages = calloc((size_t)lanes * 256, sizeof(unsigned short int*));
+    B->status = calloc(lanes, sizeof(int));
+    B->fault = calloc(lanes, sizeof(unsigned char));
+    B->instructions = calloc(lanes, sizeof(unsigned long long));
+    if (!allocated || B->pages == NULL || B->status == NULL || B->fault == NULL || B->instructions == NULL) {
+        fprintf(stderr, "Error: Out of memory for the batch\n");
+        CloseBatch(B);
+        return NULL;
+    }
+
+    for (int lane = 0; lane < lanes; lane++) {
+        B->PC[lane] = 0x8200;
+        B->PSR[lane] = 0x8002;
+        B->live[lane] = 0xFFFF;
+        for (int r = 0; r < 8; r++) {
+            B->R[r][lane] = base->R[r];
+        }
+        for (int page = 0; page < 256; page++) {
+            B->pages[(size_t)lane * 256 + page] = &base->memory[page << 8];
+        }
+    }
+
+    return B;
+}
+
+BatchState* ReadBatchInputs(char* filename, MachineState* base) {
+    FILE* file = fopen(filename, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Error: Could not open file %s\n", filename);
+        return NULL;
+    }
+
+    // one lane per line with anything on it
+    char line[BATCH_MAX_LINE];
+    int lanes = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char* word = strtok(line, " \t\r\n");
+        if (word != NULL && word[0] != '#') {
+            lanes++;
+        }
+    }
+    if (lanes == 0 || lanes > BATCH_MAX_LANES) {
+        fprintf(stderr, "Error: %s must hold 1 to %d inputs\n", filename, BATCH_MAX_LANES);
+        fclose(file);
+        return NULL;
+    }
+
+    BatchState* B = OpenBatch(base, lanes);
+    if (B == NULL) {
+        fclose(file);
+        return NULL;
+    }
+
+    rewind(file);
+    int lane = 0, number = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        number++;
+        char* word = strtok(line, " \t\r\n");
+        if (word == NULL || word[0] == '#') {
+            continue;
+        }
+        for (; word != NULL && word[0] != '#'; word = strtok(NULL, " \t\r\n")) {
+            if (ApplySetting(B, lane, word) != 0) {
+                fprintf(stderr, "Error: %s:%d: bad input %s\n", filename, number, word);
+                CloseBatch(B);
+                fclose(file);
+                return NULL;
+            }
+        }
+        lane++;
+    }
+    fclose(file);
+    return B;
+}
+
+// helper to retire a lane
+static void StopLane(BatchState* B, int lane, int status) {
+    B->live[lane] = 0;
+    B->status[lane] = status;
+}
+
+// helper to stop a lane on a denied access, access being a PAGE_*_USER bit
+static void FaultLane(BatchState* B, int lane, unsigned char access) {
+    StopLane(B, lane, RUN_FAULT);
+    B->fault[lane] = access;
+}
+
+// helper to set the NZP bits of the lanes in mask from comparing a to b as
+// signed words
+static inline void LaneNZP(BatchState* B, int i, Vec mask, Vec a, Vec b) {
+    Vec bits = VOr(VAnd(VGt(b, a), VSet(4)), VOr(VAnd(VEq(a, b), VSet(2)), VAnd(VGt(a, b), VSet(1))));
+    Vec psr = VLoad(&B->PSR[i]);
+    VStore(&B->PSR[i], VBlend(mask, VOr(VAndNot(VSet(7), psr), bits), psr));
+}
+
+// helper to write an ALU result to R[d] and the NZP bits of the lanes in mask
+static inline void Retire(BatchState* B, int i, Vec mask, int d, Vec result) {
+    VStore(&B->R[d][i], VBlend(mask, result, VLoad(&B->R[d][i])));
+    LaneNZP(B, i, mask, result, VSet(0));
+}
+
+// helper to move the lanes in mask on to target
+static inline void Jump(BatchState* B, int i, Vec mask, Vec target) {
+    VStore(&B->PC[i], VBlend(mask, target, VLoad(&B->PC[i])));
+}
+
+// helper for DIV and MOD, which have no vector form: lane by lane, with the
+// same zero divisor rule as RunFast
+static void DivideLanes(BatchState* B, const unsigned short int* mask, int d, int s, int t, int modulo) {
+    for (int lane = 0; lane < B->lanes; lane++) {
+        if (mask[lane]) {
+            unsigned short int divisor = B->R[t][lane];
+            unsigned short int dividend = B->R[s][lane];
+            B->R[d][lane] = divisor == 0 ? 0 : (modulo ? dividend % divisor : dividend / divisor);
+        }
+    }
+    FOR_CHUNKS(B, i) {
+        Vec m = VLoad(&mask[i]);
+        if (VAny(m)) {
+            LaneNZP(B, i, m, VLoad(&B->R[d][i]), VSet(0));
+        }
+    }
+}
+
+// helper for LDR and STR, lane by lane through each lane's pages
+static void MemoryLanes(BatchState* B, const unsigned short int* mask, unsigned short int insn) {
+    int store = (insn >> 12) == 7;
+    int d = (insn >> 9) & 0x7;
+    int s = (insn >> 6) & 0x7;
+    unsigned char access = store ? PAGE_WRITE_USER : PAGE_READ_USER;
+
+    for (int lane = 0; lane < B->lanes; lane++) {
+        if (!mask[lane]) {
+            continue;
+        }
+        unsigned short int address = B->R[s][lane] + SEXT(insn, 6);
+        unsigned short int psr = B->PSR[lane];
+        B->PC[lane]++;
+        if (!(B->base->pageAttr[address >> 8] & (access << (psr >> 15)))) {
+            FaultLane(B, lane, access);
+        } else if (store) {
+            if (BatchStore(B, lane, address, B->R[d][lane]) != 0) {
+                fprintf(stderr, "Error: Out of memory for lane %d\n", lane);
+                StopLane(B, lane, RUN_FAULT);
+            }
+        } else {
+            unsigned short int value = BatchLoad(B, lane, address);
+            B->R[d][lane] = value;
+            B->PSR[lane] = (psr & ~0x7) | NZP_BITS((short)value);
+        }
+    }
+}
+
+// helper to execute insn, at pc, on the lanes in mask
+static void ExecuteLanes(BatchState* B, const unsigned short int* mask, unsigned short int pc,
+                         unsigned short int insn) {
+    int d = (insn >> 9) & 0x7;
+    int s = (insn >> 6) & 0x7;
+    int t = insn & 0x7;
+    int sub = (insn >> 3) & 0x7;
+    Vec next = VSet(pc + 1);
+
+    switch (insn >> 12) {
+        case 1: // ADD, MUL, SUB, DIV, ADD IMM5
+        case 5: // AND, NOT, OR, XOR, AND IMM5
+        case 9: // CONST
+        case 10: // SLL, SRA, SRL, MOD
+        case 13: { // HICONST
+            int opcode = insn >> 12;
+            if ((opcode == 1 && !(insn & 0x0020) && sub == 3) || (opcode == 10 && ((insn >> 4) & 0x3) == 3)) {
+                DivideLanes(B, mask, d, s, t, opcode == 10);
+                FOR_CHUNKS(B, i) {
+                    Jump(B, i, VLoad(&mask[i]), next);
+                }
+                break;
+            }
+            FOR_CHUNKS(B, i) {
+                Vec m = VLoad(&mask[i]);
+                if (!VAny(m)) {
+                    continue;
+                }
+                Vec rs = VLoad(&B->R[s][i]);
+                Vec rt = VLoad(&B->R[t][i]);
+                // unused encodings leave R[d] as it is, like RunFast
+                Vec result = VLoad(&B->R[d][i]);
+                if (opcode == 1) {
+                    if (insn & 0x0020) {
+                        result = VAdd(rs, VSet(SEXT(insn, 5)));
+                    } else if (sub == 0) {
+                        result = VAdd(rs, rt);
+                    } else if (sub == 1) {
+                        result = VMul(rs, rt);
+                    } else if (sub == 2) {
+                        result = VSub(rs, rt);
+                    }
+                } else if (opcode == 5) {
+                    if (insn & 0x0020) {
+                        result = VAnd(rs, VSet(SEXT(insn, 5)));
+                    } else if (sub == 0) {
+                        result = VAnd(rs, rt);
+                    } else if (sub == 1) {
+                        result = VXor(rs, VSet(0xFFFF));
+                    } else if (sub == 2) {
+                        result = VOr(rs, rt);
+                    } else if (sub == 3) {
+                        result = VXor(rs, rt);
+                    }
+                } else if (opcode == 9) {
+                    result = VSet(SEXT(insn, 9));
+                } else if (opcode == 10) {
+                    int shift = insn & 0xF;
+                    int kind = (insn >> 4) & 0x3;
+                    result = kind == 0 ? VShl(rs, shift) : (kind == 1 ? VSar(rs, shift) : VShr(rs, shift));
+                } else {
+                    result = VOr(VAnd(result, VSet(0xFF)), VSet((insn & 0xFF) << 8));
+                }
+                Retire(B, i, m, d, result);
+                Jump(B, i, m, next);
+            }
+            break;
+        }
+        case 2: { // CMP, CMPU, CMPI, CMPIU
+            int kind = (insn >> 7) & 0x3;
+            Vec sign = VSet(0x8000);
+            FOR_CHUNKS(B, i) {
+                Vec m = VLoad(&mask[i]);
+                if (!VAny(m)) {
+                    continue;
+                }
+                Vec rd = VLoad(&B->R[d][i]);
+                if (kind == 0) {
+                    LaneNZP(B, i, m, rd, VLoad(&B->R[t][i]));
+                } else if (kind == 1) {
+                    LaneNZP(B, i, m, VXor(rd, sign), VXor(VLoad(&B->R[t][i]), sign));
+                } else if (kind == 2) {
+                    LaneNZP(B, i, m, rd, VSet(SEXT(insn, 7)));
+                } else {
+                    LaneNZP(B, i, m, VXor(rd, sign), VSet((insn & 0x7F) ^ 0x8000));
+                }
+                Jump(B, i, m, next);
+            }
+            break;
+        }
+        case 0: { // BR (and NOP)
+            Vec target = VSet(pc + 1 + SEXT(insn, 9));
+            Vec conditions = VSet(d);
+            FOR_CHUNKS(B, i) {
+                Vec m = VLoad(&mask[i]);
+                if (VAny(m)) {
+                    Vec untaken = VEq(VAnd(VLoad(&B->PSR[i]), conditions), VSet(0));
+                    Jump(B, i, m, VBlend(untaken, next, target));
+                }
+            }
+            break;
+        }
+        case 4: { // JSRR, JSR
+            Vec bits = VSet(NZP_BITS((short)(pc + 1)));
+            FOR_CHUNKS(B, i) {
+                Vec m = VLoad(&mask[i]);
+                if (!VAny(m)) {
+                    continue;
+                }
+                Vec target = (insn & 0x0800) ? VSet((pc & 0x8000) | ((insn & 0x7FF) << 4)) : VLoad(&B->R[s][i]);
+                VStore(&B->R[7][i], VBlend(m, next, VLoad(&B->R[7][i])));
+                Vec psr = VLoad(&B->PSR[i]);
+                VStore(&B->PSR[i], VBlend(m, VOr(VAndNot(VSet(7), psr), bits), psr));
+                Jump(B, i, m, target);
+            }
+            break;
+        }
+        case 6: // LDR
+        case 7: { // STR
+            MemoryLanes(B, mask, insn);
+            break;
+        }
+        case 8: { // RTI
+            FOR_CHUNKS(B, i) {
+                Vec m = VLoad(&mask[i]);
+                if (VAny(m)) {
+                    Vec psr = VLoad(&B->PSR[i]);
+                    VStore(&B->PSR[i], VBlend(m, VAnd(psr, VSet(0x7FFF)), psr));
+                    Jump(B, i, m, VLoad(&B->R[7][i]));
+                }
+            }
+            break;
+        }
+        case 12: { // JMPR, JMP
+            FOR_CHUNKS(B, i) {
+                Vec m = VLoad(&mask[i]);
+                if (VAny(m)) {
+                    Jump(B, i, m, (insn & 0x0800) ? VSet(pc + 1 + SEXT(insn, 11)) : VLoad(&B->R[s][i]));
+                }
+            }
+            break;
+        }
+        case 15: { // TRAP
+            // NZP comes from R7 + 1 as an int, like UpdateMachineState
+            Vec bits = VSet(0x8000 | NZP_BITS((unsigned short int)(pc + 1) + 1));
+            FOR_CHUNKS(B, i) {
+                Vec m = VLoad(&mask[i]);
+                if (!VAny(m)) {
+                    continue;
+                }
+                VStore(&B->R[7][i], VBlend(m, next, VLoad(&B->R[7][i])));
+                Vec psr = VLoad(&B->PSR[i]);
+                VStore(&B->PSR[i], VBlend(m, VOr(VAndNot(VSet(7), psr), bits), psr));
+                Jump(B, i, m, VSet(0x8000 | (insn & 0xFF)));
+            }
+            break;
+        }
+        default: {
+            // unknown opcodes leave the PC alone, like RunFast
+            break;
+        }
+    }
+}
+
+// helper to add the instructions counted in ticks to each lane's total
+static void FlushTicks(BatchState* B, unsigned short int* ticks) {
+    for (int lane = 0; lane < B->lanes; lane++) {
+        B->instructions[lane] += ticks[lane];
+        ticks[lane] = 0;
+    }
+}
+
+void RunBatch(BatchState* B, unsigned long long maxInstructions, unsigned long long deadline) {
+    // lanes executing this step, and 16 bit instruction counts per lane
+    // added to the totals before they can wrap
+    unsigned short int* mask = LaneArray(B, sizeof(unsigned short int));
+    unsigned short int* ticks = LaneArray(B, sizeof(unsigned short int));
+    if (mask == NULL || ticks == NULL) {
+        fprintf(stderr, "Error: Out of memory for the batch\n");
+        free(mask);
+        free(ticks);
+        return;
+    }
+
+    unsigned long long steps = 0;
+    for (;;) {
+        // the lowest PC of any live lane runs next, which is where lanes
+        // that branched apart around a loop or an if meet again
+        Vec low = VSet(0xFFFF);
+        Vec any = VSet(0);
+        FOR_CHUNKS(B, i) {
+            Vec live = VLoad(&B->live[i]);
+            low = VMin(low, VOr(VLoad(&B->PC[i]), VAndNot(live, VSet(0xFFFF))));
+            any = VOr(any, live);
+        }
+        if (!VAny(any)) {
+            break;
+        }
+        unsigned short int lows[BATCH_VECTOR] __attribute__((aligned(32)));
+        VStore(lows, low);
+        unsigned short int pc = 0xFFFF;
+        for (int l = 0; l < BATCH_VECTOR; l++) {
+            pc = lows[l] < pc ? lows[l] : pc;
+        }
+
+        // the lanes at pc, less those not allowed to execute there
+        unsigned char attr = B->base->pageAttr[pc >> 8];
+        Vec pcs = VSet(pc);
+        Vec privileged = VSet(0x8000);
+        FOR_CHUNKS(B, i) {
+            Vec m = VAnd(VEq(VLoad(&B->PC[i]), pcs), VLoad(&B->live[i]));
+            if ((attr & (PAGE_EXEC_USER | PAGE_EXEC_OS)) != (PAGE_EXEC_USER | PAGE_EXEC_OS) && VAny(m)) {
+                Vec os = VEq(VAnd(VLoad(&B->PSR[i]), privileged), privileged);
+                Vec allowed = VOr((attr & PAGE_EXEC_OS) ? os : VSet(0), (attr & PAGE_EXEC_USER) ? VXor(os, VSet(0xFFFF)) : VSet(0));
+                Vec denied = VAndNot(allowed, m);
+                if (VAny(denied)) {
+                    for (int lane = i; lane < i + BATCH_VECTOR; lane++) {
+                        if (B->PC[lane] == pc && B->live[lane] && !(attr & (PAGE_EXEC_USER << (B->PSR[lane] >> 15)))) {
+                            FaultLane(B, lane, PAGE_EXEC_USER);
+                        }
+                    }
+                    m = VAnd(m, allowed);
+                }
+            }
+            VStore(&mask[i], m);
+        }
+
+        // lanes that rewrote the code here may hold another instruction;
+        // those wait for a later step
+        unsigned short int insn = B->base->memory[pc];
+        if (B->privatePages[pc >> 8] > 0) {
+            int first = 1;
+            for (int lane = 0; lane < B->lanes; lane++) {
+                if (mask[lane]) {
+                    unsigned short int word = BatchLoad(B, lane, pc);
+                    if (first) {
+                        insn = word;
+                        first = 0;
+                    } else if (word != insn) {
+                        mask[lane] = 0;
+                    }
+                }
+            }
+        }
+
+        ExecuteLanes(B, mask, pc, insn);
+        steps++;
+
+        // count (a set mask is -1), and retire lanes that reached the halt
+        Vec halt = VSet(0x80FF);
+        FOR_CHUNKS(B, i) {
+            Vec m = VLoad(&mask[i]);
+            VStore(&ticks[i], VSub(VLoad(&ticks[i]), m));
+            B->opcodes[insn >> 12] += VCount(m);
+            Vec done = VAnd(VAnd(m, VLoad(&B->live[i])), VEq(VLoad(&B->PC[i]), halt));
+            if (VAny(done)) {
+                for (int lane = i; lane < i + BATCH_VECTOR; lane++) {
+                    if (mask[lane] && B->live[lane] && B->PC[lane] == 0x80FF) {
+                        StopLane(B, lane, RUN_BREAKPOINT);
+                    }
+                }
+            }
+        }
+        if ((steps & 0x7FFF) == 0) {
+            FlushTicks(B, ticks);
+        }
+
+        // no lane has run more instructions than there were steps
+        if (maxInstructions != 0 && steps >= maxInstructions) {
+            FlushTicks(B, ticks);
+            for (int lane = 0; lane < B->lanes; lane++) {
+                if (B->live[lane] && B->instructions[lane] >= maxInstructions) {
+                    StopLane(B, lane, RUN_BUDGET);
+                }
+            }
+        }
+        if (deadline != 0 && (steps & 0xFFF) == 0 && MonotonicNanoseconds() >= deadline) {
+            for (int lane = 0; lane < B->lanes; lane++) {
+                if (B->live[lane]) {
+                    StopLane(B, lane, RUN_TIMEOUT);
+                }
+            }
+        }
+    }
+    FlushTicks(B, ticks);
+    free(mask);
+    free(ticks);
+}
+
+unsigned long long BatchStateHash(BatchState* B, int lane) {
+    MachineState* base = B->base;
+    if (!B->hashedPages) {
+        for (int page = 0; page < 256; page++) {
+            B->pageHash[page] = HashMemory(&base->memory[page << 8], page << 8, 256);
+        }
+        B->hashedPages = 1;
+    }
+
+    unsigned long long hash = HashWord(HASH_KEY_PC, B->PC[lane]) ^ HashWord(HASH_KEY_PSR, B->PSR[lane]);
+    for (int r = 0; r < 8; r++) {
+        hash ^= HashWord(HASH_KEY_R + r, B->R[r][lane]);
+    }
+    for (int page = 0; page < 256; page++) {
+        unsigned short int* memory = B->pages[(size_t)lane * 256 + page];
+        hash ^= memory == &base->memory[page << 8] ? B->pageHash[page] : HashMemory(memory, page << 8, 256);
+    }
+    return hash;
+}
+
+void PrintBatchResults(BatchState* B, unsigned short int* lo, unsigned short int* hi, int numRanges,
+                       int hashes, FILE* output) {
+    for (int lane = 0; lane < B->lanes; lane++) {
+        fprintf(output, "%d %s %llu %04X", lane, RunStatusName(B->status[lane]), B->instructions[lane], B->PC[lane]);
+        for (int r = 0; r < 8; r++) {
+            fprintf(output, " %04X", B->R[r][lane]);
+        }
+        for (int i = 0; i < numRanges; i++) {
+            for (unsigned int address = lo[i]; address <= hi[i]; address++) {
+                fprintf(output, " %04X", BatchLoad(B, lane, address));
+            }
+        }
+        if (hashes) {
+            fprintf(output, " %016llX", BatchStateHash(B, lane));
+        }
+        fprintf(output, "\n");
+    }
+}
+
+void CloseBatch(BatchState* B) {
+    if (B == NULL) {
+        return;
+    }
+    if (B->pages != NULL) {
+        for (int lane = 0; lane < B->lanes; lane++) {
+            for (int page = 0; page < 256; page++) {
+                unsigned short int* memory = B->pages[(size_t)lane * 256 + page];
+                if (memory != &B->base->memory[page << 8]) {
+                    free(memory);
+                }
+            }
+        }
+    }
+    free(B->pages);
+    free(B->PC);
+    free(B->PSR);
+    free(B->live);
+    for (int r = 0; r < 8; r++) {
+        free(B->R[r]);
+    }
+    free(B->status);
+    free(B->fault);
+    free(B->instructions);
+    free(B);
+}
@@ -0,0 +1,93 @@
+/*
+ * batch.h: Declares the lockstep engine running one program over many inputs
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+#include "LC4.h"
+
+// Lanes handled per vector operation; lane arrays are padded to a multiple
+#define BATCH_VECTOR 16
+
+// Most instances one batch runs
+#define BATCH_MAX_LANES 65536
+
+/*
+ * Many copies of one machine, registers, PC and PSR stored per register
+ * across all lanes. Memory is the shared base image with a private copy of
+ * each page a lane writes to.
+ */
+typedef struct {
+    int lanes;                      // instances, the arrays hold padded
+    int padded;
+    MachineState* base;             // program image every lane starts from
+
+    unsigned short int* PC;
+    unsigned short int* PSR;
+    unsigned short int* R[8];
+    unsigned short int* live;       // 0xFFFF while a lane still runs
+
+    unsigned short int** pages;     // lanes x 256, base or private page
+    int privatePages[256];          // lanes holding their own copy of a page
+
+    int* status;                    // RUN_BREAKPOINT (halted), RUN_FAULT, ...
+    unsigned char* fault;           // PAGE_*_USER bit of a faulted lane's denied access
+    unsigned long long* instructions;
+    unsigned long long opcodes[16]; // instructions of all lanes by opcode (insn >> 12)
+    unsigned long long pageHash[256]; // HashMemory of each base page, once hashedPages is set
+    int hashedPages;
+} BatchState;
+
+/*
+ * Start lanes copies of base, each at PC x8200 with PSR x8002 and base's
+ * registers; callers may then set PC, PSR and R per lane. Returns NULL after
+ * printing an error.
+ */
+BatchState* OpenBatch(MachineState* base, int lanes);
+
+/*
+ * Read one instance per non-blank line of filename (# starts a comment),
+ * each a list of settings applied on top of base:
+ *
+ *     x4000=5 x4001=#-3 R0=x0010 PC=x0000 PSR=x0002
+ *
+ * Lanes start at PC x8200 with PSR x8002 unless set. Returns NULL after
+ * printing an error.
+ */
+BatchState* ReadBatchInputs(char* filename, MachineState* base);
+
+/*
+ * Run every lane until it reaches x80FF, faults, runs maxInstructions (0 for
+ * no limit) or the deadline (MonotonicNanoseconds, 0 for none) passes. Lanes
+ * at the same PC execute together; lanes that branch apart run separately,
+ * lowest PC first, until they meet again. Results match RunFast per lane.
+ */
+void RunBatch(BatchState* B, unsigned long long maxInstructions, unsigned long long deadline);
+
+/*
+ * Read a word of one lane's memory.
+ */
+unsigned short int BatchLoad(BatchState* B, int lane, unsigned short int address);
+
+/*
+ * StateHash of one lane as a MachineState: the base image's hash moved by
+ * the lane's private pages and registers, so the cost grows with the pages
+ * the lane wrote rather than with memory.
+ */
+unsigned long long BatchStateHash(BatchState* B, int lane);
+
+/*
+ * Print a line per lane: index, status, instructions, PC, R0-R7, the words
+ * at each address in lo[i]..hi[i] and, if hashes is set, BatchStateHash.
+ */
+void PrintBatchResults(BatchState* B, unsigned short int* lo, unsigned short int* hi, int numRanges,
+                       int hashes, FILE* output);
+
+/*
+ * Release the lanes and their private pages.
+ */
+void CloseBatch(BatchState* B);
+
+#endif
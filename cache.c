@@ -0,0 +1,252 @@
+/*
+ * cache.c: Defines the instruction/data cache hierarchy model
+ */
+
+#include "cache.h"
+#include <strings.h>
+
+// helper for log2 of a power of two, -1 otherwise
+static int Log2(unsigned int value) {
+    int bits = 0;
+    if (value == 0 || (value & (value - 1)) != 0) {
+        return -1;
+    }
+    while ((1u << bits) < value) {
+        bits++;
+    }
+    return bits;
+}
+
+int ParseCacheConfig(const char* text, CacheConfig* config) {
+    char policy[16] = "lru";
+    int fields = sscanf(text, "%u:%u:%u:%15s", &config->size, &config->ways, &config->lineWords, policy);
+    if (fields < 3) {
+        return -1;
+    }
+
+    if (strcasecmp(policy, "lru") == 0) {
+        config->policy = REPLACE_LRU;
+    } else if (strcasecmp(policy, "fifo") == 0) {
+        config->policy = REPLACE_FIFO;
+    } else if (strcasecmp(policy, "random") == 0) {
+        config->policy = REPLACE_RANDOM;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+// helper to allocate one cache's arrays
+static int InitCache(Cache* cache, CacheConfig* config) {
+    memset(cache, 0, sizeof(Cache));
+    cache->config = *config;
+
+    int sizeBits = Log2(config->size);
+    int wayBits = Log2(config->ways);
+    cache->offsetBits = Log2(config->lineWords);
+    if (sizeBits < 0 || wayBits < 0 || cache->offsetBits < 0 || config->ways > 255 ||
+        sizeBits < wayBits + cache->offsetBits || sizeBits > 16) {
+        fprintf(stderr, "Error: Cache size, ways and line size must be powers of two that fit together\n");
+        return -1;
+    }
+    cache->setBits = sizeBits - wayBits - cache->offsetBits;
+    cache->sets = 1u << cache->setBits;
+    if (cache->offsetBits + cache->setBits == 0) {
+        // the tag and valid bit would not fit the 16 bit packed entry
+        fprintf(stderr, "Error: Cache needs more than one set or a line of more than one word\n");
+        return -1;
+    }
+
+    unsigned int lines = cache->sets * config->ways;
+    cache->tags = calloc(lines, sizeof(unsigned short int));
+    cache->ranks = calloc(lines, 1);
+    cache->cursor = calloc(cache->sets, 1);
+    if (cache->tags == NULL || cache->ranks == NULL || cache->cursor == NULL) {
+        fprintf(stderr, "Error: Out of memory for cache\n");
+        return -1;
+    }
+
+    // every set starts with ranks 0..ways-1 so LRU always has a victim
+    for (unsigned int line = 0; line < lines; line++) {
+        cache->ranks[line] = line % config->ways;
+    }
+    cache->seed = 0x2400;
+    return 0;
+}
+
+// helper to make way the most recently used in its set
+static void Touch(Cache* cache, unsigned char* ranks, unsigned int way) {
+    unsigned char rank = ranks[way];
+    for (unsigned int i = 0; i < cache->config.ways; i++) {
+        if (ranks[i] < rank) {
+            ranks[i]++;
+        }
+    }
+    ranks[way] = 0;
+}
+
+// helper to look up one address, filling the line on a miss; returns 1 on a hit
+static int Access(Cache* cache, unsigned short int address) {
+    unsigned int set = (address >> cache->offsetBits) & (cache->sets - 1);
+    unsigned short int tag = (unsigned short int)((address >> (cache->offsetBits + cache->setBits)) << 1) | 1;
+    unsigned int ways = cache->config.ways;
+    unsigned short int* tags = &cache->tags[set * ways];
+    unsigned char* ranks = &cache->ranks[set * ways];
+
+    for (unsigned int way = 0; way < ways; way++) {
+        if (tags[way] == tag) {
+            if (cache->config.policy == REPLACE_LRU) {
+                Touch(cache, ranks, way);
+            }
+            cache->hits++;
+            return 1;
+        }
+    }
+
+    // pick an invalid line first, then follow the policy
+    unsigned int victim = ways;
+    for (unsigned int way = 0; way < ways && victim == ways; way++) {
+        if (!(tags[way] & 1)) {
+            victim = way;
+        }
+    }
+    if (victim == ways) {
+        if (cache->config.policy == REPLACE_LRU) {
+            for (victim = 0; ranks[victim] != ways - 1; victim++) {
+            }
+        } else if (cache->config.policy == REPLACE_FIFO) {
+            victim = cache->cursor[set];
+            cache->cursor[set] = (victim + 1) % ways;
+        } else {
+            cache->seed = cache->seed * 1103515245u + 12345u;
+            victim = (cache->seed >> 16) % ways;
+        }
+    }
+
+    tags[victim] = tag;
+    if (cache->config.policy == REPLACE_LRU) {
+        Touch(cache, ranks, victim);
+    }
+    cache->misses++;
+    return 0;
+}
+
+int InitCacheSystem(CacheSystem* caches, CacheConfig* icache, CacheConfig* dcache, CacheConfig* l2,
+                    unsigned short int start) {
+    memset(caches, 0, sizeof(CacheSystem));
+    if (InitCache(&caches->l1[CACHE_I], icache) != 0 || InitCache(&caches->l1[CACHE_D], dcache) != 0) {
+        return -1;
+    }
+    if (l2 != NULL) {
+        if (InitCache(&caches->l2, l2) != 0) {
+            return -1;
+        }
+        caches->hasL2 = 1;
+    }
+    InitFunctionProfile(&caches->profile, start);
+    return 0;
+}
+
+// helper to tell which region of the memory map address is in
+static int RegionOf(unsigned short int address) {
+    if (address < 0x2000) {
+        return REGION_USER_CODE;
+    } else if (address < 0x8000) {
+        return REGION_USER_DATA;
+    } else if (address < 0xA000) {
+        return REGION_OS_CODE;
+    } else if (address < 0xC000) {
+        return REGION_OS_DATA;
+    } else if (address < 0xFE00) {
+        return REGION_VIDEO;
+    }
+    return REGION_DEVICES;
+}
+
+// helper to send one access through the hierarchy and count it
+static void Reference(CacheSystem* caches, int which, unsigned short int address, int function) {
+    int hit = Access(&caches->l1[which], address);
+    if (!hit && caches->hasL2) {
+        Access(&caches->l2, address);
+    }
+
+    if (hit) {
+        caches->regions[RegionOf(address)].hits[which]++;
+        caches->functions[function].hits[which]++;
+    } else {
+        caches->regions[RegionOf(address)].misses[which]++;
+        caches->functions[function].misses[which]++;
+    }
+}
+
+void CacheStep(CacheSystem* caches, MachineState* CPU, unsigned short int pc) {
+    unsigned short int insn = CPU->memory[pc];
+    int function = ProfileStep(&caches->profile, insn, CPU->PC);
+
+    Reference(caches, CACHE_I, pc, function);
+    if ((insn >> 12) == 6 || (insn >> 12) == 7) {
+        Reference(caches, CACHE_D, CPU->dmemAddr, function);
+    }
+}
+
+// helper for a miss rate in percent
+static double MissRate(unsigned long long hits, unsigned long long misses) {
+    return hits + misses ? 100.0 * misses / (hits + misses) : 0.0;
+}
+
+// helper for one report line of I and D counts
+static void PrintCacheStats(const char* name, CacheStats* stats, FILE* output) {
+    fprintf(output, "%-24s %10llu %10llu %6.2f%% %10llu %10llu %6.2f%%\n", name,
+            stats->hits[CACHE_I], stats->misses[CACHE_I], MissRate(stats->hits[CACHE_I], stats->misses[CACHE_I]),
+            stats->hits[CACHE_D], stats->misses[CACHE_D], MissRate(stats->hits[CACHE_D], stats->misses[CACHE_D]));
+}
+
+void PrintCacheReport(CacheSystem* caches, MachineState* CPU, ObjectInfo* info, FILE* output) {
+    static const char* names[] = {"L1I", "L1D", "L2"};
+    static const char* policies[] = {"lru", "fifo", "random"};
+    static const char* regions[NUM_REGIONS] = {"user code", "user data", "OS code", "OS data", "video", "devices"};
+
+    Cache* levels[3] = {&caches->l1[CACHE_I], &caches->l1[CACHE_D], caches->hasL2 ? &caches->l2 : NULL};
+    for (int i = 0; i < 3; i++) {
+        Cache* cache = levels[i];
+        if (cache == NULL) {
+            continue;
+        }
+        fprintf(output, "%s: %u words, %u-way, %u word lines, %s: %llu hits, %llu misses (%.2f%% miss)\n",
+                names[i], cache->config.size, cache->config.ways, cache->config.lineWords,
+                policies[cache->config.policy], cache->hits, cache->misses, MissRate(cache->hits, cache->misses));
+    }
+
+    fprintf(output, "%-24s %10s %10s %7s %10s %10s %7s\n", "region", "I hits", "I misses", "I miss",
+            "D hits", "D misses", "D miss");
+    for (int r = 0; r < NUM_REGIONS; r++) {
+        CacheStats* stats = &caches->regions[r];
+        if (stats->hits[CACHE_I] + stats->misses[CACHE_I] + stats->hits[CACHE_D] + stats->misses[CACHE_D] > 0) {
+            PrintCacheStats(regions[r], stats, output);
+        }
+    }
+
+    fprintf(output, "%-24s %10s %10s %7s %10s %10s %7s\n", "function", "I hits", "I misses", "I miss",
+            "D hits", "D misses", "D miss");
+    for (int i = 0; i < caches->profile.numFunctions; i++) {
+        CacheStats* stats = &caches->functions[i];
+        if (stats->hits[CACHE_I] + stats->misses[CACHE_I] == 0) {
+            continue;
+        }
+        char name[MAX_SYMBOL_LEN];
+        FunctionName(&caches->profile, i, CPU, info, name, sizeof(name));
+        PrintCacheStats(name, stats, output);
+    }
+}
+
+void FreeCacheSystem(CacheSystem* caches) {
+    Cache* levels[3] = {&caches->l1[CACHE_I], &caches->l1[CACHE_D], &caches->l2};
+    for (int i = 0; i < 3; i++) {
+        free(levels[i]->tags);
+        free(levels[i]->ranks);
+        free(levels[i]->cursor);
+        levels[i]->tags = NULL;
+        levels[i]->ranks = NULL;
+        levels[i]->cursor = NULL;
+    }
+}
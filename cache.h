@@ -0,0 +1,95 @@
+/*
+ * cache.h: Declares the instruction/data cache hierarchy model
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "profile.h"
+
+// Replacement policies
+#define REPLACE_LRU    0
+#define REPLACE_FIFO   1
+#define REPLACE_RANDOM 2
+
+// Memory regions hits and misses are split by, from the LC4 memory map
+#define REGION_USER_CODE 0 // x0000-x1FFF
+#define REGION_USER_DATA 1 // x2000-x7FFF
+#define REGION_OS_CODE   2 // x8000-x9FFF
+#define REGION_OS_DATA   3 // xA000-xBFFF
+#define REGION_VIDEO     4 // xC000-xFDFF
+#define REGION_DEVICES   5 // xFE00-xFFFF
+#define NUM_REGIONS      6
+
+// Which cache an access went to first
+#define CACHE_I 0
+#define CACHE_D 1
+
+// Geometry of one cache, sizes in 16 bit words and all powers of two
+typedef struct {
+    unsigned int size;
+    unsigned int ways;
+    unsigned int lineWords;
+    int policy;
+} CacheConfig;
+
+// One level of cache. Each line is a packed word, (tag << 1) | valid, with
+// a rank per line for LRU (0 = most recent) or a per set cursor for FIFO
+typedef struct Cache {
+    CacheConfig config;
+    unsigned int sets;
+    int offsetBits;
+    int setBits;
+    unsigned short int* tags;
+    unsigned char* ranks;
+    unsigned char* cursor;
+    unsigned int seed;
+    unsigned long long hits;
+    unsigned long long misses;
+} Cache;
+
+// Hits and misses of the first level an access went to
+typedef struct {
+    unsigned long long hits[2];
+    unsigned long long misses[2];
+} CacheStats;
+
+// Split L1 instruction and data caches with an optional shared L2
+typedef struct {
+    Cache l1[2];
+    Cache l2;
+    int hasL2;
+    CacheStats regions[NUM_REGIONS];
+    CacheStats functions[MAX_FUNCTIONS];
+    FunctionProfile profile;
+} CacheSystem;
+
+/*
+ * Parse "size:ways:line[:lru|fifo|random]" into config. Returns 0 or -1.
+ */
+int ParseCacheConfig(const char* text, CacheConfig* config);
+
+/*
+ * Allocate the L1 caches and, when l2 is not NULL, an L2 behind both, for a
+ * run beginning at start. Returns 0, or -1 after printing an error.
+ */
+int InitCacheSystem(CacheSystem* caches, CacheConfig* icache, CacheConfig* dcache, CacheConfig* l2,
+                    unsigned short int start);
+
+/*
+ * Account for the fetch, and any LDR/STR access, of the instruction at pc
+ * that UpdateMachineState just executed.
+ */
+void CacheStep(CacheSystem* caches, MachineState* CPU, unsigned short int pc);
+
+/*
+ * Print hit and miss rates per cache, per region and per function.
+ */
+void PrintCacheReport(CacheSystem* caches, MachineState* CPU, ObjectInfo* info, FILE* output);
+
+/*
+ * Release the tag arrays.
+ */
+void FreeCacheSystem(CacheSystem* caches);
+
+#endif
@@ -0,0 +1,277 @@
+/*
+ * cosim.c: Defines the lockstep co-simulation of the reference and fast engines
+ */
+
+#include "cosim.h"
+#include "engine.h"
+
+// Where one run of both engines stopped
+typedef struct {
+    int status;                         // RunFast's
+    int fastFault;
+    int refFault;
+    unsigned long long refCount;        // the reference engine's instruction count
+} CosimStop;
+
+// helper to compare what RunFast keeps up to date: PC, PSR, R and memory
+static int SameState(MachineState* a, MachineState* b) {
+    return a->PC == b->PC && a->PSR == b->PSR && memcmp(a->R, b->R, sizeof(a->R)) == 0 &&
+           memcmp(a->memory, b->memory, sizeof(a->memory)) == 0;
+}
+
+// helper to list how the reference machine ref and the fast one differ
+static void PrintDifferences(MachineState* ref, MachineState* fast, int refFault, int fastFault, FILE* output) {
+    if (refFault != fastFault) {
+        fprintf(output, "  fault     reference %s, fast %s\n", refFault ? "yes" : "no", fastFault ? "yes" : "no");
+    }
+    if (ref->PC != fast->PC) {
+        fprintf(output, "  PC        reference %04X, fast %04X\n", ref->PC, fast->PC);
+    }
+    if (ref->PSR != fast->PSR) {
+        fprintf(output, "  PSR       reference %04X, fast %04X\n", ref->PSR, fast->PSR);
+    }
+    for (int i = 0; i < 8; i++) {
+        if (ref->R[i] != fast->R[i]) {
+            fprintf(output, "  R%d        reference %04X, fast %04X\n", i, ref->R[i], fast->R[i]);
+        }
+    }
+    int words = 0;
+    for (int address = 0; address < 65536; address++) {
+        if (ref->memory[address] != fast->memory[address] && words++ < COSIM_SHOW_WORDS) {
+            fprintf(output, "  x%04X     reference %04X, fast %04X\n", address, ref->memory[address],
+                    fast->memory[address]);
+        }
+    }
+    if (words > COSIM_SHOW_WORDS) {
+        fprintf(output, "  ... and %d more words\n", words - COSIM_SHOW_WORDS);
+    }
+}
+
+// helper to run the fast engine on from count until it stops by itself or
+// reaches limit, then the reference engine up to the same count
+static void RunWindow(MachineState* ref, MachineState* fast, RunControl* control, unsigned long long count,
+                      unsigned long long limit, CosimStop* stop) {
+    control->instructions = count;
+    control->maxInstructions = limit;
+    // RunFast would run at least one instruction from the halt
+    stop->status = fast->PC == 0x80FF ? RUN_BREAKPOINT : RunFast(fast, control);
+    stop->fastFault = stop->status == RUN_FAULT;
+    stop->refFault = 0;
+    stop->refCount = count;
+    while (ref->PC != 0x80FF && !stop->refFault) {
+        // a fetch that faults is not counted by either engine, so it is
+        // only run once the fast engine faulted too
+        int fetched = PAGE_ALLOWS(ref, ref->PC, PAGE_EXEC_USER) != 0;
+        if (stop->refCount == control->instructions && (fetched || !stop->fastFault)) {
+            break;
+        }
+        stop->refFault = UpdateMachineState(ref, NULL) != 0;
+        stop->refCount += fetched;
+    }
+}
+
+// helper to tell whether both engines stopped at the same count, the same
+// way, short of comparing their state
+static int SameStop(const RunControl* control, const CosimStop* stop) {
+    return stop->refCount == control->instructions && stop->refFault == stop->fastFault;
+}
+
+// helper to tell whether both engines stopped at the same count, the same
+// way, and in the same state
+static int Agree(MachineState* ref, MachineState* fast, const RunControl* control, const CosimStop* stop) {
+    return SameStop(control, stop) && SameState(ref, fast);
+}
+
+// helper to bring both engines from start, count instructions in, to at
+// most limit; returns 1 if they agree where they stopped and can run on
+// from there, with the count they reached in reached
+static int RunPrefix(MachineState* ref, MachineState* fast, const MachineState* start, RunControl* control,
+                     unsigned long long count, unsigned long long limit, unsigned long long* reached) {
+    *ref = *start;
+    *fast = *start;
+    *reached = count;
+    if (limit == count) {
+        return 1;
+    }
+    CosimStop stop;
+    RunWindow(ref, fast, control, count, limit, &stop);
+    *reached = control->instructions;
+    return Agree(ref, fast, control, &stop) && !stop.fastFault && fast->PC != 0x80FF;
+}
+
+/*
+ * Find where the engines start to differ, given that they agree on start,
+ * count instructions in, and not once both have run on to limit. A skip,
+ * native routine or replay only happens when the budget has room for all
+ * of it, so both engines are taken to ever later agreed counts and run on
+ * from there to limit, to find the last count from which they still end
+ * up different. If the next instruction alone makes them differ, it is
+ * printed with the differences after it; otherwise the fast engine took a
+ * shortcut from there, and the differences at limit are printed.
+ */
+static void FindDivergence(MachineState* ref, MachineState* fast, const MachineState* start, RunControl* control,
+                           unsigned long long count, unsigned long long limit, FILE* output) {
+    CosimStop stop;
+    unsigned long long last = count, after = limit;
+    unsigned long long reached;
+    while (after - last > 1) {
+        unsigned long long middle = last + (after - last) / 2;
+        int differ = 0;
+        if (RunPrefix(ref, fast, start, control, count, middle, &reached) && reached < limit) {
+            RunWindow(ref, fast, control, reached, limit, &stop);
+            differ = !Agree(ref, fast, control, &stop);
+        }
+        if (differ) {
+            last = middle;
+        } else {
+            after = middle;
+        }
+    }
+
+    RunPrefix(ref, fast, start, control, count, last, &reached);
+    unsigned short int pc = ref->PC;
+    unsigned short int insn = ref->memory[pc];
+    RunWindow(ref, fast, control, reached, reached + 1, &stop);
+    if (Agree(ref, fast, control, &stop)) {
+        RunPrefix(ref, fast, start, control, count, last, &reached);
+        RunWindow(ref, fast, control, reached, limit, &stop);
+        if (Agree(ref, fast, control, &stop)) {
+            fprintf(output, "Engines diverge within %llu instructions of x%04X, after %llu, "
+                    "but agree when they are run again\n", limit - count, start->PC, count);
+            return;
+        }
+        fprintf(output, "Engines diverge when the fast engine takes a shortcut after %llu instructions, "
+                "at PC %04X (%04X), and runs on to %llu:\n", reached, pc, insn, control->instructions);
+    } else {
+        fprintf(output, "Engines diverge after %llu instructions, at PC %04X (%04X):\n", reached, pc, insn);
+    }
+    if (stop.refCount != control->instructions) {
+        fprintf(output, "  count     reference %llu, fast %llu\n", stop.refCount, control->instructions);
+    }
+    PrintDifferences(ref, fast, stop.refFault, stop.fastFault, output);
+}
+
+int RunCosim(MachineState* image, ObjectInfo* info, unsigned long long maxInstructions, unsigned long long deadline,
+             CosimResult* result, FILE* output) {
+    if (image->devices != NULL) {
+        fprintf(stderr, "Error: Co-simulation does not support devices\n");
+        return -1;
+    }
+    MachineState* ref = malloc(sizeof(MachineState));
+    MachineState* fast = malloc(sizeof(MachineState));
+    MachineState* start = malloc(sizeof(MachineState));
+    if (ref == NULL || fast == NULL || start == NULL) {
+        free(ref);
+        free(fast);
+        free(start);
+        fprintf(stderr, "Error: Out of memory for the co-simulation\n");
+        return -1;
+    }
+    *ref = *image;
+    StartStateHash(ref);
+    *fast = *ref;
+    memset(result, 0, sizeof(CosimResult));
+
+    // the fast engine runs as it would for -F -z
+    static unsigned char breakpoints[65536];
+    breakpoints[0x80FF] = 1;
+    static HostTraps traps;
+    PrepareHostTraps(ref, breakpoints, &traps);
+    static CodeAnalysis analysis;
+    static MemoTable memo;
+    if (AnalyzeImage(ref, info, &analysis) != 0 || PrepareMemo(ref, &analysis, breakpoints, &memo) < 0) {
+        free(ref);
+        free(fast);
+        free(start);
+        return -1;
+    }
+    FreeAnalysis(&analysis);
+    unsigned long long opcodes[16] = {0};
+    RunControl control = {
+        .breakpoints = breakpoints,
+        .hostTraps = &traps,
+        .deadline = deadline,
+        .memo = &memo,
+        .opcodes = opcodes,
+    };
+
+    unsigned long long count = 0;
+    int status = RUN_BREAKPOINT;
+    int diverged = 0;
+    while (ref->PC != 0x80FF) {
+        if (maxInstructions != 0 && count >= maxInstructions) {
+            status = RUN_BUDGET;
+            break;
+        }
+        if (deadline != 0 && MonotonicNanoseconds() >= deadline) {
+            status = RUN_TIMEOUT;
+            break;
+        }
+
+        // from the state both agree on, to where RunFast stops
+        unsigned long long limit = count + COSIM_WINDOW;
+        if (maxInstructions != 0 && limit > maxInstructions) {
+            limit = maxInstructions;
+        }
+        *start = *ref;
+        CosimStop stop;
+        RunWindow(ref, fast, &control, count, limit, &stop);
+        result->stops++;
+
+        if (!SameStop(&control, &stop) || StateHash(ref) != StateHash(fast)) {
+            result->fullCompares++;
+            if (!Agree(ref, fast, &control, &stop)) {
+                FindDivergence(ref, fast, start, &control, count, limit, output);
+                diverged = 1;
+                break;
+            }
+            // equal machines, so a store got past the fast engine's hash
+            fprintf(output, "Engines agree after %llu instructions, at PC %04X, but their hashes differ\n",
+                    control.instructions, ref->PC);
+            fast->hash = ref->hash;
+        }
+        count = control.instructions;
+        if (stop.fastFault) {
+            status = RUN_FAULT;
+            break;
+        }
+        if (stop.status == RUN_TIMEOUT) {
+            status = RUN_TIMEOUT;
+            break;
+        }
+    }
+
+    // the windows give RunFast at most COSIM_WINDOW of room, so once more
+    // in one call with only the run's own budget, as -f would
+    if (!diverged && status != RUN_TIMEOUT) {
+        *fast = *image;
+        StartStateHash(fast);
+        control.instructions = 0;
+        control.maxInstructions = maxInstructions;
+        control.opcodes = NULL;
+        int whole = fast->PC == 0x80FF ? RUN_BREAKPOINT : RunFast(fast, &control);
+        if (whole != RUN_TIMEOUT && (control.instructions != count || (whole == RUN_FAULT) != (status == RUN_FAULT) ||
+            !SameState(ref, fast))) {
+            fprintf(output, "Engines diverge when the fast engine runs the whole program in one call:\n");
+            if (control.instructions != count) {
+                fprintf(output, "  count     reference %llu, fast %llu\n", count, control.instructions);
+            }
+            PrintDifferences(ref, fast, status == RUN_FAULT, whole == RUN_FAULT, output);
+            diverged = 1;
+        }
+    }
+
+    // what the fast engine fetched and ran itself is counted by opcode
+    unsigned long long fetched = 0;
+    for (int i = 0; i < 16; i++) {
+        fetched += opcodes[i];
+    }
+    result->shortcuts = count > fetched ? count - fetched : 0;
+    result->status = status;
+    result->instructions = count;
+    result->PC = ref->PC;
+    free(ref);
+    free(fast);
+    free(start);
+    return diverged;
+}
@@ -0,0 +1,49 @@
+/*
+ * cosim.h: Declares the lockstep co-simulation of the reference and fast engines
+ */
+
+#ifndef COSIM_H
+#define COSIM_H
+
+#include <stdio.h>
+#include "LC4.h"
+#include "loader.h"
+
+// Most instructions one RunFast call runs before the states are compared
+#define COSIM_WINDOW (1ULL << 20)
+
+// Most differing memory words listed for a divergence
+#define COSIM_SHOW_WORDS 8
+
+// How a co-simulation ended
+typedef struct {
+    int status;                         // RUN_BREAKPOINT for a halt, RUN_FAULT, RUN_BUDGET or RUN_TIMEOUT
+    unsigned long long instructions;
+    unsigned long long stops;           // RunFast calls, each followed by a compare
+    unsigned long long fullCompares;    // stops whose hashes differed
+    unsigned long long shortcuts;       // instructions the fast engine skipped, ran natively or replayed
+    unsigned short int PC;
+} CosimResult;
+
+/*
+ * Run the program in image on UpdateMachineState and on RunFast side by
+ * side. RunFast runs as it does for -F -z: idle loops are skipped, known
+ * OS TRAP routines run natively and pure subroutines found in the analysis
+ * of info are replayed. Each call stops where RunFast stops on its own, or
+ * after COSIM_WINDOW instructions, and the reference engine then runs to
+ * the same instruction count. The two machines' StateHash values, which
+ * each engine keeps up to date as it writes, are compared, and only when
+ * they differ are the machines themselves. On a divergence both engines
+ * are run again from the state they agreed on, to ever closer counts, and
+ * the first instruction after which they differ is printed to output.
+ * Windows leave RunFast little room, so when they all agree the program is
+ * run again from image in one RunFast call with only maxInstructions, and
+ * its instruction count and final state are checked too. Stops at x80FF, a fault, maxInstructions (0 for no limit) or the deadline
+ * (MonotonicNanoseconds, 0 for none). Devices are not supported.
+ * Returns 0 if the engines agreed throughout, 1 if they diverged, or -1
+ * after printing an error.
+ */
+int RunCosim(MachineState* image, ObjectInfo* info, unsigned long long maxInstructions, unsigned long long deadline,
+             CosimResult* result, FILE* output);
+
+#endif
@@ -0,0 +1,222 @@
+/*
+ * coverage.c: Defines instruction and branch coverage bitmaps and their reports
+ */
+
+#include "coverage.h"
+
+// helper to tell whether insn is a BR that tests some flag
+static int IsBranch(unsigned short int insn) {
+    return (insn >> 12) == 0 && (insn & 0x0E00) != 0;
+}
+
+void CoverageStep(Coverage* C, MachineState* CPU, unsigned short int pc, unsigned short int insn) {
+    COVER(C->executed, pc);
+    if (IsBranch(insn)) {
+        // BR leaves the PSR alone, so its test can be redone afterwards
+        if ((insn >> 9) & CPU->PSR & 0x7) {
+            COVER(C->taken, pc);
+        } else {
+            COVER(C->notTaken, pc);
+        }
+    }
+}
+
+int ReadCoverage(const char* filename, Coverage* C) {
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Error: Could not open file %s\n", filename);
+        return -1;
+    }
+    char magic[sizeof(COVERAGE_MAGIC) - 1];
+    unsigned char bytes[3][65536 / 8];
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+        memcmp(magic, COVERAGE_MAGIC, sizeof(magic)) != 0 ||
+        fread(bytes, 1, sizeof(bytes), file) != sizeof(bytes)) {
+        fprintf(stderr, "Error: %s is not a coverage file\n", filename);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+
+    unsigned long long* bitmaps[3] = {C->executed, C->taken, C->notTaken};
+    for (int b = 0; b < 3; b++) {
+        for (int i = 0; i < 65536 / 8; i++) {
+            bitmaps[b][i >> 3] |= (unsigned long long)bytes[b][i] << ((i & 7) * 8);
+        }
+    }
+    return 0;
+}
+
+int WriteCoverage(const char* filename, Coverage* C) {
+    FILE* file = fopen(filename, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Error: Could not open file %s\n", filename);
+        return -1;
+    }
+    fputs(COVERAGE_MAGIC, file);
+    unsigned long long* bitmaps[3] = {C->executed, C->taken, C->notTaken};
+    for (int b = 0; b < 3; b++) {
+        for (int i = 0; i < 65536 / 8; i++) {
+            fputc((bitmaps[b][i >> 3] >> ((i & 7) * 8)) & 0xFF, file);
+        }
+    }
+    if (fclose(file) != 0) {
+        fprintf(stderr, "Error: Could not write file %s\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+int MergeCoverage(char** names, int count, const char* output) {
+    static Coverage merged;
+    memset(&merged, 0, sizeof(Coverage));
+    for (int i = 0; i < count; i++) {
+        if (ReadCoverage(names[i], &merged) != 0) {
+            return -1;
+        }
+    }
+    return WriteCoverage(output, &merged);
+}
+
+// helper for the label at or before address, no further back than start,
+// with the distance from it
+static const char* LabelBefore(ObjectInfo* info, int start, unsigned short int address, int* offset) {
+    const char* name = NULL;
+    int best = start;
+    for (int i = 0; i < info->numSymbols; i++) {
+        int at = info->symbols[i].address;
+        if (at <= address && at >= best) {
+            best = at;
+            name = info->symbols[i].name;
+        }
+    }
+    *offset = address - best;
+    return name;
+}
+
+// helper to order line entries by file, line and address
+static int CompareLines(const void* a, const void* b) {
+    const SourceLine* x = a;
+    const SourceLine* y = b;
+    if (x->file != y->file) {
+        return x->file - y->file;
+    }
+    if (x->line != y->line) {
+        return x->line - y->line;
+    }
+    return x->address - y->address;
+}
+
+// helper to print a BR's missing direction, if any
+static void PrintBranch(Coverage* C, unsigned short int address, const char* where, FILE* output) {
+    int taken = COVERED(C->taken, address);
+    int notTaken = COVERED(C->notTaken, address);
+    if (COVERED(C->executed, address) && taken != notTaken) {
+        fprintf(output, "  %s x%04X: branch %s\n", where, address, taken ? "never falls through" : "never taken");
+    }
+}
+
+void PrintCoverageReport(Coverage* C, MachineState* CPU, ObjectInfo* info, FILE* output) {
+    // the code words, each once however many sections load it
+    static unsigned long long code[COVERAGE_WORDS];
+    static unsigned long long lined[COVERAGE_WORDS];
+    memset(code, 0, sizeof(code));
+    memset(lined, 0, sizeof(lined));
+    for (int i = 0; i < info->numSections; i++) {
+        for (unsigned int j = 0; info->sections[i].code && j < info->sections[i].words; j++) {
+            unsigned short int address = info->sections[i].address + j;
+            COVER(code, address);
+        }
+    }
+    int words = 0, executed = 0, branches = 0, bothWays = 0, oneWay = 0;
+    for (int address = 0; address < 65536; address++) {
+        if (!COVERED(code, address)) {
+            continue;
+        }
+        words++;
+        executed += COVERED(C->executed, address);
+        if (IsBranch(CPU->memory[address])) {
+            int ways = COVERED(C->taken, address) + COVERED(C->notTaken, address);
+            branches++;
+            bothWays += ways == 2;
+            oneWay += ways == 1;
+        }
+    }
+    fprintf(output, "Coverage: %d of %d code words executed (%.1f%%), %d of %d branches both ways, %d one way\n",
+            executed, words, words ? 100.0 * executed / words : 0.0, bothWays, branches, oneWay);
+
+    // source lines, grouped per file; a line counts as executed when any of its words was
+    SourceLine* lines = malloc((info->numLines + 1) * sizeof(SourceLine));
+    if (lines == NULL) {
+        fprintf(stderr, "Error: Out of memory for the coverage report\n");
+        return;
+    }
+    memcpy(lines, info->lines, info->numLines * sizeof(SourceLine));
+    qsort(lines, info->numLines, sizeof(SourceLine), CompareLines);
+    for (int start = 0; start < info->numLines;) {
+        int file = lines[start].file;
+        int end = start;
+        int total = 0, hit = 0;
+        while (end < info->numLines && lines[end].file == file) {
+            int run = end;
+            int any = 0;
+            while (run < info->numLines && lines[run].file == file && lines[run].line == lines[end].line) {
+                any |= COVERED(C->executed, lines[run].address);
+                COVER(lined, lines[run].address);
+                run++;
+            }
+            total++;
+            hit += any;
+            end = run;
+        }
+        const char* name = file >= 0 && file < info->numFiles ? info->files[file] : "?";
+        fprintf(output, "%s: %d of %d lines executed\n", name, hit, total);
+        for (int i = start; i < end; i++) {
+            char where[32];
+            snprintf(where, sizeof(where), "line %d", lines[i].line);
+            if (!COVERED(C->executed, lines[i].address) &&
+                (i == start || lines[i - 1].line != lines[i].line)) {
+                fprintf(output, "  %s x%04X: not executed\n", where, lines[i].address);
+            }
+            if (IsBranch(CPU->memory[lines[i].address])) {
+                PrintBranch(C, lines[i].address, where, output);
+            }
+        }
+        start = end;
+    }
+    free(lines);
+
+    // code without line numbers, as runs of missed addresses after a label
+    // in the same stretch of code
+    int header = 0;
+    int start = 0;
+    for (int address = 0; address < 65536; address++) {
+        if (!COVERED(code, address) || COVERED(lined, address)) {
+            start = address + 1;
+            continue;
+        }
+        if (!header) {
+            fprintf(output, "Code without line numbers:\n");
+            header = 1;
+        }
+        int offset;
+        const char* label = LabelBefore(info, start, address, &offset);
+        char where[MAX_SYMBOL_LEN + 16];
+        if (label != NULL) {
+            snprintf(where, sizeof(where), "%s+%d", label, offset);
+        } else {
+            snprintf(where, sizeof(where), "x%04X+%d", start, address - start);
+        }
+        if (!COVERED(C->executed, address)) {
+            int last = address;
+            while (last + 1 < 65536 && COVERED(code, last + 1) && !COVERED(lined, last + 1) &&
+                   !COVERED(C->executed, last + 1)) {
+                last++;
+            }
+            fprintf(output, "  %s x%04X-x%04X: not executed\n", where, address, last);
+            address = last;
+        } else if (IsBranch(CPU->memory[address])) {
+            PrintBranch(C, address, where, output);
+        }
+    }
+}
@@ -0,0 +1,61 @@
+/*
+ * coverage.h: Declares instruction and branch coverage bitmaps and their reports
+ */
+
+#ifndef COVERAGE_H
+#define COVERAGE_H
+
+#include <stdio.h>
+#include "loader.h"
+
+// 64-bit words in a bitmap with a bit per address
+#define COVERAGE_WORDS (65536 / 64)
+
+// First bytes of a coverage file, followed by the three bitmaps
+#define COVERAGE_MAGIC "LC4COV1\n"
+
+/*
+ * A bit per address in each bitmap. A BR that tests no flag (a NOP) only
+ * counts as executed. Runs combine by ORing the bitmaps.
+ */
+typedef struct Coverage {
+    unsigned long long executed[COVERAGE_WORDS];
+    unsigned long long taken[COVERAGE_WORDS];       // BRs that branched
+    unsigned long long notTaken[COVERAGE_WORDS];    // BRs that fell through
+} Coverage;
+
+// Set or test the bit of address in a bitmap
+#define COVER(bits, address) ((bits)[(address) >> 6] |= 1ULL << ((address) & 63))
+#define COVERED(bits, address) (((bits)[(address) >> 6] >> ((address) & 63)) & 1)
+
+/*
+ * Record the instruction at pc that UpdateMachineState just executed.
+ */
+void CoverageStep(Coverage* C, MachineState* CPU, unsigned short int pc, unsigned short int insn);
+
+/*
+ * OR the bitmaps in filename into C. Returns 0, or -1 after printing an error.
+ */
+int ReadCoverage(const char* filename, Coverage* C);
+
+/*
+ * Write C to filename, bitmaps in address order, bit i of a byte for the
+ * i-th address it covers. Returns 0, or -1 after printing an error.
+ */
+int WriteCoverage(const char* filename, Coverage* C);
+
+/*
+ * OR the coverage files in names into one written to output. Returns 0, or
+ * -1 after printing an error.
+ */
+int MergeCoverage(char** names, int count, const char* output);
+
+/*
+ * Print executed code words and branches taken both ways, over the code
+ * sections in info, then per source file from its line sections: lines not
+ * executed and BRs only seen one way. Code without line numbers is listed
+ * by address and the label before it.
+ */
+void PrintCoverageReport(Coverage* C, MachineState* CPU, ObjectInfo* info, FILE* output);
+
+#endif
@@ -0,0 +1,607 @@
+/*
+ * daemon.c: Serves simulator jobs from a Unix domain socket
+ */
+
+#define _GNU_SOURCE
+#include "daemon.h"
+#include "assembler.h"
+#include "engine.h"
+#include "metrics.h"
+#include "pool.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Most files one job may load after the OS
+#define DAEMON_MAX_FILES 16
+
+// Accepted connections waiting for a worker
+#define DAEMON_QUEUE 256
+
+// Seconds between rewrites of the Prometheus text file
+#define DAEMON_METRICS_SECONDS 5
+
+// Microseconds the accept loop first waits, and at most, while it cannot
+// take connections for want of descriptors or memory
+#define DAEMON_MIN_BACKOFF 1000
+#define DAEMON_MAX_BACKOFF 1000000
+
+// Pool slots: the OS image, then the cached images, then a machine per worker
+#define DAEMON_BASE_SLOT 0
+#define DAEMON_IMAGE_SLOT(i) (1 + (i))
+#define DAEMON_WORKER_SLOT(w) (1 + DAEMON_MAX_IMAGES + (w))
+
+// A machine with the OS and a job's files loaded, ready to copy and run.
+// Its slot is only written while no worker copies from it.
+typedef struct {
+    int used;                               // loaded and current
+    int readers;                            // workers copying the slot out
+    int writing;                            // a worker is copying an image in
+    unsigned long long lastUse;
+    char key[DAEMON_MAX_LINE];              // the file names, one after another
+    int numFiles;
+    struct timespec mtime[DAEMON_MAX_FILES];
+    off_t size[DAEMON_MAX_FILES];
+    HostTraps traps;
+} CachedImage;
+
+// state shared by the accepting thread and the workers
+typedef struct {
+    int listener;
+    MachinePool* pool;                      // Reset plus the OS image, images, workers
+    int workers;                            // workers started so far, for their slots
+    unsigned char breakpoints[65536];       // only the halt at x80FF
+
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t room;
+    int queue[DAEMON_QUEUE];
+    int head;
+    int pending;
+    int stopping;
+
+    pthread_mutex_t cacheLock;              // guards the two below, not the slots
+    CachedImage images[DAEMON_MAX_IMAGES];
+    unsigned long long uses;
+
+    const char* metricsJson;                // NULL for no records
+    const char* metricsText;
+    pthread_mutex_t metricsLock;            // guards the two below
+    MetricSamples samples;                  // requests not yet in metricsText
+    unsigned long long flushed;             // MonotonicNanoseconds of the last rewrite
+} Daemon;
+
+// a client's reply stream, counting the bytes that reach the socket
+typedef struct {
+    int fd;
+    unsigned long long bytes;
+} Connection;
+
+// arguments of one job, parsed from a run request
+typedef struct {
+    int fast;
+    int hostTraps;
+    unsigned long long budget;
+    double seconds;
+    char* files[DAEMON_MAX_FILES];
+    int numFiles;
+    struct stat stats[DAEMON_MAX_FILES];
+} Job;
+
+
+// helper to find a cached image of the job's files, unchanged on disk since,
+// and copy it into the worker's slot; returns 0 on a hit
+static int FetchImage(Daemon* D, Job* job, const char* key, int slot, HostTraps* traps) {
+    int hit = -1;
+    pthread_mutex_lock(&D->cacheLock);
+    for (int i = 0; i < DAEMON_MAX_IMAGES && hit < 0; i++) {
+        CachedImage* cached = &D->images[i];
+        if (!cached->used || cached->numFiles != job->numFiles || strcmp(cached->key, key) != 0) {
+            continue;
+        }
+        hit = i;
+        for (int f = 0; f < job->numFiles; f++) {
+            if (cached->size[f] != job->stats[f].st_size ||
+                cached->mtime[f].tv_sec != job->stats[f].st_mtim.tv_sec ||
+                cached->mtime[f].tv_nsec != job->stats[f].st_mtim.tv_nsec) {
+                hit = -1;
+            }
+        }
+    }
+    if (hit >= 0) {
+        D->images[hit].readers++;
+        *traps = D->images[hit].traps;
+        D->images[hit].lastUse = ++D->uses;
+    }
+    pthread_mutex_unlock(&D->cacheLock);
+    if (hit < 0) {
+        return -1;
+    }
+
+    // the image stays put while it has readers, so the copy needs no lock
+    PoolCopy(D->pool, slot, DAEMON_IMAGE_SLOT(hit));
+    pthread_mutex_lock(&D->cacheLock);
+    D->images[hit].readers--;
+    pthread_mutex_unlock(&D->cacheLock);
+    return 0;
+}
+
+// helper to keep a copy of a freshly loaded image, retiring an outdated
+// copy of the same files and reusing a free slot or else the least recently
+// used one; skipped when every slot is being copied
+static void StoreImage(Daemon* D, Job* job, const char* key, int slot, HostTraps* traps) {
+    pthread_mutex_lock(&D->cacheLock);
+    CachedImage* victim = NULL;
+    for (int i = 0; i < DAEMON_MAX_IMAGES; i++) {
+        CachedImage* cached = &D->images[i];
+        if (cached->used && cached->numFiles == job->numFiles && strcmp(cached->key, key) == 0) {
+            cached->used = 0;
+        }
+    }
+    for (int i = 0; i < DAEMON_MAX_IMAGES; i++) {
+        CachedImage* cached = &D->images[i];
+        if (cached->readers > 0 || cached->writing) {
+            continue;
+        }
+        if (victim == NULL || (victim->used && (!cached->used || cached->lastUse < victim->lastUse))) {
+            victim = cached;
+        }
+    }
+    if (victim == NULL) {
+        pthread_mutex_unlock(&D->cacheLock);
+        return;
+    }
+    victim->used = 0;
+    victim->writing = 1;
+    pthread_mutex_unlock(&D->cacheLock);
+
+    PoolCopy(D->pool, DAEMON_IMAGE_SLOT(victim - D->images), slot);
+
+    pthread_mutex_lock(&D->cacheLock);
+    victim->writing = 0;
+    victim->used = 1;
+    victim->lastUse = ++D->uses;
+    strcpy(victim->key, key);
+    victim->numFiles = job->numFiles;
+    for (int f = 0; f < job->numFiles; f++) {
+        victim->mtime[f] = job->stats[f].st_mtim;
+        victim->size[f] = job->stats[f].st_size;
+    }
+    victim->traps = *traps;
+    pthread_mutex_unlock(&D->cacheLock);
+}
+
+// helper to parse "run [-f|-F] [-b N] [-t seconds] files..."; returns 0 or
+// -1 after writing an error line
+static int ParseJob(char** argv, int argc, Job* job, FILE* out) {
+    memset(job, 0, sizeof(Job));
+    job->seconds = DAEMON_DEFAULT_SECONDS;
+
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++) {
+        if (strcmp(argv[arg], "-f") == 0 || strcmp(argv[arg], "-F") == 0) {
+            job->fast = 1;
+            job->hostTraps = (argv[arg][1] == 'F');
+        } else if (strcmp(argv[arg], "-b") == 0 && arg + 1 < argc) {
+            job->budget = strtoull(argv[++arg], NULL, 10);
+        } else if (strcmp(argv[arg], "-t") == 0 && arg + 1 < argc) {
+            job->seconds = atof(argv[++arg]);
+        } else {
+            fprintf(out, "error bad option %s\n", argv[arg]);
+            return -1;
+        }
+    }
+
+    if (arg == argc || argc - arg > DAEMON_MAX_FILES) {
+        fprintf(out, "error expected 1 to %d files\n", DAEMON_MAX_FILES);
+        return -1;
+    }
+    for (; arg < argc; arg++) {
+        if (stat(argv[arg], &job->stats[job->numFiles]) != 0) {
+            fprintf(out, "error could not open %s\n", argv[arg]);
+            return -1;
+        }
+        job->files[job->numFiles++] = argv[arg];
+    }
+    return 0;
+}
+
+// fopencookie write function of a Connection
+static ssize_t WriteConnection(void* cookie, const char* buffer, size_t size) {
+    Connection* C = cookie;
+    ssize_t written = write(C->fd, buffer, size);
+    if (written > 0) {
+        C->bytes += written;
+    }
+    return written;
+}
+
+// fopencookie close function of a Connection
+static int CloseConnection(void* cookie) {
+    Connection* C = cookie;
+    int result = close(C->fd);
+    free(C);
+    return result;
+}
+
+// helper to add a request to the Prometheus samples, rewriting the file
+// with what has gathered at most every DAEMON_METRICS_SECONDS
+static void AddDaemonMetrics(Daemon* D, const RunMetrics* metrics) {
+    unsigned long long now = MonotonicNanoseconds();
+    MetricSamples due = {NULL, 0, 0};
+    pthread_mutex_lock(&D->metricsLock);
+    AddMetricSamples(&D->samples, metrics);
+    if (now - D->flushed >= DAEMON_METRICS_SECONDS * 1000000000ULL) {
+        due = D->samples;
+        D->samples = (MetricSamples){NULL, 0, 0};
+        D->flushed = now;
+    }
+    pthread_mutex_unlock(&D->metricsLock);
+
+    // the file is locked and rewritten without holding up other workers
+    if (due.count > 0) {
+        FlushMetricSamples(D->metricsText, &due);
+    }
+    FreeMetricSamples(&due);
+}
+
+// helper to run one job on this worker's machine, streaming its trace to out,
+// which sends through connection
+static void RunJob(Daemon* D, int slot, char** argv, int argc, FILE* out, Connection* connection) {
+    Job job;
+    if (ParseJob(argv, argc, &job, out) != 0) {
+        return;
+    }
+
+    // names never hold whitespace, so one per line is an unambiguous key
+    char key[DAEMON_MAX_LINE];
+    size_t length = 0;
+    for (int f = 0; f < job.numFiles; f++) {
+        length += snprintf(key + length, sizeof(key) - length, "%s\n", job.files[f]);
+    }
+
+    RunMetrics metrics;
+    InitMetrics(&metrics, "daemon", job.files[job.numFiles - 1]);
+    int metered = D->metricsJson != NULL || D->metricsText != NULL;
+
+    HostTraps traps;
+    MachinePool* pool = D->pool;
+    if (FetchImage(D, &job, key, slot, &traps) != 0) {
+        // the OS image is only read once the daemon serves, so no lock
+        PoolCopy(pool, slot, DAEMON_BASE_SLOT);
+        MachineState* CPU = PoolMachine(pool, slot);
+        unsigned long long start = MonotonicNanoseconds();
+        for (int f = 0; f < job.numFiles; f++) {
+            if (LoadProgramFile(job.files[f], CPU, NULL) != 0) {
+                fprintf(out, "error could not load %s\n", job.files[f]);
+                return;
+            }
+        }
+        metrics.loadSeconds = ElapsedSeconds(start, MonotonicNanoseconds());
+        PrepareHostTraps(CPU, D->breakpoints, &traps);
+        StoreImage(D, &job, key, slot, &traps);
+    }
+
+    PooledMachine* pooled = &pool->slots[slot];
+    pooled->machine->PC = 0x8200;
+    pooled->machine->PSR = 0x8002;
+    unsigned long long deadline = 0;
+    if (job.seconds > 0) {
+        deadline = MonotonicNanoseconds() + (unsigned long long)(job.seconds * 1e9);
+    }
+
+    int status = RUN_BREAKPOINT;
+    unsigned long long count = 0;
+    unsigned long long start = MonotonicNanoseconds();
+    pooled->machine->fault = 0;
+    if (job.fast) {
+        RunControl control = {
+            .breakpoints = D->breakpoints,
+            .hostTraps = job.hostTraps ? &traps : NULL,
+            .maxInstructions = job.budget,
+            .deadline = deadline,
+        };
+        control.opcodes = metered ? metrics.opcodes : NULL;
+        status = RunPooled(pool, slot, &control);
+        count = control.instructions;
+        metrics.engineSeconds[ENGINE_FAST] = ElapsedSeconds(start, MonotonicNanoseconds());
+    } else {
+        // what the trace sent, less what was already on its way
+        fflush(out);
+        unsigned long long sent = connection->bytes;
+        MachineState* CPU = PoolMachine(pool, slot);
+        while (CPU->PC != 0x80FF) {
+            if (job.budget != 0 && count >= job.budget) {
+                status = RUN_BUDGET;
+                break;
+            }
+            if (deadline != 0 && (count & 0xFFF) == 0 && MonotonicNanoseconds() >= deadline) {
+                status = RUN_TIMEOUT;
+                break;
+            }
+            unsigned short int insn = CPU->memory[CPU->PC];
+            if (UpdateMachineState(CPU, out) != 0) {
+                status = RUN_FAULT;
+                break;
+            }
+            count++;
+            if (metered) {
+                metrics.opcodes[insn >> 12]++;
+            }
+        }
+        pooled->status = status;
+        pooled->instructions += count;
+        fflush(out);
+        metrics.engineSeconds[ENGINE_TRACED] = ElapsedSeconds(start, MonotonicNanoseconds());
+        metrics.traceBytes = connection->bytes - sent;
+    }
+
+    fprintf(out, "done %s %llu %04X\n", RunStatusName(status), count, pooled->machine->PC);
+
+    if (metered) {
+        metrics.instructions = count;
+        CountOutcome(&metrics, status, status == RUN_FAULT ? pooled->machine->fault : 0);
+        WriteMetrics(D->metricsJson, NULL, &metrics);
+        if (D->metricsText != NULL) {
+            AddDaemonMetrics(D, &metrics);
+        }
+    }
+}
+
+// helper to stop accepting and wake every worker
+static void StopDaemon(Daemon* D) {
+    pthread_mutex_lock(&D->lock);
+    D->stopping = 1;
+    pthread_cond_broadcast(&D->ready);
+    pthread_cond_broadcast(&D->room);
+    pthread_mutex_unlock(&D->lock);
+    shutdown(D->listener, SHUT_RDWR);
+}
+
+// helper to answer requests on one connection until the client hangs up
+static void ServeClient(Daemon* D, int slot, int fd) {
+    static const cookie_io_functions_t functions = { NULL, WriteConnection, NULL, CloseConnection };
+    FILE* in = fdopen(fd, "r");
+    Connection* connection = malloc(sizeof(Connection));
+    int outFd = dup(fd);
+    FILE* out = NULL;
+    if (connection != NULL && outFd >= 0) {
+        connection->fd = outFd;
+        connection->bytes = 0;
+        out = fopencookie(connection, "w", functions);
+    }
+    if (in == NULL || out == NULL) {
+        if (in != NULL) {
+            fclose(in);
+        } else {
+            close(fd);
+        }
+        if (outFd >= 0 && out == NULL) {
+            close(outFd);
+        }
+        if (out == NULL) {
+            free(connection);
+        }
+        return;
+    }
+
+    char line[DAEMON_MAX_LINE];
+    while (fgets(line, sizeof(line), in) != NULL) {
+        // the rest of a longer line must not run as a command of its own
+        if (strchr(line, '\n') == NULL && !feof(in)) {
+            int c;
+            while ((c = fgetc(in)) != EOF && c != '\n') {
+            }
+            fprintf(out, "error line longer than %d characters\n", DAEMON_MAX_LINE - 2);
+            if (fflush(out) != 0) {
+                break;
+            }
+            continue;
+        }
+        char* argv[DAEMON_MAX_FILES + 8];
+        int argc = 0;
+        // each worker splits its own lines, so strtok's hidden state is out
+        char* rest;
+        for (char* word = strtok_r(line, " \t\r\n", &rest); word != NULL; word = strtok_r(NULL, " \t\r\n", &rest)) {
+            if (argc == (int)(sizeof(argv) / sizeof(argv[0]))) {
+                break;
+            }
+            argv[argc++] = word;
+        }
+
+        if (argc == 0) {
+            continue;
+        } else if (strcmp(argv[0], "run") == 0) {
+            RunJob(D, slot, argv, argc, out, connection);
+        } else if (strcmp(argv[0], "shutdown") == 0) {
+            fprintf(out, "ok\n");
+            fflush(out);
+            StopDaemon(D);
+            break;
+        } else {
+            fprintf(out, "error unknown command %s\n", argv[0]);
+        }
+        if (fflush(out) != 0) {
+            break;
+        }
+    }
+    fclose(out);
+    fclose(in);
+}
+
+// worker thread body: serve queued connections, each on a private machine
+static void* DaemonWorker(void* arg) {
+    Daemon* D = arg;
+    pthread_mutex_lock(&D->lock);
+    int slot = DAEMON_WORKER_SLOT(D->workers++);
+    pthread_mutex_unlock(&D->lock);
+
+    for (;;) {
+        pthread_mutex_lock(&D->lock);
+        while (D->pending == 0 && !D->stopping) {
+            pthread_cond_wait(&D->ready, &D->lock);
+        }
+        if (D->pending == 0) {
+            pthread_mutex_unlock(&D->lock);
+            break;
+        }
+        int fd = D->queue[D->head];
+        D->head = (D->head + 1) % DAEMON_QUEUE;
+        D->pending--;
+        pthread_cond_signal(&D->room);
+        pthread_mutex_unlock(&D->lock);
+
+        ServeClient(D, slot, fd);
+    }
+    return NULL;
+}
+
+int RunDaemon(const char* socketPath, char* osFile, int workers, const char* metricsJson, const char* metricsText) {
+    if (workers <= 0) {
+        workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (workers <= 0) {
+            workers = 1;
+        }
+    }
+    Daemon* D = calloc(1, sizeof(Daemon));
+    if (D == NULL) {
+        fprintf(stderr, "Error: Out of memory starting the daemon\n");
+        return -1;
+    }
+    D->metricsJson = metricsJson;
+    D->metricsText = metricsText;
+
+    // every machine the daemon copies between lives in one arena
+    D->pool = OpenPool(DAEMON_WORKER_SLOT(workers));
+    if (D->pool == NULL) {
+        free(D);
+        return -1;
+    }
+    MachineState* base = PoolMachine(D->pool, DAEMON_BASE_SLOT);
+    Reset(base);
+    if (LoadProgramFile(osFile, base, NULL) != 0) {
+        fprintf(stderr, "Error: Failed to read object file %s\n", osFile);
+        ClosePool(D->pool);
+        free(D);
+        return -1;
+    }
+    D->breakpoints[0x80FF] = 1;
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Error: Socket path %s is too long\n", socketPath);
+        ClosePool(D->pool);
+        free(D);
+        return -1;
+    }
+    strcpy(address.sun_path, socketPath);
+    unlink(socketPath);
+    D->listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (D->listener < 0 || bind(D->listener, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(D->listener, DAEMON_QUEUE) != 0) {
+        fprintf(stderr, "Error: Could not listen on %s\n", socketPath);
+        if (D->listener >= 0) {
+            close(D->listener);
+        }
+        ClosePool(D->pool);
+        free(D);
+        return -1;
+    }
+
+    // a client hanging up mid-trace must not take the daemon with it
+    signal(SIGPIPE, SIG_IGN);
+    DebugOutput = 0;
+
+    pthread_mutex_init(&D->lock, NULL);
+    pthread_mutex_init(&D->cacheLock, NULL);
+    pthread_mutex_init(&D->metricsLock, NULL);
+    D->flushed = MonotonicNanoseconds();
+    pthread_cond_init(&D->ready, NULL);
+    pthread_cond_init(&D->room, NULL);
+    pthread_t* threads = calloc(workers, sizeof(pthread_t));
+    int started = 0;
+    while (threads != NULL && started < workers && pthread_create(&threads[started], NULL, DaemonWorker, D) == 0) {
+        started++;
+    }
+    if (started == 0) {
+        fprintf(stderr, "Error: Could not start any workers\n");
+        StopDaemon(D);
+    } else {
+        fprintf(stderr, "Listening on %s with %d workers\n", socketPath, started);
+    }
+
+    // hand each connection to the next free worker
+    useconds_t backoff = DAEMON_MIN_BACKOFF;
+    for (;;) {
+        int fd = accept(D->listener, NULL, NULL);
+        int error = errno;
+        pthread_mutex_lock(&D->lock);
+        while (fd >= 0 && D->pending == DAEMON_QUEUE && !D->stopping) {
+            pthread_cond_wait(&D->room, &D->lock);
+        }
+        if (D->stopping) {
+            pthread_mutex_unlock(&D->lock);
+            if (fd >= 0) {
+                close(fd);
+            }
+            break;
+        }
+        if (fd >= 0) {
+            D->queue[(D->head + D->pending) % DAEMON_QUEUE] = fd;
+            D->pending++;
+            pthread_cond_signal(&D->ready);
+            backoff = DAEMON_MIN_BACKOFF;
+        }
+        pthread_mutex_unlock(&D->lock);
+
+        if (fd >= 0 || error == EINTR || error == ECONNABORTED) {
+            continue;
+        }
+        if (error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM) {
+            // wait for a connection to close, rather than spin
+            if (backoff == DAEMON_MIN_BACKOFF) {
+                fprintf(stderr, "Warning: Could not accept a connection: %s\n", strerror(error));
+            }
+            usleep(backoff);
+            backoff = backoff < DAEMON_MAX_BACKOFF / 2 ? 2 * backoff : DAEMON_MAX_BACKOFF;
+            continue;
+        }
+        fprintf(stderr, "Error: Could not accept a connection: %s\n", strerror(error));
+        StopDaemon(D);
+        break;
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    // connections no worker got to
+    while (D->pending > 0) {
+        close(D->queue[D->head]);
+        D->head = (D->head + 1) % DAEMON_QUEUE;
+        D->pending--;
+    }
+    close(D->listener);
+    unlink(socketPath);
+
+    // what the workers gathered since the last rewrite
+    if (D->samples.count > 0) {
+        FlushMetricSamples(D->metricsText, &D->samples);
+    }
+    FreeMetricSamples(&D->samples);
+
+    pthread_mutex_destroy(&D->lock);
+    pthread_mutex_destroy(&D->cacheLock);
+    pthread_mutex_destroy(&D->metricsLock);
+    pthread_cond_destroy(&D->ready);
+    pthread_cond_destroy(&D->room);
+    free(threads);
+    ClosePool(D->pool);
+    free(D);
+    return 0;
+}
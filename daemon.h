@@ -0,0 +1,34 @@
+/*
+ * daemon.h: Declares the long-lived simulator daemon on a Unix domain socket
+ */
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include "LC4.h"
+
+// Loaded images (OS plus a job's files) kept ready to copy into a worker
+#define DAEMON_MAX_IMAGES 64
+
+// Longest request line a client may send
+#define DAEMON_MAX_LINE 4096
+
+// Wall-clock limit for a job that does not give its own, in seconds
+#define DAEMON_DEFAULT_SECONDS 10
+
+/*
+ * Load osFile once, listen on socketPath and serve clients on a pool of
+ * worker threads (0 for one per CPU). Each connection sends request lines
+ *
+ *     run [-f|-F] [-b N] [-t seconds] file.obj [file.obj ...]
+ *     shutdown
+ *
+ * and gets back, for run, the trace lines (unless -f/-F) followed by
+ * "done halt|fault|budget|timeout <instructions> <PC>", or "error <message>".
+ * Each run that gets as far as running adds a "daemon" record to the
+ * metrics files that are not NULL (see metrics.h).
+ * Returns 0 after a shutdown request, -1 if the daemon could not start.
+ */
+int RunDaemon(const char* socketPath, char* osFile, int workers, const char* metricsJson, const char* metricsText);
+
+#endif
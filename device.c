@@ -0,0 +1,156 @@
+/*
+ * device.c: Defines the memory-mapped keyboard, display and timer devices
+ */
+
+#include "device.h"
+#include "video.h"
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+// helper to close the keyboard, leaving stdin open
+static void CloseKeyboard(DeviceState* devices) {
+    if (devices->keyboard != NULL && devices->keyboard != stdin) {
+        fclose(devices->keyboard);
+    }
+    devices->keyboard = NULL;
+}
+
+DeviceState* OpenDevices(FILE* keyboard, FILE* display) {
+    DeviceState* devices = calloc(1, sizeof(DeviceState));
+    if (devices == NULL || (devices->output = malloc(DISPLAY_BUFFER_SIZE)) == NULL) {
+        fprintf(stderr, "Error: Out of memory for devices\n");
+        free(devices);
+        if (keyboard != NULL && keyboard != stdin) {
+            fclose(keyboard);
+        }
+        return NULL;
+    }
+    devices->display = display;
+    devices->keyboard = keyboard;
+    return devices;
+}
+
+// helper to refill an empty input buffer with whatever keys the host has
+// ready, without waiting; a keyboard with none is asked again only after
+// KEYBOARD_POLL_INTERVAL instructions
+static void PollKeyboard(DeviceState* devices) {
+    if (devices->inputPos < devices->inputLength || devices->keyboard == NULL || devices->clock < devices->nextPoll) {
+        return;
+    }
+    struct pollfd ready = { fileno(devices->keyboard), POLLIN, 0 };
+    if (poll(&ready, 1, 0) > 0) {
+        ssize_t got = read(ready.fd, devices->input, sizeof(devices->input));
+        if (got > 0) {
+            devices->inputLength = got;
+            devices->inputPos = 0;
+            return;
+        }
+        if (got == 0 || (errno != EINTR && errno != EAGAIN)) {
+            CloseKeyboard(devices);
+            return;
+        }
+    }
+    devices->nextPoll = devices->clock + KEYBOARD_POLL_INTERVAL;
+}
+
+void AttachDevices(MachineState* CPU, DeviceState* devices) {
+    CPU->devices = devices;
+    SetPageAttributes(CPU, DEVICE_PAGE << 8, (DEVICE_PAGE << 8) | 0xFF, devices ? PAGE_DEVICE : PAGE_READ_OS | PAGE_WRITE_OS);
+}
+
+// helper to start the next timer interval from the current clock
+static void RestartTimer(MachineState* CPU) {
+    DeviceState* devices = CPU->devices;
+    devices->timerDeadline = devices->clock + (unsigned long long)CPU->memory[TIR] * DEVICE_INSTRUCTIONS_PER_MS;
+}
+
+unsigned short int DeviceRead(MachineState* CPU, unsigned short int address) {
+    DeviceState* devices = CPU->devices;
+    switch (address) {
+        case KBSR:
+            PollKeyboard(devices);
+            return devices->inputPos < devices->inputLength ? 0x8000 : 0;
+        case KBDR:
+            PollKeyboard(devices);
+            if (devices->inputPos < devices->inputLength) {
+                unsigned short int old = CPU->memory[KBDR];
+                CPU->memory[KBDR] = devices->input[devices->inputPos++];
+                HASH_STORE(CPU, KBDR, old);
+            }
+            return CPU->memory[KBDR];
+        case ADSR:
+            // the host buffer always has room, it is flushed when full
+            return 0x8000;
+        case TSR:
+            if (devices->clock < devices->timerDeadline) {
+                return 0;
+            }
+            RestartTimer(CPU);
+            return 0x8000;
+        default:
+            return CPU->memory[address];
+    }
+}
+
+void DeviceWrite(MachineState* CPU, unsigned short int address, unsigned short int value) {
+    DeviceState* devices = CPU->devices;
+    if (address <= VIDEO_END) {
+        VideoStore(CPU, address, value);
+        return;
+    }
+
+    CPU->memory[address] = value;
+    switch (address) {
+        case ADDR:
+            if (devices->outputLength == DISPLAY_BUFFER_SIZE) {
+                FlushDevices(devices);
+            }
+            devices->output[devices->outputLength++] = (char)(value & 0xFF);
+            break;
+        case TIR:
+            RestartTimer(CPU);
+            break;
+        case VDCR:
+            if (devices->video != NULL) {
+                VideoCommand(CPU, value);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+unsigned long long DeviceNextEvent(MachineState* CPU, unsigned short int address) {
+    DeviceState* devices = CPU->devices;
+    if (address == TSR) {
+        return devices->timerDeadline;
+    }
+    if (address == KBSR && devices->inputPos < devices->inputLength) {
+        return devices->clock;
+    }
+    if (address == KBSR && devices->keyboard != NULL) {
+        // the next time the host is asked for keys
+        return devices->nextPoll;
+    }
+    // a keyboard at end of file gets no more input, everything else is memory
+    return DEVICE_NO_EVENT;
+}
+
+void FlushDevices(DeviceState* devices) {
+    if (devices->outputLength > 0 && devices->display != NULL) {
+        fwrite(devices->output, 1, devices->outputLength, devices->display);
+        fflush(devices->display);
+    }
+    devices->outputLength = 0;
+}
+
+void CloseDevices(DeviceState* devices) {
+    if (devices == NULL) {
+        return;
+    }
+    FlushDevices(devices);
+    CloseKeyboard(devices);
+    free(devices->output);
+    free(devices);
+}
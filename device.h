@@ -0,0 +1,97 @@
+/*
+ * device.h: Declares the memory-mapped keyboard, display and timer devices
+ */
+
+#ifndef DEVICE_H
+#define DEVICE_H
+
+#include "LC4.h"
+
+// Device registers, all on the device page xFE00-xFEFF
+#define KBSR 0xFE00 // keyboard status, bit 15 set when a character is ready
+#define KBDR 0xFE02 // keyboard data, reading it consumes the character
+#define ADSR 0xFE04 // display status, bit 15 set when ready for a character
+#define ADDR 0xFE06 // display data, writing it prints the low 8 bits
+#define TSR  0xFE08 // timer status, bit 15 set once the interval has passed
+#define TIR  0xFE0A // timer interval in milliseconds
+#define VDCR 0xFE0C // video display control
+
+#define DEVICE_PAGE 0xFE
+
+// Instructions the timer counts as one millisecond
+#define DEVICE_INSTRUCTIONS_PER_MS 1000
+
+// Size of the host buffer display output is batched into
+#define DISPLAY_BUFFER_SIZE (64 * 1024)
+
+// Most keyboard input read from the host at once
+#define KEYBOARD_BUFFER_SIZE 4096
+
+// Instructions between asking the host for keys after it had none ready
+#define KEYBOARD_POLL_INTERVAL 4096
+
+typedef struct DeviceState {
+    // keyboard input, read from keyboard as the program polls for it;
+    // keyboard is NULL once it reaches end of file
+    FILE* keyboard;
+    unsigned char input[KEYBOARD_BUFFER_SIZE];
+    size_t inputLength;
+    size_t inputPos;
+    unsigned long long nextPoll;        // clock before which an idle keyboard is not asked again
+
+    // display output, written to display when full or flushed
+    FILE* display;
+    char* output;
+    size_t outputLength;
+
+    // instructions executed while the devices were attached, the timer's clock
+    unsigned long long clock;
+    unsigned long long timerDeadline;
+
+    // framebuffer output behind VDCR and video memory, NULL when not wanted
+    struct VideoState* video;
+} DeviceState;
+
+/*
+ * Set up devices reading keys from keyboard (NULL for none) and printing to
+ * display. Keys are read only when the program looks at KBSR or KBDR, so
+ * keyboard may be interactive. The devices own keyboard and close it,
+ * unless it is stdin, even on failure. Returns NULL after printing an error
+ * to stderr.
+ */
+DeviceState* OpenDevices(FILE* keyboard, FILE* display);
+
+/*
+ * Route the device page of CPU to devices. Reset detaches them again.
+ */
+void AttachDevices(MachineState* CPU, DeviceState* devices);
+
+/*
+ * Read or write a register on the device page, or write video memory; the
+ * OS has already been checked to be the one asking. Addresses without a
+ * device act as memory.
+ */
+unsigned short int DeviceRead(MachineState* CPU, unsigned short int address);
+void DeviceWrite(MachineState* CPU, unsigned short int address, unsigned short int value);
+
+// DeviceNextEvent result for a register no amount of waiting changes
+#define DEVICE_NO_EVENT (~0ULL)
+
+/*
+ * The clock at which reading address may first return something new, for a
+ * poll loop to skip ahead to. Returns DEVICE_NO_EVENT for registers that
+ * only change when the program does something else.
+ */
+unsigned long long DeviceNextEvent(MachineState* CPU, unsigned short int address);
+
+/*
+ * Write any buffered display output.
+ */
+void FlushDevices(DeviceState* devices);
+
+/*
+ * Flush and release devices returned by OpenDevices.
+ */
+void CloseDevices(DeviceState* devices);
+
+#endif
@@ -0,0 +1,477 @@
+/*
+ * engine.c: Defines the fast (untraced) execution engine
+ */
+
+#include "engine.h"
+#include "device.h"
+#include <time.h>
+
+// Longest loop body, in words, checked for idling
+#define IDLE_MAX_BODY 8
+
+// Machine state seen at a backward branch, see RunFast
+typedef struct {
+    int branch;                 // address of the branch, -1 for none
+    unsigned short int R[8];
+    unsigned short int PSR;
+    unsigned long long start;   // count when the branch ran
+    int reads;                  // device reads since then
+    unsigned long long readAt;  // count at the last one
+    unsigned short int device;  // and its address
+} IdleLoop;
+
+/*
+ * Finish a counter loop in one step. The loop is "L: ADD Rc, Rc, #imm; BR L"
+ * or "L: ADD Rc, Rc, #imm; CMPI Rc, #limit; BR L" and the branch at branch
+ * was just taken, with the PSR flags up to date. Leaves Rc and the flags as
+ * the last iteration would and returns the instructions skipped, or 0 when
+ * the loop has another shape, its end is not worked out in closed form or
+ * it would take more than room instructions. PSR is the caller's copy of
+ * the register.
+ */
+static unsigned long long SkipCounterLoop(MachineState* CPU, unsigned short int* PSR, const unsigned char* breakpoints,
+                                          unsigned short int top, unsigned short int branch, unsigned long long room) {
+    unsigned short int* memory = CPU->memory;
+    unsigned int length = branch - top + 1;
+    unsigned short int add = memory[top];
+    int c = (add >> 9) & 0x7;
+    int limit = 0;
+
+    // ADD Rc, Rc, #imm with a non-zero imm
+    if ((add & 0xF020) != 0x1020 || ((add >> 6) & 0x7) != c || (add & 0x1F) == 0) {
+        return 0;
+    }
+    if (length == 3) {
+        unsigned short int cmpi = memory[top + 1];
+        if ((cmpi & 0xFF80) != (0x2100 | (c << 9))) {
+            return 0;
+        }
+        limit = SEXT(cmpi, 7);
+    } else if (length != 2) {
+        return 0;
+    }
+    for (unsigned int i = 0; i < length; i++) {
+        if (breakpoints[(unsigned short int)(top + i)]) {
+            return 0;
+        }
+    }
+
+    // w is what the branch tests; it moves by step each iteration
+    int step = SEXT(add, 5);
+    int w = (short)CPU->R[c] - limit;
+    int nzp = (memory[branch] >> 9) & 0x7;
+    long long iterations;
+    if ((nzp == 1 || nzp == 3) && step < 0) {
+        // BRp / BRzp counting down: run until w drops below 1 (or 0)
+        int floor = nzp == 1 ? 1 : 0;
+        iterations = (w - floor) / -step + 1;
+    } else if ((nzp == 4 || nzp == 6) && step > 0) {
+        // BRn / BRnz counting up: run until w rises above -1 (or 0)
+        int ceiling = nzp == 4 ? -1 : 0;
+        iterations = (ceiling - w) / step + 1;
+    } else if (nzp == 5 && (step == 1 || step == -1)) {
+        // BRnp stepping by one: run until w wraps around to zero
+        iterations = step < 0 ? (unsigned short int)w : (unsigned short int)-w;
+    } else {
+        return 0;
+    }
+    // flags that did not come from Rc, as when code jumps straight to the
+    // branch, can leave w already past the end
+    if (iterations <= 0 || (unsigned long long)iterations > room / length) {
+        return 0;
+    }
+
+    // the last iteration's results, as the instructions would leave them
+    unsigned short int rc = CPU->R[c] + iterations * step;
+    CPU->R[c] = rc;
+    int flags = (short)rc - limit;
+    if (length == 2) {
+        flags = (short)rc;
+    }
+    *PSR = (*PSR & ~0x7) | NZP_BITS(flags);
+    return iterations * length;
+}
+
+/*
+ * Skip a poll loop that, at its branch, is in the same state as after the
+ * previous iteration and read one device register in between. Every
+ * iteration until the device's next event reads the same value, so returns
+ * the instructions of the whole iterations whose read would come before it,
+ * but no more than room.
+ */
+static unsigned long long SkipPollLoop(MachineState* CPU, IdleLoop* idle, unsigned long long clock_base,
+                                       unsigned long long count, unsigned long long room) {
+    unsigned long long length = count - idle->start;
+    unsigned long long read = clock_base + count + (idle->readAt - idle->start);
+    unsigned long long event = DeviceNextEvent(CPU, idle->device);
+    if (event == DEVICE_NO_EVENT || event <= read) {
+        return 0;
+    }
+    unsigned long long iterations = (event - read + length - 1) / length;
+    if (iterations > room / length) {
+        iterations = room / length;
+    }
+    return iterations * length;
+}
+
+unsigned long long MonotonicNanoseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+const char* RunStatusName(int status) {
+    static const char* names[RUN_STATUSES] = {"halt", "fault", "budget", "timeout", "mode", "loop"};
+    return status >= 0 && status < RUN_STATUSES ? names[status] : "unknown";
+}
+
+// helper for the count at which RunFast next has to look at its budgets
+static unsigned long long Horizon(const RunControl* control, unsigned long long limit, unsigned long long count) {
+    if (control->deadline != 0 && limit - count > RUN_CLOCK_INTERVAL) {
+        return count + RUN_CLOCK_INTERVAL;
+    }
+    return limit;
+}
+
+// helper called when count reaches the horizon; returns the status to stop
+// with, or RUN_BREAKPOINT to go on until the new horizon
+static int CheckBudgets(const RunControl* control, unsigned long long limit, unsigned long long count,
+                        unsigned long long* horizon) {
+    if (count >= limit) {
+        return RUN_BUDGET;
+    }
+    if (control->deadline != 0 && MonotonicNanoseconds() >= control->deadline) {
+        return RUN_TIMEOUT;
+    }
+    *horizon = Horizon(control, limit, count);
+    return RUN_BREAKPOINT;
+}
+
+int RunFast(MachineState* CPU, RunControl* control) {
+    unsigned short int* memory = CPU->memory;
+    unsigned short int* R = CPU->R;
+    const unsigned char* breakpoints = control->breakpoints;
+    ShadowState* shadow = control->shadow;
+    Coverage* coverage = control->coverage;
+    MemoTable* memo = control->memo;
+    unsigned long long* opcodes = control->opcodes;
+    MemoCall call;
+    call.function = 0;
+    unsigned short int PC = CPU->PC;
+    unsigned short int PSR = CPU->PSR;
+    unsigned long long count = 0;
+
+    // the state hash follows each store as it happens, and the registers
+    // by comparing them with their values on entry
+    int hashing = CPU->hashing;
+    unsigned short int entryR[8];
+    unsigned short int entryPSR = PSR;
+    if (hashing) {
+        memcpy(entryR, R, sizeof(entryR));
+    }
+
+    int status = RUN_BREAKPOINT;
+
+    // NZP is lazy: instructions only record the value it derives from, and the
+    // PSR bits are worked out when a BR reads them or the run ends
+    int nzp_source = 0;
+    int nzp_pending = 0;
+
+    // the devices' clock advances by count, brought up to date before any access
+    DeviceState* devices = CPU->devices;
+    unsigned long long clock_base = devices ? devices->clock : 0;
+
+    // the state at the last backward branch, to spot a poll loop repeating itself
+    IdleLoop idle;
+    idle.branch = -1;
+
+    // count may not pass limit; both budgets are only looked at once count
+    // reaches horizon, so the loop pays a single compare for them
+    unsigned long long limit = ~0ULL;
+    if (control->maxInstructions != 0) {
+        if (control->instructions >= control->maxInstructions) {
+            return RUN_BUDGET;
+        }
+        limit = control->maxInstructions - control->instructions;
+    }
+    unsigned long long horizon = Horizon(control, limit, 0);
+
+    do {
+        // PAGE_ALLOWS, but against the PSR kept in a local
+        if (!(CPU->pageAttr[PC >> 8] & (PAGE_EXEC_USER << (PSR >> 15)))) {
+            AccessFault(CPU, PC, PAGE_EXEC_USER);
+            status = RUN_FAULT;
+            break;
+        }
+
+        if (coverage != NULL) {
+            COVER(coverage->executed, PC);
+        }
+
+        unsigned short int insn = memory[PC];
+        unsigned short int d = (insn >> 9) & 0x7;
+        unsigned short int s = (insn >> 6) & 0x7;
+        unsigned short int t = insn & 0x7;
+        count++;
+        if (opcodes != NULL) {
+            opcodes[insn >> 12]++;
+        }
+
+        switch (insn >> 12) {
+            case 0: { // BR (and NOP)
+                if (nzp_pending) {
+                    PSR = (PSR & ~0x7) | NZP_BITS(nzp_source);
+                    nzp_pending = 0;
+                }
+                if (!(d & PSR & 0x7)) {
+                    if (coverage != NULL && d != 0) {
+                        COVER(coverage->notTaken, PC);
+                    }
+                    PC++;
+                    break;
+                }
+                if (coverage != NULL) {
+                    COVER(coverage->taken, PC);
+                }
+                unsigned short int branch = PC;
+                PC += 1 + SEXT(insn, 9);
+
+                // a backward branch closes a loop that may just be idling
+                if (PC <= branch && branch - PC < IDLE_MAX_BODY) {
+                    unsigned long long skipped = SkipCounterLoop(CPU, &PSR, breakpoints, PC, branch, limit - count);
+                    if (skipped > 0) {
+                        // the skipped iterations end with the branch falling through
+                        if (coverage != NULL) {
+                            COVER(coverage->notTaken, branch);
+                        }
+                        count += skipped;
+                        PC = branch + 1;
+                        break;
+                    }
+                    // a poll loop whose last iteration changed nothing but reading
+                    // a device repeats itself until the device's next event
+                    if (idle.branch == branch && idle.reads == 1 && idle.PSR == PSR &&
+                        memcmp(idle.R, R, sizeof(idle.R)) == 0) {
+                        count += SkipPollLoop(CPU, &idle, clock_base, count, limit - count);
+                    }
+                    idle.branch = branch;
+                    idle.PSR = PSR;
+                    memcpy(idle.R, R, sizeof(idle.R));
+                    idle.start = count;
+                    idle.reads = 0;
+                }
+                break;
+            }
+            case 1: { // ADD, MUL, SUB, DIV, ADD IMM5
+                if (insn & 0x0020) {
+                    R[d] = R[s] + SEXT(insn, 5);
+                } else {
+                    switch ((insn >> 3) & 0x7) {
+                        case 0: R[d] = R[s] + R[t]; break;
+                        case 1: R[d] = (unsigned int)R[s] * R[t]; break;
+                        case 2: R[d] = R[s] - R[t]; break;
+                        case 3: R[d] = R[t] ? R[s] / R[t] : 0; break;
+                        default: break;
+                    }
+                }
+                nzp_source = (short)R[d];
+                nzp_pending = 1;
+                PC++;
+                break;
+            }
+            case 2: { // CMP, CMPU, CMPI, CMPIU
+                switch ((insn >> 7) & 0x3) {
+                    case 0: nzp_source = (short)R[d] - (short)R[t]; break;
+                    case 1: nzp_source = (int)R[d] - (int)R[t]; break;
+                    case 2: nzp_source = (short)R[d] - SEXT(insn, 7); break;
+                    case 3: nzp_source = (int)R[d] - (int)(insn & 0x7F); break;
+                }
+                nzp_pending = 1;
+                PC++;
+                break;
+            }
+            case 4: { // JSRR, JSR
+                unsigned short int target = (insn & 0x0800)
+                    ? (PC & 0x8000) | ((insn & 0x7FF) << 4)
+                    : R[s];
+                R[7] = PC + 1;
+                nzp_source = (short)R[7];
+                nzp_pending = 1;
+                PC = target;
+
+                // a pure subroutine replays its cached result, or is recorded
+                if (memo != NULL && (memo->function[PC] != 0 || call.function != 0)) {
+                    PSR = (PSR & ~0x7) | NZP_BITS(nzp_source);
+                    nzp_pending = 0;
+                    unsigned long long replayed = EnterMemo(memo, &call, R, &PSR, &PC, count, limit - count);
+                    if (replayed > 0) {
+                        count += replayed;
+                        idle.branch = -1;
+                    }
+                }
+                break;
+            }
+            case 5: { // AND, NOT, OR, XOR, AND IMM5
+                if (insn & 0x0020) {
+                    R[d] = R[s] & SEXT(insn, 5);
+                } else {
+                    switch ((insn >> 3) & 0x7) {
+                        case 0: R[d] = R[s] & R[t]; break;
+                        case 1: R[d] = ~R[s]; break;
+                        case 2: R[d] = R[s] | R[t]; break;
+                        case 3: R[d] = R[s] ^ R[t]; break;
+                        default: break;
+                    }
+                }
+                nzp_source = (short)R[d];
+                nzp_pending = 1;
+                PC++;
+                break;
+            }
+            case 6: { // LDR
+                unsigned short int address = R[s] + SEXT(insn, 6);
+                PC++;
+                if (!(CPU->pageAttr[address >> 8] & (PAGE_READ_USER << (PSR >> 15)))) {
+                    if (!((CPU->pageAttr[address >> 8] & PAGE_HOOKED) && (PSR & 0x8000))) {
+                        AccessFault(CPU, address, PAGE_READ_USER);
+                        status = RUN_FAULT;
+                        break;
+                    }
+                    devices->clock = clock_base + count;
+                    R[d] = DeviceRead(CPU, address);
+                    idle.reads++;
+                    idle.readAt = count;
+                    idle.device = address;
+                } else {
+                    R[d] = memory[address];
+                }
+                if (shadow != NULL) {
+                    ShadowLoad(shadow, PC - 1, s, address, PSR);
+                }
+                nzp_source = (short)R[d];
+                nzp_pending = 1;
+                break;
+            }
+            case 7: { // STR
+                unsigned short int address = R[s] + SEXT(insn, 6);
+                PC++;
+                if (!(CPU->pageAttr[address >> 8] & (PAGE_WRITE_USER << (PSR >> 15)))) {
+                    if (!((CPU->pageAttr[address >> 8] & PAGE_HOOKED) && (PSR & 0x8000))) {
+                        AccessFault(CPU, address, PAGE_WRITE_USER);
+                        status = RUN_FAULT;
+                        break;
+                    }
+                    devices->clock = clock_base + count;
+                    unsigned short int old = memory[address];
+                    DeviceWrite(CPU, address, R[d]);
+                    HASH_STORE(CPU, address, old);
+                } else {
+                    if (hashing) {
+                        CPU->hash ^= HashWord(address, memory[address]) ^ HashWord(address, R[d]);
+                    }
+                    memory[address] = R[d];
+                }
+                if (shadow != NULL) {
+                    ShadowStore(shadow, PC - 1, s, address, PSR);
+                }
+                idle.branch = -1;
+                break;
+            }
+            case 8: { // RTI
+                if ((PSR & 0x8000) && control->stopOnModeChange) {
+                    status = RUN_MODE;
+                }
+                PSR &= 0x7FFF;
+                PC = R[7];
+                break;
+            }
+            case 9: { // CONST
+                R[d] = SEXT(insn, 9);
+                nzp_source = (short)R[d];
+                nzp_pending = 1;
+                PC++;
+                break;
+            }
+            case 10: { // SLL, SRA, SRL, MOD
+                unsigned short int shift = insn & 0xF;
+                switch ((insn >> 4) & 0x3) {
+                    case 0: R[d] = R[s] << shift; break;
+                    case 1: R[d] = (short)R[s] >> shift; break;
+                    case 2: R[d] = R[s] >> shift; break;
+                    case 3: R[d] = R[t] ? R[s] % R[t] : 0; break;
+                }
+                nzp_source = (short)R[d];
+                nzp_pending = 1;
+                PC++;
+                break;
+            }
+            case 12: { // JMPR, JMP
+                unsigned short int jump = PC;
+                PC = (insn & 0x0800) ? PC + 1 + SEXT(insn, 11) : R[s];
+                if (call.function != 0 && memo->exit[jump]) {
+                    ExitMemo(memo, &call, R, nzp_pending ? (PSR & ~0x7) | NZP_BITS(nzp_source) : PSR, PC, count);
+                }
+                break;
+            }
+            case 13: { // HICONST
+                R[d] = (R[d] & 0xFF) | ((insn & 0xFF) << 8);
+                nzp_source = (short)R[d];
+                nzp_pending = 1;
+                PC++;
+                break;
+            }
+            case 15: { // TRAP
+                if (!(PSR & 0x8000) && control->stopOnModeChange) {
+                    status = RUN_MODE;
+                }
+                PSR |= 0x8000;
+                R[7] = PC + 1;
+                // UpdateMachineState derives NZP from R7 + 1 as an int
+                nzp_source = R[7] + 1;
+                nzp_pending = 1;
+                PC = 0x8000 | (insn & 0xFF);
+                idle.branch = -1;
+
+                // run a known routine natively, it ends with the RTI done
+                HostTrapHandler handler =
+                    control->hostTraps && status == RUN_BREAKPOINT && shadow == NULL && coverage == NULL
+                    ? control->hostTraps->handlers[insn & 0xFF] : NULL;
+                if (handler != NULL) {
+                    CPU->PC = PC;
+                    CPU->PSR = (PSR & ~0x7) | NZP_BITS(nzp_source);
+                    if (devices != NULL) {
+                        devices->clock = clock_base + count;
+                    }
+                    long routine = handler(CPU, limit - count);
+                    if (routine >= 0) {
+                        count += routine;
+                        PC = CPU->PC;
+                        PSR = CPU->PSR;
+                        nzp_pending = 0;
+                    }
+                }
+                break;
+            }
+            default: {
+                // unknown opcodes leave the PC alone, like UpdateMachineState
+                break;
+            }
+        }
+    } while (status == RUN_BREAKPOINT && !breakpoints[PC] &&
+             (count < horizon || (status = CheckBudgets(control, limit, count, &horizon)) == RUN_BREAKPOINT));
+
+    // materialize the flags for whoever reads the PSR next
+    if (nzp_pending) {
+        PSR = (PSR & ~0x7) | NZP_BITS(nzp_source);
+    }
+    CPU->PC = PC;
+    CPU->PSR = PSR;
+    if (hashing) {
+        HashRegisterChanges(CPU, entryR, entryPSR);
+    }
+    if (devices != NULL) {
+        devices->clock = clock_base + count;
+    }
+    control->instructions += count;
+    return status;
+}
@@ -0,0 +1,101 @@
+/*
+ * engine.h: Declares the fast (untraced) execution engine
+ */
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "LC4.h"
+#include "hosttrap.h"
+#include "shadow.h"
+#include "coverage.h"
+#include "memo.h"
+
+// sign extend the low bits of value
+#define SEXT(value, bits) ((((int)(value) & ((1 << (bits)) - 1)) ^ (1 << ((bits) - 1))) - (1 << ((bits) - 1)))
+
+// NZP bits for a result, the same mapping as NZP_calc
+#define NZP_BITS(value) ((value) > 0 ? 1 : ((value) == 0 ? 2 : 4))
+
+// Why RunFast returned
+#define RUN_BREAKPOINT 0
+#define RUN_FAULT      1
+#define RUN_BUDGET     2 // maxInstructions reached
+#define RUN_TIMEOUT    3 // deadline passed
+#define RUN_MODE       4 // a TRAP or RTI changed the privilege level
+#define RUN_LOOP       5 // the machine state repeated (repeat.h), never from RunFast
+#define RUN_STATUSES   6
+
+// Inputs and outputs of one RunFast call
+typedef struct {
+    // 65536 flags, execution stops before any address whose flag is set
+    const unsigned char* breakpoints;
+
+    // instructions executed, RunFast adds to it
+    unsigned long long instructions;
+
+    // native TRAP routines from PrepareHostTraps, NULL to always run the guest code
+    const HostTraps* hostTraps;
+
+    // stop once instructions reaches this, 0 for no limit
+    unsigned long long maxInstructions;
+
+    // stop once MonotonicNanoseconds() passes this, 0 for no limit; the clock
+    // is read every RUN_CLOCK_INTERVAL instructions
+    unsigned long long deadline;
+
+    // stop after any TRAP or RTI that switches between user and OS mode
+    // (native TRAP routines are then not used)
+    int stopOnModeChange;
+
+    // check every LDR and STR against this shadow memory, NULL for none
+    // (native TRAP routines are then not used, their stores would be missed)
+    ShadowState* shadow;
+
+    // mark each executed address and each BR's direction here, NULL for none
+    // (native TRAP routines are then not used, their code would go unmarked)
+    Coverage* coverage;
+
+    // replay the results of the pure subroutines in this table from
+    // PrepareMemo, NULL to run every call (must be NULL with coverage)
+    MemoTable* memo;
+
+    // count each instruction fetched here by its opcode (insn >> 12), NULL
+    // for none; instructions skipped, run natively or replayed are not counted
+    unsigned long long* opcodes;
+} RunControl;
+
+#define RUN_CLOCK_INTERVAL (1ULL << 20)
+
+/*
+ * Execute instructions exactly as UpdateMachineState would, without writing
+ * a trace or debug output, until a breakpoint is reached or an access faults.
+ * At least one instruction runs even when starting on a breakpoint. Only PC,
+ * PSR, R and memory are updated; the control signals and the trace fields
+ * (regInputVal, NZPVal, dmemAddr, dmemValue) are left alone. While
+ * CPU->hashing is set the state hash follows each store and, once the run
+ * ends, the registers.
+ * Idle loops are fast-forwarded: a loop counting a register down or up to a
+ * branch condition finishes in one step, and a device poll loop jumps to the
+ * device's next event. Skipped instructions are still counted. Traced runs
+ * go through UpdateMachineState, which never skips. With a memo table a JSR
+ * to a pure subroutine already seen with the same keys jumps straight to its
+ * return, counting the instructions it stands for.
+ * Skips, replayed calls and native TRAP routines never take the count past
+ * maxInstructions; when the budget is already used up nothing runs.
+ * Returns RUN_BREAKPOINT, RUN_FAULT, RUN_BUDGET, RUN_TIMEOUT or RUN_MODE.
+ */
+int RunFast(MachineState* CPU, RunControl* control);
+
+/*
+ * CLOCK_MONOTONIC in nanoseconds, for RunControl.deadline.
+ */
+unsigned long long MonotonicNanoseconds(void);
+
+/*
+ * The word reports use for a RUN_* code: halt, fault, budget, timeout, mode
+ * or loop, and "unknown" for anything else.
+ */
+const char* RunStatusName(int status);
+
+#endif
@@ -0,0 +1,426 @@
+/*
+ * hosttrap.c: Defines native host versions of known OS TRAP routines
+ */
+
+#include "hosttrap.h"
+#include "device.h"
+
+// a guest routine this file has a native version of
+typedef struct {
+    unsigned char vector;
+    unsigned short int entry;   // first word of the routine
+    unsigned short int length;  // words from entry up to and including its RTI
+    unsigned long long hash;    // FNV-1a of those words
+    HostTrapHandler handler;
+} KnownRoutine;
+
+
+// helper to get the NZP bits of a 16 bit result
+static int NzpOf(unsigned short int value) {
+    return (short)value > 0 ? 1 : ((short)value == 0 ? 2 : 4);
+}
+
+// helper to check that the OS may write every word in [start, end]
+static int OsWritable(MachineState* CPU, unsigned short int start, unsigned short int end) {
+    for (int page = start >> 8; page <= end >> 8; page++) {
+        if (!(CPU->pageAttr[page] & (PAGE_WRITE_OS | PAGE_HOOKED))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// helper to store like STR does, through the devices for hooked pages
+static void StoreWord(MachineState* CPU, unsigned short int address, unsigned short int value) {
+    unsigned short int old = CPU->memory[address];
+    if (CPU->pageAttr[address >> 8] & PAGE_HOOKED) {
+        DeviceWrite(CPU, address, value);
+    } else {
+        CPU->memory[address] = value;
+    }
+    HASH_STORE(CPU, address, old);
+}
+
+// helper to finish like RTI after the routine's last flag setting instruction
+static void ReturnFromTrap(MachineState* CPU, int nzp) {
+    CPU->PSR = (CPU->PSR & 0x7FF8) | nzp;
+    CPU->PC = CPU->R[7];
+}
+
+// helper for TRAP_DRAW_PTS: walks the points like the guest loop and returns
+// its instruction count, storing pixels and registers only when store is set
+static long DrawPoints(MachineState* CPU, unsigned int iterations, int store) {
+    unsigned short int* R = CPU->R;
+    unsigned short int* memory = CPU->memory;
+
+    long count = 5; // JMP in the vector table, CONST, HICONST, STR, ADD
+    if (store) {
+        StoreWord(CPU, 0xBFFF, R[6]);
+    }
+
+    unsigned short int r1 = R[1], r3 = R[3], r4 = R[4], r5 = R[5];
+    unsigned short int r0 = R[0];
+    for (unsigned int i = 0; i < iterations; i++) {
+        r3 = memory[r1];
+        r4 = memory[(unsigned short int)(r1 + 1)];
+        r1 += 2;
+
+        // same compares, in the same order, as DRAW_PTS_LOOP
+        if ((short)r4 < 0) {
+            count += 5;
+        } else {
+            r5 = 124;
+            if ((short)r4 - (short)r5 >= 0) {
+                count += 8;
+            } else if ((short)r3 < 0) {
+                count += 10;
+            } else {
+                r5 = 128;
+                if ((short)r3 - (short)r5 >= 0) {
+                    count += 13;
+                } else {
+                    r5 = r4 * r5 + r3 + 0xC000;
+                    r4 = 0xC000;
+                    if (store) {
+                        StoreWord(CPU, r5, R[2]);
+                    }
+                    count += 19;
+                }
+            }
+        }
+
+        // DRAW_PTS_TEST
+        r0--;
+        count += 2;
+    }
+
+    if (store) {
+        R[0] = r0;
+        R[1] = r1;
+        R[3] = r3;
+        R[4] = r4;
+        R[5] = r5;
+        R[6] = memory[0xBFFF];
+        ReturnFromTrap(CPU, NzpOf(R[6]));
+    }
+    return count + 2; // LDR, RTI
+}
+
+/*
+ * TRAP_DRAW_PTS (os.obj): R0 points, R1 list of (x, y) pairs, R2 color.
+ * Saves R6 at xBFFF, writes every point inside the 128x124 display and
+ * restores R6. The loop body runs once before R0 is first tested.
+ */
+static long HostDrawPoints(MachineState* CPU, unsigned long long limit) {
+    unsigned short int* R = CPU->R;
+
+    unsigned int iterations = 0;
+    unsigned short int r0 = R[0];
+    do {
+        iterations++;
+        r0--;
+    } while ((short)r0 > 0);
+
+    // refuse anything the guest routine would fault on
+    if (!OsWritable(CPU, 0xBFFF, 0xBFFF) || !OsWritable(CPU, 0xC000, 0xFDFF)) {
+        return -1;
+    }
+    int overlaps = 0;
+    for (unsigned int i = 0; i < 2 * iterations; i++) {
+        unsigned short int address = R[1] + i;
+        if (!(CPU->pageAttr[address >> 8] & PAGE_READ_OS)) {
+            return -1;
+        }
+        overlaps |= address >= 0xBFFF && address <= 0xFDFF;
+    }
+
+    // a dry run counts the cost up front, unless the routine's own stores
+    // could change the points it reads
+    if (limit < 19 * (unsigned long long)iterations + 9) {
+        if (overlaps || (unsigned long long)DrawPoints(CPU, iterations, 0) > limit) {
+            return -1;
+        }
+    }
+    return DrawPoints(CPU, iterations, 1);
+}
+
+// helper for TRAP_RESET_VMEM and TRAP_BLT_VMEM, which store one command word
+static long HostVideoCommand(MachineState* CPU, unsigned short int command, unsigned long long limit) {
+    if (!OsWritable(CPU, VDCR, VDCR) || limit < 6) {
+        return -1;
+    }
+
+    CPU->R[4] = VDCR;
+    CPU->R[5] = command;
+    StoreWord(CPU, VDCR, command);
+    ReturnFromTrap(CPU, NzpOf(command));
+    return 6; // JMP, CONST, HICONST, CONST, STR, RTI
+}
+
+/*
+ * TRAP_RESET_VMEM (os.obj): writes 1 to the video control register xFE0C.
+ */
+static long HostResetVideo(MachineState* CPU, unsigned long long limit) {
+    return HostVideoCommand(CPU, 1, limit);
+}
+
+/*
+ * TRAP_BLT_VMEM (os.obj): writes 2 to the video control register xFE0C.
+ */
+static long HostBlitVideo(MachineState* CPU, unsigned long long limit) {
+    return HostVideoCommand(CPU, 2, limit);
+}
+
+// helper for TRAP_DRAW_CHECKERS: returns the guest instruction count,
+// storing pixels and registers only when store is set
+static long DrawCheckers(MachineState* CPU, int store) {
+    unsigned short int* R = CPU->R;
+
+    long count = 5; // LC R0 (two words), LC R1, LC R2, CONST R3
+    unsigned short int r0 = 0xC000, r1 = 128, r2 = 124, r3 = 0, r4, r5 = R[5], r6 = R[6];
+    for (;;) {
+        // ROW_LOOP
+        r4 = 0;
+        count++;
+        do {
+            // COL_LOOP
+            r5 = r3 & 1;
+            r6 = r4 & 1;
+            r6 = r5 ^ r6;
+            count += 4;
+            if (r6 == 0) {
+                r5 = 128 * r3;
+                r6 = 4;
+                r5 = r5 * r6;
+                r1 = r4 * r6;
+                r5 = r1 + r5;
+                r5 = r0 + r5;
+                r6 = 0x001F;
+                if (store) {
+                    StoreWord(CPU, r5, r6);
+                    StoreWord(CPU, r5 + 1, r6);
+                    StoreWord(CPU, r5 + 2, r6);
+                    StoreWord(CPU, r5 + 3, r6);
+                }
+                count += 12;
+            }
+
+            // UPDATE_COL
+            r4++;
+            r2 = 0x80;
+            count += 4;
+        } while (r4 != r2);
+
+        r3++;
+        count += 3;
+        if (r3 == 31) {
+            break;
+        }
+        count++; // JMP ROW_LOOP
+    }
+
+    if (store) {
+        R[0] = r0;
+        R[1] = r1;
+        R[2] = r2;
+        R[3] = r3;
+        R[4] = r4;
+        R[5] = r5;
+        R[6] = r6;
+        ReturnFromTrap(CPU, 2); // CMPI R3, #31 was zero
+    }
+    return count + 1; // RTI
+}
+
+/*
+ * TRAP_DRAW_CHECKERS (public-test_checkers_img): fills 4 pixel wide blue
+ * cells in a checkerboard over the first 31 rows of 4 pixel runs. Ignores
+ * its inputs, so only the counters' final values and the pixels matter.
+ */
+static long HostDrawCheckers(MachineState* CPU, unsigned long long limit) {
+    if (!OsWritable(CPU, 0xC000, 0xFDFF)) {
+        return -1;
+    }
+
+    // the count never depends on the inputs, so a dry run gives it exactly
+    if ((unsigned long long)DrawCheckers(CPU, 0) > limit) {
+        return -1;
+    }
+    return DrawCheckers(CPU, 1);
+}
+
+// helper to check that the OS may read every word in [start, end] as memory
+static int OsReadable(MachineState* CPU, unsigned short int start, unsigned short int end) {
+    for (int page = start >> 8; page <= end >> 8; page++) {
+        if ((CPU->pageAttr[page] & (PAGE_READ_OS | PAGE_HOOKED)) != PAGE_READ_OS) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// helper to load like LDR does, through the devices for hooked pages with
+// their clock at the reading instruction, offset into the routine
+static unsigned short int LoadWord(MachineState* CPU, unsigned long long start, long offset,
+                                   unsigned short int address) {
+    if (!(CPU->pageAttr[address >> 8] & PAGE_HOOKED)) {
+        return CPU->memory[address];
+    }
+    CPU->devices->clock = start + offset;
+    return DeviceRead(CPU, address);
+}
+
+// helper for the device clock the routine starts from, 0 without devices
+static unsigned long long DeviceClock(MachineState* CPU) {
+    return CPU->devices != NULL ? CPU->devices->clock : 0;
+}
+
+/*
+ * TRAP_GETC (os.obj): polls KBSR until bit 15 is set, then reads KBDR into
+ * R1. Only runs natively when the first poll finds a character; otherwise
+ * the guest loop waits, and the engine's poll loop skip with it.
+ */
+static long HostGetc(MachineState* CPU, unsigned long long limit) {
+    if (limit < 9 || !(CPU->pageAttr[DEVICE_PAGE] & (PAGE_READ_OS | PAGE_HOOKED))) {
+        return -1;
+    }
+    unsigned long long start = DeviceClock(CPU);
+    if (CPU->devices != NULL) {
+        // KBSR would only be set by asking the host, which the guest does
+        CPU->devices->clock = start + 4;
+        if (DeviceNextEvent(CPU, KBSR) != CPU->devices->clock) {
+            return -1;
+        }
+    } else if ((short)CPU->memory[KBSR] >= 0) {
+        return -1;
+    }
+
+    // JMP, CONST, HICONST, LDR KBSR, BRzp, CONST, HICONST, LDR KBDR, RTI
+    CPU->R[0] = LoadWord(CPU, start, 4, KBSR);
+    CPU->R[4] = KBDR;
+    CPU->R[1] = LoadWord(CPU, start, 8, KBDR);
+    ReturnFromTrap(CPU, NzpOf(CPU->R[1]));
+    return 9;
+}
+
+/*
+ * TRAP_PUTS (os.obj): R0 points to a zero terminated string of one
+ * character per word. Saves R6 at xBFFF and, for each character, polls
+ * ADSR and writes the character to ADDR.
+ */
+static long HostPuts(MachineState* CPU, unsigned long long limit) {
+    unsigned short int* R = CPU->R;
+    unsigned short int* memory = CPU->memory;
+
+    // the string must be plain memory apart from the saved R6 and the
+    // display registers, so reading it ahead sees what the loop would
+    unsigned int length = 0;
+    for (;;) {
+        unsigned short int address = R[0] + length;
+        if (!OsReadable(CPU, address, address) || address == 0xBFFF || address >> 8 == DEVICE_PAGE) {
+            return -1;
+        }
+        if (memory[address] == 0) {
+            break;
+        }
+        length++;
+        if (11 * (unsigned long long)length + 9 > limit) {
+            return -1;
+        }
+    }
+    if (limit < 9 || !OsWritable(CPU, 0xBFFF, 0xBFFF)) {
+        return -1;
+    }
+    if (length > 0) {
+        // without devices a clear ADSR bit 15 would have the loop wait forever
+        if (!OsWritable(CPU, ADDR, ADDR) || !(CPU->pageAttr[DEVICE_PAGE] & (PAGE_READ_OS | PAGE_HOOKED)) ||
+            (CPU->devices == NULL && (short)memory[ADSR] >= 0)) {
+            return -1;
+        }
+    }
+
+    unsigned long long start = DeviceClock(CPU);
+    long count = 5; // JMP in the vector table, CONST, HICONST, STR, ADD
+    StoreWord(CPU, 0xBFFF, R[6]);
+    R[4] = 0xBFFF;
+    for (unsigned int i = 0; i < length; i++) {
+        // PUTS_CHARLOOP: LDR, BRz; PUTS_ADSRLOOP: CONST, HICONST, LDR, BRzp;
+        // CONST, HICONST, STR, ADD, JMP
+        R[1] = memory[R[0]];
+        LoadWord(CPU, start, count + 5, ADSR);
+        R[2] = ADDR;
+        if (CPU->devices != NULL) {
+            CPU->devices->clock = start + count + 9;
+        }
+        StoreWord(CPU, ADDR, R[1]);
+        R[0]++;
+        count += 11;
+    }
+    R[1] = 0;
+    R[6] = memory[0xBFFF];
+    ReturnFromTrap(CPU, NzpOf(R[6]));
+    return count + 4; // LDR, BRz, LDR, RTI
+}
+
+static const KnownRoutine knownRoutines[] = {
+    {0x41, 0x820F, 27, 0xD2F9B87F15FE729EULL, HostDrawPoints},
+    {0x4E, 0x822A, 5, 0x4CA0F71FE0F29212ULL, HostResetVideo},
+    {0x4F, 0x822F, 5, 0x09192E7A7114B451ULL, HostBlitVideo},
+    {0x60, 0x8234, 17, 0xDEEA7CDD349335AEULL, HostPuts},
+    {0x62, 0x8245, 8, 0x9860F4EE8590A8FCULL, HostGetc},
+    {0xE0, 0x80E0, 31, 0x4E834CD8B0DE2900ULL, HostDrawCheckers},
+};
+
+// helper to hash words of memory, low byte first
+static unsigned long long HashWords(MachineState* CPU, unsigned short int start, unsigned short int length) {
+    unsigned long long hash = 0xCBF29CE484222325ULL;
+    for (unsigned int i = 0; i < length; i++) {
+        unsigned short int word = CPU->memory[(unsigned short int)(start + i)];
+        hash = (hash ^ (word & 0xFF)) * 0x100000001B3ULL;
+        hash = (hash ^ (word >> 8)) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+int PrepareHostTraps(MachineState* CPU, const unsigned char* breakpoints, HostTraps* traps) {
+    int installed = 0;
+    memset(traps, 0, sizeof(HostTraps));
+
+    for (unsigned int i = 0; i < sizeof(knownRoutines) / sizeof(knownRoutines[0]); i++) {
+        const KnownRoutine* routine = &knownRoutines[i];
+        unsigned short int slot = 0x8000 | routine->vector;
+        unsigned short int last = routine->entry + routine->length - 1;
+
+        // the vector must be the routine itself or a JMP straight to it
+        if (slot != routine->entry) {
+            unsigned short int jump = CPU->memory[slot];
+            int offset = ((jump & 0x7FF) ^ 0x400) - 0x400;
+            if ((jump & 0xF800) != 0xC800 || (unsigned short int)(slot + 1 + offset) != routine->entry) {
+                continue;
+            }
+        }
+
+        if (HashWords(CPU, routine->entry, routine->length) != routine->hash) {
+            continue;
+        }
+
+        // code that could change, or that someone wants to stop in, runs as is
+        int usable = !(breakpoints != NULL && breakpoints[slot]);
+        for (unsigned int address = routine->entry; usable && address <= last; address++) {
+            if (breakpoints != NULL && breakpoints[address]) {
+                usable = 0;
+            }
+        }
+        for (int page = slot >> 8; usable && page <= last >> 8; page++) {
+            if (CPU->pageAttr[page] & (PAGE_WRITE_USER | PAGE_WRITE_OS)) {
+                usable = 0;
+            }
+        }
+
+        if (usable) {
+            traps->handlers[routine->vector] = routine->handler;
+            installed++;
+        }
+    }
+    return installed;
+}
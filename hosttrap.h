@@ -0,0 +1,32 @@
+/*
+ * hosttrap.h: Declares native host versions of known OS TRAP routines
+ */
+
+#ifndef HOSTTRAP_H
+#define HOSTTRAP_H
+
+#include "LC4.h"
+
+/*
+ * Runs in place of a guest TRAP routine. Called with PC at the trap vector,
+ * right after the TRAP instruction, and must leave the machine exactly as the
+ * routine's RTI would. Returns how many guest instructions that took, or -1
+ * (before changing anything) when the guest routine has to run instead,
+ * including when it would take more than limit instructions.
+ */
+typedef long (*HostTrapHandler)(MachineState* CPU, unsigned long long limit);
+
+// Handlers to use for each trap vector, NULL where the guest code must run
+typedef struct {
+    HostTrapHandler handlers[256];
+} HostTraps;
+
+/*
+ * Install a handler for every known routine whose code in memory hashes to
+ * the version it was written for, whose pages cannot be written, and that
+ * has no breakpoint in it. Anything else falls back to the guest routine.
+ * Returns the number of handlers installed.
+ */
+int PrepareHostTraps(MachineState* CPU, const unsigned char* breakpoints, HostTraps* traps);
+
+#endif
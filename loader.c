@@ -3,6 +3,7 @@
  */
 
 #include "loader.h"
+#include <strings.h>
 
 
 // helper function to convert endianness of a word
@@ -18,6 +19,10 @@ unsigned short int swap_bytes(unsigned short int x) {
 unsigned short memoryAddress;
 
 int ReadObjectFile(char* filename, MachineState* CPU) {
+    return LoadObjectFile(filename, CPU, NULL);
+}
+
+int LoadObjectFile(char* filename, MachineState* CPU, ObjectInfo* info) {
 
     FILE* file = fopen(filename, "rb");
     if (file == NULL) {
@@ -28,6 +33,9 @@ int ReadObjectFile(char* filename, MachineState* CPU) {
     unsigned short section, address, n, word, i, fileIndex;
     char character;
 
+    // line sections count file names from the first one in this file
+    int firstFile = info != NULL ? info->numFiles : 0;
+
     while (fread(&section, sizeof(unsigned short), 1, file) == 1) {
         section = swap_bytes(section); 
 
@@ -44,6 +52,11 @@ int ReadObjectFile(char* filename, MachineState* CPU) {
                     fread(&word, sizeof(unsigned short), 1, file);
                     CPU->memory[address + i] = swap_bytes(word); //since CPU is a POINTER to the structure
                 }
+
+                if (info != NULL && AddSection(info, address, n, 1) != 0) {
+                    fclose(file);
+                    return -1;
+                }
                 break;
              }
 
@@ -59,6 +72,11 @@ int ReadObjectFile(char* filename, MachineState* CPU) {
                     fread(&word, sizeof(unsigned short), 1, file);
                     CPU->memory[address + i] = swap_bytes(word); //since CPU is a POINTER to the structure
                 }
+
+                if (info != NULL && AddSection(info, address, n, 0) != 0) {
+                    fclose(file);
+                    return -1;
+                }
                 break;
             }
             case 0xC3B7: {
@@ -68,10 +86,19 @@ int ReadObjectFile(char* filename, MachineState* CPU) {
                 address = swap_bytes(address);
                 n = swap_bytes(n);
 
-                // read next n lines of code 
+                // read the n characters of the label
+                char name[MAX_SYMBOL_LEN];
                 for (i = 0; i < n; i++) {
-                    // skip filling the array
                     fread(&character, sizeof(char), 1, file);
+                    if (i < MAX_SYMBOL_LEN - 1) {
+                        name[i] = character;
+                    }
+                }
+                name[n < MAX_SYMBOL_LEN - 1 ? n : MAX_SYMBOL_LEN - 1] = '\0';
+
+                if (info != NULL && AddSymbol(info, name, address) != 0) {
+                    fclose(file);
+                    return -1;
                 }
                 break;
             }			
@@ -80,10 +107,24 @@ int ReadObjectFile(char* filename, MachineState* CPU) {
                 fread(&n, sizeof(unsigned short), 1, file);
                 n = swap_bytes(n);
 
-                 // read next n lines of code 
+                // read the n characters of the name
+                char* name = malloc(n + 1);
+                if (name == NULL) {
+                    fprintf(stderr, "Error: Out of memory while reading file names\n");
+                    fclose(file);
+                    return -1;
+                }
                 for (i = 0; i < n; i++) {
-                    // skip filling the array
                     fread(&character, sizeof(char), 1, file);
+                    name[i] = character;
+                }
+                name[n] = '\0';
+
+                int added = info != NULL ? AddFile(info, name) : 0;
+                free(name);
+                if (added < 0) {
+                    fclose(file);
+                    return -1;
                 }
                 break;
             }
@@ -95,8 +136,11 @@ int ReadObjectFile(char* filename, MachineState* CPU) {
                 address = swap_bytes(address);
                 word = swap_bytes(word);
                 fileIndex = swap_bytes(fileIndex);
-                
-                // no body
+
+                if (info != NULL && AddLine(info, address, word, firstFile + fileIndex) != 0) {
+                    fclose(file);
+                    return -1;
+                }
                 break;
             }
             default: {
@@ -108,4 +152,116 @@ int ReadObjectFile(char* filename, MachineState* CPU) {
       }
     fclose(file);
     return 0;
-}
\ No newline at end of file
+}
+
+int AddSymbol(ObjectInfo* info, const char* name, unsigned short int address) {
+    // grow the symbol array when full
+    if (info->numSymbols == info->capSymbols) {
+        int cap = info->capSymbols ? 2 * info->capSymbols : 64;
+        Symbol* symbols = realloc(info->symbols, cap * sizeof(Symbol));
+        if (symbols == NULL) {
+            fprintf(stderr, "Error: Out of memory while reading symbols\n");
+            return -1;
+        }
+        info->symbols = symbols;
+        info->capSymbols = cap;
+    }
+
+    Symbol* symbol = &info->symbols[info->numSymbols++];
+    symbol->address = address;
+    strncpy(symbol->name, name, MAX_SYMBOL_LEN - 1);
+    symbol->name[MAX_SYMBOL_LEN - 1] = '\0';
+    return 0;
+}
+
+int AddSection(ObjectInfo* info, unsigned short int address, unsigned short int words, int code) {
+    // grow the section array when full
+    if (info->numSections == info->capSections) {
+        int cap = info->capSections ? 2 * info->capSections : 16;
+        ObjectSection* sections = realloc(info->sections, cap * sizeof(ObjectSection));
+        if (sections == NULL) {
+            fprintf(stderr, "Error: Out of memory while reading sections\n");
+            return -1;
+        }
+        info->sections = sections;
+        info->capSections = cap;
+    }
+
+    ObjectSection* section = &info->sections[info->numSections++];
+    section->address = address;
+    section->words = words;
+    section->code = code;
+    return 0;
+}
+
+int AddFile(ObjectInfo* info, const char* name) {
+    // grow the file array when full
+    if (info->numFiles == info->capFiles) {
+        int cap = info->capFiles ? 2 * info->capFiles : 4;
+        char** files = realloc(info->files, cap * sizeof(char*));
+        if (files == NULL) {
+            fprintf(stderr, "Error: Out of memory while reading file names\n");
+            return -1;
+        }
+        info->files = files;
+        info->capFiles = cap;
+    }
+
+    info->files[info->numFiles] = strdup(name);
+    if (info->files[info->numFiles] == NULL) {
+        fprintf(stderr, "Error: Out of memory while reading file names\n");
+        return -1;
+    }
+    return info->numFiles++;
+}
+
+int AddLine(ObjectInfo* info, unsigned short int address, unsigned short int line, int file) {
+    // grow the line array when full
+    if (info->numLines == info->capLines) {
+        int cap = info->capLines ? 2 * info->capLines : 256;
+        SourceLine* lines = realloc(info->lines, cap * sizeof(SourceLine));
+        if (lines == NULL) {
+            fprintf(stderr, "Error: Out of memory while reading line numbers\n");
+            return -1;
+        }
+        info->lines = lines;
+        info->capLines = cap;
+    }
+
+    SourceLine* entry = &info->lines[info->numLines++];
+    entry->address = address;
+    entry->line = line;
+    entry->file = file;
+    return 0;
+}
+
+int LookupSymbol(ObjectInfo* info, const char* name, unsigned short int* address) {
+    // later definitions win, as they would when PennSim loads several files
+    for (int i = info->numSymbols - 1; i >= 0; i--) {
+        if (strcasecmp(info->symbols[i].name, name) == 0) {
+            *address = info->symbols[i].address;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char* SymbolAt(ObjectInfo* info, unsigned short int address) {
+    for (int i = info->numSymbols - 1; i >= 0; i--) {
+        if (info->symbols[i].address == address) {
+            return info->symbols[i].name;
+        }
+    }
+    return NULL;
+}
+
+void FreeObjectInfo(ObjectInfo* info) {
+    free(info->symbols);
+    free(info->sections);
+    for (int i = 0; i < info->numFiles; i++) {
+        free(info->files[i]);
+    }
+    free(info->files);
+    free(info->lines);
+    memset(info, 0, sizeof(ObjectInfo));
+}
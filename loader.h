@@ -2,8 +2,80 @@
  * loader.h: Declares loader functions for opening and loading object files
  */
 
+#ifndef LOADER_H
+#define LOADER_H
+
 #include <stdio.h>
 #include "LC4.h"
 
+// Longest label kept from a symbol section (longer names are truncated)
+#define MAX_SYMBOL_LEN 64
+
+// A label recorded from a 0xC3B7 symbol section
+typedef struct {
+    unsigned short int address;
+    char name[MAX_SYMBOL_LEN];
+} Symbol;
+
+// Where a 0xCADE or 0xDADA section put its words
+typedef struct {
+    unsigned short int address;
+    unsigned short int words;
+    int code;                   // 1 for a code section, 0 for data
+} ObjectSection;
+
+// The source line of a code word, from a 0x715E line number section
+typedef struct {
+    unsigned short int address;
+    unsigned short int line;
+    int file;                   // index into ObjectInfo.files
+} SourceLine;
+
+// Everything besides memory contents that an object file describes
+typedef struct {
+    Symbol* symbols;
+    int numSymbols;
+    int capSymbols;
+
+    ObjectSection* sections;
+    int numSections;
+    int capSections;
+
+    char** files;               // names from 0xF17E file name sections
+    int numFiles;
+    int capFiles;
+
+    SourceLine* lines;
+    int numLines;
+    int capLines;
+} ObjectInfo;
+
 // Read an object file and modify the machine state as described in the writeup
-int ReadObjectFile(char* filename, MachineState* CPU);
\ No newline at end of file
+int ReadObjectFile(char* filename, MachineState* CPU);
+
+// Same as ReadObjectFile, also recording symbols, sections, file names and
+// line numbers into info (which may be NULL)
+int LoadObjectFile(char* filename, MachineState* CPU, ObjectInfo* info);
+
+// Add a symbol to info, returns 0 on success
+int AddSymbol(ObjectInfo* info, const char* name, unsigned short int address);
+
+// Add a loaded code or data section to info, returns 0 on success
+int AddSection(ObjectInfo* info, unsigned short int address, unsigned short int words, int code);
+
+// Add a source file name to info, returns its index or -1
+int AddFile(ObjectInfo* info, const char* name);
+
+// Add the source line of the code word at address to info, returns 0 on success
+int AddLine(ObjectInfo* info, unsigned short int address, unsigned short int line, int file);
+
+// Look up a label (case-insensitive like PennSim), returns 0 if found
+int LookupSymbol(ObjectInfo* info, const char* name, unsigned short int* address);
+
+// Name of a label at address (the latest one if several), NULL if none
+const char* SymbolAt(ObjectInfo* info, unsigned short int address);
+
+// Release everything held by info and reset it to empty
+void FreeObjectInfo(ObjectInfo* info);
+
+#endif
@@ -0,0 +1,368 @@
+/*
+ * memo.c: Defines memoization of pure guest subroutines for the fast engine
+ */
+
+#include "memo.h"
+#include "engine.h"
+
+// Where a subroutine's proof stands
+#define PROOF_UNKNOWN 0
+#define PROOF_ACTIVE  1 // being proven, so a call to it is recursion
+#define PROOF_PURE    2
+#define PROOF_IMPURE  3
+
+// Everything the proofs share
+typedef struct {
+    MachineState* CPU;
+    CodeAnalysis* A;
+    const unsigned char* breakpoints;
+    MemoTable* M;
+    unsigned char state[65536];         // PROOF_* per entry address
+    unsigned char keys[65536];          // summaries per entry address
+    unsigned char writes[65536];
+    unsigned char mustWrite[65536];
+    unsigned int walked[65536];         // walk that last visited an address
+    unsigned int walks;
+    unsigned char defined[65536];       // registers written on every path to an address
+} Proof;
+
+// helper for the registers insn reads and writes, as RunFast runs it
+static void RegisterUse(unsigned short int insn, unsigned char* reads, unsigned char* writes) {
+    int d = 1 << ((insn >> 9) & 7), s = 1 << ((insn >> 6) & 7), t = 1 << (insn & 7);
+    int sub = (insn >> 3) & 7;
+    *reads = 0;
+    *writes = 0;
+    switch (insn >> 12) {
+        case 1: case 5:
+            if (insn & 0x20) {
+                *reads = s;
+                *writes = d;
+            } else if (sub < 4) {
+                // NOT reads only s
+                *reads = (insn >> 12) == 5 && sub == 1 ? s : s | t;
+                *writes = d;
+            } else {
+                // left alone, but its flags come from R[d]
+                *reads = d;
+            }
+            break;
+        case 2:
+            *reads = ((insn >> 7) & 3) < 2 ? d | t : d;
+            break;
+        case 4:
+            *reads = (insn & 0x0800) ? 0 : s;
+            *writes = 0x80;
+            break;
+        case 9:
+            *writes = d;
+            break;
+        case 10:
+            *reads = ((insn >> 4) & 3) == 3 ? s | t : s;
+            *writes = d;
+            break;
+        case 12:
+            *reads = (insn & 0x0800) ? 0 : s;
+            break;
+        case 13:
+            *reads = d;
+            *writes = d;
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * Where control goes after the instruction at address within its subroutine:
+ * up to two successors, a callee for JSR/JSRR and whether it returns.
+ * Returns 0 for an instruction that is not pure or whose target is unknown.
+ */
+static int Successors(Proof* P, unsigned short int address, int* next, int* numNext, int* callee, int* exit) {
+    unsigned short int insn = P->CPU->memory[address];
+    unsigned short int after = address + 1;
+    *numNext = 0;
+    *callee = -1;
+    *exit = 0;
+    switch (insn >> 12) {
+        case 0: {
+            int nzp = (insn >> 9) & 7;
+            if (nzp != 7) {
+                next[(*numNext)++] = after;
+            }
+            if (nzp != 0) {
+                next[(*numNext)++] = (unsigned short int)(after + SEXT(insn, 9));
+            }
+            return 1;
+        }
+        case 1: case 2: case 5: case 9: case 10: case 13:
+            next[(*numNext)++] = after;
+            return 1;
+        case 4:
+            *callee = (insn & 0x0800) ? (address & 0x8000) | ((insn & 0x7FF) << 4) : P->A->target[address];
+            next[(*numNext)++] = after;
+            return *callee >= 0;
+        case 12:
+            if (insn & 0x0800) {
+                next[(*numNext)++] = (unsigned short int)(after + SEXT(insn, 11));
+            } else if (P->A->target[address] >= 0) {
+                next[(*numNext)++] = P->A->target[address];
+            } else {
+                *exit = 1;
+            }
+            return 1;
+        default:
+            // LDR, STR, RTI, TRAP and the opcodes that never move the PC
+            return 0;
+    }
+}
+
+// helper to tell whether the code at address can be trusted never to change or stop
+static int Immutable(Proof* P, unsigned short int address) {
+    unsigned char attr = P->CPU->pageAttr[address >> 8];
+    return (attr & (PAGE_EXEC_USER | PAGE_EXEC_OS)) &&
+           !(attr & (PAGE_WRITE_USER | PAGE_WRITE_OS | PAGE_HOOKED)) && !P->breakpoints[address];
+}
+
+// helper to prove the subroutine at entry pure and summarize it, callees first
+static int Prove(Proof* P, unsigned short int entry) {
+    if (P->state[entry] != PROOF_UNKNOWN) {
+        return P->state[entry] == PROOF_PURE;
+    }
+    P->state[entry] = PROOF_ACTIVE;
+
+    // the code reachable without following calls
+    int* body = malloc(65536 * sizeof(int));
+    int* stack = malloc(65536 * sizeof(int));
+    int* callees = malloc(65536 * sizeof(int));
+    int numBody = 0, depth = 0, numCallees = 0, pure = body && stack && callees;
+    unsigned int walk = ++P->walks;
+    if (pure) {
+        stack[depth++] = entry;
+        P->walked[entry] = walk;
+    }
+    while (pure && depth > 0) {
+        int address = stack[--depth];
+        int next[2], numNext, callee, exit;
+        body[numBody++] = address;
+        if (!Immutable(P, address) || !Successors(P, address, next, &numNext, &callee, &exit)) {
+            pure = 0;
+            break;
+        }
+        if (callee >= 0) {
+            callees[numCallees++] = callee;
+        }
+        for (int i = 0; i < numNext; i++) {
+            if (P->walked[next[i]] != walk) {
+                P->walked[next[i]] = walk;
+                stack[depth++] = next[i];
+            }
+        }
+    }
+    for (int i = 0; pure && i < numCallees; i++) {
+        pure = Prove(P, callees[i]);
+    }
+
+    // registers written on every path to each instruction, until nothing changes
+    if (pure) {
+        for (int i = 0; i < numBody; i++) {
+            P->defined[body[i]] = 0xFF;
+        }
+        P->defined[entry] = 0;
+        for (int changed = 1; changed;) {
+            changed = 0;
+            for (int i = 0; i < numBody; i++) {
+                int next[2], numNext, callee, exit;
+                unsigned char reads, writes;
+                Successors(P, body[i], next, &numNext, &callee, &exit);
+                RegisterUse(P->CPU->memory[body[i]], &reads, &writes);
+                unsigned char out = P->defined[body[i]] | writes | (callee >= 0 ? P->mustWrite[callee] : 0);
+                for (int j = 0; j < numNext; j++) {
+                    if ((P->defined[next[j]] & out) != P->defined[next[j]]) {
+                        P->defined[next[j]] &= out;
+                        changed = 1;
+                    }
+                }
+            }
+        }
+
+        // keys: reads of registers not yet written, here or by a callee (which
+        // reads R7 as the return address the JSR set)
+        unsigned char keys = 0, allWrites = 0, must = 0xFF;
+        int exits = 0;
+        for (int i = 0; i < numBody; i++) {
+            int next[2], numNext, callee, exit;
+            unsigned char reads, writes;
+            Successors(P, body[i], next, &numNext, &callee, &exit);
+            RegisterUse(P->CPU->memory[body[i]], &reads, &writes);
+            if (callee >= 0) {
+                reads |= P->keys[callee] & 0x7F;
+                writes |= P->writes[callee];
+            }
+            keys |= reads & ~P->defined[body[i]];
+            allWrites |= writes;
+            if (exit) {
+                must &= P->defined[body[i]];
+                exits++;
+            }
+        }
+        // a register written on only some paths may still hold its input
+        keys |= allWrites & ~must;
+
+        P->keys[entry] = keys;
+        P->writes[entry] = allWrites;
+        P->mustWrite[entry] = must;
+        for (int i = 0; i < numBody; i++) {
+            int next[2], numNext, callee, exit;
+            Successors(P, body[i], next, &numNext, &callee, &exit);
+            P->M->exit[body[i]] |= exit;
+        }
+        // code that never returns has no result to cache
+        pure = exits > 0;
+    }
+    free(body);
+    free(stack);
+    free(callees);
+
+    P->state[entry] = pure ? PROOF_PURE : PROOF_IMPURE;
+    return pure;
+}
+
+int PrepareMemo(MachineState* CPU, CodeAnalysis* A, const unsigned char* breakpoints, MemoTable* M) {
+    memset(M, 0, sizeof(MemoTable));
+    Proof* P = calloc(1, sizeof(Proof));
+    if (P == NULL) {
+        fprintf(stderr, "Error: Out of memory for memoization\n");
+        return -1;
+    }
+    P->CPU = CPU;
+    P->A = A;
+    P->breakpoints = breakpoints;
+    P->M = M;
+
+    // the JSR and JSRR targets, from the call graph
+    for (int i = 0; i < A->numCalls; i++) {
+        unsigned short int callee = A->calls[i].callee;
+        unsigned short int site = A->calls[i].site;
+        if ((CPU->memory[site] >> 12) != 4 || !Prove(P, callee) || M->function[callee] != 0 ||
+            M->numFunctions == MEMO_MAX_FUNCTIONS) {
+            continue;
+        }
+        MemoFunction* function = &M->functions[M->numFunctions++];
+        function->entry = callee;
+        function->keys = P->keys[callee];
+        function->writes = P->writes[callee];
+        M->function[callee] = M->numFunctions;
+    }
+    free(P);
+    return M->numFunctions;
+}
+
+// helper for the slot of a call, from its entry PSR and key registers
+static MemoEntry* MemoSlot(MemoTable* M, int function, const unsigned short int* R, unsigned short int PSR) {
+    unsigned char keys = M->functions[function - 1].keys;
+    unsigned int h = function * 0x9E3779B1u ^ PSR;
+    for (int r = 0; r < 8; r++) {
+        if (keys & (1 << r)) {
+            h = (h ^ R[r]) * 0x85EBCA6Bu;
+        }
+    }
+    h ^= h >> 15;
+    return &M->entries[h & (MEMO_ENTRIES - 1)];
+}
+
+// helper to compare a slot with a call
+static int MemoMatches(MemoEntry* slot, int function, unsigned char keys, const unsigned short int* R,
+                       unsigned short int PSR) {
+    if (slot->function != function || slot->PSR != PSR) {
+        return 0;
+    }
+    for (int r = 0; r < 8; r++) {
+        if ((keys & (1 << r)) && slot->R[r] != R[r]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+unsigned long long EnterMemo(MemoTable* M, MemoCall* call, unsigned short int* R, unsigned short int* PSR,
+                             unsigned short int* PC, unsigned long long count, unsigned long long room) {
+    // a call nested in a recording has to come back to the next instruction
+    unsigned short int back = R[7];
+    if (call->function != 0) {
+        if (call->depth == MEMO_MAX_DEPTH) {
+            call->function = 0;
+        } else {
+            call->returns[call->depth++] = back;
+        }
+    }
+
+    int function = M->function[*PC];
+    if (function == 0) {
+        return 0;
+    }
+    MemoFunction* f = &M->functions[function - 1];
+    MemoEntry* slot = MemoSlot(M, function, R, *PSR);
+    if (MemoMatches(slot, function, f->keys, R, *PSR) && slot->instructions <= room) {
+        for (int r = 0; r < 8; r++) {
+            if (f->writes & (1 << r)) {
+                R[r] = slot->outR[r];
+            }
+        }
+        *PSR = slot->outPSR;
+        *PC = slot->outPC;
+        f->hits++;
+        M->replayed += slot->instructions;
+        if (call->function != 0) {
+            call->depth--;
+            if (*PC != back) {
+                call->function = 0;
+            }
+        }
+        return slot->instructions;
+    }
+
+    f->misses++;
+    if (call->function == 0) {
+        call->function = function;
+        call->start = count;
+        call->PSR = *PSR;
+        memcpy(call->R, R, sizeof(call->R));
+        call->depth = 0;
+    }
+    return 0;
+}
+
+void ExitMemo(MemoTable* M, MemoCall* call, unsigned short int* R, unsigned short int PSR, unsigned short int PC,
+              unsigned long long count) {
+    if (call->depth > 0) {
+        if (call->returns[--call->depth] != PC) {
+            call->function = 0;
+        }
+        return;
+    }
+    MemoEntry* slot = MemoSlot(M, call->function, call->R, call->PSR);
+    slot->function = call->function;
+    slot->PSR = call->PSR;
+    memcpy(slot->R, call->R, sizeof(slot->R));
+    slot->outPSR = PSR;
+    slot->outPC = PC;
+    memcpy(slot->outR, R, sizeof(slot->outR));
+    slot->instructions = count - call->start;
+    call->function = 0;
+}
+
+void PrintMemoReport(MemoTable* M, ObjectInfo* info, FILE* output) {
+    fprintf(output, "Memoized %d pure subroutines, %llu instructions replayed\n", M->numFunctions, M->replayed);
+    for (int i = 0; i < M->numFunctions; i++) {
+        MemoFunction* f = &M->functions[i];
+        const char* name = SymbolAt(info, f->entry);
+        char keys[32] = "";
+        for (int r = 0; r < 8; r++) {
+            if (f->keys & (1 << r)) {
+                snprintf(keys + strlen(keys), sizeof(keys) - strlen(keys), " R%d", r);
+            }
+        }
+        fprintf(output, "  %04X %-16s %10llu hits %10llu misses, keys%s\n", f->entry, name ? name : "", f->hits,
+                f->misses, keys[0] ? keys : " none");
+    }
+}
@@ -0,0 +1,94 @@
+/*
+ * memo.h: Declares memoization of pure guest subroutines for the fast engine
+ */
+
+#ifndef MEMO_H
+#define MEMO_H
+
+#include <stdio.h>
+#include "analysis.h"
+
+// Results kept, direct mapped (a power of two)
+#define MEMO_ENTRIES 4096
+
+// Most pure subroutines memoized, the rest still run every time
+#define MEMO_MAX_FUNCTIONS 256
+
+// Calls nested inside a subroutine being recorded
+#define MEMO_MAX_DEPTH 16
+
+// A subroutine proven pure: no LDR, STR, TRAP or RTI in it or anything it calls
+typedef struct {
+    unsigned short int entry;
+    unsigned char keys;                 // registers its result depends on
+    unsigned char writes;               // registers it may change
+    unsigned long long hits;
+    unsigned long long misses;
+} MemoFunction;
+
+// The result of one call, keyed by the entry PSR and the key registers
+typedef struct {
+    unsigned short int function;        // index + 1 into MemoTable.functions, 0 when empty
+    unsigned short int PSR;
+    unsigned short int R[8];
+    unsigned short int outPSR;
+    unsigned short int outPC;
+    unsigned short int outR[8];
+    unsigned long long instructions;    // from after the JSR through the return
+} MemoEntry;
+
+typedef struct {
+    unsigned short int function[65536]; // index + 1 of the subroutine starting here, 0 for none
+    unsigned char exit[65536];          // JMPRs without a static target in pure code: returns
+    MemoFunction functions[MEMO_MAX_FUNCTIONS];
+    int numFunctions;
+    MemoEntry entries[MEMO_ENTRIES];
+    unsigned long long replayed;        // instructions skipped by hits
+} MemoTable;
+
+// A call RunFast is recording, from the JSR to the matching return
+typedef struct {
+    int function;                       // index + 1, 0 when not recording
+    unsigned long long start;           // instruction count after the JSR
+    unsigned short int PSR;
+    unsigned short int R[8];
+    int depth;                          // calls made by it that have not returned
+    unsigned short int returns[MEMO_MAX_DEPTH];
+} MemoCall;
+
+/*
+ * Find the pure subroutines among the JSR targets of the analysed image.
+ * Each is proven over the call graph, callees first, and recursion is
+ * never pure. Its code must sit on executable pages no STR can write and
+ * hold no breakpoint. A register dataflow gives the registers read before
+ * being written (the keys), those written, and which of them are written on
+ * every path to a return; any register written on only some paths is a key
+ * too, so the keys decide every register the call leaves behind.
+ * Returns the number of subroutines memoized.
+ */
+int PrepareMemo(MachineState* CPU, CodeAnalysis* A, const unsigned char* breakpoints, MemoTable* M);
+
+/*
+ * Called by RunFast after a JSR to *PC, with count including the JSR and the
+ * PSR flags worked out. Replays a cached result that fits in room
+ * instructions, updating R, *PSR and *PC and returning the instructions it
+ * stands for, or returns 0 and starts recording into call if not already.
+ * While recording, the return address of every nested call is remembered.
+ */
+unsigned long long EnterMemo(MemoTable* M, MemoCall* call, unsigned short int* R, unsigned short int* PSR,
+                             unsigned short int* PC, unsigned long long count, unsigned long long room);
+
+/*
+ * Called by RunFast after an exit JMPR while recording. A nested call must
+ * return where it was called from, or the recording is dropped; the
+ * recorded call itself is stored with count including the JMPR.
+ */
+void ExitMemo(MemoTable* M, MemoCall* call, unsigned short int* R, unsigned short int PSR, unsigned short int PC,
+              unsigned long long count);
+
+/*
+ * Print each memoized subroutine with its keys, hits and misses.
+ */
+void PrintMemoReport(MemoTable* M, ObjectInfo* info, FILE* output);
+
+#endif
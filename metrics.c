@@ -0,0 +1,437 @@
+/*
+ * metrics.c: Defines run-level metrics records, written as NDJSON and Prometheus text
+ */
+
+#include "metrics.h"
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char* faultNames[METRICS_FAULTS] = {"exec", "read", "write"};
+static const char* engineNames[METRICS_ENGINES] = {"traced", "fast", "batch"};
+
+// opcodes 3, 11 and 14 do nothing but are still fetched and counted
+static const char* opcodeNames[16] = {
+    "br", "arith", "cmp", "op3", "jsr", "logic", "ldr", "str",
+    "rti", "const", "shift", "op11", "jmp", "hiconst", "op14", "trap"
+};
+
+// A family of series in the text file, with its help line
+typedef struct {
+    const char* name;
+    const char* help;
+} MetricFamily;
+
+static const MetricFamily families[] = {
+    {"lc4_runs_total", "Instances run, by how they ended"},
+    {"lc4_faults_total", "Instances that faulted, by the access denied"},
+    {"lc4_instructions_total", "Guest instructions executed"},
+    {"lc4_opcode_instructions_total", "Guest instructions executed, by opcode class"},
+    {"lc4_engine_seconds_total", "Host seconds spent executing, by engine"},
+    {"lc4_load_seconds_total", "Host seconds spent loading object files"},
+    {"lc4_trace_bytes_total", "Trace bytes written"},
+};
+
+
+void InitMetrics(RunMetrics* metrics, const char* kind, const char* program) {
+    memset(metrics, 0, sizeof(RunMetrics));
+    metrics->kind = kind;
+    metrics->program = program != NULL ? program : "";
+}
+
+void CountOutcome(RunMetrics* metrics, int status, unsigned char access) {
+    metrics->instances++;
+    if (status >= 0 && status < METRICS_OUTCOMES) {
+        metrics->outcomes[status]++;
+    }
+    if (access == PAGE_EXEC_USER) {
+        metrics->faults[FAULT_EXEC]++;
+    } else if (access == PAGE_READ_USER) {
+        metrics->faults[FAULT_READ]++;
+    } else if (access == PAGE_WRITE_USER) {
+        metrics->faults[FAULT_WRITE]++;
+    }
+}
+
+double ElapsedSeconds(unsigned long long start, unsigned long long end) {
+    return end > start ? (end - start) / 1e9 : 0.0;
+}
+
+// helper to write text as the inside of a quoted JSON string or label value
+static void WriteQuoted(FILE* output, const char* text, int json) {
+    for (const unsigned char* c = (const unsigned char*)text; *c != '\0'; c++) {
+        if (*c == '\\' || *c == '"') {
+            fprintf(output, "\\%c", *c);
+        } else if (*c == '\n') {
+            fputs("\\n", output);
+        } else if (*c < 0x20 && json) {
+            fprintf(output, "\\u%04X", *c);
+        } else {
+            fputc(*c, output);
+        }
+    }
+}
+
+// helper to write a JSON object of the counts, named by names
+static void WriteCounts(FILE* output, const char* key, const char** names, const unsigned long long* counts,
+                        int count) {
+    fprintf(output, ",\"%s\":{", key);
+    for (int i = 0; i < count; i++) {
+        fprintf(output, "%s\"%s\":%llu", i ? "," : "", names[i], counts[i]);
+    }
+    fputc('}', output);
+}
+
+int AppendMetricsJson(const char* filename, const RunMetrics* metrics) {
+    char* line = NULL;
+    size_t length = 0;
+    FILE* output = open_memstream(&line, &length);
+    if (output == NULL) {
+        fprintf(stderr, "Error: Out of memory for a metrics record\n");
+        return -1;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    unsigned long long classified = 0;
+    for (int i = 0; i < 16; i++) {
+        classified += metrics->opcodes[i];
+    }
+    fprintf(output, "{\"time\":%lld.%03ld,\"kind\":\"%s\",\"program\":\"", (long long)now.tv_sec,
+            now.tv_nsec / 1000000, metrics->kind);
+    WriteQuoted(output, metrics->program, 1);
+    fprintf(output, "\",\"instances\":%d", metrics->instances);
+    const char* outcomeNames[METRICS_OUTCOMES];
+    for (int i = 0; i < METRICS_OUTCOMES; i++) {
+        outcomeNames[i] = RunStatusName(i);
+    }
+    WriteCounts(output, "outcomes", outcomeNames, metrics->outcomes, METRICS_OUTCOMES);
+    WriteCounts(output, "faults", faultNames, metrics->faults, METRICS_FAULTS);
+    fprintf(output, ",\"instructions\":%llu", metrics->instructions);
+    WriteCounts(output, "opcodes", opcodeNames, metrics->opcodes, 16);
+    fprintf(output, ",\"unclassified\":%llu,\"load_seconds\":%.6f,\"engine_seconds\":{",
+            metrics->instructions > classified ? metrics->instructions - classified : 0, metrics->loadSeconds);
+    for (int i = 0; i < METRICS_ENGINES; i++) {
+        fprintf(output, "%s\"%s\":%.6f", i ? "," : "", engineNames[i], metrics->engineSeconds[i]);
+    }
+    fprintf(output, "},\"trace_bytes\":%llu}\n", metrics->traceBytes);
+    fclose(output);
+
+    // one write to a descriptor opened for appending lands in one piece
+    int fd = open(filename, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Could not open file %s\n", filename);
+        free(line);
+        return -1;
+    }
+    ssize_t written = write(fd, line, length);
+    close(fd);
+    free(line);
+    if (written != (ssize_t)length) {
+        fprintf(stderr, "Error: Could not write file %s\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+// helper for the length of the metric name at the start of a series
+static size_t FamilyLength(const char* series) {
+    return strcspn(series, "{ ");
+}
+
+// helper to hash a series, FNV-1a
+static unsigned long long HashSeries(const char* series) {
+    unsigned long long hash = 0xCBF29CE484222325ULL;
+    for (const unsigned char* c = (const unsigned char*)series; *c != '\0'; c++) {
+        hash = (hash ^ *c) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+// helper to find the index entry of series, or the free one it would take
+static int* FindSeries(MetricSamples* S, const char* series) {
+    unsigned int mask = S->indexSize - 1;
+    for (unsigned int at = HashSeries(series) & mask;; at = (at + 1) & mask) {
+        if (S->index[at] < 0 || strcmp(S->samples[S->index[at]].series, series) == 0) {
+            return &S->index[at];
+        }
+    }
+}
+
+// helper to rebuild the index at size entries; returns -1 when out of memory
+static int ResizeIndex(MetricSamples* S, int size) {
+    int* index = malloc(size * sizeof(int));
+    if (index == NULL) {
+        return -1;
+    }
+    free(S->index);
+    S->index = index;
+    S->indexSize = size;
+    memset(index, 0xFF, size * sizeof(int));
+    for (int i = 0; i < S->count; i++) {
+        *FindSeries(S, S->samples[i].series) = i;
+    }
+    return 0;
+}
+
+// helper to add value to series, appending it if new; returns -1 when out
+// of memory
+static int AddSample(MetricSamples* S, const char* series, double value) {
+    if (2 * (S->count + 1) > S->indexSize && ResizeIndex(S, S->indexSize ? 2 * S->indexSize : 128) != 0) {
+        return -1;
+    }
+    int* entry = FindSeries(S, series);
+    if (*entry >= 0) {
+        S->samples[*entry].value += value;
+        return 0;
+    }
+    if (S->count == S->capacity) {
+        int capacity = S->capacity ? 2 * S->capacity : 64;
+        MetricSample* samples = realloc(S->samples, capacity * sizeof(MetricSample));
+        if (samples == NULL) {
+            return -1;
+        }
+        S->samples = samples;
+        S->capacity = capacity;
+    }
+    char* copy = strdup(series);
+    if (copy == NULL) {
+        return -1;
+    }
+    S->samples[S->count].series = copy;
+    S->samples[S->count].value = value;
+    *entry = S->count++;
+    return 0;
+}
+
+// helper to add one sample of the record: family{kind,program[,label="value"]}
+static int AddRecordSample(MetricSamples* S, const RunMetrics* metrics, const char* family, const char* label,
+                           const char* labelValue, double value) {
+    char* series = NULL;
+    size_t length = 0;
+    FILE* output = open_memstream(&series, &length);
+    if (output == NULL) {
+        return -1;
+    }
+    fprintf(output, "%s{kind=\"%s\",program=\"", family, metrics->kind);
+    WriteQuoted(output, metrics->program, 0);
+    fputc('"', output);
+    if (label != NULL) {
+        fprintf(output, ",%s=\"%s\"", label, labelValue);
+    }
+    fputc('}', output);
+    fclose(output);
+    int result = AddSample(S, series, value);
+    free(series);
+    return result;
+}
+
+// helper to read the samples of an existing text file, skipping comments
+static int ReadSamples(FILE* input, MetricSamples* S) {
+    char* line = NULL;
+    size_t size = 0;
+    int result = 0;
+    while (result == 0 && getline(&line, &size, input) != -1) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char* space = strrchr(line, ' ');
+        if (line[0] == '#' || space == NULL) {
+            continue;
+        }
+        *space = '\0';
+        result = AddSample(S, line, strtod(space + 1, NULL));
+    }
+    free(line);
+    return result;
+}
+
+// helper to tell whether two series belong to the same family
+static int SameFamily(const char* a, const char* b) {
+    size_t family = FamilyLength(a);
+    return FamilyLength(b) == family && strncmp(a, b, family) == 0;
+}
+
+// helper to write the samples, each family under its HELP and TYPE lines, in
+// the order the families and their samples were first added; returns -1
+// when out of memory
+static int WriteSamples(FILE* output, MetricSamples* S) {
+    // the first sample of each family; there are only a handful of families
+    int* firsts = malloc((S->count + 1) * sizeof(int));
+    if (firsts == NULL) {
+        return -1;
+    }
+    int familyCount = 0;
+    for (int i = 0; i < S->count; i++) {
+        int f = 0;
+        while (f < familyCount && !SameFamily(S->samples[firsts[f]].series, S->samples[i].series)) {
+            f++;
+        }
+        if (f == familyCount) {
+            firsts[familyCount++] = i;
+        }
+    }
+
+    for (int f = 0; f < familyCount; f++) {
+        const char* first = S->samples[firsts[f]].series;
+        size_t family = FamilyLength(first);
+        const char* help = NULL;
+        for (size_t k = 0; k < sizeof(families) / sizeof(families[0]); k++) {
+            if (strlen(families[k].name) == family && strncmp(families[k].name, first, family) == 0) {
+                help = families[k].help;
+            }
+        }
+        if (help != NULL) {
+            fprintf(output, "# HELP %.*s %s\n", (int)family, first, help);
+        }
+        fprintf(output, "# TYPE %.*s %s\n", (int)family, first, help != NULL ? "counter" : "untyped");
+
+        for (int i = firsts[f]; i < S->count; i++) {
+            const char* series = S->samples[i].series;
+            if (!SameFamily(first, series)) {
+                continue;
+            }
+            double value = S->samples[i].value;
+            if (value >= 0 && value < 1e18 && value == (double)(unsigned long long)value) {
+                fprintf(output, "%s %llu\n", series, (unsigned long long)value);
+            } else {
+                fprintf(output, "%s %.9g\n", series, value);
+            }
+        }
+    }
+    free(firsts);
+    return 0;
+}
+
+// helper to open and lock filename, retrying while another writer renames
+// a new file into place; returns the descriptor or -1
+static int LockMetricsFile(const char* filename) {
+    for (;;) {
+        int fd = open(filename, O_RDONLY | O_CREAT, 0644);
+        if (fd < 0) {
+            return -1;
+        }
+        struct stat locked, current;
+        if (flock(fd, LOCK_EX) != 0 || fstat(fd, &locked) != 0) {
+            close(fd);
+            return -1;
+        }
+        if (stat(filename, &current) == 0 && current.st_ino == locked.st_ino && current.st_dev == locked.st_dev) {
+            return fd;
+        }
+        close(fd);
+    }
+}
+
+int AddMetricSamples(MetricSamples* S, const RunMetrics* metrics) {
+    int result = 0;
+    for (int i = 0; result == 0 && i < METRICS_OUTCOMES; i++) {
+        if (metrics->outcomes[i] != 0) {
+            result = AddRecordSample(S, metrics, "lc4_runs_total", "outcome", RunStatusName(i), metrics->outcomes[i]);
+        }
+    }
+    for (int i = 0; result == 0 && i < METRICS_FAULTS; i++) {
+        if (metrics->faults[i] != 0) {
+            result = AddRecordSample(S, metrics, "lc4_faults_total", "access", faultNames[i], metrics->faults[i]);
+        }
+    }
+    if (result == 0) {
+        result = AddRecordSample(S, metrics, "lc4_instructions_total", NULL, NULL, metrics->instructions);
+    }
+    for (int i = 0; result == 0 && i < 16; i++) {
+        if (metrics->opcodes[i] != 0) {
+            result = AddRecordSample(S, metrics, "lc4_opcode_instructions_total", "class", opcodeNames[i],
+                                     metrics->opcodes[i]);
+        }
+    }
+    for (int i = 0; result == 0 && i < METRICS_ENGINES; i++) {
+        if (metrics->engineSeconds[i] != 0) {
+            result = AddRecordSample(S, metrics, "lc4_engine_seconds_total", "engine", engineNames[i],
+                                     metrics->engineSeconds[i]);
+        }
+    }
+    if (result == 0) {
+        result = AddRecordSample(S, metrics, "lc4_load_seconds_total", NULL, NULL, metrics->loadSeconds);
+    }
+    if (result == 0) {
+        result = AddRecordSample(S, metrics, "lc4_trace_bytes_total", NULL, NULL, metrics->traceBytes);
+    }
+    if (result != 0) {
+        fprintf(stderr, "Error: Out of memory for metrics samples\n");
+    }
+    return result;
+}
+
+int FlushMetricSamples(const char* filename, MetricSamples* S) {
+    int fd = LockMetricsFile(filename);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Could not open file %s\n", filename);
+        FreeMetricSamples(S);
+        return -1;
+    }
+    MetricSamples F = {NULL, 0, 0};
+    int dupped = dup(fd);
+    FILE* input = dupped >= 0 ? fdopen(dupped, "r") : NULL;
+    int result = input != NULL ? ReadSamples(input, &F) : -1;
+    if (input != NULL) {
+        fclose(input);
+    } else if (dupped >= 0) {
+        close(dupped);
+    }
+    for (int i = 0; result == 0 && i < S->count; i++) {
+        result = AddSample(&F, S->samples[i].series, S->samples[i].value);
+    }
+    if (result != 0) {
+        fprintf(stderr, "Error: Could not read metrics file %s\n", filename);
+    }
+
+    // a scraper reading the file sees the old or the new one, never half of one
+    char temporary[4096];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", filename);
+    FILE* output = result == 0 ? fopen(temporary, "w") : NULL;
+    if (output != NULL) {
+        int written = WriteSamples(output, &F);
+        if (fclose(output) != 0 || written != 0 || rename(temporary, filename) != 0) {
+            fprintf(stderr, "Error: Could not write file %s\n", filename);
+            unlink(temporary);
+            result = -1;
+        }
+    } else if (result == 0) {
+        fprintf(stderr, "Error: Could not open file %s\n", temporary);
+        result = -1;
+    }
+
+    FreeMetricSamples(&F);
+    FreeMetricSamples(S);
+    close(fd);
+    return result;
+}
+
+void FreeMetricSamples(MetricSamples* S) {
+    for (int i = 0; i < S->count; i++) {
+        free(S->samples[i].series);
+    }
+    free(S->samples);
+    free(S->index);
+    memset(S, 0, sizeof(MetricSamples));
+}
+
+int AddMetricsText(const char* filename, const RunMetrics* metrics) {
+    MetricSamples S = {NULL, 0, 0};
+    if (AddMetricSamples(&S, metrics) != 0) {
+        FreeMetricSamples(&S);
+        return -1;
+    }
+    return FlushMetricSamples(filename, &S);
+}
+
+int WriteMetrics(const char* jsonName, const char* textName, const RunMetrics* metrics) {
+    int result = 0;
+    if (jsonName != NULL && AppendMetricsJson(jsonName, metrics) != 0) {
+        result = -1;
+    }
+    if (textName != NULL && AddMetricsText(textName, metrics) != 0) {
+        result = -1;
+    }
+    return result;
+}
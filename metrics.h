@@ -0,0 +1,115 @@
+/*
+ * metrics.h: Declares run-level metrics records, written as NDJSON and Prometheus text
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include "LC4.h"
+#include "engine.h"
+
+// Engines a run's host time is split between
+#define ENGINE_TRACED 0 // UpdateMachineState, one step at a time
+#define ENGINE_FAST   1 // RunFast
+#define ENGINE_BATCH  2 // RunBatch
+#define METRICS_ENGINES 3
+
+// Ways an instance can end, indexed by RUN_BREAKPOINT (a halt) through RUN_LOOP
+#define METRICS_OUTCOMES RUN_STATUSES
+
+// Kinds of denied access: instruction fetch, LDR and STR
+#define FAULT_EXEC  0
+#define FAULT_READ  1
+#define FAULT_WRITE 2
+#define METRICS_FAULTS 3
+
+/*
+ * What one run, batch job or daemon request did. A batch counts each of its
+ * instances in outcomes and faults; a run or request counts one.
+ */
+typedef struct {
+    const char* kind;                               // "run", "batch" or "daemon"
+    const char* program;                            // the last file loaded, the one after the OS
+    int instances;
+    unsigned long long outcomes[METRICS_OUTCOMES];
+    unsigned long long faults[METRICS_FAULTS];
+    unsigned long long instructions;
+    // by opcode (insn >> 12); instructions a loop skip, a native TRAP
+    // routine or a memoized call stands for are in no class
+    unsigned long long opcodes[16];
+    double loadSeconds;                             // in LoadProgramFile, 0 for a cached image
+    double engineSeconds[METRICS_ENGINES];
+    unsigned long long traceBytes;
+} RunMetrics;
+
+// One sample of the text file: the series as written, name and labels, and its value
+typedef struct {
+    char* series;
+    double value;
+} MetricSample;
+
+// Samples to add to a text file, in the order first added, with a hash
+// index of their series; {NULL, 0, 0} is empty
+typedef struct {
+    MetricSample* samples;
+    int count;
+    int capacity;
+    int* index;                         // sample numbers by series hash, -1 for free
+    int indexSize;                      // a power of two, over twice count
+} MetricSamples;
+
+/*
+ * Start a record of one instance of kind running program.
+ */
+void InitMetrics(RunMetrics* metrics, const char* kind, const char* program);
+
+/*
+ * Count an instance ending with status (a RUN_* code). For RUN_FAULT,
+ * access is the PAGE_*_USER bit that MachineState.fault recorded.
+ */
+void CountOutcome(RunMetrics* metrics, int status, unsigned char access);
+
+/*
+ * Seconds between two MonotonicNanoseconds readings.
+ */
+double ElapsedSeconds(unsigned long long start, unsigned long long end);
+
+/*
+ * Append the record to filename as one line of JSON. Lines from concurrent
+ * writers never interleave. Returns 0, or -1 after printing an error.
+ */
+int AppendMetricsJson(const char* filename, const RunMetrics* metrics);
+
+/*
+ * Add the record to the samples S in memory, each series labelled with the
+ * kind and the program. Returns 0, or -1 after printing an error.
+ */
+int AddMetricSamples(MetricSamples* S, const RunMetrics* metrics);
+
+/*
+ * Add the samples S to the counters in the Prometheus text file filename,
+ * creating it if needed, and empty S. The file is rewritten under an
+ * exclusive lock and renamed into place, so concurrent writers add up and
+ * a reader always sees a whole file. Returns 0, or -1 after printing an
+ * error.
+ */
+int FlushMetricSamples(const char* filename, MetricSamples* S);
+
+/*
+ * Free the samples S, leaving it empty.
+ */
+void FreeMetricSamples(MetricSamples* S);
+
+/*
+ * Add the record to the Prometheus text file filename at once, so the file
+ * sums all runs of each program. Returns 0, or -1 after printing an error.
+ */
+int AddMetricsText(const char* filename, const RunMetrics* metrics);
+
+/*
+ * Both of the above for whichever file names are not NULL.
+ */
+int WriteMetrics(const char* jsonName, const char* textName, const RunMetrics* metrics);
+
+#endif
@@ -0,0 +1,300 @@
+/*
+ * multicore.c: Defines the shared-memory multi-core system simulation
+ */
+
+#include "multicore.h"
+#include "engine.h"
+#include <pthread.h>
+
+// Store log entries a core starts with; the log doubles as needed
+#define STORE_LOG_START 1024
+
+// One store, replayed into the other cores' memory
+typedef struct {
+    unsigned short int address;
+    unsigned short int value;
+} StoreEntry;
+
+typedef struct System System;
+
+// One core: a full machine whose memory is kept equal to the shared memory
+// apart from its own stores not yet published
+typedef struct {
+    MachineState machine;
+    System* system;
+    int index;
+    pthread_t thread;
+    FILE* output;
+
+    StoreEntry* log;                // stores since the last publish
+    int logCount;
+    int logSize;
+
+    int live;
+    int status;
+    unsigned long long instructions;
+} Core;
+
+struct System {
+    Core* cores[MULTICORE_MAX_CORES];
+    MulticoreConfig config;
+
+    // MODEL_SC: whose turn it is; the lock also guards start and failed
+    pthread_mutex_t lock;
+    pthread_cond_t turnChanged;
+    int turn;
+
+    // set once every thread is created: 1 to run, -1 when one could not be
+    int start;
+
+    // MODEL_TSO: quantum boundaries
+    pthread_barrier_t barrier;
+
+    int stop;                       // every core has finished
+    int failed;                     // out of memory for a store log
+};
+
+// helper for a core thread to wait until all the others exist; returns 0
+// to run, or -1 when a thread could not be created and nobody runs
+static int AwaitStart(System* system) {
+    pthread_mutex_lock(&system->lock);
+    while (system->start == 0) {
+        pthread_cond_wait(&system->turnChanged, &system->lock);
+    }
+    int start = system->start;
+    pthread_mutex_unlock(&system->lock);
+    return start > 0 ? 0 : -1;
+}
+
+// helper to remember a store for the other cores
+static int LogStore(Core* core, unsigned short int address, unsigned short int value) {
+    if (core->logCount == core->logSize) {
+        int size = core->logSize * 2;
+        StoreEntry* log = realloc(core->log, size * sizeof(StoreEntry));
+        if (log == NULL) {
+            return -1;
+        }
+        core->log = log;
+        core->logSize = size;
+    }
+    core->log[core->logCount].address = address;
+    core->log[core->logCount].value = value;
+    core->logCount++;
+    return 0;
+}
+
+// helper to run one core for a quantum, or until it stops
+static void RunQuantum(Core* core) {
+    System* system = core->system;
+    MachineState* M = &core->machine;
+    for (unsigned long long i = 0; i < system->config.quantum; i++) {
+        if (M->PC == 0x80FF) {
+            core->live = 0;
+            core->status = RUN_BREAKPOINT;
+            return;
+        }
+        if (system->config.maxInstructions != 0 && core->instructions >= system->config.maxInstructions) {
+            core->live = 0;
+            core->status = RUN_BUDGET;
+            return;
+        }
+
+        unsigned short int insn = M->memory[M->PC];
+        if (UpdateMachineState(M, core->output) != 0) {
+            core->live = 0;
+            core->status = RUN_FAULT;
+            return;
+        }
+        core->instructions++;
+
+        // STR leaves its address and value in the trace fields
+        if ((insn >> 12) == 7 && LogStore(core, M->dmemAddr, M->dmemValue) != 0) {
+            core->live = 0;
+            core->status = RUN_FAULT;
+            pthread_mutex_lock(&system->lock);
+            system->failed = 1;
+            pthread_mutex_unlock(&system->lock);
+            return;
+        }
+    }
+}
+
+// helper to replay a core's logged stores into another core's memory
+static void Replay(Core* from, Core* to) {
+    for (int i = 0; i < from->logCount; i++) {
+        to->machine.memory[from->log[i].address] = from->log[i].value;
+    }
+}
+
+// helper to stop every live core once the deadline passes; returns 1 if
+// no core is left running
+static int Finished(System* system) {
+    int timedOut = system->config.deadline != 0 && MonotonicNanoseconds() >= system->config.deadline;
+    int live = 0;
+    for (int i = 0; i < system->config.cores; i++) {
+        Core* core = system->cores[i];
+        if (core->live && timedOut) {
+            core->live = 0;
+            core->status = RUN_TIMEOUT;
+        }
+        live += core->live;
+    }
+    return live == 0;
+}
+
+// helper for a MODEL_SC core thread: wait for the turn, run, publish the
+// stores to every other core and pass the turn on
+static void* RunSequential(void* argument) {
+    Core* core = argument;
+    System* system = core->system;
+    int cores = system->config.cores;
+    if (AwaitStart(system) != 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&system->lock);
+    for (;;) {
+        while (system->turn != core->index && !system->stop) {
+            pthread_cond_wait(&system->turnChanged, &system->lock);
+        }
+        if (system->stop) {
+            break;
+        }
+        // the others are all waiting, so their memory can be written
+        pthread_mutex_unlock(&system->lock);
+        RunQuantum(core);
+        for (int i = 0; i < cores; i++) {
+            if (i != core->index) {
+                Replay(core, system->cores[i]);
+            }
+        }
+        core->logCount = 0;
+        pthread_mutex_lock(&system->lock);
+
+        if (Finished(system)) {
+            system->stop = 1;
+        } else {
+            int next = core->index;
+            do {
+                next = (next + 1) % cores;
+            } while (!system->cores[next]->live);
+            system->turn = next;
+        }
+        pthread_cond_broadcast(&system->turnChanged);
+    }
+    pthread_mutex_unlock(&system->lock);
+    return NULL;
+}
+
+// helper for a MODEL_TSO core thread: run every quantum alongside the
+// others, then bring memory up to date with all cores' stores in core order
+static void* RunBuffered(void* argument) {
+    Core* core = argument;
+    System* system = core->system;
+    int cores = system->config.cores;
+    if (AwaitStart(system) != 0) {
+        return NULL;
+    }
+
+    for (;;) {
+        if (core->live) {
+            RunQuantum(core);
+        }
+        pthread_barrier_wait(&system->barrier);
+
+        // each core only writes its own memory and the logs are left alone
+        // until everyone has replayed them
+        for (int i = 0; i < cores; i++) {
+            Replay(system->cores[i], core);
+        }
+        if (core->index == 0) {
+            system->stop = Finished(system);
+        }
+        pthread_barrier_wait(&system->barrier);
+
+        core->logCount = 0;
+        if (system->stop) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+int RunMulticore(MachineState* image, MulticoreConfig* config, FILE** outputs, int* status,
+                 unsigned long long* instructions, unsigned short int* PC) {
+    if (config->cores < 1 || config->cores > MULTICORE_MAX_CORES || config->quantum == 0) {
+        fprintf(stderr, "Error: A system has 1 to %d cores and a quantum of at least 1\n", MULTICORE_MAX_CORES);
+        return -1;
+    }
+
+    System system;
+    memset(&system, 0, sizeof(System));
+    system.config = *config;
+    int result = 0;
+    for (int i = 0; i < config->cores && result == 0; i++) {
+        Core* core = calloc(1, sizeof(Core));
+        if (core == NULL || (core->log = malloc(STORE_LOG_START * sizeof(StoreEntry))) == NULL) {
+            free(core);
+            result = -1;
+            break;
+        }
+        system.cores[i] = core;
+        core->machine = *image;
+        core->machine.R[0] = i;
+        core->system = &system;
+        core->index = i;
+        core->output = outputs[i];
+        core->logSize = STORE_LOG_START;
+        core->live = 1;
+    }
+
+    if (result == 0) {
+        pthread_mutex_init(&system.lock, NULL);
+        pthread_cond_init(&system.turnChanged, NULL);
+        pthread_barrier_init(&system.barrier, NULL, config->cores);
+        void* (*body)(void*) = config->model == MODEL_TSO ? RunBuffered : RunSequential;
+        int started = 0;
+        for (; started < config->cores; started++) {
+            if (pthread_create(&system.cores[started]->thread, NULL, body, system.cores[started]) != 0) {
+                break;
+            }
+        }
+        // the started cores would wait at the barrier or for their turn
+        // forever without the rest, so they are told to give up instead
+        pthread_mutex_lock(&system.lock);
+        system.start = started == config->cores ? 1 : -1;
+        pthread_cond_broadcast(&system.turnChanged);
+        pthread_mutex_unlock(&system.lock);
+        for (int i = 0; i < started; i++) {
+            pthread_join(system.cores[i]->thread, NULL);
+        }
+        pthread_barrier_destroy(&system.barrier);
+        pthread_cond_destroy(&system.turnChanged);
+        pthread_mutex_destroy(&system.lock);
+
+        if (started < config->cores) {
+            fprintf(stderr, "Error: Could not start core %d\n", started);
+            result = -1;
+        } else if (system.failed) {
+            fprintf(stderr, "Error: Out of memory for a store log\n");
+            result = -1;
+        } else {
+            for (int i = 0; i < config->cores; i++) {
+                status[i] = system.cores[i]->status;
+                instructions[i] = system.cores[i]->instructions;
+                PC[i] = system.cores[i]->machine.PC;
+            }
+            // every copy holds the final shared memory
+            memcpy(image->memory, system.cores[0]->machine.memory, sizeof(image->memory));
+        }
+    } else {
+        fprintf(stderr, "Error: Out of memory for the cores\n");
+    }
+    for (int i = 0; i < config->cores; i++) {
+        if (system.cores[i] != NULL) {
+            free(system.cores[i]->log);
+            free(system.cores[i]);
+        }
+    }
+    return result;
+}
@@ -0,0 +1,51 @@
+/*
+ * multicore.h: Declares the shared-memory multi-core system simulation
+ */
+
+#ifndef MULTICORE_H
+#define MULTICORE_H
+
+#include <stdio.h>
+#include "LC4.h"
+
+// Most cores one system runs, each on its own host thread
+#define MULTICORE_MAX_CORES 64
+
+// Instructions a core runs per turn unless told otherwise
+#define MULTICORE_DEFAULT_QUANTUM 1000
+
+// Memory consistency models
+#define MODEL_SC  0 // one core at a time, round robin; stores are seen at once
+#define MODEL_TSO 1 // all cores at once; stores are buffered until the quantum ends
+
+typedef struct {
+    int cores;
+    int model;
+    unsigned long long quantum;         // instructions per core per turn
+    unsigned long long maxInstructions; // per core, 0 for no limit
+    unsigned long long deadline;        // MonotonicNanoseconds, 0 for none
+} MulticoreConfig;
+
+/*
+ * Run config->cores copies of image sharing its memory. Every core starts
+ * as the single-core machine does, at image's PC and PSR, with its index in
+ * R0, and runs until it reaches x80FF, faults, or uses up its budget or the
+ * deadline.
+ *
+ * Scheduling is deterministic, so runs repeat exactly. Under MODEL_SC the
+ * cores take turns of config->quantum instructions in index order (a
+ * quantum of 1 interleaves single instructions) and each sees the others'
+ * stores at once. Under MODEL_TSO every core runs its quantum at the same
+ * time against memory as it was when the quantum began plus its own stores;
+ * at the end of the quantum the stores reach memory in core order, so where
+ * two cores wrote the same word the higher index wins.
+ *
+ * outputs[i] receives core i's trace in the WriteOut format, NULL for none.
+ * status[i] (RUN_BREAKPOINT for a halt, RUN_FAULT, RUN_BUDGET or
+ * RUN_TIMEOUT), instructions[i] and PC[i] receive how core i ended.
+ * Returns 0, or -1 after printing an error.
+ */
+int RunMulticore(MachineState* image, MulticoreConfig* config, FILE** outputs, int* status,
+                 unsigned long long* instructions, unsigned short int* PC);
+
+#endif
@@ -0,0 +1,622 @@
+/*
+ * oracle.c: Defines the ISA conformance oracle and per-opcode benchmarks
+ */
+
+#include "oracle.h"
+#include "batch.h"
+#include "engine.h"
+#include <fcntl.h>
+#include <unistd.h>
+
+// instruction fields
+#define RD(insn) (((insn) >> 9) & 7)
+#define RS(insn) (((insn) >> 6) & 7)
+#define RT(insn) ((insn) & 7)
+
+// How an entry's benchmark code is laid out
+#define BENCH_NONE 0    // not timed: the instruction does not move on
+#define BENCH_LINE 1    // one instruction per word, falling through
+#define BENCH_PAIR 2    // pair word, then the instruction, repeated
+#define BENCH_JSR  3    // a JSR every 16 words calling the next one
+
+// Engines checked against the oracle
+#define ENGINE_REFERENCE 0
+#define ENGINE_FAST      1
+#define ENGINE_BATCH     2
+#define NUM_ENGINES      3
+
+typedef void (*Semantics)(OracleState* s, unsigned short int insn);
+
+// loads and stores also see the memory and page permissions
+typedef void (*MemorySemantics)(OracleState* s, unsigned short int insn, const MachineState* CPU);
+
+// One row of the semantics table: insn belongs to the first row with
+// (insn & mask) == match
+typedef struct {
+    const char* name;
+    unsigned short int mask;
+    unsigned short int match;
+    Semantics execute;
+    MemorySemantics access;         // instead of execute, for LDR and STR
+
+    // benchmark code: fields under fixedMask are set to fixedValue, the
+    // register startReg (-1 for none) holds the address of the first word
+    int bench;
+    unsigned short int fixedMask;
+    unsigned short int fixedValue;
+    unsigned short int pair;
+    int startReg;
+} OracleEntry;
+
+// helper to write a result register, set NZP from it and move on
+static void Result(OracleState* s, int reg, unsigned short int value) {
+    s->R[reg] = value;
+    s->PSR = (s->PSR & ~7) | NZP_BITS((short)value);
+    s->PC++;
+}
+
+// helper to set NZP from a comparison and move on
+static void Compare(OracleState* s, int difference) {
+    s->PSR = (s->PSR & ~7) | NZP_BITS(difference);
+    s->PC++;
+}
+
+// helper to save the return address and set NZP from it, as JSR and JSRR do
+static void Link(OracleState* s) {
+    s->R[7] = s->PC + 1;
+    s->PSR = (s->PSR & ~7) | NZP_BITS((short)s->R[7]);
+}
+
+// helper to tell whether the current privilege level may access address
+static int Allowed(const MachineState* CPU, const OracleState* s, unsigned short int address, unsigned char access) {
+    return CPU->pageAttr[address >> 8] & (access << (s->PSR >> 15));
+}
+
+static void Branch(OracleState* s, unsigned short int insn) {
+    s->PC += (RD(insn) & s->PSR) ? 1 + SEXT(insn, 9) : 1;
+}
+
+static void Add(OracleState* s, unsigned short int insn) {
+    Result(s, RD(insn), s->R[RS(insn)] + s->R[RT(insn)]);
+}
+
+static void Mul(OracleState* s, unsigned short int insn) {
+    Result(s, RD(insn), s->R[RS(insn)] * s->R[RT(insn)]);
+}
+
+static void Sub(OracleState* s, unsigned short int insn) {
+    Result(s, RD(insn), s->R[RS(insn)] - s->R[RT(insn)]);
+}
+
+// unsigned; a zero divisor gives 0
+static void Div(OracleState* s, unsigned short int insn) {
+    Result(s, RD(insn), s->R[RT(insn)] ? s->R[RS(insn)] / s->R[RT(insn)] : 0);
+}
+
+static void AddImm(OracleState* s, unsigned short int insn) {
+    Result(s, RD(insn), s->R[RS(insn)] + SEXT(insn, 5));
+}
+
+// signed, on the operands rather than their wrapped difference: CMP x7FFF, x8000 gives P
+static void Cmp(OracleState* s, unsigned short int insn) {
+    Compare(s, (short)s->R[RD(insn)] - (short)s->R[RT(insn)]);
+}
+
+static void Cmpu(OracleState* s, unsigned short int insn) {
+    Compare(s, (int)s->R[RD(insn)] - (int)s->R[RT(insn)]);
+}
+
+static void Cmpi(OracleState* s, unsigned short int insn) {
+    Compare(s, (short)s->R[RD(insn)] - SEXT(insn, 7));
+}
+
+static void Cmpiu(OracleState* s, unsigned short int insn) {
+    Compare(s, (int)s->R[RD(insn)] - (int)(insn & 0x7F));
+}
+
+// opcodes 3, 11 and 14 do nothing, not even move the PC
+static void Unused(OracleState* s, unsigned short int insn) {
+    (void)s;
+    (void)insn;
+}
+
+// Rs is read before R7 is written
+static void Jsrr(OracleState* s, unsigned short int insn) {
+    unsigned short int target = s->R[RS(insn)];
+    Link(s);
+    s->PC = target;
+}
+
+// the target keeps the caller's half of memory: (PC & x8000) | (imm11 << 4)
+static void Jsr(OracleState* s, unsigned short int insn) {
+    Link(s);
+    s->PC = (s->PC & 0x8000) | ((insn & 0x7FF) << 4);
+}
+
+static void And(OracleState* s, unsigned short int insn) {
+    Result(s, RD(insn), s->R[RS(insn)] & s->R[RT(insn)]);
+}
+
+static void Not(OracleState* s, unsigned short int insn) {
+    Result(s, RD(insn), ~s->R[RS(insn)]);
+}
+
+static void Or(OracleState* s, unsigned short int insn) {
+    Result(s, RD(insn), s->R[RS(insn)] | s->R[RT(insn)]);
+}
+
+static void Xor(OracleState* s, unsigned short int insn) {
+    Result(s, RD(insn), s->R[RS(insn)] ^ s->R[RT(insn)]);
+}
+
+static void AndImm(OracleState* s, unsigned short int insn) {
+    Result(s, RD(insn), s->R[RS(insn)] & SEXT(insn, 5));
+}
+
+// a denied access still moves the PC on
+static void Ldr(OracleState* s, unsigned short int insn, const MachineState* CPU) {
+    unsigned short int address = s->R[RS(insn)] + SEXT(insn, 6);
+    if (!Allowed(CPU, s, address, PAGE_READ_USER)) {
+        s->fault = 1;
+        s->PC++;
+        return;
+    }
+    Result(s, RD(insn), CPU->memory[address]);
+}
+
+static void Str(OracleState* s, unsigned short int insn, const MachineState* CPU) {
+    unsigned short int address = s->R[RS(insn)] + SEXT(insn, 6);
+    if (!Allowed(CPU, s, address, PAGE_WRITE_USER)) {
+        s->fault = 1;
+    } else {
+        s->stored = 1;
+        s->storeAddr = address;
+        s->storeValue = s->R[RD(insn)];
+    }
+    s->PC++;
+}
+
+static void Rti(OracleState* s, unsigned short int insn) {
+    (void)insn;
+    s->PSR &= 0x7FFF;
+    s->PC = s->R[7];
+}
+
+static void Const(OracleState* s, unsigned short int insn) {
+    Result(s, RD(insn), SEXT(insn, 9));
+}
+
+static void Sll(OracleState* s, unsigned short int insn) {
+    Result(s, RD(insn), s->R[RS(insn)] << (insn & 0xF));
+}
+
+static void Sra(OracleState* s, unsigned short int insn) {
+    Result(s, RD(insn), (short)s->R[RS(insn)] >> (insn & 0xF));
+}
+
+static void Srl(OracleState* s, unsigned short int insn) {
+    Result(s, RD(insn), s->R[RS(insn)] >> (insn & 0xF));
+}
+
+// unsigned; a zero divisor gives 0
+static void Mod(OracleState* s, unsigned short int insn) {
+    Result(s, RD(insn), s->R[RT(insn)] ? s->R[RS(insn)] % s->R[RT(insn)] : 0);
+}
+
+static void Jmpr(OracleState* s, unsigned short int insn) {
+    s->PC = s->R[RS(insn)];
+}
+
+static void Jmp(OracleState* s, unsigned short int insn) {
+    s->PC += 1 + SEXT(insn, 11);
+}
+
+static void Hiconst(OracleState* s, unsigned short int insn) {
+    Result(s, RD(insn), (s->R[RD(insn)] & 0xFF) | ((insn & 0xFF) << 8));
+}
+
+// NZP comes from R7 + 1 as an int, so it is always P
+static void Trap(OracleState* s, unsigned short int insn) {
+    s->R[7] = s->PC + 1;
+    s->PSR = (s->PSR & ~7) | 0x8000 | NZP_BITS(s->R[7] + 1);
+    s->PC = 0x8000 | (insn & 0xFF);
+}
+
+static const OracleEntry table[] = {
+    // branches fall through to the next word when timed
+    {"NOP",      0xFE00, 0x0000, Branch,     NULL, BENCH_LINE, 0x01FF, 0x0000, 0, -1},
+    {"BR",       0xF000, 0x0000, Branch,     NULL, BENCH_LINE, 0x01FF, 0x0000, 0, -1},
+    {"ADD",      0xF038, 0x1000, Add,        NULL, BENCH_LINE, 0, 0, 0, -1},
+    {"MUL",      0xF038, 0x1008, Mul,        NULL, BENCH_LINE, 0, 0, 0, -1},
+    {"SUB",      0xF038, 0x1010, Sub,        NULL, BENCH_LINE, 0, 0, 0, -1},
+    {"DIV",      0xF038, 0x1018, Div,        NULL, BENCH_LINE, 0, 0, 0, -1},
+    {"ADDI",     0xF020, 0x1020, AddImm,     NULL, BENCH_LINE, 0, 0, 0, -1},
+    {"CMP",      0xF180, 0x2000, Cmp,        NULL, BENCH_LINE, 0, 0, 0, -1},
+    {"CMPU",     0xF180, 0x2080, Cmpu,       NULL, BENCH_LINE, 0, 0, 0, -1},
+    {"CMPI",     0xF180, 0x2100, Cmpi,       NULL, BENCH_LINE, 0, 0, 0, -1},
+    {"CMPIU",    0xF180, 0x2180, Cmpiu,      NULL, BENCH_LINE, 0, 0, 0, -1},
+    {"OP3",      0xF000, 0x3000, Unused,     NULL, BENCH_NONE, 0, 0, 0, -1},
+    // JSRR R7 runs twice per word: once to where R7 points, once back to the next word
+    {"JSRR",     0xF800, 0x4000, Jsrr,       NULL, BENCH_LINE, 0x01C0, 0x01C0, 0, 7},
+    {"JSR",      0xF800, 0x4800, Jsr,        NULL, BENCH_JSR,  0, 0, 0, -1},
+    {"AND",      0xF038, 0x5000, And,        NULL, BENCH_LINE, 0, 0, 0, -1},
+    {"NOT",      0xF038, 0x5008, Not,        NULL, BENCH_LINE, 0, 0, 0, -1},
+    {"OR",       0xF038, 0x5010, Or,         NULL, BENCH_LINE, 0, 0, 0, -1},
+    {"XOR",      0xF038, 0x5018, Xor,        NULL, BENCH_LINE, 0, 0, 0, -1},
+    {"ANDI",     0xF020, 0x5020, AndImm,     NULL, BENCH_LINE, 0, 0, 0, -1},
+    {"LDR",      0xF000, 0x6000, NULL,       Ldr,  BENCH_LINE, 0, 0, 0, -1},
+    {"STR",      0xF000, 0x7000, NULL,       Str,  BENCH_LINE, 0, 0, 0, -1},
+    // timed as part of TRAP
+    {"RTI",      0xF000, 0x8000, Rti,        NULL, BENCH_NONE, 0, 0, 0, -1},
+    {"CONST",    0xF000, 0x9000, Const,      NULL, BENCH_LINE, 0, 0, 0, -1},
+    {"SLL",      0xF030, 0xA000, Sll,        NULL, BENCH_LINE, 0, 0, 0, -1},
+    {"SRA",      0xF030, 0xA010, Sra,        NULL, BENCH_LINE, 0, 0, 0, -1},
+    {"SRL",      0xF030, 0xA020, Srl,        NULL, BENCH_LINE, 0, 0, 0, -1},
+    {"MOD",      0xF030, 0xA030, Mod,        NULL, BENCH_LINE, 0, 0, 0, -1},
+    {"OP11",     0xF000, 0xB000, Unused,     NULL, BENCH_NONE, 0, 0, 0, -1},
+    // JMPR R6 after ADD R6, R6, #2, the pair timed together
+    {"JMPR",     0xF800, 0xC000, Jmpr,       NULL, BENCH_PAIR, 0x01C0, 0x0180, 0x1DA2, 6},
+    {"JMP",      0xF800, 0xC800, Jmp,        NULL, BENCH_LINE, 0x07FF, 0x0000, 0, -1},
+    {"HICONST",  0xF000, 0xD000, Hiconst,    NULL, BENCH_LINE, 0, 0, 0, -1},
+    {"OP14",     0xF000, 0xE000, Unused,     NULL, BENCH_NONE, 0, 0, 0, -1},
+    // vectors x00-x7F, each an RTI back to the next word
+    {"TRAP",     0xF000, 0xF000, Trap,       NULL, BENCH_LINE, 0x0080, 0x0000, 0, -1},
+};
+
+#define NUM_ENTRIES ((int)(sizeof(table) / sizeof(table[0])))
+
+// Register values the cases are built from: zero, signs, carries and wraps,
+// and addresses in each region of the memory map
+static const unsigned short int values[16] = {
+    0x0000, 0x0001, 0x0002, 0x7FFF, 0x8000, 0x8001, 0xFFFF, 0xFFFE,
+    0x00FF, 0x0100, 0x4000, 0x1234, 0x000F, 0x0010, 0x7FFE, 0xC000,
+};
+
+// Results gathered per table entry
+typedef struct {
+    unsigned long long cases;
+    unsigned long long misses[NUM_ENGINES];
+    int shown[NUM_ENGINES];
+    double ns[NUM_ENGINES];         // per instruction, < 0 when not timed
+} EntryStats;
+
+static const char* engineNames[NUM_ENGINES] = {"reference", "fast", "batch"};
+
+// conformance and benchmark machine, and RunFast breakpoint sets
+static MachineState machine;
+static unsigned char everywhere[65536];
+static unsigned char benchEnd[65536];
+
+int OracleStep(const MachineState* CPU, unsigned short int insn, const OracleState* in, OracleState* out) {
+    int entry = 0;
+    while ((insn & table[entry].mask) != table[entry].match) {
+        entry++;
+    }
+    *out = *in;
+    out->fault = 0;
+    out->stored = 0;
+    if (table[entry].access != NULL) {
+        table[entry].access(out, insn, CPU);
+    } else {
+        table[entry].execute(out, insn);
+    }
+    return entry;
+}
+
+// helper for the word every address holds outside the code under test
+static unsigned short int Pattern(unsigned short int address) {
+    return address * 0x9E37 + 0x79B9;
+}
+
+// helper to build register state c: user and OS mode alternate, OS cases
+// run from both halves of memory, and each register takes its own value
+static void CaseState(int c, OracleState* s) {
+    memset(s, 0, sizeof(OracleState));
+    int os = c & 1;
+    s->PSR = (os << 15) | (1 << ((c >> 1) % 3));
+    s->PC = os && (c & 2) ? 0x8100 : 0x0100;
+    for (int r = 0; r < 8; r++) {
+        s->R[r] = values[(3 * c + 5 * r) & 15];
+    }
+}
+
+// helper to put s into the machine
+static void LoadState(MachineState* CPU, const OracleState* s) {
+    CPU->PC = s->PC;
+    CPU->PSR = s->PSR;
+    memcpy(CPU->R, s->R, sizeof(CPU->R));
+}
+
+// helper to read back the machine after one instruction, then undo the store
+// the oracle expected so the next case sees the same memory
+static void SaveState(MachineState* CPU, const OracleState* want, int fault, OracleState* got) {
+    memset(got, 0, sizeof(OracleState));
+    got->PC = CPU->PC;
+    got->PSR = CPU->PSR;
+    memcpy(got->R, CPU->R, sizeof(got->R));
+    got->fault = fault;
+    if (want->stored) {
+        got->stored = 1;
+        got->storeAddr = want->storeAddr;
+        got->storeValue = CPU->memory[want->storeAddr];
+        CPU->memory[want->storeAddr] = Pattern(want->storeAddr);
+    }
+}
+
+// helper to print a state as one line
+static void PrintState(const OracleState* s, FILE* output) {
+    fprintf(output, "PC %04X PSR %04X R", s->PC, s->PSR);
+    for (int r = 0; r < 8; r++) {
+        fprintf(output, " %04X", s->R[r]);
+    }
+    if (s->fault) {
+        fprintf(output, " fault");
+    }
+    if (s->stored) {
+        fprintf(output, " x%04X=%04X", s->storeAddr, s->storeValue);
+    }
+    fprintf(output, "\n");
+}
+
+// helper to compare an engine's result with the oracle's, printing the first
+// few differences of each entry
+static void Check(EntryStats* stats, int entry, int engine, unsigned short int insn, const OracleState* in,
+                  const OracleState* want, const OracleState* got, FILE* output) {
+    if (got->PC == want->PC && got->PSR == want->PSR && memcmp(got->R, want->R, sizeof(got->R)) == 0 &&
+        got->fault == want->fault && (!want->stored || got->storeValue == want->storeValue)) {
+        return;
+    }
+    stats->misses[engine]++;
+    if (stats->shown[engine]++ < ORACLE_SHOW) {
+        fprintf(output, "%s: %s %04X differs\n    from     ", engineNames[engine], table[entry].name, insn);
+        PrintState(in, output);
+        fprintf(output, "    expected ");
+        PrintState(want, output);
+        fprintf(output, "    got      ");
+        PrintState(got, output);
+    }
+}
+
+// helper to send stdout, where denied accesses are reported, to /dev/null;
+// returns the descriptor to restore, -1 if nothing changed
+static int Silence(void) {
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    if (saved < 0 || null < 0) {
+        if (saved >= 0) {
+            close(saved);
+        }
+        if (null >= 0) {
+            close(null);
+        }
+        return -1;
+    }
+    dup2(null, STDOUT_FILENO);
+    close(null);
+    return saved;
+}
+
+// helper to undo Silence
+static void Unsilence(int saved) {
+    if (saved >= 0) {
+        fflush(stdout);
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+    }
+}
+
+// helper to run every case of one instruction word on every engine
+static int CheckWord(unsigned short int insn, EntryStats* stats, FILE* output) {
+    OracleState in[ORACLE_CASES], want[ORACLE_CASES], got[NUM_ENGINES][ORACLE_CASES];
+    machine.memory[0x0100] = insn;
+    machine.memory[0x8100] = insn;
+
+    int entry = 0, faults = 0;
+    for (int c = 0; c < ORACLE_CASES; c++) {
+        CaseState(c, &in[c]);
+        entry = OracleStep(&machine, insn, &in[c], &want[c]);
+        faults |= want[c].fault;
+    }
+
+    int saved = faults ? Silence() : -1;
+    for (int c = 0; c < ORACLE_CASES; c++) {
+        LoadState(&machine, &in[c]);
+        int fault = UpdateMachineState(&machine, NULL) != 0;
+        SaveState(&machine, &want[c], fault, &got[ENGINE_REFERENCE][c]);
+
+        // breakpoints everywhere stop RunFast after one instruction
+        RunControl control = { .breakpoints = everywhere, .maxInstructions = 1 };
+        LoadState(&machine, &in[c]);
+        fault = RunFast(&machine, &control) == RUN_FAULT;
+        SaveState(&machine, &want[c], fault, &got[ENGINE_FAST][c]);
+    }
+    Unsilence(saved);
+
+    BatchState* B = OpenBatch(&machine, ORACLE_CASES);
+    if (B == NULL) {
+        return -1;
+    }
+    for (int c = 0; c < ORACLE_CASES; c++) {
+        B->PC[c] = in[c].PC;
+        B->PSR[c] = in[c].PSR;
+        for (int r = 0; r < 8; r++) {
+            B->R[r][c] = in[c].R[r];
+        }
+    }
+    RunBatch(B, 1, 0);
+    for (int c = 0; c < ORACLE_CASES; c++) {
+        OracleState* lane = &got[ENGINE_BATCH][c];
+        memset(lane, 0, sizeof(OracleState));
+        lane->PC = B->PC[c];
+        lane->PSR = B->PSR[c];
+        for (int r = 0; r < 8; r++) {
+            lane->R[r] = B->R[r][c];
+        }
+        lane->fault = B->status[c] == RUN_FAULT;
+        if (want[c].stored) {
+            lane->stored = 1;
+            lane->storeAddr = want[c].storeAddr;
+            lane->storeValue = BatchLoad(B, c, want[c].storeAddr);
+        }
+    }
+    CloseBatch(B);
+
+    stats[entry].cases += ORACLE_CASES;
+    for (int engine = 0; engine < NUM_ENGINES; engine++) {
+        for (int c = 0; c < ORACLE_CASES; c++) {
+            Check(&stats[entry], entry, engine, insn, &in[c], &want[c], &got[engine][c], output);
+        }
+    }
+    return 0;
+}
+
+// helper for the next pseudo-random 16 bits
+static unsigned short int Random(unsigned int* seed) {
+    *seed = *seed * 1103515245u + 12345u;
+    return *seed >> 16;
+}
+
+// helper to lay out an entry's benchmark code at x0000-BENCH_WORDS and the
+// data its loads and stores reach; fills in the starting state
+static void BuildBench(const OracleEntry* e, unsigned int* seed, OracleState* start) {
+    Reset(&machine);
+    memset(start, 0, sizeof(OracleState));
+    start->PSR = 0x0002;
+    for (int r = 0; r < 8; r++) {
+        start->R[r] = 0x4000 | (Random(seed) & 0xFF);
+    }
+    if (e->startReg >= 0) {
+        start->R[e->startReg] = 0;
+    }
+
+    // loads keep every register near x4000, so LDR and STR stay in user data
+    for (int address = 0x3F00; address < 0x4200; address++) {
+        machine.memory[address] = 0x4000 | (Random(seed) & 0xFF);
+    }
+    for (int vector = 0; vector < 0x80; vector++) {
+        machine.memory[0x8000 | vector] = 0x8000;
+    }
+
+    for (int address = 0; address < BENCH_WORDS; address++) {
+        unsigned short int varying = ~(e->mask | e->fixedMask);
+        unsigned short int insn = (Random(seed) & varying) | e->match | e->fixedValue;
+        if (e->bench == BENCH_PAIR) {
+            insn = address & 1 ? insn : e->pair;
+        } else if (e->bench == BENCH_JSR) {
+            insn = address & 15 ? 0 : e->match | ((address + 16) >> 4);
+        }
+        machine.memory[address] = insn;
+    }
+}
+
+// helper to time one entry on every engine; leaves ns at -1 if the code
+// does not reach its end
+static void Bench(const OracleEntry* e, unsigned int* seed, EntryStats* stats) {
+    for (int engine = 0; engine < NUM_ENGINES; engine++) {
+        stats->ns[engine] = -1;
+    }
+    if (e->bench == BENCH_NONE) {
+        return;
+    }
+    OracleState start;
+    BuildBench(e, seed, &start);
+
+    // the reference engine also gives the instructions in one pass
+    unsigned long long perPass = 0, limit = 16ULL * BENCH_WORDS;
+    unsigned long long begin = MonotonicNanoseconds();
+    for (int pass = 0; pass < BENCH_PASSES; pass++) {
+        LoadState(&machine, &start);
+        unsigned long long count = 0;
+        while (machine.PC != BENCH_WORDS && count < limit) {
+            if (UpdateMachineState(&machine, NULL) != 0) {
+                return;
+            }
+            count++;
+        }
+        if (count == limit) {
+            return;
+        }
+        perPass = count;
+    }
+    stats->ns[ENGINE_REFERENCE] = (double)(MonotonicNanoseconds() - begin) / (perPass * BENCH_PASSES);
+
+    RunControl control = { .breakpoints = benchEnd };
+    begin = MonotonicNanoseconds();
+    for (int pass = 0; pass < BENCH_PASSES; pass++) {
+        LoadState(&machine, &start);
+        if (RunFast(&machine, &control) != RUN_BREAKPOINT) {
+            return;
+        }
+    }
+    stats->ns[ENGINE_FAST] = (double)(MonotonicNanoseconds() - begin) / control.instructions;
+
+    // per lane, with a full vector of lanes
+    unsigned long long elapsed = 0;
+    for (int pass = 0; pass < BENCH_PASSES; pass++) {
+        BatchState* B = OpenBatch(&machine, BATCH_VECTOR);
+        if (B == NULL) {
+            return;
+        }
+        for (int lane = 0; lane < BATCH_VECTOR; lane++) {
+            B->PC[lane] = start.PC;
+            B->PSR[lane] = start.PSR;
+            for (int r = 0; r < 8; r++) {
+                B->R[r][lane] = start.R[r];
+            }
+        }
+        begin = MonotonicNanoseconds();
+        RunBatch(B, perPass, 0);
+        elapsed += MonotonicNanoseconds() - begin;
+        CloseBatch(B);
+    }
+    stats->ns[ENGINE_BATCH] = (double)elapsed / (perPass * BENCH_PASSES * BATCH_VECTOR);
+}
+
+unsigned long long RunConformance(FILE* output) {
+    EntryStats stats[NUM_ENTRIES];
+    memset(stats, 0, sizeof(stats));
+    int debug = DebugOutput;
+    DebugOutput = 0;
+
+    Reset(&machine);
+    for (int address = 0; address < 65536; address++) {
+        machine.memory[address] = Pattern(address);
+    }
+    memset(everywhere, 1, sizeof(everywhere));
+    for (int word = 0; word < 65536; word++) {
+        if (CheckWord(word, stats, output) != 0) {
+            DebugOutput = debug;
+            return 1;
+        }
+    }
+
+    unsigned int seed = 0x2400;
+    benchEnd[BENCH_WORDS] = 1;
+    for (int entry = 0; entry < NUM_ENTRIES; entry++) {
+        Bench(&table[entry], &seed, &stats[entry]);
+    }
+    DebugOutput = debug;
+
+    unsigned long long cases = 0, misses = 0;
+    fprintf(output, "%-8s %8s %10s %10s %10s %10s %10s %10s\n", "entry", "cases", "reference", "fast", "batch",
+            "ref ns", "fast ns", "batch ns");
+    for (int entry = 0; entry < NUM_ENTRIES; entry++) {
+        EntryStats* s = &stats[entry];
+        fprintf(output, "%-8s %8llu %10llu %10llu %10llu", table[entry].name, s->cases,
+                s->misses[ENGINE_REFERENCE], s->misses[ENGINE_FAST], s->misses[ENGINE_BATCH]);
+        for (int engine = 0; engine < NUM_ENGINES; engine++) {
+            if (s->ns[engine] < 0) {
+                fprintf(output, " %10s", "-");
+            } else {
+                fprintf(output, " %10.2f", s->ns[engine]);
+            }
+        }
+        fprintf(output, "\n");
+        cases += s->cases * NUM_ENGINES;
+        misses += s->misses[ENGINE_REFERENCE] + s->misses[ENGINE_FAST] + s->misses[ENGINE_BATCH];
+    }
+    fprintf(output, "JMPR is timed with an ADD and TRAP with an RTI; batch times are per lane\n");
+    fprintf(output, "%llu mismatches in %llu checks\n", misses, cases);
+    return misses;
+}
@@ -0,0 +1,47 @@
+/*
+ * oracle.h: Declares the ISA conformance oracle and per-opcode benchmarks
+ */
+
+#ifndef ORACLE_H
+#define ORACLE_H
+
+#include <stdio.h>
+#include "LC4.h"
+
+// Register states every instruction word is checked from
+#define ORACLE_CASES 32
+
+// Mismatches printed in full per table entry and engine
+#define ORACLE_SHOW 3
+
+// Words of generated code per benchmark, and passes over them
+#define BENCH_WORDS  0x1000
+#define BENCH_PASSES 64
+
+// Architectural state an instruction reads and writes
+typedef struct {
+    unsigned short int PC;
+    unsigned short int PSR;
+    unsigned short int R[8];
+    int fault;                      // a load or store was denied
+    int stored;                     // memory[storeAddr] = storeValue
+    unsigned short int storeAddr;
+    unsigned short int storeValue;
+} OracleState;
+
+/*
+ * The architectural effect of executing insn from in, with memory and page
+ * permissions taken from CPU (no devices), per the semantics table in
+ * oracle.c. Returns the index of the table entry insn belongs to.
+ */
+int OracleStep(const MachineState* CPU, unsigned short int insn, const OracleState* in, OracleState* out);
+
+/*
+ * Check every instruction word from ORACLE_CASES register states on
+ * UpdateMachineState, RunFast and the batch engine against OracleStep, then
+ * time each table entry on BENCH_WORDS of generated straight-line code.
+ * Prints a line per entry to output and returns the number of mismatches.
+ */
+unsigned long long RunConformance(FILE* output);
+
+#endif
@@ -0,0 +1,12 @@
+;; A counter loop entered at its branch, with flags that do not come from
+;; the counter: the loop runs once and falls through
+
+        .CODE
+        .ADDR x0000
+        CONST R1, #-5
+        CONST R2, #1
+        BRnzp BR_IN
+TOP     ADD R1, R1, #-1
+        CMPI R1, #0
+BR_IN   BRp TOP
+        TRAP xFF
@@ -0,0 +1,195 @@
+/*
+ * pipeline.c: Defines the 5-stage pipeline timing model
+ */
+
+#include "pipeline.h"
+
+void InitPipeline(PipelineState* P, int predictor, unsigned short int start) {
+    memset(P, 0, sizeof(PipelineState));
+    P->predictor = predictor;
+    P->lastLoadReg = -1;
+    P->lastWriteReg = -1;
+    InitFunctionProfile(&P->profile, start);
+}
+
+// helper to tell which registers an instruction reads, using the rs/rt mux
+// selections for the register numbers; -1 when a port is unused
+static void SourceRegisters(MachineState* CPU, unsigned short int insn, int* rs, int* rt) {
+    unsigned short int opcode = insn >> 12;
+    int uses_rs = 0, uses_rt = 0;
+
+    switch (opcode) {
+        case 1:  // ADD, MUL, SUB, DIV, ADD IMM5
+            uses_rs = 1;
+            uses_rt = !(insn & 0x0020);
+            break;
+        case 2:  // CMP, CMPU read rt, CMPI, CMPIU do not
+            uses_rs = 1;
+            uses_rt = ((insn >> 7) & 0x3) < 2;
+            break;
+        case 4:  // JSRR
+        case 12: // JMPR
+            uses_rs = !(insn & 0x0800);
+            break;
+        case 5:  // AND, OR, XOR read rt, NOT and AND IMM5 do not
+            uses_rs = 1;
+            uses_rt = !(insn & 0x0020) && ((insn >> 3) & 0x7) != 1;
+            break;
+        case 6:  // LDR
+        case 8:  // RTI
+        case 13: // HICONST
+            uses_rs = 1;
+            break;
+        case 7:  // STR
+            uses_rs = 1;
+            uses_rt = 1;
+            break;
+        case 10: // SLL, SRA, SRL read rs, MOD also rt
+            uses_rs = 1;
+            uses_rt = ((insn >> 4) & 0x3) == 3;
+            break;
+        default:
+            break;
+    }
+
+    // rsMux: 0 = I[8:6], 1 = R7, 2 = I[11:9]; rtMux: 0 = I[2:0], 1 = I[11:9]
+    static const int rs_shift[3] = {6, -1, 9};
+    *rs = -1;
+    *rt = -1;
+    if (uses_rs) {
+        int shift = CPU->rsMux_CTL < 3 ? rs_shift[CPU->rsMux_CTL] : 6;
+        *rs = shift < 0 ? 7 : (insn >> shift) & 0x7;
+    }
+    if (uses_rt) {
+        *rt = CPU->rtMux_CTL == 1 ? (insn >> 9) & 0x7 : insn & 0x7;
+    }
+}
+
+// helper to predict the next fetch after pc and train on the real one;
+// returns 1 on a misprediction
+static int Predict(PipelineState* P, unsigned short int pc, unsigned short int insn, unsigned short int nextPC) {
+    int entry = pc % BTB_SIZE;
+    int hit = P->btbValid[entry] && P->btbTag[entry] == pc;
+    int taken = nextPC != (unsigned short int)(pc + 1);
+    unsigned short int predicted = pc + 1;
+
+    if (P->predictor == PREDICT_BTB && hit) {
+        predicted = P->btbTarget[entry];
+    } else if (P->predictor == PREDICT_2BIT && hit && (P->counter[entry] >= 2 || (insn >> 12) != 0)) {
+        // only BR has a direction to guess, jumps always go to their target
+        predicted = P->btbTarget[entry];
+    }
+
+    if (P->predictor != PREDICT_NOT_TAKEN) {
+        if (taken) {
+            P->btbValid[entry] = 1;
+            P->btbTag[entry] = pc;
+            P->btbTarget[entry] = nextPC;
+        } else if (P->predictor == PREDICT_BTB && hit) {
+            P->btbValid[entry] = 0;
+        }
+        if (taken && P->counter[entry] < 3) {
+            P->counter[entry]++;
+        } else if (!taken && P->counter[entry] > 0) {
+            P->counter[entry]--;
+        }
+    }
+    return predicted != nextPC;
+}
+
+void PipelineStep(PipelineState* P, MachineState* CPU, unsigned short int pc) {
+    unsigned short int insn = CPU->memory[pc];
+    unsigned short int opcode = insn >> 12;
+    int function = ProfileStep(&P->profile, insn, CPU->PC);
+    PipelineStats* stats = &P->functions[function];
+    unsigned long long cycles = 1;
+
+    int rs, rt;
+    SourceRegisters(CPU, insn, &rs, &rt);
+    int reads_nzp = opcode == 0 && (insn & 0x0E00) != 0;
+    int is_store = opcode == 7;
+    int control = reads_nzp || opcode == 4 || opcode == 8 || opcode == 12 || opcode == 15;
+
+    // load-use: the LDR's value is only ready after M; a store's data port
+    // (rt) takes it through the M to M bypass
+    int stall = 0;
+    if (P->started && P->lastLoadReg >= 0) {
+        stall = rs == P->lastLoadReg || (rt == P->lastLoadReg && !is_store) || reads_nzp;
+    }
+    if (stall) {
+        cycles++;
+        P->total.loadUseStalls++;
+        stats->loadUseStalls++;
+    }
+
+    if (control) {
+        P->total.branches++;
+        stats->branches++;
+        if (Predict(P, pc, insn, CPU->PC)) {
+            cycles += MISPREDICT_PENALTY;
+            P->total.mispredictions++;
+            stats->mispredictions++;
+        }
+    }
+
+    // a 2-wide in-order machine could issue this with the previous one if
+    // they were fetched together and are independent
+    int dest = CPU->regFile_WE ? (CPU->rdMux_CTL == 1 ? 7 : (insn >> 9) & 0x7) : -1;
+    int memory = is_store || opcode == 6;
+    int paired = 0;
+    if (P->started && !P->lastPaired && !P->lastControl && pc == (unsigned short int)(P->lastPC + 1) && !stall &&
+        !(memory && P->lastMemory) && !(reads_nzp && P->lastSetsNZP) &&
+        (P->lastWriteReg < 0 || (rs != P->lastWriteReg && rt != P->lastWriteReg && dest != P->lastWriteReg))) {
+        paired = 1;
+        P->total.pairs++;
+        stats->pairs++;
+    }
+
+    P->total.instructions++;
+    P->total.cycles += cycles;
+    stats->instructions++;
+    stats->cycles += cycles;
+
+    P->started = 1;
+    P->lastPC = pc;
+    P->lastLoadReg = opcode == 6 ? dest : -1;
+    P->lastWriteReg = dest;
+    P->lastSetsNZP = CPU->NZP_WE;
+    P->lastMemory = memory;
+    P->lastControl = control;
+    P->lastPaired = paired;
+}
+
+// helper for one report line
+static void PrintStats(const char* name, PipelineStats* stats, FILE* output) {
+    fprintf(output, "%-24s %10llu %10llu %6.3f %8llu %8llu %8llu %8llu\n", name, stats->instructions,
+            stats->cycles, stats->instructions ? (double)stats->cycles / stats->instructions : 0.0,
+            stats->loadUseStalls, stats->branches, stats->mispredictions, stats->pairs);
+}
+
+void PrintPipelineReport(PipelineState* P, MachineState* CPU, ObjectInfo* info, FILE* output) {
+    static const char* predictors[] = {"not-taken", "btb", "2-bit"};
+    fprintf(output, "Pipeline: 5 stages, %s predictor, %d cycle mispredict penalty\n",
+            predictors[P->predictor], MISPREDICT_PENALTY);
+    fprintf(output, "%-24s %10s %10s %6s %8s %8s %8s %8s\n", "function", "insns", "cycles", "CPI", "stalls",
+            "branches", "mispred", "pairs");
+
+    for (int i = 0; i < P->profile.numFunctions; i++) {
+        // a call the run stopped on before its first instruction
+        if (P->functions[i].instructions == 0) {
+            continue;
+        }
+        char name[MAX_SYMBOL_LEN];
+        FunctionName(&P->profile, i, CPU, info, name, sizeof(name));
+        PrintStats(name, &P->functions[i], output);
+    }
+
+    // the whole run also pays for filling the pipeline once
+    PipelineStats total = P->total;
+    total.cycles += PIPELINE_FILL;
+    PrintStats("total", &total, output);
+    if (total.instructions > 0) {
+        fprintf(output, "Dual issue would save %llu cycles (CPI %.3f)\n", total.pairs,
+                (double)(total.cycles - total.pairs) / total.instructions);
+    }
+}
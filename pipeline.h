@@ -0,0 +1,74 @@
+/*
+ * pipeline.h: Declares the 5-stage pipeline timing model
+ */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "profile.h"
+
+// Branch predictors
+#define PREDICT_NOT_TAKEN 0 // always fetch PC + 1
+#define PREDICT_BTB       1 // fetch the BTB's target when the PC hits
+#define PREDICT_2BIT      2 // BTB target, direction from 2-bit counters
+
+// Entries in the direct-mapped BTB and the 2-bit counter table
+#define BTB_SIZE 256
+
+// Cycles lost when a control transfer was fetched down the wrong path,
+// they resolve in X
+#define MISPREDICT_PENALTY 2
+
+// Cycles to fill (and drain) the F D X M W stages
+#define PIPELINE_FILL 4
+
+// Counters for the whole run or one function
+typedef struct {
+    unsigned long long instructions;
+    unsigned long long cycles;
+    unsigned long long loadUseStalls;
+    unsigned long long branches;
+    unsigned long long mispredictions;
+    unsigned long long pairs;
+} PipelineStats;
+
+typedef struct {
+    int predictor;
+
+    unsigned short int btbTag[BTB_SIZE];
+    unsigned short int btbTarget[BTB_SIZE];
+    unsigned char btbValid[BTB_SIZE];
+    unsigned char counter[BTB_SIZE];
+
+    // what the previous instruction left in flight, for hazards and pairing
+    int started;
+    unsigned short int lastPC;
+    int lastLoadReg;        // register an LDR is writing, -1 for none
+    int lastWriteReg;       // register written, -1 for none
+    int lastSetsNZP;
+    int lastMemory;
+    int lastControl;
+    int lastPaired;
+
+    PipelineStats total;
+    PipelineStats functions[MAX_FUNCTIONS];
+    FunctionProfile profile;
+} PipelineState;
+
+/*
+ * Start timing a run that begins at start with the given predictor.
+ */
+void InitPipeline(PipelineState* P, int predictor, unsigned short int start);
+
+/*
+ * Account for the instruction at pc that UpdateMachineState just executed,
+ * reading its control signals and the next PC from CPU.
+ */
+void PipelineStep(PipelineState* P, MachineState* CPU, unsigned short int pc);
+
+/*
+ * Print totals and CPI per function, naming functions from info (may be NULL).
+ */
+void PrintPipelineReport(PipelineState* P, MachineState* CPU, ObjectInfo* info, FILE* output);
+
+#endif
@@ -0,0 +1,87 @@
+/*
+ * pool.c: Defines pools of machines in a hugepage memory arena
+ */
+
+#include "pool.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+MachinePool* OpenPool(int count) {
+    MachinePool* P = calloc(1, sizeof(MachinePool));
+    if (P == NULL || (P->slots = calloc(count, sizeof(PooledMachine))) == NULL) {
+        fprintf(stderr, "Error: Out of memory for a pool of %d machines\n", count);
+        free(P);
+        return NULL;
+    }
+    P->count = count;
+
+    // slots a whole number of host pages apart, the first one shifted so
+    // that every memory array starts on a page
+    size_t lead = (POOL_PAGE - offsetof(MachineState, memory) % POOL_PAGE) % POOL_PAGE;
+    P->slotBytes = (sizeof(MachineState) + POOL_PAGE - 1) / POOL_PAGE * POOL_PAGE;
+    size_t bytes = (lead + count * P->slotBytes + POOL_HUGEPAGE - 1) / POOL_HUGEPAGE * POOL_HUGEPAGE;
+
+    unsigned char* arena = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                                -1, 0);
+    if (arena != MAP_FAILED) {
+        P->mapping = arena;
+        P->mappingBytes = bytes;
+        P->hugepages = 1;
+    } else {
+        // no reserved huge pages: over-map to align, and ask for transparent ones
+        P->mappingBytes = bytes + POOL_HUGEPAGE;
+        P->mapping = mmap(NULL, P->mappingBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (P->mapping == MAP_FAILED) {
+            fprintf(stderr, "Error: Out of memory for a pool of %d machines\n", count);
+            free(P->slots);
+            free(P);
+            return NULL;
+        }
+        uintptr_t start = ((uintptr_t)P->mapping + POOL_HUGEPAGE - 1) & ~(uintptr_t)(POOL_HUGEPAGE - 1);
+        arena = (unsigned char*)start;
+#ifdef MADV_HUGEPAGE
+        madvise(arena, bytes, MADV_HUGEPAGE);
+#endif
+    }
+
+    for (int i = 0; i < count; i++) {
+        P->slots[i].machine = (MachineState*)(arena + lead + i * P->slotBytes);
+    }
+    return P;
+}
+
+void ClosePool(MachinePool* P) {
+    if (P == NULL) {
+        return;
+    }
+    munmap(P->mapping, P->mappingBytes);
+    free(P->slots);
+    free(P);
+}
+
+MachineState* PoolMachine(MachinePool* P, int i) {
+    return P->slots[i].machine;
+}
+
+void PoolLoad(MachinePool* P, int i, const MachineState* image) {
+    memcpy(P->slots[i].machine, image, sizeof(MachineState));
+    P->slots[i].status = RUN_BREAKPOINT;
+    P->slots[i].instructions = 0;
+}
+
+void PoolStore(MachinePool* P, int i, MachineState* image) {
+    memcpy(image, P->slots[i].machine, sizeof(MachineState));
+}
+
+void PoolCopy(MachinePool* P, int to, int from) {
+    PoolLoad(P, to, P->slots[from].machine);
+}
+
+int RunPooled(MachinePool* P, int i, RunControl* control) {
+    unsigned long long before = control->instructions;
+    int status = RunFast(P->slots[i].machine, control);
+    P->slots[i].status = status;
+    P->slots[i].instructions += control->instructions - before;
+    return status;
+}
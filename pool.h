@@ -0,0 +1,74 @@
+/*
+ * pool.h: Declares pools of machines in a hugepage memory arena
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include "engine.h"
+
+// Size of a huge page, which the arena is rounded up to
+#define POOL_HUGEPAGE (2UL << 20)
+
+// Host page each instance's memory array starts on
+#define POOL_PAGE 4096UL
+
+// What the pool keeps of an instance besides its MachineState
+typedef struct {
+    MachineState* machine;              // its slot in the arena
+    int status;                         // RUN_* of the last RunPooled
+    unsigned long long instructions;    // over every RunPooled since PoolLoad
+} PooledMachine;
+
+typedef struct {
+    int count;
+    PooledMachine* slots;
+    void* mapping;                      // the arena as mapped
+    size_t mappingBytes;
+    size_t slotBytes;                   // distance between instances
+    int hugepages;                      // 1 for reserved huge pages, 0 for a transparent huge page hint
+} MachinePool;
+
+/*
+ * Make count zeroed instances. The arena holding their MachineStates comes
+ * from reserved huge pages when the system has them, else from a mapping
+ * aligned to POOL_HUGEPAGE marked for transparent huge pages. Each slot is
+ * placed so its memory array starts on a POOL_PAGE boundary. Returns NULL
+ * after printing an error.
+ */
+MachinePool* OpenPool(int count);
+
+/*
+ * Unmap the arena and free the pool.
+ */
+void ClosePool(MachinePool* P);
+
+/*
+ * The MachineState of instance i, in the arena.
+ */
+MachineState* PoolMachine(MachinePool* P, int i);
+
+/*
+ * Copy a whole MachineState into instance i, clearing its status and
+ * instruction count.
+ */
+void PoolLoad(MachinePool* P, int i, const MachineState* image);
+
+/*
+ * Copy instance i out as a whole MachineState.
+ */
+void PoolStore(MachinePool* P, int i, MachineState* image);
+
+/*
+ * Copy instance from over instance to, within the arena, clearing the
+ * copy's status and instruction count. Instance from is only read.
+ */
+void PoolCopy(MachinePool* P, int to, int from);
+
+/*
+ * RunFast on instance i, keeping the status and adding the instructions
+ * run to both the instance's count and control.
+ */
+int RunPooled(MachinePool* P, int i, RunControl* control);
+
+#endif
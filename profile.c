@@ -0,0 +1,61 @@
+/*
+ * profile.c: Defines per-function attribution of executed instructions
+ */
+
+#include "profile.h"
+
+// helper to find or add the function entered at entry
+static int FindFunction(FunctionProfile* profile, unsigned short int entry) {
+    if (profile->slot[entry] == 0) {
+        if (profile->numFunctions == MAX_FUNCTIONS) {
+            return profile->current;
+        }
+        profile->entry[profile->numFunctions] = entry;
+        profile->slot[entry] = ++profile->numFunctions;
+    }
+    return profile->slot[entry] - 1;
+}
+
+void InitFunctionProfile(FunctionProfile* profile, unsigned short int start) {
+    memset(profile, 0, sizeof(FunctionProfile));
+    profile->current = FindFunction(profile, start);
+}
+
+int ProfileStep(FunctionProfile* profile, unsigned short int insn, unsigned short int nextPC) {
+    int function = profile->current;
+    unsigned short int opcode = insn >> 12;
+
+    if (opcode == 4 || opcode == 15) {
+        // JSR, JSRR, TRAP
+        if (profile->depth < MAX_CALL_DEPTH) {
+            profile->stack[profile->depth++] = function;
+            profile->current = FindFunction(profile, nextPC);
+        }
+    } else if (opcode == 8 || (opcode == 12 && (insn & 0x0800) == 0 && ((insn >> 6) & 0x7) == 7)) {
+        // RTI, JMPR R7
+        if (profile->depth > 0) {
+            profile->current = profile->stack[--profile->depth];
+        } else {
+            profile->current = FindFunction(profile, nextPC);
+        }
+    }
+    return function;
+}
+
+void FunctionName(FunctionProfile* profile, int function, MachineState* CPU, ObjectInfo* info,
+                  char* name, size_t size) {
+    unsigned short int entry = profile->entry[function];
+    const char* label = info ? SymbolAt(info, entry) : NULL;
+
+    // a TRAP enters at its vector slot, which holds a JMP to the routine
+    unsigned short int jump = CPU->memory[entry];
+    if (label == NULL && info != NULL && (entry & 0xFF00) == 0x8000 && (jump & 0xF800) == 0xC800) {
+        label = SymbolAt(info, entry + 1 + (((jump & 0x7FF) ^ 0x400) - 0x400));
+    }
+
+    if (label != NULL) {
+        snprintf(name, size, "%s", label);
+    } else {
+        snprintf(name, size, "x%04X", entry);
+    }
+}
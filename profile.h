@@ -0,0 +1,48 @@
+/*
+ * profile.h: Declares per-function attribution of executed instructions
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "loader.h"
+
+// Most distinct functions told apart; later callees count toward their caller
+#define MAX_FUNCTIONS 1024
+
+// Deepest call nesting followed; deeper calls count toward the caller
+#define MAX_CALL_DEPTH 256
+
+// A function is the code between a JSR, JSRR or TRAP and its return
+typedef struct {
+    unsigned short int entry[MAX_FUNCTIONS];
+    int numFunctions;
+
+    // entry address -> function index + 1, 0 when not seen yet
+    unsigned short int slot[65536];
+
+    int stack[MAX_CALL_DEPTH];
+    int depth;
+    int current;
+} FunctionProfile;
+
+/*
+ * Start attributing at start, which becomes the first function.
+ */
+void InitFunctionProfile(FunctionProfile* profile, unsigned short int start);
+
+/*
+ * Follow an executed instruction: calls enter a new function and JMPR R7 or
+ * RTI leave it; a return with no caller left starts a new outermost function.
+ * Returns the index of the function the instruction itself belongs to.
+ */
+int ProfileStep(FunctionProfile* profile, unsigned short int insn, unsigned short int nextPC);
+
+/*
+ * Name a function after the label at its entry. TRAP vector slots are named
+ * after the routine their JMP leads to, unlabeled entries as xHHHH.
+ */
+void FunctionName(FunctionProfile* profile, int function, MachineState* CPU, ObjectInfo* info,
+                  char* name, size_t size);
+
+#endif
@@ -0,0 +1,46 @@
+/*
+ * repeat.c: Defines infinite loop detection from repeating machine states
+ */
+
+#include "repeat.h"
+
+int InitLoopDetector(LoopDetector* L, MachineState* CPU, unsigned long long count) {
+    memset(L, 0, sizeof(LoopDetector));
+    L->saved = malloc(sizeof(MachineState));
+    if (L->saved == NULL) {
+        fprintf(stderr, "Error: Out of memory for loop detection\n");
+        return -1;
+    }
+    if (!CPU->hashing) {
+        StartStateHash(CPU);
+    }
+    *L->saved = *CPU;
+    L->savedHash = StateHash(CPU);
+    L->savedAt = count;
+    L->power = 1;
+    return 0;
+}
+
+int CheckLoop(LoopDetector* L, MachineState* CPU, unsigned long long count) {
+    unsigned long long hash = StateHash(CPU);
+    MachineState* saved = L->saved;
+    if (hash == L->savedHash && saved->PC == CPU->PC && saved->PSR == CPU->PSR &&
+        memcmp(saved->R, CPU->R, sizeof(CPU->R)) == 0 &&
+        memcmp(saved->memory, CPU->memory, sizeof(CPU->memory)) == 0) {
+        L->repeatedAt = count;
+        return 1;
+    }
+    if (++L->length == L->power) {
+        *saved = *CPU;
+        L->savedHash = hash;
+        L->savedAt = count;
+        L->power *= 2;
+        L->length = 0;
+    }
+    return 0;
+}
+
+void FreeLoopDetector(LoopDetector* L) {
+    free(L->saved);
+    L->saved = NULL;
+}
@@ -0,0 +1,47 @@
+/*
+ * repeat.h: Declares infinite loop detection from repeating machine states
+ */
+
+#ifndef REPEAT_H
+#define REPEAT_H
+
+#include "engine.h"
+
+// Instructions between samples of the machine state
+#define LOOP_SAMPLE 4096
+
+/*
+ * Brent's cycle search over the machine state sampled every LOOP_SAMPLE
+ * instructions. Without devices the next state follows from the current
+ * one, so once a sample equals an earlier one the program runs forever.
+ * One sample is kept as a full copy, replaced after 1, 2, 4, ... further
+ * samples; every sample's StateHash is compared with it and a match is
+ * confirmed against the copy.
+ */
+typedef struct {
+    MachineState* saved;
+    unsigned long long savedHash;
+    unsigned long long savedAt;         // instruction count of the saved sample
+    unsigned long long power;           // samples compared before the next save
+    unsigned long long length;
+    unsigned long long repeatedAt;      // count at which the saved state came back
+} LoopDetector;
+
+/*
+ * Start the state hash of CPU if needed and save its state, count
+ * instructions into the run. Returns 0, or -1 after printing an error.
+ */
+int InitLoopDetector(LoopDetector* L, MachineState* CPU, unsigned long long count);
+
+/*
+ * Take the sample of CPU after count instructions, a multiple of
+ * LOOP_SAMPLE. Returns 1 if it is the saved state again.
+ */
+int CheckLoop(LoopDetector* L, MachineState* CPU, unsigned long long count);
+
+/*
+ * Release the saved copy.
+ */
+void FreeLoopDetector(LoopDetector* L);
+
+#endif
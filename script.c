@@ -0,0 +1,303 @@
+/*
+ * script.c: Replays PennSim script files without the GUI
+ */
+
+#include "script.h"
+#include "assembler.h"
+#include "engine.h"
+#include <limits.h>
+#include <pthread.h>
+#include <strings.h>
+
+// longest script line we accept
+#define MAX_LINE 1024
+
+// most words on a script line
+#define MAX_WORDS 8
+
+// state of one script being replayed
+typedef struct {
+    char* filename;
+    char dir[PATH_MAX];
+    int line;
+    MachineState* CPU;
+    ObjectInfo info;
+    unsigned char breakpoints[65536];
+    FILE* trace;
+    AsmImage* image;
+    char imageName[PATH_MAX];
+    unsigned long long instructions;
+    int faulted;
+} ScriptState;
+
+// arguments and result of one worker thread
+typedef struct {
+    char* filename;
+    int started;
+    int result;
+} ScriptJob;
+
+
+// helper to report a problem with the current script line
+static int ScriptError(ScriptState* S, const char* message, const char* arg) {
+    fprintf(stderr, "Error: %s:%d: %s %s\n", S->filename, S->line, message, arg ? arg : "");
+    return -1;
+}
+
+// helper to build a path relative to the script's directory; returns 0, or
+// -1 after reporting a path longer than PATH_MAX
+static int ScriptPath(ScriptState* S, const char* name, const char* ext, char* path) {
+    int length;
+    if (name[0] == '/' || S->dir[0] == '\0') {
+        length = snprintf(path, PATH_MAX, "%s%s", name, ext);
+    } else {
+        length = snprintf(path, PATH_MAX, "%s/%s%s", S->dir, name, ext);
+    }
+    if (length < 0 || length >= PATH_MAX) {
+        return ScriptError(S, "path too long for", name);
+    }
+    return 0;
+}
+
+// helper to resolve a PennSim address: a label, xHEX or #DECIMAL
+static int ParseAddress(ScriptState* S, const char* text, unsigned short int* address) {
+    char* end;
+    long value;
+
+    if (text[0] == 'x' || text[0] == 'X') {
+        value = strtol(text + 1, &end, 16);
+    } else if (text[0] == '#') {
+        value = strtol(text + 1, &end, 10);
+    } else {
+        return LookupSymbol(&S->info, text, address);
+    }
+
+    if (*end != '\0' || value < 0 || value > 0xFFFF) {
+        return -1;
+    }
+    *address = (unsigned short int)value;
+    return 0;
+}
+
+// helper to run until a breakpoint or a fault, always leaving the current PC
+static void Continue(ScriptState* S) {
+    // without a trace the fast engine gives the same result
+    if (S->trace == NULL) {
+        RunControl control = { .breakpoints = S->breakpoints };
+        if (RunFast(S->CPU, &control) == RUN_FAULT) {
+            S->faulted = 1;
+            fprintf(stderr, "%s:%d: execution stopped at PC %04X\n", S->filename, S->line, S->CPU->PC);
+        }
+        S->instructions += control.instructions;
+        return;
+    }
+
+    do {
+        if (UpdateMachineState(S->CPU, S->trace) != 0) {
+            S->faulted = 1;
+            fprintf(stderr, "%s:%d: execution stopped at PC %04X\n", S->filename, S->line, S->CPU->PC);
+            return;
+        }
+        S->instructions++;
+    } while (!S->breakpoints[S->CPU->PC]);
+}
+
+// helper to execute one tokenized script command
+static int ExecuteCommand(ScriptState* S, char** argv, int argc) {
+    char path[PATH_MAX];
+    unsigned short int address;
+
+    if (strcasecmp(argv[0], "reset") == 0) {
+        Reset(S->CPU);
+        FreeObjectInfo(&S->info);
+        memset(S->breakpoints, 0, sizeof(S->breakpoints));
+        FreeAsmImage(S->image);
+        S->image = NULL;
+        S->imageName[0] = '\0';
+    } else if (strcasecmp(argv[0], "clear") == 0) {
+        // clears the PennSim console, nothing to do headless
+    } else if (strcasecmp(argv[0], "as") == 0) {
+        if (argc != 3) {
+            return ScriptError(S, "usage: as <output> <source>", NULL);
+        }
+        // assemble in memory; ld of the same name skips the disk round trip
+        if (ScriptPath(S, argv[2], ".asm", path) != 0) {
+            return -1;
+        }
+        FILE* file = fopen(path, "r");
+        if (file == NULL) {
+            // no source next to the script, keep using the existing object
+            if (ScriptPath(S, argv[1], ".obj", path) != 0) {
+                return -1;
+            }
+            file = fopen(path, "rb");
+            if (file == NULL) {
+                return ScriptError(S, "no source or object file for", argv[2]);
+            }
+            fclose(file);
+            return 0;
+        }
+        fclose(file);
+
+        FreeAsmImage(S->image);
+        S->image = AssembleFile(path);
+        if (S->image == NULL) {
+            return ScriptError(S, "failed to assemble", path);
+        }
+        strncpy(S->imageName, argv[1], PATH_MAX - 1);
+    } else if (strcasecmp(argv[0], "ld") == 0) {
+        if (argc != 2) {
+            return ScriptError(S, "usage: ld <object>", NULL);
+        }
+        if (S->image != NULL && strcmp(S->imageName, argv[1]) == 0) {
+            return LoadAsmImage(S->image, S->CPU, &S->info);
+        }
+        if (ScriptPath(S, argv[1], ".obj", path) != 0) {
+            return -1;
+        }
+        if (LoadObjectFile(path, S->CPU, &S->info) != 0) {
+            return ScriptError(S, "failed to load", path);
+        }
+    } else if (strcasecmp(argv[0], "break") == 0) {
+        if (argc != 3 || (strcasecmp(argv[1], "set") != 0 && strcasecmp(argv[1], "clear") != 0)) {
+            return ScriptError(S, "usage: break set|clear <address>", NULL);
+        }
+        if (ParseAddress(S, argv[2], &address) != 0) {
+            return ScriptError(S, "unknown address", argv[2]);
+        }
+        S->breakpoints[address] = (strcasecmp(argv[1], "set") == 0);
+    } else if (strcasecmp(argv[0], "trace") == 0) {
+        if (S->trace != NULL) {
+            fclose(S->trace);
+            S->trace = NULL;
+        }
+        if (argc == 3 && strcasecmp(argv[1], "on") == 0) {
+            if (ScriptPath(S, argv[2], "", path) != 0) {
+                return -1;
+            }
+            S->trace = fopen(path, "wb");
+            if (S->trace == NULL) {
+                return ScriptError(S, "could not open trace file", path);
+            }
+        } else if (argc != 2 || strcasecmp(argv[1], "off") != 0) {
+            return ScriptError(S, "usage: trace on <file> | trace off", NULL);
+        }
+    } else if (strcasecmp(argv[0], "continue") == 0) {
+        Continue(S);
+    } else {
+        return ScriptError(S, "unknown command", argv[0]);
+    }
+    return 0;
+}
+
+int RunScript(char* filename) {
+    FILE* file = fopen(filename, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Error: Could not open file %s\n", filename);
+        return -1;
+    }
+
+    ScriptState* S = calloc(1, sizeof(ScriptState));
+    MachineState* CPU = malloc(sizeof(MachineState));
+    if (S == NULL || CPU == NULL) {
+        fprintf(stderr, "Error: Out of memory running %s\n", filename);
+        free(S);
+        free(CPU);
+        fclose(file);
+        return -1;
+    }
+    S->filename = filename;
+    S->CPU = CPU;
+    Reset(CPU);
+
+    // file names in the script are relative to the script itself
+    strncpy(S->dir, filename, PATH_MAX - 1);
+    char* slash = strrchr(S->dir, '/');
+    if (slash != NULL) {
+        *slash = '\0';
+    } else {
+        S->dir[0] = '\0';
+    }
+
+    int result = 0;
+    char line[MAX_LINE];
+    while (result == 0 && fgets(line, sizeof(line), file) != NULL) {
+        S->line++;
+
+        // split the line into words
+        char* argv[MAX_WORDS];
+        int argc = 0;
+        char* rest;
+        for (char* word = strtok_r(line, " \t\r\n", &rest); word != NULL; word = strtok_r(NULL, " \t\r\n", &rest)) {
+            if (argc == MAX_WORDS) {
+                result = ScriptError(S, "too many words at", word);
+                break;
+            }
+            argv[argc++] = word;
+        }
+
+        if (result == 0 && argc > 0) {
+            result = ExecuteCommand(S, argv, argc);
+        }
+    }
+
+    if (result == 0 && S->faulted) {
+        result = 1;
+    }
+
+    if (S->trace != NULL) {
+        fclose(S->trace);
+    }
+    FreeObjectInfo(&S->info);
+    FreeAsmImage(S->image);
+    free(S);
+    free(CPU);
+    fclose(file);
+    return result;
+}
+
+// worker thread body
+static void* ScriptThread(void* arg) {
+    ScriptJob* job = arg;
+    job->result = RunScript(job->filename);
+    return NULL;
+}
+
+int RunScripts(char** filenames, int count) {
+    ScriptJob* jobs = calloc(count, sizeof(ScriptJob));
+    pthread_t* threads = calloc(count, sizeof(pthread_t));
+    if (jobs == NULL || threads == NULL) {
+        fprintf(stderr, "Error: Out of memory starting scripts\n");
+        free(jobs);
+        free(threads);
+        return count;
+    }
+
+    for (int i = 0; i < count; i++) {
+        jobs[i].filename = filenames[i];
+        jobs[i].started = (pthread_create(&threads[i], NULL, ScriptThread, &jobs[i]) == 0);
+        if (!jobs[i].started) {
+            // could not start a thread, run this one inline
+            ScriptThread(&jobs[i]);
+        }
+    }
+
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        if (jobs[i].started) {
+            pthread_join(threads[i], NULL);
+        }
+        if (jobs[i].result == 0) {
+            printf("%s: ok\n", filenames[i]);
+        } else if (jobs[i].result > 0) {
+            printf("%s: stopped on fault\n", filenames[i]);
+        } else {
+            printf("%s: error\n", filenames[i]);
+            failed++;
+        }
+    }
+
+    free(jobs);
+    free(threads);
+    return failed;
+}
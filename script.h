@@ -0,0 +1,23 @@
+/*
+ * script.h: Declares the headless interpreter for PennSim script files
+ */
+
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include "loader.h"
+
+/*
+ * Run one PennSim script (reset, clear, as, ld, break, trace, continue).
+ * File names inside the script are relative to the script's directory.
+ * Returns 0 on success, 1 if a run stopped on a fault, -1 on a script error.
+ */
+int RunScript(char* filename);
+
+/*
+ * Run several scripts concurrently, one thread and one machine per script.
+ * Prints a status line per script and returns the number with script errors.
+ */
+int RunScripts(char** filenames, int count);
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ * shadow.c: Defines the shadow-memory checker for uninitialized reads and stack misuse
+ */
+
+#include "shadow.h"
+#include "video.h"
+
+void InitShadow(ShadowState* S, ObjectInfo* info, unsigned short int stackLo, unsigned short int stackHi) {
+    memset(S, 0, sizeof(ShadowState));
+    S->stackLo = stackLo;
+    S->stackHi = stackHi;
+    S->lowest = 0x10000;
+
+    for (int i = 0; info != NULL && i < info->numSections; i++) {
+        for (unsigned int j = 0; j < info->sections[i].words; j++) {
+            SHADOW_MARK(S, (unsigned short int)(info->sections[i].address + j));
+        }
+    }
+    // video memory through the device registers, a whole number of 64 word groups
+    memset(&S->initialized[VIDEO_BASE >> 6], 0xFF, sizeof(S->initialized) - (VIDEO_BASE >> 6) * sizeof(S->initialized[0]));
+}
+
+void ShadowUninitialized(ShadowState* S, unsigned short int pc, unsigned short int address) {
+    S->uninitializedReads++;
+    if (S->uninitializedAt[pc]++ == 0) {
+        S->uninitializedAddress[pc] = address;
+    }
+}
+
+void ShadowStack(ShadowState* S, unsigned short int pc, unsigned short int address) {
+    if (address < S->lowest) {
+        S->lowest = address;
+    }
+    if (address < S->stackLo || address > S->stackHi) {
+        S->stackViolations++;
+        if (S->stackAt[pc]++ == 0) {
+            S->stackAddress[pc] = address;
+        }
+    }
+}
+
+void ShadowStep(ShadowState* S, MachineState* CPU, unsigned short int pc, unsigned short int insn) {
+    if ((insn >> 12) == 6) {
+        ShadowLoad(S, pc, (insn >> 6) & 0x7, CPU->dmemAddr, CPU->PSR);
+    } else if ((insn >> 12) == 7) {
+        ShadowStore(S, pc, (insn >> 6) & 0x7, CPU->dmemAddr, CPU->PSR);
+    }
+}
+
+// helper to list the PCs with a non-zero count, at most SHADOW_MAX_SITES of them
+static void PrintSites(const unsigned long long* counts, const unsigned short int* addresses, const char* what,
+                       ObjectInfo* info, FILE* output) {
+    int sites = 0;
+    for (int pc = 0; pc < 65536; pc++) {
+        if (counts[pc] == 0) {
+            continue;
+        }
+        if (sites++ < SHADOW_MAX_SITES) {
+            const char* name = SymbolAt(info, pc);
+            fprintf(output, "  %04X %-16s %10llu %s, first x%04X\n", pc, name ? name : "", counts[pc], what,
+                    addresses[pc]);
+        }
+    }
+    if (sites > SHADOW_MAX_SITES) {
+        fprintf(output, "  ... and %d more\n", sites - SHADOW_MAX_SITES);
+    }
+}
+
+void PrintShadowReport(ShadowState* S, ObjectInfo* info, FILE* output) {
+    fprintf(output, "Shadow memory: %llu uninitialized reads, %llu stack accesses outside x%04X-x%04X\n",
+            S->uninitializedReads, S->stackViolations, S->stackLo, S->stackHi);
+    if (S->lowest <= S->stackHi) {
+        fprintf(output, "Deepest user stack access: x%04X, %u words below x%04X\n", S->lowest,
+                S->stackHi + 1 - S->lowest, S->stackHi + 1);
+    }
+    if (S->uninitializedReads > 0) {
+        fprintf(output, "Uninitialized reads:\n");
+        PrintSites(S->uninitializedAt, S->uninitializedAddress, "reads", info, output);
+    }
+    if (S->stackViolations > 0) {
+        fprintf(output, "Stack accesses out of bounds:\n");
+        PrintSites(S->stackAt, S->stackAddress, "accesses", info, output);
+    }
+}
@@ -0,0 +1,90 @@
+/*
+ * shadow.h: Declares the shadow-memory checker for uninitialized reads and stack misuse
+ */
+
+#ifndef SHADOW_H
+#define SHADOW_H
+
+#include <stdio.h>
+#include "loader.h"
+
+// User stack bounds unless told otherwise: the user data region, which the
+// stack grows down through from x7FFF
+#define SHADOW_STACK_LO 0x2000
+#define SHADOW_STACK_HI 0x7FFF
+
+// Most sites listed per kind of report
+#define SHADOW_MAX_SITES 32
+
+typedef struct ShadowState {
+    // a bit per word, set once the loader or an STR has written it
+    unsigned long long initialized[65536 / 64];
+
+    unsigned short int stackLo;
+    unsigned short int stackHi;
+    unsigned int lowest;                    // lowest user R6-based address, 0x10000 before any
+
+    unsigned long long uninitializedReads;
+    unsigned long long stackViolations;
+
+    // per PC: how often it read an uninitialized word or left the stack
+    // bounds, and the first address it did so at
+    unsigned long long uninitializedAt[65536];
+    unsigned short int uninitializedAddress[65536];
+    unsigned long long stackAt[65536];
+    unsigned short int stackAddress[65536];
+} ShadowState;
+
+// Non-zero if the word at address has been loaded or stored
+#define SHADOW_INITIALIZED(S, address) (((S)->initialized[(address) >> 6] >> ((address) & 63)) & 1)
+
+// Mark the word at address as initialized
+#define SHADOW_MARK(S, address) ((S)->initialized[(address) >> 6] |= 1ULL << ((address) & 63))
+
+/*
+ * Start with the words of every code and data section in info initialized,
+ * along with video memory and the device registers, whose contents come
+ * from the hardware. User-mode LDR/STR with base R6 must stay within
+ * stackLo..stackHi.
+ */
+void InitShadow(ShadowState* S, ObjectInfo* info, unsigned short int stackLo, unsigned short int stackHi);
+
+/*
+ * Record an uninitialized read by the LDR at pc, and a user R6-based access
+ * that is the deepest so far or above the stack; the slow paths of the
+ * checks below.
+ */
+void ShadowUninitialized(ShadowState* S, unsigned short int pc, unsigned short int address);
+void ShadowStack(ShadowState* S, unsigned short int pc, unsigned short int address);
+
+// The checks of an LDR or STR at pc with base register base, run by both
+// engines; the common case is a bit test and a compare
+static inline void ShadowLoad(ShadowState* S, unsigned short int pc, int base, unsigned short int address,
+                              unsigned short int PSR) {
+    if (!SHADOW_INITIALIZED(S, address)) {
+        ShadowUninitialized(S, pc, address);
+    }
+    if (base == 6 && !(PSR & 0x8000) && (address < S->lowest || address > S->stackHi)) {
+        ShadowStack(S, pc, address);
+    }
+}
+
+static inline void ShadowStore(ShadowState* S, unsigned short int pc, int base, unsigned short int address,
+                               unsigned short int PSR) {
+    SHADOW_MARK(S, address);
+    if (base == 6 && !(PSR & 0x8000) && (address < S->lowest || address > S->stackHi)) {
+        ShadowStack(S, pc, address);
+    }
+}
+
+/*
+ * Check the LDR or STR, if any, at pc that UpdateMachineState just executed.
+ */
+void ShadowStep(ShadowState* S, MachineState* CPU, unsigned short int pc, unsigned short int insn);
+
+/*
+ * Print the totals, the deepest stack access and the sites of each report.
+ */
+void PrintShadowReport(ShadowState* S, ObjectInfo* info, FILE* output);
+
+#endif
@@ -2,16 +2,814 @@
  * trace.c: location of main() to start the simulator
  */
 
-#include "loader.h"
+#include "analysis.h"
+#include "assembler.h"
+#include "batch.h"
+#include "cache.h"
+#include "cosim.h"
+#include "coverage.h"
+#include "device.h"
+#include "daemon.h"
+#include "engine.h"
+#include "memo.h"
+#include "metrics.h"
+#include "multicore.h"
+#include "oracle.h"
+#include "pipeline.h"
+#include "repeat.h"
+#include "video.h"
+#include "script.h"
+#include "shadow.h"
 
 // Global variable defining the current state of the machine
 MachineState* CPU;
 static MachineState CPUState;
 
+// Samples of the run for -l
+static LoopDetector detector;
+
+// Whether each word was written and the stack bounds, for -U
+static ShadowState shadowState;
+
+// Which instructions ran and which way each BR went, for -v and -E
+static Coverage coverage;
+
+// Most -w ranges a run can trace
+#define MAX_TRACE_RANGES 16
+
+// Which instructions a traced run writes out; everything else still runs
+typedef struct {
+    int numRanges;                          // PC ranges, none for any PC
+    unsigned short int lo[MAX_TRACE_RANGES];
+    unsigned short int hi[MAX_TRACE_RANGES];
+    unsigned long long from;                // instruction counts, to = 0 for no end
+    unsigned long long to;
+    int mode;                               // 0 user, 1 OS, -1 either
+} TraceWindow;
+
+// helper to parse "lo:hi" as hex addresses, each with an optional x or 0x
+static int ParseRange(const char* text, unsigned short int* lo, unsigned short int* hi) {
+    unsigned long value[2];
+    for (int i = 0; i < 2; i++) {
+        if (text[0] == '0' && (text[1] == 'x' || text[1] == 'X')) {
+            text += 2;
+        } else if (text[0] == 'x' || text[0] == 'X') {
+            text++;
+        }
+        char* end;
+        value[i] = strtoul(text, &end, 16);
+        if (end == text || value[i] > 0xFFFF || *end != (i == 0 ? ':' : '\0')) {
+            return -1;
+        }
+        text = end + 1;
+    }
+    if (value[0] > value[1]) {
+        return -1;
+    }
+    *lo = value[0];
+    *hi = value[1];
+    return 0;
+}
+
+// helper to tell whether the next instruction, with count run before it, is traced
+static int InWindow(const TraceWindow* window, MachineState* CPU, unsigned long long count) {
+    if (count < window->from || (window->to != 0 && count >= window->to)) {
+        return 0;
+    }
+    if (window->mode >= 0 && (CPU->PSR >> 15) != window->mode) {
+        return 0;
+    }
+    if (window->numRanges == 0) {
+        return 1;
+    }
+    for (int i = 0; i < window->numRanges; i++) {
+        if (CPU->PC >= window->lo[i] && CPU->PC <= window->hi[i]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// helper to order state hashes for counting the distinct ones
+static int CompareHashes(const void* a, const void* b) {
+    unsigned long long x = *(const unsigned long long*)a;
+    unsigned long long y = *(const unsigned long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+// helper to sort count hashes and count the distinct values among them
+static int CountDistinct(unsigned long long* hashes, int count) {
+    qsort(hashes, count, sizeof(unsigned long long), CompareHashes);
+    int distinct = 0;
+    for (int i = 0; i < count; i++) {
+        distinct += i == 0 || hashes[i] != hashes[i - 1];
+    }
+    return distinct;
+}
+
+// helper to say why a run stopped early
+static void ReportStop(int status, MachineState* CPU, unsigned long long count) {
+    if (status == RUN_BUDGET) {
+        fprintf(stderr, "Stopped: instruction budget used up after %llu instructions at PC %04X\n", count, CPU->PC);
+    } else if (status == RUN_TIMEOUT) {
+        fprintf(stderr, "Stopped: time limit reached after %llu instructions at PC %04X\n", count, CPU->PC);
+    } else if (status == RUN_LOOP) {
+        fprintf(stderr, "Stopped: infinite loop, the state after %llu instructions repeats after %llu at PC %04X\n",
+                detector.savedAt, count, CPU->PC);
+    }
+}
+
+
+// Leading options:
+//   -f / -F       untraced run on the fast engine instead of an output file
+//                 (-F also runs known OS TRAP routines natively)
+//   -k keys.txt   attach the devices, keyboard input from a file (- for stdin)
+//   -d out.txt    attach the devices, display output to a file (default stdout)
+//   -p prefix     write video frames as prefixNNNN.ppm (implies the devices)
+//   -r video.rgb  write video frames as a raw RGB24 stream (implies the devices)
+//   -n N          keep every Nth TRAP_BLT_VMEM frame (default 1)
+//   -P predictor  time the traced run on the 5-stage pipeline model with a
+//                 nt, btb or 2bit branch predictor and print CPI per function
+//   -I / -D / -L size:ways:line[:lru|fifo|random]
+//                 model L1 instruction / L1 data / shared L2 caches on the
+//                 traced run (sizes in words) and print hit rates
+//   -w lo:hi      only trace instructions at PCs lo..hi (hex, repeatable)
+//   -c N:M        only trace once N instructions have run and until M have
+//                 (:M may be left off)
+//   -m user|os    only trace instructions run in user or OS mode
+//   -b N          stop after N instructions
+//   -t seconds    stop after this much wall-clock time
+//   -B inputs.txt run the program once per line of inputs.txt, in lockstep,
+//                 and print each instance's final state instead of a trace
+//   -o lo:hi      with -B, also print the words at lo..hi (repeatable)
+//   -A            print the static analysis of the loaded image (blocks, call
+//                 graph, stores that may write code) instead of running
+//   -M cores      run that many cores sharing memory, one host thread each,
+//                 core N tracing to output.N (no trace with -f)
+//   -q N          instructions per core per turn (default 1000)
+//   -C sc|tso     memory model: cores take turns and see stores at once, or
+//                 run together and see each other's stores after each turn
+//   -U            check LDRs against a shadow map of initialized words and
+//                 user R6-based accesses against the stack bounds
+//   -u lo:hi      user stack bounds for -U (default x2000:x7FFF, implies -U)
+//   -X            run the reference and fast engines side by side, comparing
+//                 their state wherever the fast engine stops or every 2^20
+//                 instructions, then the whole run in one fast call, instead
+//                 of writing a trace
+//   -H            print the 64-bit hash of the final machine state (with -B,
+//                 per instance, and how many start and end states differ)
+//   -l            stop once the machine state repeats, an infinite loop
+//   -v cov.bin    record which instructions ran and which way each BR went,
+//                 write the bitmaps to cov.bin and print the coverage report
+//   -z            with -f/-F, replay the results of pure subroutines called
+//                 again with the same arguments
+//   -J m.ndjson   append a metrics record of the run (or batch) as a line of JSON
+//   -O m.prom     add the run's metrics to the counters in a Prometheus text file
+// Outside the -w/-c/-m window the traced run uses the fast engine, with
+// native TRAP routines, unless a pipeline or cache model needs every step.
+typedef struct {
+    int analyze, fast, hostTraps, devices, every, predictor;
+    CacheConfig cacheConfig[3];
+    int hasCache[3];
+    char* keysName;
+    char* displayName;
+    char* ppmPrefix;
+    char* rawName;
+    TraceWindow window;
+    unsigned long long budget;
+    double seconds;
+    char* batchName;
+    unsigned short int outLo[MAX_TRACE_RANGES], outHi[MAX_TRACE_RANGES];
+    int numOut;
+    MulticoreConfig multicore;
+    int shadow, cosim, hashes, loops;
+    char* coverageName;
+    int memo;
+    char* metricsJson;
+    char* metricsText;
+    unsigned short int stackLo, stackHi;
+
+    // worked out from the above once they are all parsed
+    int caches;     // either L1
+    int windowed;   // any of -w, -c and -m
+    int batch;      // -B
+    int cores;      // -M
+    int covered;    // -v
+    int metered;    // -J or -O
+} Options;
+
+// helper to parse the leading options into O, returning the index of the first file name or -1
+static int ParseOptions(int argc, char** argv, Options* O) {
+    *O = (Options){
+        .every = 1,
+        .predictor = -1,
+        .window = { .mode = -1 },
+        .multicore = { .model = MODEL_SC, .quantum = MULTICORE_DEFAULT_QUANTUM },
+        .stackLo = SHADOW_STACK_LO,
+        .stackHi = SHADOW_STACK_HI,
+    };
+    TraceWindow* window = &O->window;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-' && argv[arg][1] != '\0'; arg++) {
+        if (strcmp(argv[arg], "-f") == 0 || strcmp(argv[arg], "-F") == 0) {
+            O->fast = 1;
+            O->hostTraps = (argv[arg][1] == 'F');
+        } else if (strcmp(argv[arg], "-k") == 0 && arg + 1 < argc) {
+            O->keysName = argv[++arg];
+            O->devices = 1;
+        } else if (strcmp(argv[arg], "-d") == 0 && arg + 1 < argc) {
+            O->displayName = argv[++arg];
+            O->devices = 1;
+        } else if (strcmp(argv[arg], "-p") == 0 && arg + 1 < argc) {
+            O->ppmPrefix = argv[++arg];
+            O->devices = 1;
+        } else if (strcmp(argv[arg], "-r") == 0 && arg + 1 < argc) {
+            O->rawName = argv[++arg];
+            O->devices = 1;
+        } else if (strcmp(argv[arg], "-n") == 0 && arg + 1 < argc) {
+            O->every = atoi(argv[++arg]);
+        } else if ((strcmp(argv[arg], "-I") == 0 || strcmp(argv[arg], "-D") == 0 ||
+                    strcmp(argv[arg], "-L") == 0) && arg + 1 < argc) {
+            int level = argv[arg][1] == 'I' ? 0 : (argv[arg][1] == 'D' ? 1 : 2);
+            if (ParseCacheConfig(argv[++arg], &O->cacheConfig[level]) != 0) {
+                fprintf(stderr, "Error: Bad cache configuration %s\n", argv[arg]);
+                return -1;
+            }
+            O->hasCache[level] = 1;
+        } else if (strcmp(argv[arg], "-P") == 0 && arg + 1 < argc) {
+            arg++;
+            O->predictor = strcmp(argv[arg], "nt") == 0 ? PREDICT_NOT_TAKEN :
+                           strcmp(argv[arg], "btb") == 0 ? PREDICT_BTB :
+                           strcmp(argv[arg], "2bit") == 0 ? PREDICT_2BIT : -2;
+        } else if (strcmp(argv[arg], "-w") == 0 && arg + 1 < argc) {
+            arg++;
+            if (window->numRanges == MAX_TRACE_RANGES ||
+                ParseRange(argv[arg], &window->lo[window->numRanges], &window->hi[window->numRanges]) != 0) {
+                fprintf(stderr, "Error: Bad trace range %s\n", argv[arg]);
+                return -1;
+            }
+            window->numRanges++;
+        } else if (strcmp(argv[arg], "-c") == 0 && arg + 1 < argc) {
+            arg++;
+            if (sscanf(argv[arg], "%llu:%llu", &window->from, &window->to) < 1 ||
+                (window->to != 0 && window->to <= window->from)) {
+                fprintf(stderr, "Error: Bad instruction window %s\n", argv[arg]);
+                return -1;
+            }
+        } else if (strcmp(argv[arg], "-m") == 0 && arg + 1 < argc) {
+            arg++;
+            window->mode = strcmp(argv[arg], "user") == 0 ? 0 : strcmp(argv[arg], "os") == 0 ? 1 : -2;
+        } else if (strcmp(argv[arg], "-B") == 0 && arg + 1 < argc) {
+            O->batchName = argv[++arg];
+        } else if (strcmp(argv[arg], "-o") == 0 && arg + 1 < argc) {
+            arg++;
+            if (O->numOut == MAX_TRACE_RANGES ||
+                ParseRange(argv[arg], &O->outLo[O->numOut], &O->outHi[O->numOut]) != 0) {
+                fprintf(stderr, "Error: Bad output range %s\n", argv[arg]);
+                return -1;
+            }
+            O->numOut++;
+        } else if (strcmp(argv[arg], "-A") == 0) {
+            O->analyze = 1;
+        } else if (strcmp(argv[arg], "-M") == 0 && arg + 1 < argc) {
+            O->multicore.cores = atoi(argv[++arg]);
+        } else if (strcmp(argv[arg], "-q") == 0 && arg + 1 < argc) {
+            O->multicore.quantum = strtoull(argv[++arg], NULL, 10);
+        } else if (strcmp(argv[arg], "-C") == 0 && arg + 1 < argc) {
+            arg++;
+            O->multicore.model = strcmp(argv[arg], "sc") == 0 ? MODEL_SC :
+                                 strcmp(argv[arg], "tso") == 0 ? MODEL_TSO : -1;
+        } else if (strcmp(argv[arg], "-H") == 0) {
+            O->hashes = 1;
+        } else if (strcmp(argv[arg], "-l") == 0) {
+            O->loops = 1;
+        } else if (strcmp(argv[arg], "-v") == 0 && arg + 1 < argc) {
+            O->coverageName = argv[++arg];
+        } else if (strcmp(argv[arg], "-z") == 0) {
+            O->memo = 1;
+        } else if (strcmp(argv[arg], "-J") == 0 && arg + 1 < argc) {
+            O->metricsJson = argv[++arg];
+        } else if (strcmp(argv[arg], "-O") == 0 && arg + 1 < argc) {
+            O->metricsText = argv[++arg];
+        } else if (strcmp(argv[arg], "-X") == 0) {
+            O->cosim = 1;
+        } else if (strcmp(argv[arg], "-U") == 0) {
+            O->shadow = 1;
+        } else if (strcmp(argv[arg], "-u") == 0 && arg + 1 < argc) {
+            arg++;
+            if (ParseRange(argv[arg], &O->stackLo, &O->stackHi) != 0) {
+                fprintf(stderr, "Error: Bad stack bounds %s\n", argv[arg]);
+                return -1;
+            }
+            O->shadow = 1;
+        } else if (strcmp(argv[arg], "-b") == 0 && arg + 1 < argc) {
+            O->budget = strtoull(argv[++arg], NULL, 10);
+        } else if (strcmp(argv[arg], "-t") == 0 && arg + 1 < argc) {
+            O->seconds = atof(argv[++arg]);
+        } else {
+            break;
+        }
+    }
+
+    // a missing L1 gets the other one's geometry
+    O->caches = O->hasCache[0] || O->hasCache[1];
+    if (O->caches && !O->hasCache[0]) {
+        O->cacheConfig[0] = O->cacheConfig[1];
+    } else if (O->caches && !O->hasCache[1]) {
+        O->cacheConfig[1] = O->cacheConfig[0];
+    }
+    O->windowed = window->numRanges > 0 || window->from > 0 || window->to > 0 || window->mode >= 0;
+    O->batch = O->batchName != NULL;
+    O->cores = O->multicore.cores != 0;
+    O->covered = O->coverageName != NULL;
+    O->metered = O->metricsJson != NULL || O->metricsText != NULL;
+    return arg;
+}
+
+// helper to tell whether any of the timing and cache models is on; they
+// follow the traced path's control signals, so only a traced run has them
+static int HasModels(const Options* O) {
+    return O->predictor >= 0 || O->caches || O->hasCache[2];
+}
+
+// helper to tell whether the options ask for a run of any kind
+static int HasRun(const Options* O) {
+    return O->fast || O->batch || O->cores || O->devices || HasModels(O) || O->windowed || O->shadow ||
+           O->covered;
+}
+
+// helper to check -A: an analysis only loads the files
+static int ValidAnalysis(const Options* O) {
+    return !O->analyze || (!HasRun(O) && !O->hashes && !O->loops && !O->metered);
+}
+
+// helper to check -X: the engines run side by side on their own
+static int ValidCosim(const Options* O) {
+    return !O->cosim || (!HasRun(O) && !O->analyze && !O->hashes && !O->loops && !O->metered);
+}
+
+// helper to check -B: a batch runs without devices or models and has no
+// trace file; -o only means something to a batch
+static int ValidBatch(const Options* O) {
+    if (!O->batch) {
+        return O->numOut == 0;
+    }
+    return !O->fast && !O->devices && !HasModels(O) && !O->windowed && !O->shadow && !O->covered && !O->loops;
+}
+
+// helper to check -M: each core has its own trace file and no devices
+static int ValidMulticore(const Options* O) {
+    if (O->multicore.model < 0) {
+        return 0;
+    }
+    return !O->cores || (!O->batch && !O->devices && !O->hostTraps && !HasModels(O) && !O->windowed &&
+                         !O->shadow && !O->covered && !O->hashes && !O->loops && !O->metered);
+}
+
+// helper to check -f/-F: a fast run writes no trace, so it has no window
+// or models; only it replays calls, and not while recording coverage
+static int ValidFast(const Options* O) {
+    if (O->memo && (!O->fast || O->covered)) {
+        return 0;
+    }
+    return !O->fast || (!HasModels(O) && !O->windowed);
+}
+
+// helper to check the models and window of a traced run
+static int ValidTraced(const Options* O) {
+    return O->predictor != -2 && O->window.mode != -2 && (!O->hasCache[2] || O->caches) &&
+           (!O->loops || (!O->devices && !O->windowed));
+}
+
+// helper to check the options go together, with files names left after them
+static int ValidOptions(const Options* O, int files) {
+    // all but a traced run need only the files to load
+    int needed = O->fast || O->batch || O->analyze || O->cosim ? 1 : 2;
+    return files >= needed && ValidAnalysis(O) && ValidCosim(O) && ValidBatch(O) && ValidMulticore(O) &&
+           ValidFast(O) && ValidTraced(O);
+}
+
+// helper to attach the devices and video the options ask for
+static int OpenRunDevices(const Options* O, DeviceState** deviceState, VideoState** video) {
+    FILE* keys = NULL;
+    if (O->keysName != NULL) {
+        keys = strcmp(O->keysName, "-") == 0 ? stdin : fopen(O->keysName, "rb");
+        if (keys == NULL) {
+            fprintf(stderr, "Error: Could not open file %s\n", O->keysName);
+            return -1;
+        }
+    }
+    FILE* display = O->displayName != NULL ? fopen(O->displayName, "wb") : stdout;
+    if (display == NULL) {
+        fprintf(stderr, "Error: Could not open file %s\n", O->displayName);
+        return -1;
+    }
+    *deviceState = OpenDevices(keys, display);
+    if (*deviceState == NULL) {
+        return -1;
+    }
+    AttachDevices(CPU, *deviceState);
+
+    if (O->ppmPrefix != NULL || O->rawName != NULL) {
+        FILE* raw = NULL;
+        if (O->rawName != NULL && (raw = fopen(O->rawName, "wb")) == NULL) {
+            fprintf(stderr, "Error: Could not open file %s\n", O->rawName);
+            return -1;
+        }
+        *video = OpenVideo(O->ppmPrefix, raw, O->every);
+        if (*video == NULL) {
+            return -1;
+        }
+        AttachVideo(CPU, *video);
+    }
+    return 0;
+}
+
+// helper to run -M: the cores share memory, each tracing to traceName.N
+static int RunCores(Options* O, const char* traceName, unsigned long long deadline) {
+    static FILE* outputs[MULTICORE_MAX_CORES];
+    static int status[MULTICORE_MAX_CORES];
+    static unsigned long long instructions[MULTICORE_MAX_CORES];
+    static unsigned short int corePC[MULTICORE_MAX_CORES];
+    MulticoreConfig* config = &O->multicore;
+    for (int i = 0; traceName != NULL && i < config->cores && i < MULTICORE_MAX_CORES; i++) {
+        char name[4096];
+        snprintf(name, sizeof(name), "%s.%d", traceName, i);
+        outputs[i] = fopen(name, "wb");
+        if (outputs[i] == NULL) {
+            fprintf(stderr, "Error: Could not open file %s\n", name);
+            return -1;
+        }
+    }
+    // the cores' threads share stdout
+    DebugOutput = 0;
+    config->maxInstructions = O->budget;
+    config->deadline = deadline;
+    if (RunMulticore(CPU, config, outputs, status, instructions, corePC) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < config->cores; i++) {
+        printf("Core %d: %s after %llu instructions at PC %04X\n", i, RunStatusName(status[i]), instructions[i], corePC[i]);
+        if (outputs[i] != NULL) {
+            fclose(outputs[i]);
+        }
+    }
+    return 0;
+}
+
+// helper to run -X: the reference and fast engines side by side
+static int RunSideBySide(const Options* O, ObjectInfo* info, unsigned long long deadline) {
+    CosimResult result;
+    DebugOutput = 0;
+    int diverged = RunCosim(CPU, info, O->budget, deadline, &result, stdout);
+    if (diverged < 0) {
+        return -1;
+    }
+    CPU->PC = result.PC;
+    ReportStop(result.status, CPU, result.instructions);
+    if (diverged) {
+        return -1;
+    }
+    printf("Engines agree on %llu instructions (%llu skipped, run natively or replayed) in %llu runs "
+           "(%llu full compares), stopped at PC %04X\n", result.instructions, result.shortcuts, result.stops,
+           result.fullCompares, result.PC);
+    return 0;
+}
+
+// helper to run -B: one instance per line of the inputs file, in lockstep
+static int RunBatchFile(Options* O, RunMetrics* metrics, unsigned long long deadline) {
+    BatchState* B = ReadBatchInputs(O->batchName, CPU);
+    if (B == NULL) {
+        return -1;
+    }
+    // identical instances run identically, so the counts show how many
+    // distinct runs and end states the batch really holds
+    unsigned long long* starts = NULL;
+    if (O->hashes && (starts = malloc(2 * B->lanes * sizeof(unsigned long long))) == NULL) {
+        fprintf(stderr, "Error: Out of memory for the batch\n");
+        return -1;
+    }
+    for (int lane = 0; O->hashes && lane < B->lanes; lane++) {
+        starts[lane] = BatchStateHash(B, lane);
+    }
+    unsigned long long start = MonotonicNanoseconds();
+    RunBatch(B, O->budget, deadline);
+    metrics->engineSeconds[ENGINE_BATCH] = ElapsedSeconds(start, MonotonicNanoseconds());
+    PrintBatchResults(B, O->outLo, O->outHi, O->numOut, O->hashes, stdout);
+    if (O->hashes) {
+        unsigned long long* ends = &starts[B->lanes];
+        for (int lane = 0; lane < B->lanes; lane++) {
+            ends[lane] = BatchStateHash(B, lane);
+        }
+        printf("Distinct states: %d at the start, %d at the end, of %d instances\n",
+               CountDistinct(starts, B->lanes), CountDistinct(ends, B->lanes), B->lanes);
+        free(starts);
+    }
+    for (int lane = 0; lane < B->lanes; lane++) {
+        metrics->instructions += B->instructions[lane];
+        CountOutcome(metrics, B->status[lane], B->status[lane] == RUN_FAULT ? B->fault[lane] : 0);
+    }
+    memcpy(metrics->opcodes, B->opcodes, sizeof(metrics->opcodes));
+    CloseBatch(B);
+    return WriteMetrics(O->metricsJson, O->metricsText, metrics) == 0 ? 0 : -1;
+}
+
+// helper to print the -U, -v, -z and -H reports at the end of a single run
+static int PrintRunReports(const Options* O, ObjectInfo* info, MemoTable* memoTable) {
+    if (O->shadow) {
+        PrintShadowReport(&shadowState, info, stdout);
+    }
+    if (O->covered) {
+        if (WriteCoverage(O->coverageName, &coverage) != 0) {
+            return -1;
+        }
+        PrintCoverageReport(&coverage, CPU, info, stdout);
+    }
+    if (memoTable != NULL) {
+        PrintMemoReport(memoTable, info, stdout);
+    }
+    if (O->hashes) {
+        printf("State hash: %016llX\n", StateHash(CPU));
+    }
+    return 0;
+}
+
+// helper to run -f/-F: the whole program on the fast engine, no trace
+static int RunFastOnly(const Options* O, ObjectInfo* info, RunMetrics* metrics, unsigned long long deadline,
+                       DeviceState* deviceState, VideoState* video) {
+    static unsigned char breakpoints[65536];
+    breakpoints[0x80FF] = 1;
+    RunControl control = {
+        .breakpoints = breakpoints,
+        .maxInstructions = O->budget,
+        .deadline = deadline,
+        .shadow = O->shadow ? &shadowState : NULL,
+        .coverage = O->covered ? &coverage : NULL,
+        .opcodes = O->metered ? metrics->opcodes : NULL,
+    };
+    static HostTraps traps;
+    if (O->hostTraps) {
+        PrepareHostTraps(CPU, breakpoints, &traps);
+        control.hostTraps = &traps;
+    }
+    // full traces never replay, every instruction is written out
+    static MemoTable memoTable;
+    if (O->memo) {
+        static CodeAnalysis analysis;
+        if (AnalyzeImage(CPU, info, &analysis) != 0 || PrepareMemo(CPU, &analysis, breakpoints, &memoTable) < 0) {
+            return -1;
+        }
+        FreeAnalysis(&analysis);
+        control.memo = &memoTable;
+    }
+    // with loop detection the run stops for a sample every LOOP_SAMPLE instructions
+    int status;
+    unsigned long long start = MonotonicNanoseconds();
+    for (;;) {
+        if (O->loops) {
+            unsigned long long sample = control.instructions + LOOP_SAMPLE;
+            control.maxInstructions = O->budget != 0 && O->budget < sample ? O->budget : sample;
+        }
+        status = RunFast(CPU, &control);
+        if (!O->loops || status != RUN_BUDGET || control.instructions == O->budget) {
+            break;
+        }
+        if (CheckLoop(&detector, CPU, control.instructions)) {
+            status = RUN_LOOP;
+            break;
+        }
+    }
+    metrics->engineSeconds[ENGINE_FAST] = ElapsedSeconds(start, MonotonicNanoseconds());
+    ReportStop(status, CPU, control.instructions);
+    int videoFailed = CloseVideo(CPU, video) != 0;
+    CloseDevices(deviceState);
+    printf("Executed %llu instructions, stopped at PC %04X\n", control.instructions, CPU->PC);
+    if (PrintRunReports(O, info, O->memo ? &memoTable : NULL) != 0) {
+        return -1;
+    }
+    metrics->instructions = control.instructions;
+    CountOutcome(metrics, status, status == RUN_FAULT ? CPU->fault : 0);
+    if (WriteMetrics(O->metricsJson, O->metricsText, metrics) != 0 || videoFailed) {
+        return -1;
+    }
+    // a run that faulted or ran out of time did not finish
+    return status == RUN_FAULT || status == RUN_TIMEOUT ? -1 : 0;
+}
+
+// helper to run the program writing the trace to out_file, stepping the
+// models, and using the fast engine outside the trace window
+static int RunTraced(Options* O, ObjectInfo* info, RunMetrics* metrics, unsigned long long deadline,
+                     DeviceState* deviceState, VideoState* video, FILE* out_file) {
+    const TraceWindow* window = &O->window;
+    unsigned long long budget = O->budget;
+    unsigned short int currentPC = CPU->PC;
+    static PipelineState pipeline;
+    if (O->predictor >= 0) {
+        InitPipeline(&pipeline, O->predictor, currentPC);
+    }
+    static CacheSystem cacheSystem;
+    if (O->caches && InitCacheSystem(&cacheSystem, &O->cacheConfig[0], &O->cacheConfig[1],
+                                     O->hasCache[2] ? &O->cacheConfig[2] : NULL, currentPC) != 0) {
+        return -1;
+    }
+
+    // breakpoints for the fast engine: where the window's PC ranges start
+    // being traced, or only the halt
+    static unsigned char haltBreakpoints[65536];
+    static unsigned char rangeBreakpoints[65536];
+    haltBreakpoints[0x80FF] = 1;
+    rangeBreakpoints[0x80FF] = 1;
+    for (int i = 0; i < window->numRanges; i++) {
+        memset(&rangeBreakpoints[window->lo[i]], 1, window->hi[i] - window->lo[i] + 1);
+    }
+    static HostTraps traps;
+    PrepareHostTraps(CPU, rangeBreakpoints, &traps);
+
+    // the models have to see every instruction, traced or not
+    int stepAll = !O->windowed || O->predictor >= 0 || O->caches;
+    unsigned long long count = 0;
+    int status = RUN_BREAKPOINT;
+    // the fast engine's share is timed per call, the rest is the traced engine's
+    unsigned long long start = MonotonicNanoseconds();
+    unsigned long long fastNanoseconds = 0;
+    while (currentPC != 0x80FF) {
+        if (budget != 0 && count >= budget) {
+            status = RUN_BUDGET;
+            break;
+        }
+        if (deadline != 0 && (count & 0xFFF) == 0 && MonotonicNanoseconds() >= deadline) {
+            status = RUN_TIMEOUT;
+            break;
+        }
+
+        int traced = InWindow(window, CPU, count);
+        if (traced || stepAll) {
+            DebugOutput = traced;
+            unsigned short int insn = CPU->memory[currentPC];
+            if (UpdateMachineState(CPU, traced ? out_file : NULL) != 0) {
+                status = RUN_FAULT;
+                break;
+            }
+            count++;
+            if (O->metered) {
+                metrics->opcodes[insn >> 12]++;
+            }
+            if (O->predictor >= 0) {
+                PipelineStep(&pipeline, CPU, currentPC);
+            }
+            if (O->caches) {
+                CacheStep(&cacheSystem, CPU, currentPC);
+            }
+            if (O->shadow) {
+                ShadowStep(&shadowState, CPU, currentPC, insn);
+            }
+            if (O->covered) {
+                CoverageStep(&coverage, CPU, currentPC, insn);
+            }
+            if (O->loops && count % LOOP_SAMPLE == 0 && CheckLoop(&detector, CPU, count)) {
+                status = RUN_LOOP;
+                currentPC = CPU->PC;
+                break;
+            }
+        } else {
+            // run up to where the window could open next: the start of the
+            // count window, a mode switch, or a traced PC range
+            int past = window->to != 0 && count >= window->to;
+            RunControl control = {
+                .breakpoints = haltBreakpoints,
+                .instructions = count,
+                .hostTraps = &traps,
+                .maxInstructions = budget,
+                .deadline = deadline,
+                .shadow = O->shadow ? &shadowState : NULL,
+                .coverage = O->covered ? &coverage : NULL,
+                .opcodes = O->metered ? metrics->opcodes : NULL,
+            };
+            if (count < window->from && (budget == 0 || window->from < budget)) {
+                control.maxInstructions = window->from;
+            }
+            if (!past && window->mode >= 0) {
+                control.stopOnModeChange = 1;
+            }
+            if (!past && count >= window->from && (window->mode < 0 || (CPU->PSR >> 15) == window->mode)) {
+                control.breakpoints = rangeBreakpoints;
+            }
+            unsigned long long started = MonotonicNanoseconds();
+            status = RunFast(CPU, &control);
+            fastNanoseconds += MonotonicNanoseconds() - started;
+            count = control.instructions;
+            if (status == RUN_FAULT || status == RUN_TIMEOUT) {
+                break;
+            }
+            // reaching the start of the count window is not the budget
+            status = RUN_BREAKPOINT;
+        }
+        currentPC = CPU->PC;
+    }
+    unsigned long long elapsed = MonotonicNanoseconds() - start;
+    metrics->engineSeconds[ENGINE_FAST] = fastNanoseconds / 1e9;
+    metrics->engineSeconds[ENGINE_TRACED] = elapsed > fastNanoseconds ? (elapsed - fastNanoseconds) / 1e9 : 0.0;
+    ReportStop(status, CPU, count);
+
+    if (O->predictor >= 0) {
+        PrintPipelineReport(&pipeline, CPU, info, stdout);
+    }
+    if (O->caches) {
+        PrintCacheReport(&cacheSystem, CPU, info, stdout);
+        FreeCacheSystem(&cacheSystem);
+    }
+    if (PrintRunReports(O, info, NULL) != 0) {
+        return -1;
+    }
+
+    int videoFailed = CloseVideo(CPU, video) != 0;
+    CloseDevices(deviceState);
+    fflush(out_file);
+    long bytes = ftell(out_file);
+    fclose(out_file);
+    metrics->instructions = count;
+    metrics->traceBytes = bytes > 0 ? bytes : 0;
+    CountOutcome(metrics, status, status == RUN_FAULT ? CPU->fault : 0);
+    return WriteMetrics(O->metricsJson, O->metricsText, metrics) == 0 && !videoFailed ? 0 : -1;
+}
 
 int main(int argc, char** argv) {
-    // Check command line arguments
-    if (argc < 3) {
+    // Replay PennSim scripts headless: trace -s script1.txt [script2.txt ...]
+    if (argc >= 3 && strcmp(argv[1], "-s") == 0) {
+        // scripts run concurrently, so keep the per-instruction chatter off stdout
+        DebugOutput = 0;
+        return RunScripts(&argv[2], argc - 2) == 0 ? 0 : -1;
+    }
+
+    // Serve jobs from a socket: trace -S socket [-j workers] [-J m.ndjson] [-O m.prom] os.obj
+    if (argc >= 4 && strcmp(argv[1], "-S") == 0) {
+        int workers = 0;
+        char* metricsJson = NULL;
+        char* metricsText = NULL;
+        for (int i = 3; i < argc - 1; i += 2) {
+            if (i + 1 == argc - 1) {
+                fprintf(stderr, "Invalid arguments. \n");
+                return -1;
+            } else if (strcmp(argv[i], "-j") == 0) {
+                workers = atoi(argv[i + 1]);
+            } else if (strcmp(argv[i], "-J") == 0) {
+                metricsJson = argv[i + 1];
+            } else if (strcmp(argv[i], "-O") == 0) {
+                metricsText = argv[i + 1];
+            } else {
+                fprintf(stderr, "Invalid arguments. \n");
+                return -1;
+            }
+        }
+        return RunDaemon(argv[2], argv[argc - 1], workers, metricsJson, metricsText) == 0 ? 0 : -1;
+    }
+
+    // Check every engine against the ISA oracle and time each opcode: trace -V
+    if (argc == 2 && strcmp(argv[1], "-V") == 0) {
+        return RunConformance(stdout) == 0 ? 0 : -1;
+    }
+
+    // Assemble only: trace -a output.obj source.asm
+    if (argc == 4 && strcmp(argv[1], "-a") == 0) {
+        AsmImage* image = AssembleFile(argv[3]);
+        if (image == NULL) {
+            return -1;
+        }
+        int result = WriteAsmImage(image, argv[2]);
+        FreeAsmImage(image);
+        return result;
+    }
+
+    // Merge coverage files from parallel runs: trace -e merged.bin run1.bin [run2.bin ...]
+    if (argc >= 4 && strcmp(argv[1], "-e") == 0) {
+        return MergeCoverage(&argv[3], argc - 3, argv[2]) == 0 ? 0 : -1;
+    }
+
+    // Report coverage against source lines: trace -E coverage.bin file.obj [...]
+    if (argc >= 4 && strcmp(argv[1], "-E") == 0) {
+        if (ReadCoverage(argv[2], &coverage) != 0) {
+            return -1;
+        }
+        Reset(&CPUState);
+        ObjectInfo info = {0};
+        for (int i = 3; i < argc; i++) {
+            if (LoadProgramFile(argv[i], &CPUState, &info) != 0) {
+                fprintf(stderr, "Error: Failed to read object file %s\n", argv[i]);
+                return -1;
+            }
+        }
+        PrintCoverageReport(&coverage, &CPUState, &info, stdout);
+        FreeObjectInfo(&info);
+        return 0;
+    }
+
+    Options options;
+    int arg = ParseOptions(argc, argv, &options);
+    if (arg < 0) {
+        return -1;
+    }
+    Options* O = &options;
+    if (!ValidOptions(O, argc - arg)) {
         fprintf(stderr, "Invalid arguments. \n");
         return -1;
     }
@@ -19,18 +817,39 @@ int main(int argc, char** argv) {
     // Point CPU to the statically allocated CPUState
     CPU = &CPUState;
 
-    // open output file 
-    FILE* out_file = fopen(argv[1], "wb");
+    // open output file
+    FILE* out_file = NULL;
+    char* traceName = NULL;
+    if (O->cores && !O->fast) {
+        traceName = argv[arg++];
+    } else if (!O->fast && !O->batch && !O->analyze && !O->cosim) {
+        out_file = fopen(argv[arg], "wb");
         if (out_file == NULL) {
-            fprintf(stderr, "Error: Could not open file %s\n", argv[1]);
+            fprintf(stderr, "Error: Could not open file %s\n", argv[arg]);
             return -1;
         }
+        arg++;
+    }
+
+    // Initialize memory to zero and build the page table
+    Reset(CPU);
+
+    // Attach the devices after Reset, which detaches them
+    DeviceState* deviceState = NULL;
+    VideoState* video = NULL;
+    if (O->devices && OpenRunDevices(O, &deviceState, &video) != 0) {
+        return -1;
+    }
 
-    // Initialize memory to zero 
-    memset(CPU->memory, 0, sizeof(CPU->memory));
+    // Labels from the files, to name functions in reports
+    ObjectInfo info = {0};
 
-    // Iterate over the .OBJ files
-    for (int i = 2; i < argc; i++) {
+    // named after the last file, the program run under the OS
+    RunMetrics metrics;
+    InitMetrics(&metrics, O->batch ? "batch" : "run", argv[argc - 1]);
+
+    // Iterate over the .OBJ (or .asm) files
+    for (int i = arg; i < argc; i++) {
         FILE* file = fopen(argv[i], "rb");
         if (file == NULL) {
             fprintf(stderr, "Error: Could not open file %s\n", argv[i]);
@@ -39,30 +858,68 @@ int main(int argc, char** argv) {
         }
 
         // Load the object file into the simulator's memory
-        if (ReadObjectFile(argv[i], CPU) != 0) {
+        unsigned long long start = MonotonicNanoseconds();
+        if (LoadProgramFile(argv[i], CPU, &info) != 0) {
             fprintf(stderr, "Error: Failed to read object file %s\n", argv[i]);
             // Return error if loading fails
             return -1;
         }
+        metrics.loadSeconds += ElapsedSeconds(start, MonotonicNanoseconds());
         fclose(file);
     }
-   
+
     for (int address = 0x8200; address < 0x8205; address++) {
         printf("address: %05X contents: 0x%04X\n", address, CPU->memory[address]);
     }
-    
+
     for (int address = 0; address < 5; address++) {
         printf("address: %05d contents: 0x%04X\n", address, CPU->memory[address]);
     }
 
-    unsigned short int currentPC = 0x8200;
     CPU->PC = 0x8200;
     CPU->PSR = 0x8002;
 
-    while (currentPC != 0x80FF && UpdateMachineState(CPU, out_file) == 0) {
-        currentPC = CPU->PC;
+    // the clock starts once the program is loaded
+    unsigned long long deadline = 0;
+    if (O->seconds > 0) {
+        deadline = MonotonicNanoseconds() + (unsigned long long)(O->seconds * 1e9);
     }
 
-    fclose(out_file);
-    return 0;
-} 
\ No newline at end of file
+    // the loaded words start out initialized
+    if (O->shadow) {
+        InitShadow(&shadowState, &info, O->stackLo, O->stackHi);
+    }
+
+    if (O->analyze) {
+        static CodeAnalysis analysis;
+        if (AnalyzeImage(CPU, &info, &analysis) != 0) {
+            return -1;
+        }
+        PrintAnalysis(&analysis, CPU, &info, stdout);
+        FreeAnalysis(&analysis);
+        return 0;
+    }
+
+    if (O->cores) {
+        return RunCores(O, traceName, deadline);
+    }
+
+    // the state hash is kept up to date from here on
+    if (O->hashes) {
+        StartStateHash(CPU);
+    }
+    if (O->loops && InitLoopDetector(&detector, CPU, 0) != 0) {
+        return -1;
+    }
+
+    if (O->cosim) {
+        return RunSideBySide(O, &info, deadline);
+    }
+    if (O->batch) {
+        return RunBatchFile(O, &metrics, deadline);
+    }
+    if (O->fast) {
+        return RunFastOnly(O, &info, &metrics, deadline, deviceState, video);
+    }
+    return RunTraced(O, &info, &metrics, deadline, deviceState, video, out_file);
+}
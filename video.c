@@ -0,0 +1,121 @@
+/*
+ * video.c: Defines the framebuffer view of video memory
+ */
+
+#include <limits.h>
+#include "video.h"
+#include "device.h"
+
+VideoState* OpenVideo(char* ppmPrefix, FILE* raw, int every) {
+    VideoState* video = calloc(1, sizeof(VideoState));
+    if (video == NULL) {
+        fprintf(stderr, "Error: Out of memory for video\n");
+        return NULL;
+    }
+    video->ppmPrefix = ppmPrefix;
+    video->raw = raw;
+    video->every = every > 0 ? every : 1;
+
+    // nothing has been converted yet
+    memset(video->dirty, 1, sizeof(video->dirty));
+    video->anyDirty = 1;
+    return video;
+}
+
+void AttachVideo(MachineState* CPU, VideoState* video) {
+    CPU->devices->video = video;
+
+    // reads stay plain, only stores take the hooked path
+    unsigned char attr = video ? PAGE_READ_OS | PAGE_VIDEO : PAGE_READ_OS | PAGE_WRITE_OS;
+    SetPageAttributes(CPU, VIDEO_BASE, VIDEO_END, attr);
+}
+
+void VideoStore(MachineState* CPU, unsigned short int address, unsigned short int value) {
+    VideoState* video = CPU->devices->video;
+    CPU->memory[address] = value;
+    video->dirty[(address - VIDEO_BASE) / VIDEO_WIDTH] = 1;
+    video->anyDirty = 1;
+}
+
+void VideoCommand(MachineState* CPU, unsigned short int command) {
+    VideoState* video = CPU->devices->video;
+    if (command != VIDEO_BLIT) {
+        return;
+    }
+    if (video->blits++ % video->every == 0) {
+        WriteVideoFrame(CPU);
+    }
+}
+
+// helper to widen a 5 bit channel to 8 bits
+static unsigned char Channel(unsigned short int pixel, int shift) {
+    unsigned char value = (pixel >> shift) & 0x1F;
+    return (value << 3) | (value >> 2);
+}
+
+int WriteVideoFrame(MachineState* CPU) {
+    VideoState* video = CPU->devices->video;
+
+    // only rows stored to since the last frame need converting
+    if (video->anyDirty) {
+        for (int row = 0; row < VIDEO_HEIGHT; row++) {
+            if (!video->dirty[row]) {
+                continue;
+            }
+            unsigned short int* pixels = &CPU->memory[VIDEO_BASE + row * VIDEO_WIDTH];
+            unsigned char* rgb = &video->rgb[row * VIDEO_WIDTH * 3];
+            for (int x = 0; x < VIDEO_WIDTH; x++) {
+                rgb[3 * x] = Channel(pixels[x], 10);
+                rgb[3 * x + 1] = Channel(pixels[x], 5);
+                rgb[3 * x + 2] = Channel(pixels[x], 0);
+            }
+            video->dirty[row] = 0;
+        }
+        video->anyDirty = 0;
+    }
+
+    int result = 0;
+    if (video->ppmPrefix != NULL) {
+        char filename[PATH_MAX];
+        snprintf(filename, sizeof(filename), "%s%04d.ppm", video->ppmPrefix, video->frames);
+        FILE* file = fopen(filename, "wb");
+        if (file == NULL) {
+            fprintf(stderr, "Error: Could not open file %s\n", filename);
+            result = -1;
+        } else {
+            fprintf(file, "P6\n%d %d\n255\n", VIDEO_WIDTH, VIDEO_HEIGHT);
+            size_t written = fwrite(video->rgb, 1, sizeof(video->rgb), file);
+            if (fclose(file) != 0 || written != sizeof(video->rgb)) {
+                fprintf(stderr, "Error: Could not write file %s\n", filename);
+                result = -1;
+            }
+        }
+    }
+    if (video->raw != NULL && fwrite(video->rgb, 1, sizeof(video->rgb), video->raw) != sizeof(video->rgb)) {
+        if (!video->failed) {
+            fprintf(stderr, "Error: Could not write the raw video stream\n");
+        }
+        result = -1;
+    }
+    if (result != 0) {
+        video->failed = 1;
+    }
+    video->frames++;
+    return result;
+}
+
+int CloseVideo(MachineState* CPU, VideoState* video) {
+    if (video == NULL) {
+        return 0;
+    }
+    if (video->anyDirty || video->frames == 0) {
+        WriteVideoFrame(CPU);
+    }
+    if (video->raw != NULL && fclose(video->raw) != 0) {
+        fprintf(stderr, "Error: Could not write the raw video stream\n");
+        video->failed = 1;
+    }
+    int result = video->failed ? -1 : 0;
+    free(video);
+    return result;
+}
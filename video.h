@@ -0,0 +1,72 @@
+/*
+ * video.h: Declares the framebuffer view of video memory
+ */
+
+#ifndef VIDEO_H
+#define VIDEO_H
+
+#include "LC4.h"
+
+// Video memory: one 15 bit RGB word (5 bits each, red highest) per pixel
+#define VIDEO_BASE   0xC000
+#define VIDEO_END    0xFDFF
+#define VIDEO_WIDTH  128
+#define VIDEO_HEIGHT 124
+
+// VDCR commands written by TRAP_RESET_VMEM and TRAP_BLT_VMEM
+#define VIDEO_RESET 1
+#define VIDEO_BLIT  2
+
+typedef struct VideoState {
+    // frames go to <ppmPrefix>NNNN.ppm and/or as raw RGB24 to raw
+    char* ppmPrefix;
+    FILE* raw;
+    int failed;                     // a frame could not be written, reported once
+
+    // write every Nth blit, counting from the first
+    int every;
+    int blits;
+    int frames;
+
+    // rows stored to since they were last converted into rgb
+    unsigned char dirty[VIDEO_HEIGHT];
+    int anyDirty;
+    unsigned char rgb[VIDEO_HEIGHT * VIDEO_WIDTH * 3];
+} VideoState;
+
+/*
+ * Set up frame output to PPM files named from ppmPrefix and/or a raw RGB24
+ * stream (either may be NULL), keeping every Nth blit. CloseVideo closes
+ * raw. Returns NULL after printing an error to stderr.
+ */
+VideoState* OpenVideo(char* ppmPrefix, FILE* raw, int every);
+
+/*
+ * Mark video memory of CPU as hooked so stores to it reach VideoStore.
+ * The devices must already be attached; Reset detaches the video again.
+ */
+void AttachVideo(MachineState* CPU, VideoState* video);
+
+/*
+ * Store a word of video memory and mark its row dirty.
+ */
+void VideoStore(MachineState* CPU, unsigned short int address, unsigned short int value);
+
+/*
+ * Handle a VDCR command: every Nth VIDEO_BLIT writes a frame.
+ */
+void VideoCommand(MachineState* CPU, unsigned short int command);
+
+/*
+ * Convert the dirty rows and write the current frame. Returns 0 or -1.
+ */
+int WriteVideoFrame(MachineState* CPU);
+
+/*
+ * Write a last frame if the picture changed since the previous one (or none
+ * was written), close the raw stream and release video returned by
+ * OpenVideo. Returns 0, or -1 if any frame could not be written.
+ */
+int CloseVideo(MachineState* CPU, VideoState* video);
+
+#endif